@@ -0,0 +1,1668 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+#include <random>
+#include <cmath>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "EcTransport.h"
+#include "EcArbiter.h"
+#include "EcShadow.h"
+#include "SimulatedEc.h"
+#include "ControlEvents.h"
+#include "ControlLoop.h"
+#include "AcquisitionStage.h"
+#include "Mailbox.h"
+#include "CurveTable.h"
+#include "ConfigCommands.h"
+#include "SettingsStore.h"
+#include "ProfileSet.h"
+#include "ProfileRules.h"
+#include "SampleScheduler.h"
+#include "TraceRecorder.h"
+#include "TraceReplay.h"
+#include "CurveTuner.h"
+
+// Benchmarks for the fan control backend. Runs on any machine: the
+// simulated EC is always available, hardware backends are skipped when
+// they cannot be opened.
+
+typedef std::chrono::steady_clock Clock;
+
+struct LatencyStats
+{
+    double min, p50, p99, max, mean;
+};
+
+static LatencyStats summarize(std::vector<double> samples)
+{
+    LatencyStats stats = { 0, 0, 0, 0, 0 };
+    if (samples.empty()) return stats;
+
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double s : samples) sum += s;
+
+    stats.min = samples.front();
+    stats.p50 = samples[samples.size() / 2];
+    stats.p99 = samples[(samples.size() * 99) / 100];
+    stats.max = samples.back();
+    stats.mean = sum / samples.size();
+    return stats;
+}
+
+static void printStats(const std::string& label, const LatencyStats& stats)
+{
+    std::cout << std::left << std::setw(28) << label << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << stats.min
+              << std::setw(10) << stats.p50
+              << std::setw(10) << stats.p99
+              << std::setw(10) << stats.max
+              << std::setw(10) << stats.mean << std::endl;
+}
+
+static std::unique_ptr<EcTransport> openBackend(const std::string& name)
+{
+    if (name == "sim") return std::unique_ptr<EcTransport>(new SimulatedEc());
+#ifdef _WIN32
+    if (name == "inpout") return std::unique_ptr<EcTransport>(new InpOutEcTransport());
+#endif
+#ifdef __linux__
+    if (name == "devport") return std::unique_ptr<EcTransport>(new DevPortEcTransport());
+    if (name == "ecsys") return std::unique_ptr<EcTransport>(new EcSysTransport());
+#endif
+    throw std::invalid_argument("Unknown backend: " + name);
+}
+
+static void benchTransport(EcTransport& ec, const std::string& label, int iterations, short reg, bool doWrite)
+{
+    std::vector<double> readUs, writeUs;
+    readUs.reserve(iterations);
+    writeUs.reserve(iterations);
+
+    for (int i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        short value = ec.read(reg);
+        readUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+
+        if (doWrite) {
+            // Write back what was just read so the benchmark is harmless on real hardware
+            start = Clock::now();
+            ec.write(reg, value);
+            writeUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+    }
+
+    printStats(label + " read", summarize(readUs));
+    if (doWrite) printStats(label + " write", summarize(writeUs));
+
+    // One bulk pass for the registers a control tick needs, and for the whole EC space
+    const short tickRegs[] = { 176, 180 };
+    std::vector<double> tickUs, fullUs;
+    EcSnapshot snapshot = {};
+    for (int i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        ec.snapshot(tickRegs, 2, snapshot);
+        tickUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+    for (int i = 0; i < iterations && i < 10; ++i) {
+        Clock::time_point start = Clock::now();
+        ec.snapshotAll(snapshot);
+        fullUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+    printStats(label + " snapshot(2)", summarize(tickUs));
+    printStats(label + " snapshot(256)", summarize(fullUs));
+}
+
+static int benchEc(const std::vector<std::string>& args)
+{
+    std::vector<std::string> backends;
+    int iterations = 50;
+    short reg = 176;
+    bool hardwareWrites = false;
+    std::string mode = "both";
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-n" && i + 1 < args.size()) iterations = std::atoi(args[++i].c_str());
+        else if (args[i] == "-r" && i + 1 < args.size()) reg = static_cast<short>(std::atoi(args[++i].c_str()));
+        else if (args[i] == "--mode" && i + 1 < args.size()) mode = args[++i];
+        else if (args[i] == "--write") hardwareWrites = true;
+        else backends.push_back(args[i]);
+    }
+    if (backends.empty() || (backends.size() == 1 && backends[0] == "all")) {
+#ifdef _WIN32
+        backends = { "sim", "inpout" };
+#elif defined(__linux__)
+        backends = { "sim", "ecsys", "devport" };
+#else
+        backends = { "sim" };
+#endif
+    }
+
+    std::cout << "EC transaction latency, " << iterations << " iterations on register " << reg << " (us)" << std::endl;
+    std::cout << std::left << std::setw(28) << "transaction" << std::right
+              << std::setw(10) << "min" << std::setw(10) << "p50" << std::setw(10) << "p99"
+              << std::setw(10) << "max" << std::setw(10) << "mean" << std::endl;
+
+    for (const std::string& name : backends) {
+        try {
+            std::unique_ptr<EcTransport> ec = openBackend(name);
+            bool doWrite = name == "sim" || hardwareWrites;
+
+            // Port I/O backends are measured once per completion mode
+            PortIoEcTransport* portIo = dynamic_cast<PortIoEcTransport*>(ec.get());
+            if (!portIo) {
+                benchTransport(*ec, name, iterations, reg, doWrite);
+                continue;
+            }
+            EcCompletionPolicy policy;
+            if (mode == "fixed" || mode == "both") {
+                policy.mode = EcCompletionMode::FixedSleep;
+                portIo->setCompletionPolicy(policy);
+                benchTransport(*ec, name + "/fixed", iterations, reg, doWrite);
+            }
+            if (mode == "adaptive" || mode == "both") {
+                policy.mode = EcCompletionMode::Adaptive;
+                portIo->setCompletionPolicy(policy);
+                benchTransport(*ec, name + "/adaptive", iterations, reg, doWrite);
+            }
+        }
+        catch (const std::exception& e) {
+            std::cout << name << ": skipped (" << e.what() << ")" << std::endl;
+        }
+    }
+    return 0;
+}
+
+// Counts control loop wakeups while idle and measures how long a config
+// notification takes to wake the loop; exits with status 2 on a wakeup
+// the timer did not ask for or a notification slower than max_us
+static int benchEvents(const std::vector<std::string>& args)
+{
+    int periodMs = 1000;
+    int seconds = 5;
+    int notifications = 20;
+    double maxUs = 10000;
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-p" && i + 1 < args.size()) periodMs = std::atoi(args[++i].c_str());
+        else if (args[i] == "-s" && i + 1 < args.size()) seconds = std::atoi(args[++i].c_str());
+        else if (args[i] == "-c" && i + 1 < args.size()) notifications = std::atoi(args[++i].c_str());
+        else if (args[i] == "-m" && i + 1 < args.size()) maxUs = std::atof(args[++i].c_str());
+    }
+    periodMs = std::max(1, periodMs);
+
+    ControlEvents events(std::chrono::milliseconds(periodMs), L"FanBenchConfigChanged");
+
+    // Idle: only the control timer should wake us
+    Clock::time_point end = Clock::now() + std::chrono::seconds(seconds);
+    uint64_t ticks = 0;
+    while (Clock::now() < end) {
+        if (events.wait() == WakeReason::ControlTick) ++ticks;
+    }
+    double idleSeconds = static_cast<double>(seconds);
+    std::cout << "idle: " << events.wakeups() << " wakeups in " << seconds << " s ("
+              << std::fixed << std::setprecision(2) << events.wakeups() / idleSeconds << "/s, "
+              << ticks << " control ticks, period " << periodMs << " ms)" << std::endl;
+    uint64_t idleWakeups = events.wakeups();
+    uint64_t allowedWakeups = static_cast<uint64_t>(seconds) * 1000 / periodMs + 1;
+
+    // Config notifications from another thread, as a client would send them
+    std::vector<double> latencyUs;
+    for (int i = 0; i < notifications; ++i) {
+        Clock::time_point sent;
+        std::thread client([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            sent = Clock::now();
+            events.notifyConfigChanged();
+        });
+        while (events.wait() != WakeReason::ConfigChanged) {
+        }
+        Clock::time_point woke = Clock::now();
+        client.join();
+        latencyUs.push_back(std::chrono::duration<double, std::micro>(woke - sent).count());
+    }
+
+    std::cout << std::left << std::setw(28) << "notify to wake (us)" << std::right
+              << std::setw(10) << "min" << std::setw(10) << "p50" << std::setw(10) << "p99"
+              << std::setw(10) << "max" << std::setw(10) << "mean" << std::endl;
+    LatencyStats notify = summarize(latencyUs);
+    printStats("config changed", notify);
+
+    bool ok = true;
+    if (idleWakeups > allowedWakeups) {
+        std::cout << "FAIL  " << idleWakeups << " idle wakeups, at most " << allowedWakeups << " expected" << std::endl;
+        ok = false;
+    }
+    if (notify.max >= maxUs) {
+        std::cout << "FAIL  a notification took " << notify.max << " us to wake the loop, bound " << maxUs << " us" << std::endl;
+        ok = false;
+    }
+    return ok ? 0 : 2;
+}
+
+// The curve evaluation FanController did before lookup tables: a scan for
+// the segment and a division on every call. Temperatures outside the
+// curve leave the fan speed where it was. fanSpeed is the value before
+// FanController truncated it to a whole percent.
+static bool legacyLinear(const int32_t* temps, const int32_t* fans, int count, double temp, double& fanSpeed)
+{
+    for (int i = 0; i < count - 1; ++i) {
+        if (temp >= temps[i] && temp < temps[i + 1]) {
+            double temp_range = temps[i + 1] - temps[i];
+            double fan_range = fans[i + 1] - fans[i];
+            fanSpeed = fans[i] + (temp - temps[i]) * fan_range / temp_range;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct TestCurve
+{
+    std::vector<int32_t> temps;
+    std::vector<int32_t> fans;
+};
+
+// Every five-point curve the UI can produce on a 5 C grid, with a few fan
+// shapes, plus random curves of 2 to MAX_CURVE_POINTS points
+static std::vector<TestCurve> testCurves(std::mt19937& rng)
+{
+    std::vector<TestCurve> curves;
+    const int32_t shapes[][5] = { { 0, 5, 8, 30, 100 }, { 0, 40, 50, 60, 100 }, { 20, 20, 20, 20, 20 }, { 100, 60, 30, 10, 0 } };
+    for (int t2 = 5; t2 < 100; t2 += 5) {
+        for (int t3 = t2 + 5; t3 < 100; t3 += 5) {
+            for (int t4 = t3 + 5; t4 < 100; t4 += 5) {
+                for (const int32_t* shape : shapes) {
+                    curves.push_back({ { 0, t2, t3, t4, 100 }, std::vector<int32_t>(shape, shape + 5) });
+                }
+            }
+        }
+    }
+
+    std::uniform_int_distribution<int> pointCount(2, MAX_CURVE_POINTS);
+    std::uniform_int_distribution<int> percent(0, 100);
+    for (int n = 0; n < 2000; ++n) {
+        TestCurve curve;
+        int count = pointCount(rng);
+        std::vector<int> temps;
+        while (static_cast<int>(temps.size()) < count) {
+            int t = std::uniform_int_distribution<int>(0, 110)(rng);
+            if (std::find(temps.begin(), temps.end(), t) == temps.end()) temps.push_back(t);
+        }
+        std::sort(temps.begin(), temps.end());
+        for (int i = 0; i < count; ++i) {
+            curve.temps.push_back(temps[i]);
+            curve.fans.push_back(percent(rng));
+        }
+        curves.push_back(curve);
+    }
+    return curves;
+}
+
+// Checks the lookup tables against the legacy linear evaluation and the
+// monotone cubic against its own points, then times both evaluations
+static int benchCurve(const std::vector<std::string>& args)
+{
+    int evaluations = 1000000;
+    unsigned int seed = 1;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-n" && i + 1 < args.size()) evaluations = std::atoi(args[++i].c_str());
+        else if (args[i] == "--seed" && i + 1 < args.size()) seed = static_cast<unsigned int>(std::atoi(args[++i].c_str()));
+    }
+
+    std::mt19937 rng(seed);
+    std::vector<TestCurve> curves = testCurves(rng);
+
+    // Every 0.01 C from 0 to 110 C: each table entry and the points between.
+    // Where the exact fan speed is a whole percent, the two evaluations can
+    // land on either side of it by a rounding error and truncate to
+    // neighbouring percents; those ties are counted apart from mismatches.
+    unsigned long long compared = 0, mismatches = 0, ties = 0, stepChecks = 0, stepFailures = 0;
+    unsigned long long cubicChecks = 0, cubicFailures = 0;
+    double cubicError = 0;
+    for (const TestCurve& curve : curves) {
+        int count = static_cast<int>(curve.temps.size());
+        CurveTable linear;
+        linear.build(curve.temps.data(), curve.fans.data(), count, CURVE_LINEAR);
+
+        for (int step = 0; step <= 11000; ++step) {
+            double temp = step / 100.0;
+            double exact = 0;
+            if (!legacyLinear(curve.temps.data(), curve.fans.data(), count, temp, exact)) continue;
+            ++compared;
+            double value = linear.at(temp);
+            if (static_cast<int>(value) == static_cast<int>(exact)) continue;
+            if (std::fabs(value - exact) < 1e-9) {
+                ++ties;
+            }
+            else if (++mismatches <= 5) {
+                std::cout << "mismatch at " << temp << " C on a " << count << "-point curve: table "
+                          << value << "%, legacy " << exact << "%" << std::endl;
+            }
+        }
+
+        // A step curve holds each point's speed up to the next point
+        CurveTable step;
+        step.build(curve.temps.data(), curve.fans.data(), count, CURVE_STEP);
+        for (int i = 0; i + 1 < count; ++i) {
+            for (int t = curve.temps[i] * 100; t < curve.temps[i + 1] * 100; ++t) {
+                ++stepChecks;
+                if (step.at(t / 100.0) != curve.fans[i]) ++stepFailures;
+            }
+        }
+
+        // The cubic passes through every point, stays within the fan range
+        // of each segment, and the table tracks the exact interpolant
+        CurveTable cubic;
+        cubic.build(curve.temps.data(), curve.fans.data(), count, CURVE_CUBIC);
+        for (int i = 0; i < count; ++i) {
+            ++cubicChecks;
+            if (std::fabs(cubic.at(curve.temps[i]) - curve.fans[i]) > 1e-9) ++cubicFailures;
+        }
+        for (int step = curve.temps.front() * 10; step < curve.temps.back() * 10; ++step) {
+            double temp = step / 10.0 + 0.05;
+            size_t i = std::upper_bound(curve.temps.begin(), curve.temps.end(), static_cast<int32_t>(std::floor(temp))) - curve.temps.begin() - 1;
+            double value = cubic.at(temp);
+            double low = std::min(curve.fans[i], curve.fans[i + 1]), high = std::max(curve.fans[i], curve.fans[i + 1]);
+            ++cubicChecks;
+            if (value < low - 1e-9 || value > high + 1e-9) ++cubicFailures;
+            cubicError = std::max(cubicError, std::fabs(value - cubic.evaluate(temp)));
+        }
+    }
+
+    std::cout << "linear table vs legacy: " << curves.size() << " curves, " << compared << " temperatures, "
+              << mismatches << " mismatches, " << ties << " rounding ties" << std::endl;
+    std::cout << "step table: " << stepChecks << " checks, " << stepFailures << " failures" << std::endl;
+    std::cout << "monotone cubic: " << cubicChecks << " checks, " << cubicFailures << " failures, max table error "
+              << std::scientific << std::setprecision(2) << cubicError << " %" << std::fixed << std::endl;
+
+    // Temperatures a control loop would see, reused for every timing run
+    std::uniform_real_distribution<double> temperature(30.0, 100.0);
+    std::vector<double> temps(evaluations);
+    for (double& t : temps) t = temperature(rng);
+
+    std::cout << std::left << std::setw(28) << "evaluation" << std::right << std::setw(12) << "ns/eval"
+              << std::setw(12) << "build us" << std::setw(10) << "entries" << std::endl;
+
+    const TestCurve timed[] = {
+        { { 0, 55, 70, 80, 100 }, { 0, 5, 8, 30, 100 } },
+        { { 0, 40, 50, 60, 70, 80, 90, 100 }, { 0, 5, 10, 20, 35, 55, 80, 100 } },
+    };
+    for (const TestCurve& curve : timed) {
+        int count = static_cast<int>(curve.temps.size());
+        std::string points = std::to_string(count) + "-point ";
+        long long sink = 0;
+
+        Clock::time_point start = Clock::now();
+        for (double t : temps) {
+            double fan = 0;
+            legacyLinear(curve.temps.data(), curve.fans.data(), count, t, fan);
+            sink += static_cast<int>(fan);
+        }
+        double legacyNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / evaluations;
+        std::cout << std::left << std::setw(28) << points + "legacy scan" << std::right << std::setprecision(2)
+                  << std::setw(12) << legacyNs << std::setw(12) << "-" << std::setw(10) << "-" << std::endl;
+
+        const int32_t modes[] = { CURVE_LINEAR, CURVE_STEP, CURVE_CUBIC };
+        const char* names[] = { "linear", "step", "cubic" };
+        for (int m = 0; m < 3; ++m) {
+            CurveTable table;
+            const int builds = 1000;
+            start = Clock::now();
+            for (int b = 0; b < builds; ++b) {
+                table.build(curve.temps.data(), curve.fans.data(), count, modes[m]);
+            }
+            double buildUs = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / builds;
+
+            start = Clock::now();
+            for (double t : temps) sink += static_cast<int>(table.at(t));
+            double tableNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / evaluations;
+            std::cout << std::left << std::setw(28) << points + names[m] + " table" << std::right
+                      << std::setw(12) << tableNs << std::setw(12) << buildUs << std::setw(10) << table.size() << std::endl;
+        }
+        if (sink == 42) std::cout << std::endl; // keeps the loops from being optimized away
+    }
+
+    return mismatches || stepFailures || cubicFailures ? 2 : 0;
+}
+
+// Passes every transaction through and timestamps completed writes, so
+// the pipeline bench can see when a fan command reached the EC
+class StampedEc : public EcTransport
+{
+public:
+    explicit StampedEc(EcTransport& inner) : inner(inner)
+    {
+        values.fill(-1);
+    }
+
+    const char* name() const override { return inner.name(); }
+    short read(short reg) override { return inner.read(reg); }
+    void readBlock(const short* regs, size_t count, short* out) override { inner.readBlock(regs, count, out); }
+
+    void write(short reg, short val) override
+    {
+        inner.write(reg, val);
+        std::lock_guard<std::mutex> lock(mutex);
+        values[reg & 0xff] = val;
+        landed[reg & 0xff] = Clock::now();
+        changed.notify_all();
+    }
+
+    // Waits until reg holds a value other than previous, written no
+    // earlier than since, and returns it with the time the write completed
+    short waitForChange(short reg, short previous, Clock::time_point& at, Clock::time_point since = Clock::time_point::min())
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!changed.wait_for(lock, std::chrono::seconds(10), [&] { return values[reg & 0xff] != previous && landed[reg & 0xff] >= since; })) {
+            throw std::runtime_error("fan command never reached the EC");
+        }
+        at = landed[reg & 0xff];
+        return values[reg & 0xff];
+    }
+
+private:
+    EcTransport& inner;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::array<short, 256> values;
+    std::array<Clock::time_point, 256> landed;
+};
+
+// Time from a temperature crossing a curve point to the new fan command
+// completing on the EC bus, for the single-threaded loop the backend used
+// to run (verify, read, control, write, in sequence) and for the
+// acquisition and control stages behind an EcBusArbiter
+static int benchPipeline(const std::vector<std::string>& args)
+{
+    int crossings = 40;
+    int periodMs = 100;
+    int verifyMs = 250;
+    int latencyUs = 1000;
+    unsigned int seed = 1;
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-n" && i + 1 < args.size()) crossings = std::atoi(args[++i].c_str());
+        else if (args[i] == "-p" && i + 1 < args.size()) periodMs = std::atoi(args[++i].c_str());
+        else if (args[i] == "--verify" && i + 1 < args.size()) verifyMs = std::atoi(args[++i].c_str());
+        else if (args[i] == "--latency" && i + 1 < args.size()) latencyUs = std::atoi(args[++i].c_str());
+        else if (args[i] == "--seed" && i + 1 < args.size()) seed = static_cast<unsigned int>(std::atoi(args[++i].c_str()));
+    }
+
+    // Every reading goes straight to the curve, so the latency is the
+    // threads' and the bus's alone
+    SensorPipeline::Params sensor;
+    sensor.medianWindow = 1;
+    sensor.alpha = 1.0;
+    sensor.fastAlpha = 1.0;
+
+    // Each fan follows its own curve straight to the new speed, so the
+    // only write after a crossing is the one it caused
+    FanConfig config = defaultFanConfig();
+    config.min_period_ms = config.max_period_ms = periodMs;
+    for (int c = 0; c < MAX_CHANNELS; ++c) {
+        for (int o = 0; o < MAX_CHANNELS; ++o) config.coupling[c][o] = c == o ? 1.0f : 0.0f;
+        config.slew_up[c] = config.slew_down[c] = 0.0f;
+        config.min_step[c] = 0;
+    }
+    const double coolTemp = 50, hotTemp = 75;
+
+    std::cout << "Crossing to fan command on the EC (ms), " << crossings << " crossings, period " << periodMs
+              << " ms, read-back every " << verifyMs << " ms, EC byte latency " << latencyUs << " us" << std::endl;
+    std::cout << std::left << std::setw(28) << "loop" << std::right
+              << std::setw(10) << "min" << std::setw(10) << "p50" << std::setw(10) << "p99"
+              << std::setw(10) << "max" << std::setw(10) << "mean" << std::endl;
+
+    int negative = 0;
+    for (int pipelined = 0; pipelined < 2; ++pipelined) {
+        SimulatedEc::Timing timing;
+        timing.inputLatency = std::chrono::microseconds(latencyUs);
+        timing.outputLatency = std::chrono::microseconds(2 * latencyUs);
+        SimulatedEc sim(timing);
+        const EcRegisterMap& registers = predator_phn16_72;
+        for (int c = 0; c < registers.channelCount; ++c) sim.poke(registers.channels[c].tempReg, static_cast<short>(coolTemp));
+        StampedEc stamped(sim);
+
+        std::unique_ptr<EcBusArbiter> arbiter;
+        if (pipelined) arbiter.reset(new EcBusArbiter(stamped));
+        ShadowedEcTransport shadow(pipelined ? arbiter->client(EcPriority::Actuation) : stamped, std::chrono::milliseconds(verifyMs));
+        if (pipelined) shadow.verifyThrough(arbiter->client(EcPriority::Background));
+
+        ControlLoop loop(shadow, config, sensor);
+        ControlEvents events(std::chrono::milliseconds(periodMs), L"FanBenchPipeline");
+        Mailbox<SensorFrame> frames;
+        Clock::time_point start = Clock::now();
+        std::atomic<int> ecErrors(0);
+        std::vector<std::thread> threads;
+        if (pipelined) {
+            threads.emplace_back(acquisitionStage, std::ref(arbiter->client(EcPriority::Acquisition)), std::cref(registers), std::ref(events), std::ref(frames), nullptr);
+            threads.emplace_back([&]() {
+                SensorFrame frame;
+                while (frames.take(frame)) {
+                    try {
+                        loop.tick(std::chrono::duration<double>(Clock::now() - start).count(), 0.0, frame.snapshot);
+                        shadow.verify_if_due();
+                    }
+                    catch (const std::exception&) {
+                        ++ecErrors;
+                    }
+                }
+            });
+        }
+        else {
+            threads.emplace_back([&]() {
+                do {
+                    try {
+                        shadow.verify_if_due();
+                        loop.tick(std::chrono::duration<double>(Clock::now() - start).count());
+                    }
+                    catch (const std::exception&) {
+                        ++ecErrors;
+                    }
+                } while (events.wait() != WakeReason::Shutdown);
+            });
+        }
+
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<double> phase(0.0, periodMs * 1.5);
+        std::vector<double> latencyMs;
+        try {
+            Clock::time_point at;
+            short fans[MAX_CHANNELS];
+            for (int c = 0; c < registers.channelCount; ++c) fans[c] = stamped.waitForChange(registers.channels[c].fanSpeedReg, -1, at);
+
+            for (int i = 0; i < crossings; ++i) {
+                const FanChannelRegisters& channel = registers.channels[i % registers.channelCount];
+                short& fan = fans[i % registers.channelCount];
+                std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(phase(rng)));
+
+                Clock::time_point crossed = Clock::now();
+                sim.poke(channel.tempReg, static_cast<short>(hotTemp));
+                fan = stamped.waitForChange(channel.fanSpeedReg, fan, at, crossed);
+                latencyMs.push_back(std::chrono::duration<double, std::milli>(at - crossed).count());
+
+                Clock::time_point cooled = Clock::now();
+                sim.poke(channel.tempReg, static_cast<short>(coolTemp));
+                fan = stamped.waitForChange(channel.fanSpeedReg, fan, at, cooled);
+            }
+        }
+        catch (...) {
+            events.requestShutdown();
+            for (std::thread& t : threads) t.join();
+            throw;
+        }
+        events.requestShutdown();
+        for (std::thread& t : threads) t.join();
+
+        printStats(pipelined ? "acquire + control stages" : "sequential", summarize(latencyMs));
+        for (double ms : latencyMs) negative += ms < 0;
+        if (ecErrors) std::cout << "  " << ecErrors << " ticks failed on an EC timeout" << std::endl;
+        if (pipelined) {
+            const char* names[EC_PRIORITY_COUNT] = { "actuation", "acquisition", "background" };
+            for (int p = 0; p < EC_PRIORITY_COUNT; ++p) {
+                EcBusArbiter::Stats stats = arbiter->stats(static_cast<EcPriority>(p));
+                std::cout << "  " << std::left << std::setw(12) << names[p] << std::right << stats.transactions
+                          << " transactions, queue wait mean " << std::setprecision(2)
+                          << (stats.transactions ? stats.queueWaitUs / stats.transactions / 1000 : 0.0)
+                          << " ms, max " << stats.maxQueueWaitUs / 1000 << " ms" << std::endl;
+            }
+        }
+    }
+    if (negative) {
+        std::cout << "FAIL  " << negative << " fan commands landed before their crossing" << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+// Several clients change one curve point each, as fast as they can: first
+// through the command queue, with a backend thread applying the commands,
+// then the way clients wrote settings before it, loading the whole config,
+// changing their point and storing it back under the config lock. A write
+// that another client's whole-config store undid before the writer's next
+// load counts as lost.
+static int benchCommands(const std::vector<std::string>& args)
+{
+    int clients = 3;
+    int updates = 20000;
+    int badEvery = 10;
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-c" && i + 1 < args.size()) clients = std::atoi(args[++i].c_str());
+        else if (args[i] == "-n" && i + 1 < args.size()) updates = std::atoi(args[++i].c_str());
+        else if (args[i] == "--bad" && i + 1 < args.size()) badEvery = std::atoi(args[++i].c_str());
+    }
+    clients = std::max(1, std::min<int>(clients, std::min<int>(COMMAND_LANES, 6)));
+    updates = std::max(1, updates);
+
+    // Client k owns point 1 + k / 2 of channel k % 2; the temperatures stay put
+    std::unique_ptr<SharedData> shared(new SharedData());
+    shared->commands.init();
+    shared->config.store(defaultFanConfig());
+    std::mutex configLock;
+    auto pointOf = [](int client) { return std::make_pair(client % 2, 1 + client / 2); };
+    auto fanValue = [](int client, int update) { return (client * 7 + update) % 101; };
+
+    std::cout << clients << " clients, " << updates << " updates each" << std::endl;
+    std::cout << std::left << std::setw(28) << "path" << std::right << std::setw(12) << "updates/s"
+              << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(10) << "max us"
+              << std::setw(10) << "lost" << std::setw(10) << "rejected" << std::endl;
+
+    bool ok = true;
+    for (int queued = 1; queued >= 0; --queued) {
+        std::atomic<bool> stop(false);
+        std::atomic<unsigned long long> lost(0), rejected(0), expectedRejects(0);
+        std::vector<std::vector<double> > latencies(clients);
+
+        std::thread backend;
+        if (queued) {
+            backend = std::thread([&]() {
+                FanConfig config;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    if (!shared->commands.pending()) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    std::lock_guard<std::mutex> lock(configLock);
+                    shared->config.load(config);
+                    shared->commands.drain([&](const FanCommand& command) {
+                        int32_t status = applyConfigCommand(config, command);
+                        if (status == COMMAND_ACCEPTED) shared->config.store(config);
+                        return status;
+                    }, [&] { return shared->config.version(); });
+                }
+            });
+        }
+
+        Clock::time_point start = Clock::now();
+        std::vector<std::thread> threads;
+        for (int k = 0; k < clients; ++k) {
+            threads.emplace_back([&, k]() {
+                int channel = pointOf(k).first, point = pointOf(k).second;
+                int temp = defaultFanConfig().curve_temp[channel][point];
+                std::vector<double>& latency = latencies[k];
+                latency.reserve(updates);
+
+                if (!queued) {
+                    FanConfig config;
+                    int lastWritten = -1;
+                    for (int i = 0; i < updates; ++i) {
+                        Clock::time_point begin = Clock::now();
+                        shared->config.load(config);
+                        if (lastWritten >= 0 && config.curve_fan[channel][point] != lastWritten) ++lost;
+                        config.curve_fan[channel][point] = lastWritten = fanValue(k, i);
+                        {
+                            std::lock_guard<std::mutex> lock(configLock);
+                            shared->config.store(config);
+                        }
+                        latency.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+                    }
+                    return;
+                }
+
+                int lane = shared->commands.claim(static_cast<uint32_t>(k + 1), [](uint32_t) { return true; });
+                std::vector<Clock::time_point> submitted(updates);
+                std::vector<int32_t> wanted(updates);
+                uint32_t first = shared->commands.nextIndex(lane);
+                int sent = 0, done = 0;
+                while (done < updates) {
+                    // Collect what completed, then submit until the lane is full; a
+                    // completion is only kept until its slot is submitted to again
+                    int32_t status;
+                    while (done < sent && (status = shared->commands.completion(lane, first + done, first + done + 1)) != COMMAND_PENDING) {
+                        latency.push_back(std::chrono::duration<double, std::micro>(Clock::now() - submitted[done]).count());
+                        if (status != COMMAND_ACCEPTED) ++rejected;
+                        if (status != wanted[done]) ++lost;
+                        ++done;
+                    }
+                    while (sent < updates && sent - done < static_cast<int>(CommandLane::Capacity)) {
+                        bool bad = badEvery > 0 && sent % badEvery == badEvery - 1;
+                        FanCommand command = { first + sent + 1, COMMAND_SET_CURVE_POINT, bad ? MAX_CHANNELS : channel,
+                                               { point, temp, fanValue(k, sent), 0, 0 } };
+                        wanted[sent] = bad ? COMMAND_BAD_CHANNEL : COMMAND_ACCEPTED;
+                        submitted[sent] = Clock::now();
+                        if (!shared->commands.submit(lane, command)) break;
+                        if (bad) ++expectedRejects;
+                        ++sent;
+                    }
+                    if (done < sent) std::this_thread::yield();
+                }
+                shared->commands.release(lane);
+            });
+        }
+        for (std::thread& t : threads) t.join();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        stop = true;
+        if (backend.joinable()) backend.join();
+
+        // Every client's last accepted value must be what the config holds
+        FanConfig final = shared->config.load();
+        for (int k = 0; k < clients && queued; ++k) {
+            int last = updates - 1;
+            while (last > 0 && badEvery > 0 && last % badEvery == badEvery - 1) --last;
+            if (final.curve_fan[pointOf(k).first][pointOf(k).second] != fanValue(k, last)) ++lost;
+        }
+
+        std::vector<double> all;
+        for (const std::vector<double>& l : latencies) all.insert(all.end(), l.begin(), l.end());
+        LatencyStats stats = summarize(all);
+        std::cout << std::left << std::setw(28) << (queued ? "command queue" : "whole-config writes") << std::right
+                  << std::fixed << std::setprecision(0) << std::setw(12) << all.size() / seconds
+                  << std::setprecision(1) << std::setw(10) << stats.p50 << std::setw(10) << stats.p99
+                  << std::setw(10) << stats.max << std::setw(10) << lost.load() << std::setw(10) << rejected.load() << std::endl;
+        if (queued && (lost || rejected != expectedRejects)) ok = false;
+    }
+    if (!ok) std::cout << "command queue lost or misreported updates" << std::endl;
+    return ok ? 0 : 2;
+}
+
+// Nanoseconds per event of body(i) over events events
+template <typename Body>
+static double timePerEvent(int events, Body body)
+{
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < events; ++i) body(i);
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / events;
+}
+
+static int benchStats(const std::vector<std::string>& args)
+{
+    int events = 2000000;
+    int threads = 2;
+    unsigned seed = 1;
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-n" && i + 1 < args.size()) events = std::max(1000, std::atoi(args[++i].c_str()));
+        else if (args[i] == "-t" && i + 1 < args.size()) threads = std::max(1, std::atoi(args[++i].c_str()));
+        else if (args[i] == "--seed" && i + 1 < args.size()) seed = static_cast<unsigned>(std::atoi(args[++i].c_str()));
+    }
+
+    bool ok = true;
+    std::mt19937_64 rng(seed);
+
+    // Every value lands in the bucket whose range holds it
+    std::uniform_real_distribution<double> exponent(0, 36);
+    int misplaced = 0;
+    for (int i = 0; i < 1000000; ++i) {
+        uint64_t ns = static_cast<uint64_t>(std::pow(2.0, exponent(rng)));
+        int b = latencyBucket(ns);
+        if (ns < latencyBucketStart(b) || (b < LATENCY_BUCKETS - 1 && ns >= latencyBucketStart(b + 1))) ++misplaced;
+        if (b < LATENCY_BUCKETS - 1 && b >= 4 && latencyBucketStart(b + 1) - latencyBucketStart(b) > latencyBucketStart(b) / 4) ++misplaced;
+    }
+    std::cout << "bucket placement: " << misplaced << " of 1000000 values misplaced" << std::endl;
+    if (misplaced) ok = false;
+
+    // Percentiles from the buckets against the exact ones of log-normal EC-like latencies
+    std::unique_ptr<HotPathStats> stats(new HotPathStats());
+    stats->init();
+    std::lognormal_distribution<double> latencyNs(std::log(40000.0), 0.8);
+    std::vector<double> exact;
+    for (int i = 0; i < 200000; ++i) {
+        uint64_t ns = static_cast<uint64_t>(latencyNs(rng));
+        stats->phases[PHASE_EC_READ].record(ns);
+        exact.push_back(ns / 1000.0);
+    }
+    std::sort(exact.begin(), exact.end());
+    LatencySummary summary = summarizeLatency(stats->phases[PHASE_EC_READ]);
+    double worst = 0;
+    const double wanted[3] = { exact[exact.size() / 2], exact[exact.size() * 9 / 10], exact[exact.size() * 99 / 100] };
+    const double got[3] = { summary.p50Us, summary.p90Us, summary.p99Us };
+    for (int q = 0; q < 3; ++q) worst = std::max(worst, std::fabs(got[q] - wanted[q]) / wanted[q]);
+    std::cout << std::fixed << std::setprecision(1) << "percentiles: p50 " << summary.p50Us << " us (exact " << wanted[0]
+              << "), p90 " << summary.p90Us << " (" << wanted[1] << "), p99 " << summary.p99Us << " (" << wanted[2]
+              << "), worst error " << worst * 100 << "%" << std::endl;
+    if (summary.count != exact.size() || worst > 0.25 || summary.maxUs != exact.back()) ok = false;
+
+    // What an instrumented event costs on top of the event itself
+    stats->init();
+    std::atomic<long long> sink(0);
+    HotPathStats* none = nullptr;
+    double recordNs = timePerEvent(events, [&](int i) { stats->phases[PHASE_FILTER].record(static_cast<uint64_t>(i & 0xffff)); });
+    double clocksNs = timePerEvent(events, [&](int) {
+        LatencyClock::time_point start = LatencyClock::now();
+        sink.fetch_add((LatencyClock::now() - start).count(), std::memory_order_relaxed);
+    });
+    double timedNs = timePerEvent(events, [&](int) {
+        LatencyClock::time_point start = latencyStart(stats.get());
+        latencyEnd(stats.get(), PHASE_CONTROL, start);
+    });
+    double offNs = timePerEvent(events, [&](int) {
+        LatencyClock::time_point start = latencyStart(none);
+        latencyEnd(none, PHASE_CONTROL, start);
+    });
+
+    // Several threads timing into the same histogram, as the bus and control threads do
+    std::vector<double> perThread(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            perThread[t] = timePerEvent(events / threads, [&](int) {
+                LatencyClock::time_point start = latencyStart(stats.get());
+                latencyEnd(stats.get(), PHASE_TICK, start);
+            });
+        });
+    }
+    for (std::thread& w : workers) w.join();
+    double contendedNs = *std::max_element(perThread.begin(), perThread.end());
+    uint64_t recorded = summarizeLatency(stats->phases[PHASE_TICK]).count;
+    if (recorded != static_cast<uint64_t>(events / threads) * threads) {
+        std::cout << "concurrent recording lost " << static_cast<uint64_t>(events / threads) * threads - recorded << " events" << std::endl;
+        ok = false;
+    }
+
+    // A zero-latency simulated EC read with and without its statistics
+    SimulatedEc::Timing timing;
+    timing.inputLatency = std::chrono::microseconds(0);
+    timing.outputLatency = std::chrono::microseconds(0);
+    SimulatedEc ec(timing);
+    int reads = std::max(1000, events / 20);
+    double readNs = timePerEvent(reads, [&](int) { ec.read(176); });
+    ec.setStats(stats.get());
+    double readStatsNs = timePerEvent(reads, [&](int) { ec.read(176); });
+
+    std::cout << std::left << std::setw(40) << "event" << std::right << std::setw(12) << "ns/event" << std::endl;
+    auto row = [](const std::string& label, double ns) {
+        std::cout << std::left << std::setw(40) << label << std::right << std::fixed << std::setprecision(1) << std::setw(12) << ns << std::endl;
+    };
+    row("record a duration", recordNs);
+    row("two clock reads", clocksNs);
+    row("timed event (clock reads + record)", timedNs);
+    row("timed event, statistics off", offNs);
+    row("timed event, " + std::to_string(threads) + " threads, one histogram", contendedNs);
+    row("simulated EC read", readNs);
+    row("simulated EC read with statistics", readStatsNs);
+
+    if (timedNs >= 1000 || contendedNs >= 1000) {
+        std::cout << "instrumentation costs a microsecond or more per event" << std::endl;
+        ok = false;
+    }
+    if (!ok) std::cout << "latency histograms are wrong or too slow" << std::endl;
+    return ok ? 0 : 2;
+}
+
+static void writeBytes(const std::string& path, const std::string& bytes)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(bytes.data(), bytes.size());
+}
+
+static bool sameConfig(const FanConfig& a, const FanConfig& b)
+{
+    return std::memcmp(&a, &b, sizeof(FanConfig)) == 0;
+}
+
+static int benchSettings(const std::vector<std::string>& args)
+{
+    std::string dir = ".";
+    int steps = 200;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-d" && i + 1 < args.size()) dir = args[++i];
+        else if (args[i] == "-n" && i + 1 < args.size()) steps = std::max(1, std::atoi(args[++i].c_str()));
+    }
+    const std::string path = dir + "/fanbench_settings.dat";
+    bool ok = true;
+    auto check = [&](bool passed, const std::string& what) {
+        std::cout << (passed ? "ok    " : "FAIL  ") << what << std::endl;
+        if (!passed) ok = false;
+    };
+    auto command = [](uint32_t type, int32_t number, const std::string& name) {
+        FanCommand c = { 1, type, 0, { number, 0, 0, 0, 0 } };
+        if (!name.empty()) packProfileName(name, c.args + 1);
+        return c;
+    };
+    uint32_t builtins = 0;
+    for (int p = 0; p < PROFILE_COUNT; ++p) {
+        if (isBuiltinProfile(p)) builtins |= 1u << p;
+    }
+
+    // Current settings and three profiles survive a write and a reload
+    FanConfig edited = defaultFanConfig();
+    edited.curve_fan[CHANNEL_CPU][2] = 17;
+    edited.mode[CHANNEL_GPU] = FAN_MODE_PID;
+    Clock::time_point now = Clock::now();
+    std::string encoded;
+    {
+        SettingsStore store(path);
+        FanConfig config = edited;
+        for (int p = 1; p <= 3; ++p) {
+            config.hysteresis[CHANNEL_CPU] = p;
+            store.applyProfileCommand(config, command(COMMAND_SAVE_PROFILE, p * 2, "profile " + std::to_string(p)), now);
+        }
+        store.update(edited, now);
+        check(store.flush() && store.writes() == 1, "the settings file is written");
+        encoded = store.encode();
+    }
+    {
+        SettingsStore store(path);
+        ProfileDirectory directory = store.directory();
+        check(store.load() == SettingsLoad::Loaded && sameConfig(store.current(), edited) && !store.pending(),
+              "the current settings load back unchanged");
+        directory = store.directory();
+        FanConfig config = edited;
+        bool profilesOk = directory.active == 6 && directory.used == (builtins | 1u << 2 | 1u << 4 | 1u << 6) &&
+                          std::string(directory.names[4]) == "profile 2";
+        profilesOk = profilesOk && store.applyProfileCommand(config, command(COMMAND_SWITCH_PROFILE, 2, ""), now) == COMMAND_ACCEPTED &&
+                     config.hysteresis[CHANNEL_CPU] == 1 && config.curve_fan[CHANNEL_CPU][2] == 17;
+        check(profilesOk, "the profiles load back with their names and settings");
+    }
+
+    // A file cut short or with any byte changed is never loaded
+    int misloaded = 0;
+    for (size_t length = 0; length < encoded.size(); ++length) {
+        writeBytes(path, encoded.substr(0, length));
+        SettingsStore store(path);
+        if (store.load() != SettingsLoad::Corrupt || !sameConfig(store.current(), defaultFanConfig())) ++misloaded;
+    }
+    for (size_t at = 0; at < encoded.size(); ++at) {
+        std::string damaged = encoded;
+        damaged[at] ^= 0x10;
+        writeBytes(path, damaged);
+        SettingsStore store(path);
+        if (store.load() != SettingsLoad::Corrupt) ++misloaded;
+    }
+    check(misloaded == 0, "every truncation and single-byte change of a " + std::to_string(encoded.size()) +
+          "-byte file is rejected (" + std::to_string(misloaded) + " loaded)");
+    std::ifstream kept(path + ".corrupt", std::ios::binary);
+    check(static_cast<bool>(kept), "a damaged file is kept next to the settings");
+    kept.close();
+    std::remove((path + ".corrupt").c_str());
+
+    // A crash before the rename leaves the old file and a stray temporary
+    writeBytes(path, encoded);
+    writeBytes(path + ".tmp", encoded.substr(0, encoded.size() / 2));
+    {
+        SettingsStore store(path);
+        check(store.load() == SettingsLoad::Loaded && sameConfig(store.current(), edited), "an interrupted write leaves the old file");
+        store.update(defaultFanConfig(), now);
+        store.flush();
+        std::ifstream temp(path + ".tmp");
+        check(!temp, "the next write replaces the stray temporary file");
+    }
+
+    // Version 1 files and the headerless files from before channels were arrays
+    {
+        FanConfig v1 = edited;
+        std::string bytes(16, '\0');
+        uint32_t v1Header[4] = { SETTINGS_MAGIC, 1, offsetof(FanConfig, idle_mode), 0 };
+        std::memcpy(&bytes[0], v1Header, sizeof(v1Header));
+        bytes.append(reinterpret_cast<const char*>(&v1), offsetof(FanConfig, idle_mode));
+        writeBytes(path, bytes);
+        SettingsStore store(path);
+        FanConfig expected = edited;
+        expected.idle_mode = defaultFanConfig().idle_mode;
+        bool migrated = store.load() == SettingsLoad::Migrated && sameConfig(store.current(), expected) && store.flush();
+        SettingsStore reloaded(path);
+        check(migrated && reloaded.load() == SettingsLoad::Loaded && sameConfig(reloaded.current(), expected),
+              "a version 1 file without the idle settings migrates and is rewritten");
+
+        std::string legacy;
+        double temps[2] = { 50, 45 };
+        int32_t speeds[2] = { 20, 30 }, hysteresis[2] = { 4, 2 };
+        int32_t tempPoints[2][3] = { { 50, 65, 75 }, { 45, 60, 70 } };
+        int32_t fanPoints[2][5] = { { 0, 10, 20, 40, 100 }, { 0, 15, 25, 50, 100 } };
+        legacy.append(reinterpret_cast<const char*>(temps), sizeof(temps));
+        legacy.append(reinterpret_cast<const char*>(speeds), sizeof(speeds));
+        legacy.append(reinterpret_cast<const char*>(hysteresis), sizeof(hysteresis));
+        legacy.append(reinterpret_cast<const char*>(tempPoints), sizeof(tempPoints));
+        legacy.append(reinterpret_cast<const char*>(fanPoints), sizeof(fanPoints));
+        writeBytes(path, legacy);
+        SettingsStore old(path);
+        FanConfig config;
+        bool legacyOk = old.load() == SettingsLoad::Migrated;
+        config = old.current();
+        check(legacyOk && config.curve_temp[CHANNEL_GPU][2] == 60 && config.curve_fan[CHANNEL_CPU][3] == 40 &&
+              config.hysteresis[CHANNEL_CPU] == 4 && config.curve_temp[CHANNEL_CPU][4] == 100,
+              "a headerless legacy file migrates");
+    }
+
+    // Dragging a point: a change every 50 ms for steps steps, then nothing
+    std::remove(path.c_str());
+    SettingsStore store(path);
+    store.load();
+    store.flush();
+    unsigned long long before = store.writes();
+    Clock::time_point t = now;
+    FanConfig dragged = defaultFanConfig();
+    for (int i = 0; i < steps; ++i) {
+        dragged.curve_fan[CHANNEL_CPU][2] = i % 101;
+        store.update(dragged, t);
+        store.flushIfDue(t);
+        t += std::chrono::milliseconds(50);
+    }
+    unsigned long long during = store.writes() - before;
+    for (int i = 0; i < 100; ++i) {
+        t += std::chrono::milliseconds(50);
+        store.flushIfDue(t);
+    }
+    unsigned long long drag = store.writes() - before;
+    unsigned long long bound = steps * 50 / 10000 + 1;
+    check(during <= bound && drag == during + 1 && !store.pending(),
+          std::to_string(steps) + " changes 50 ms apart take " + std::to_string(drag) + " file writes (one per 10 s of dragging and one at the end)");
+
+    // A saver thread writes a change once it is due, and a reader never
+    // waits for it to reach the disk
+    {
+        SettingsStore saved(path, std::chrono::milliseconds(50), std::chrono::milliseconds(200));
+        saved.load();
+        saved.flush();
+        unsigned long long first = saved.writes();
+        std::thread saver([&] {
+            while (saved.flushWhenDue()) {
+            }
+        });
+        FanConfig changed = defaultFanConfig();
+        changed.curve_fan[CHANNEL_GPU][2] = 23;
+        saved.update(changed, Clock::now());
+        bool earlyWrite = saved.writes() != first;
+        double worstUs = 0;
+        Clock::time_point deadline = Clock::now() + std::chrono::seconds(5);
+        while (saved.pending() && Clock::now() < deadline) {
+            Clock::time_point before = Clock::now();
+            saved.directory();
+            worstUs = std::max(worstUs, std::chrono::duration<double, std::micro>(Clock::now() - before).count());
+        }
+        saved.stopSaving();
+        saver.join();
+        SettingsStore reloaded(path);
+        check(!earlyWrite && saved.writes() == first + 1 && reloaded.load() == SettingsLoad::Loaded &&
+              sameConfig(reloaded.current(), changed),
+              "a saver thread writes a change once it is due (directory() took at most " +
+              std::to_string(static_cast<int>(worstUs)) + " us meanwhile)");
+    }
+
+    // Profile commands
+    {
+        FanConfig config = defaultFanConfig();
+        config.curve_fan[CHANNEL_GPU][3] = 44;
+        bool commandsOk = store.applyProfileCommand(config, command(COMMAND_SAVE_PROFILE, 1, "silent"), t) == COMMAND_ACCEPTED &&
+                          store.applyProfileCommand(config, command(COMMAND_SWITCH_PROFILE, PROFILE_DEFAULTS, ""), t) == COMMAND_ACCEPTED &&
+                          config.curve_fan[CHANNEL_GPU][3] == defaultFanConfig().curve_fan[CHANNEL_GPU][3] &&
+                          store.applyProfileCommand(config, command(COMMAND_SWITCH_PROFILE, 1, ""), t) == COMMAND_ACCEPTED &&
+                          config.curve_fan[CHANNEL_GPU][3] == 44 && store.directory().active == 1 &&
+                          store.applyProfileCommand(config, command(COMMAND_SAVE_PROFILE, PROFILE_SLOTS + 1, "x"), t) == COMMAND_UNKNOWN_PROFILE &&
+                          store.applyProfileCommand(config, command(COMMAND_SAVE_PROFILE, 2, ""), t) == COMMAND_BAD_VALUE &&
+                          store.applyProfileCommand(config, command(COMMAND_DELETE_PROFILE, 1, ""), t) == COMMAND_ACCEPTED &&
+                          store.applyProfileCommand(config, command(COMMAND_SWITCH_PROFILE, 1, ""), t) == COMMAND_UNKNOWN_PROFILE &&
+                          store.directory().active == PROFILE_DEFAULTS && store.directory().used == builtins &&
+                          store.applyProfileCommand(config, command(COMMAND_SWITCH_PROFILE, PROFILE_QUIET, ""), t) == COMMAND_ACCEPTED &&
+                          store.directory().active == PROFILE_QUIET && config.curve_temp[CHANNEL_CPU][1] == 60 &&
+                          store.applyProfileCommand(config, command(COMMAND_DELETE_PROFILE, PROFILE_QUIET, ""), t) == COMMAND_UNKNOWN_PROFILE;
+        check(commandsOk, "profiles are saved, switched to and deleted through commands, built-in ones only switched to");
+    }
+
+    // What one write costs, flushed to disk and renamed into place
+    const int writes = 20;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < writes; ++i) {
+        dragged.curve_fan[CHANNEL_CPU][2] = i;
+        store.update(dragged, t);
+        store.flush();
+    }
+    double flushMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / writes;
+    std::cout << std::fixed << std::setprecision(2) << "one settings write (" << store.encode().size() << " bytes) takes "
+              << flushMs << " ms" << std::endl;
+    std::remove(path.c_str());
+
+    if (!ok) std::cout << "the settings store lost, misloaded or rewrote settings" << std::endl;
+    return ok ? 0 : 2;
+}
+
+// A config marked with k in several places, so a profile whose parts
+// disagree shows that it was read while being written
+static FanConfig markedConfig(int k)
+{
+    FanConfig config = defaultFanConfig();
+    int m = k % 50;
+    for (int c = 0; c < config.channel_count; ++c) {
+        config.curve_fan[c][2] = 10 + m;
+        config.curve_fan[c][3] = 40 + m;
+        config.target_temp[c] = 50 + m;
+        config.interpolation[c] = k % 3;
+    }
+    return config;
+}
+
+static bool consistentProfile(const CompiledProfile& profile)
+{
+    const FanConfig& config = profile.config;
+    int m = config.target_temp[0] - 50;
+    for (int c = 0; c < config.channel_count; ++c) {
+        if (config.curve_fan[c][2] != 10 + m || config.curve_fan[c][3] != 40 + m || config.target_temp[c] != 50 + m) return false;
+        if (profile.curves[c].at(config.curve_temp[c][2]) != 10 + m || profile.curves[c].at(config.curve_temp[c][3]) != 40 + m) return false;
+    }
+    return true;
+}
+
+// One saved profile, standing in for SettingsStore
+struct SavedProfile
+{
+    int32_t number;
+    FanConfig config;
+
+    bool profile(int32_t n, FanConfig& out) const
+    {
+        if (n != number) return false;
+        out = config;
+        return true;
+    }
+};
+
+// Profile switching: a control thread ticking on the profiles a compiler
+// thread publishes as fast as it can, checked for torn profiles and timed
+// against compiling on the control thread as applyConfig does; then the
+// precompiled profiles, validation and the selection rules
+static int benchProfiles(const std::vector<std::string>& args)
+{
+    int switches = 2000;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-n" && i + 1 < args.size()) switches = std::max(1, std::atoi(args[++i].c_str()));
+    }
+    bool ok = true;
+    auto check = [&](bool passed, const std::string& what) {
+        std::cout << (passed ? "ok    " : "FAIL  ") << what << std::endl;
+        if (!passed) ok = false;
+    };
+    auto sinceUs = [](Clock::time_point start) { return std::chrono::duration<double, std::micro>(Clock::now() - start).count(); };
+
+    SimulatedEc::Timing instant;
+    instant.inputLatency = std::chrono::microseconds(0);
+    instant.outputLatency = std::chrono::microseconds(0);
+    SimulatedEc ec(instant);
+
+    ProfileSet profiles;
+    profiles.publish(markedConfig(0), -1);
+    std::atomic<bool> done(false);
+    std::vector<double> swapUs;
+    swapUs.reserve(switches + 1);
+    unsigned long long ticks = 0, torn = 0;
+    FanConfig last = {};
+    std::thread control([&] {
+        ControlLoop loop(ec, markedConfig(0));
+        SampleScheduler scheduler(markedConfig(0));
+        EcSnapshot frame = {};
+        const CompiledProfile* running = nullptr;
+        for (;;) {
+            // Read before acquire(), so the last profile published is picked up
+            bool finished = done.load();
+            Clock::time_point start = Clock::now();
+            const CompiledProfile* profile = profiles.acquire();
+            if (profile != running) {
+                loop.applyProfile(*profile);
+                scheduler.configure(profile->config);
+                running = profile;
+                swapUs.push_back(sinceUs(start));
+            }
+            for (int c = 0; c < predator_phn16_72.channelCount; ++c) frame.values[predator_phn16_72.channels[c].tempReg & 0xff] = static_cast<short>(40 + ticks % 40);
+            frame.timestamp = Clock::now();
+            loop.tick(ticks * 0.1, 0, frame);
+            ++ticks;
+            // Still what it was when adopted, whatever the compiler did meanwhile
+            if (!consistentProfile(*running)) ++torn;
+            if (finished) break;
+            // Ticks far closer together than the backend's, but not spinning
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        last = running->config;
+    });
+    Clock::time_point publishStart = Clock::now();
+    for (int k = 1; k <= switches; ++k) profiles.publish(markedConfig(k), -1);
+    double publishSeconds = std::chrono::duration<double>(Clock::now() - publishStart).count();
+    done.store(true);
+    control.join();
+
+    check(torn == 0, std::to_string(switches) + " profiles published during " + std::to_string(ticks) + " ticks, " +
+          std::to_string(swapUs.size()) + " picked up, " + std::to_string(torn) + " ticks on a torn profile");
+    FanConfig expected = markedConfig(switches);
+    check(std::memcmp(&last, &expected, sizeof(FanConfig)) == 0, "the control loop ends on the last profile published");
+    std::cout << std::fixed << std::setprecision(2) << "the compiler thread published " << switches / publishSeconds
+              << " profiles/s" << std::endl;
+
+    // The same switches compiled on the control thread
+    std::vector<double> compileUs;
+    {
+        ControlLoop loop(ec, markedConfig(0));
+        SampleScheduler scheduler(markedConfig(0));
+        std::vector<FanConfig> configs;
+        for (int k = 1; k <= switches; ++k) configs.push_back(markedConfig(k));
+        compileUs.reserve(switches);
+        for (const FanConfig& config : configs) {
+            Clock::time_point start = Clock::now();
+            loop.applyConfig(config);
+            scheduler.configure(config);
+            compileUs.push_back(sinceUs(start));
+        }
+    }
+    std::cout << std::left << std::setw(28) << "switch on the control (us)" << std::right
+              << std::setw(10) << "min" << std::setw(10) << "p50" << std::setw(10) << "p99"
+              << std::setw(10) << "max" << std::setw(10) << "mean" << std::endl;
+    printStats("pointer swap", summarize(swapUs));
+    printStats("compile (applyConfig)", summarize(compileUs));
+
+    // The hand-over under pressure: the compiler publishes edited and
+    // saved profiles back to back while a reader checks, again and again,
+    // that the profile it acquired is not rewritten under it
+    {
+        ProfileSet set;
+        set.publish(markedConfig(0), -1);
+        std::atomic<bool> stop(false);
+        unsigned long long reads = 0, rewritten = 0;
+        std::thread reader([&] {
+            while (!stop.load()) {
+                const CompiledProfile* profile = set.acquire();
+                uint32_t sum = settingsChecksum(reinterpret_cast<const char*>(&profile->config), sizeof(FanConfig));
+                for (int i = 0; i < 10; ++i) {
+                    // Lets the compiler in while the profile is held, even on one core
+                    std::this_thread::yield();
+                    if (settingsChecksum(reinterpret_cast<const char*>(&profile->config), sizeof(FanConfig)) != sum ||
+                        !consistentProfile(*profile)) {
+                        ++rewritten;
+                        break;
+                    }
+                }
+                ++reads;
+            }
+        });
+        SavedProfile saved = { 3, markedConfig(0) };
+        int published = switches * 5;
+        for (int k = 1; k <= published; ++k) {
+            if (k % 5 == 0) {
+                saved.config = markedConfig(k);
+                set.refresh(saved);
+                set.publish(saved.config, 3);
+            }
+            else {
+                set.publish(markedConfig(k), -1);
+            }
+        }
+        stop.store(true);
+        reader.join();
+        check(rewritten == 0, std::to_string(published) + " profiles published back to back during " + std::to_string(reads) +
+              " reads, " + std::to_string(rewritten) + " of a profile rewritten while acquired");
+    }
+
+    // Built-in and saved profiles are compiled once
+    {
+        ProfileSet set;
+        FanConfig quiet, performance;
+        builtinFanConfig(PROFILE_QUIET, quiet);
+        builtinFanConfig(PROFILE_PERFORMANCE, performance);
+        set.publish(quiet, PROFILE_QUIET);
+        const CompiledProfile* first = set.acquire();
+        set.publish(performance, PROFILE_PERFORMANCE);
+        set.acquire();
+        set.publish(quiet, PROFILE_QUIET);
+        check(set.current() == first && first->number == PROFILE_QUIET,
+              "switching back to a built-in profile publishes the same precompiled copy");
+
+        SavedProfile saved = { 3, markedConfig(7) };
+        set.refresh(saved);
+        set.publish(saved.config, 3);
+        const CompiledProfile* compiled = set.acquire();
+        saved.config.curve_fan[CHANNEL_CPU][4] = 90;
+        set.refresh(saved);
+        set.publish(saved.config, 3);
+        check(compiled->number == 3 && consistentProfile(*compiled) && set.current() != compiled &&
+              set.current()->config.curve_fan[CHANNEL_CPU][4] == 90,
+              "a saved profile is recompiled into a new copy when it changes, leaving the running one alone");
+
+        // Settings the loop cannot run with are refused and the profile stays
+        const CompiledProfile* before = set.current();
+        FanConfig bad = defaultFanConfig();
+        bad.point_count[CHANNEL_GPU] = 1;
+        bool refused = !set.publish(bad, -1);
+        bad = defaultFanConfig();
+        bad.curve_temp[CHANNEL_CPU][2] = bad.curve_temp[CHANNEL_CPU][1] - 1;
+        refused = !set.publish(bad, -1) && refused;
+        bad = defaultFanConfig();
+        bad.kp[CHANNEL_CPU] = std::nanf("");
+        refused = !set.publish(bad, -1) && refused;
+        check(refused && set.rejected() == 3 && set.current() == before, "invalid settings are rejected and the running profile kept");
+    }
+
+    // Selection rules
+    {
+        ProfileDirectory directory = {};
+        for (int p = 0; p < PROFILE_COUNT; ++p) {
+            if (!isBuiltinProfile(p)) continue;
+            directory.used |= 1u << p;
+            std::strcpy(directory.names[p], builtinProfileName(p));
+        }
+        directory.used |= 1u << 2;
+        std::strcpy(directory.names[2], "Late Night");
+
+        ProfileRules rules = ProfileRules::parse(
+            "# games get the performance profile, plugged in or not\n"
+            "process \"Some Game.exe\" performance\n"
+            "process editor.exe Missing profile\n"
+            "battery battery\n"
+            "time 22:30-07:00 late night\n"
+            "mains 0\n");
+        RuleInputs inputs = { false, 12 * 60, { "explorer.exe", "editor.exe" } };
+        bool selected = rules.select(inputs, directory) == PROFILE_DEFAULTS;
+        inputs.minuteOfDay = 23 * 60;
+        selected = selected && rules.select(inputs, directory) == 2;
+        inputs.minuteOfDay = 6 * 60 + 59;
+        selected = selected && rules.select(inputs, directory) == 2;
+        inputs.minuteOfDay = 7 * 60;
+        selected = selected && rules.select(inputs, directory) == PROFILE_DEFAULTS;
+        inputs.onBattery = true;
+        selected = selected && rules.select(inputs, directory) == PROFILE_BATTERY;
+        inputs.processes.push_back("some game.exe");
+        selected = selected && rules.select(inputs, directory) == PROFILE_PERFORMANCE;
+        selected = selected && rules.needsProcesses() && ProfileRules::parse("mains quiet\n").select(inputs, directory) == -1;
+        check(selected, "rules select by process, power source and time of day, first match first");
+
+        int errors = 0;
+        const char* broken[] = { "mains quiet\ntime 25:00-07:00 quiet\n", "fly high\n", "process \"unterminated quiet\n",
+                                 "\n\nbattery\n", "time 22:00 quiet\n" };
+        const char* lines[] = { "line 2", "line 1", "line 1", "line 3", "line 1" };
+        for (size_t i = 0; i < sizeof(broken) / sizeof(broken[0]); ++i) {
+            try {
+                ProfileRules::parse(broken[i]);
+            }
+            catch (const std::invalid_argument& e) {
+                if (std::string(e.what()).find(lines[i]) != std::string::npos) ++errors;
+            }
+        }
+        check(errors == 5, "malformed rules are refused with their line number");
+
+        // What one evaluation costs with a typical process list
+        inputs.processes.clear();
+        for (int p = 0; p < 250; ++p) inputs.processes.push_back("process" + std::to_string(p) + ".exe");
+        const int evaluations = 10000;
+        int found = 0;
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < evaluations; ++i) found += rules.select(inputs, directory) >= 0;
+        std::cout << std::fixed << std::setprecision(2) << "one rules evaluation over " << inputs.processes.size()
+                  << " processes takes " << sinceUs(start) / evaluations << " us (" << found << " matched)" << std::endl;
+    }
+
+    if (!ok) std::cout << "profile switching ran on a torn or wrong profile" << std::endl;
+    return ok ? 0 : 2;
+}
+
+// The backend's acquisition and control stages behind an EcBusArbiter,
+// driving a simulated EC whose temperatures keep moving, once as they run
+// by default and once recording to trace files small enough to rotate.
+// Compares the tick times, then replays the files and checks that every
+// decision comes out the same. Returns 2 when the replay differs or the
+// recorder lost records.
+static int benchTrace(const std::vector<std::string>& args)
+{
+    std::string dir = ".";
+    int ticks = 1000;
+    int periodMs = 5;
+    double fileKb = 64;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-d" && i + 1 < args.size()) dir = args[++i];
+        else if (args[i] == "-n" && i + 1 < args.size()) ticks = std::max(10, std::atoi(args[++i].c_str()));
+        else if (args[i] == "-p" && i + 1 < args.size()) periodMs = std::max(1, std::atoi(args[++i].c_str()));
+        else if (args[i] == "--file-kb" && i + 1 < args.size()) fileKb = std::atof(args[++i].c_str());
+    }
+
+    FanConfig config = defaultFanConfig();
+    config.min_period_ms = config.max_period_ms = periodMs;
+    SensorPipeline::Params sensor;
+
+    std::cout << ticks << " ticks every " << periodMs << " ms, trace files of " << fileKb << " KB" << std::endl;
+    std::cout << std::left << std::setw(28) << "tick us" << std::right
+              << std::setw(10) << "min" << std::setw(10) << "p50" << std::setw(10) << "p99"
+              << std::setw(10) << "max" << std::setw(10) << "mean" << std::endl;
+
+    std::vector<std::string> files;
+    uint64_t dropped = 0;
+    for (int recording = 0; recording < 2; ++recording) {
+        SimulatedEc::Timing timing;
+        timing.inputLatency = std::chrono::microseconds(20);
+        timing.outputLatency = std::chrono::microseconds(40);
+        SimulatedEc sim(timing);
+        const EcRegisterMap& registers = predator_phn16_72;
+        for (int c = 0; c < registers.channelCount; ++c) sim.poke(registers.channels[c].tempReg, 50);
+
+        RecordingEcTransport bus(sim);
+        EcBusArbiter arbiter(bus);
+        ShadowedEcTransport shadow(arbiter.client(EcPriority::Actuation));
+        shadow.verifyThrough(arbiter.client(EcPriority::Background));
+        TickTrace tickTrace(shadow);
+        ControlLoop loop(tickTrace, config, sensor);
+        SampleScheduler scheduler(config);
+
+        Clock::time_point start = Clock::now();
+        std::unique_ptr<TraceRecorder> recorder;
+        if (recording) {
+            TraceRecorderParams traceParams;
+            traceParams.prefix = dir + "/fanbench_trace";
+            traceParams.fileBytes = static_cast<size_t>(fileKb * 1024);
+            traceParams.keepFiles = 1 << 20;
+            TraceStart traceStart = { config, -1, loop.ecRegisters(), sensor };
+            recorder.reset(new TraceRecorder(traceParams, traceStart, start));
+            bus.setRecorder(recorder.get());
+            tickTrace.setRecorder(recorder.get());
+        }
+
+        ControlEvents events(std::chrono::milliseconds(periodMs), L"FanBenchTrace");
+        Mailbox<SensorFrame> frames;
+        std::atomic<int> ticked(0);
+        std::vector<double> tickUs;
+        tickUs.reserve(ticks);
+        std::thread acquisition(acquisitionStage, std::ref(arbiter.client(EcPriority::Acquisition)), std::cref(registers),
+                                std::ref(events), std::ref(frames), nullptr);
+        std::thread control([&]() {
+            SensorFrame frame;
+            while (frames.take(frame)) {
+                if (ticked.load() >= ticks) continue;
+                Clock::time_point tickStart = Clock::now();
+                double now = std::chrono::duration<double>(tickStart - start).count();
+                double load = 50 + 40 * std::sin(now * 3.1);
+                tickTrace.beginTick(now, load, false, false);
+                tickTrace.recordFrame(frame.snapshot, loop.ecRegisters(), loop.channels());
+                ControlTickResult tick = loop.tick(now, load, frame.snapshot);
+                shadow.verify_if_due();
+                int nextPeriodMs = scheduler.next(now, tick.fast, tick.channelCount, load, tick.idle || tick.fallback);
+                tickTrace.endTick(tick, false, nextPeriodMs);
+                tickUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - tickStart).count());
+                ++ticked;
+            }
+        });
+
+        // Temperatures crossing the curve points both ways, faster than a laptop's
+        while (ticked.load() < ticks) {
+            double t = std::chrono::duration<double>(Clock::now() - start).count();
+            sim.poke(registers.channels[CHANNEL_CPU].tempReg, static_cast<short>(65 + 25 * std::sin(t * 2.3)));
+            sim.poke(registers.channels[CHANNEL_GPU].tempReg, static_cast<short>(60 + 20 * std::sin(t * 1.7)));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        events.requestShutdown();
+        acquisition.join();
+        control.join();
+
+        printStats(recording ? "recording" : "not recording", summarize(tickUs));
+        if (recording) {
+            bus.setRecorder(nullptr);
+            recorder->close();
+            files = recorder->files();
+            dropped = recorder->dropped();
+        }
+    }
+
+    uint64_t bytes = 0;
+    std::vector<TraceFile> traces;
+    for (const std::string& path : files) {
+        traces.push_back(readTraceFile(path));
+        bytes += traces.back().header.headerSize + traces.back().records.size() * sizeof(TraceRecord);
+    }
+    orderTraceFiles(traces);
+    TraceReplayResult replay = replayTrace(traces);
+    for (const std::string& path : files) std::remove(path.c_str());
+
+    std::cout << std::endl << std::fixed << std::setprecision(0) << files.size() << " trace files, " << bytes << " bytes, "
+              << static_cast<double>(bytes) / ticks << " bytes/tick, " << replay.busTransactions << " EC transactions, "
+              << dropped << " records dropped" << std::endl;
+    std::cout << "replayed " << replay.ticks << " ticks (" << std::setprecision(1) << replay.traceSeconds << " s) in "
+              << std::setprecision(3) << replay.wallSeconds * 1000 << " ms, " << std::setprecision(0)
+              << replay.traceSeconds / std::max(replay.wallSeconds, 1e-9) << "x real time, " << replay.mismatches
+              << " ticks decided differently" << std::endl;
+    if (!replay.firstMismatch.empty()) std::cout << "first " << replay.firstMismatch << std::endl;
+
+    bool ok = replay.ticks == static_cast<unsigned long long>(ticks) && replay.mismatches == 0 && dropped == 0;
+    if (!ok) std::cout << "the trace does not replay the run it recorded" << std::endl;
+    return ok ? 0 : 2;
+}
+
+// A recording of a known zone model: heat and fan stepping independently,
+// one sample a second. With restarts, every 20th sample has the fan with
+// the EC, and every 300 s the recording skips 30 s.
+static ThermalSeries syntheticSeries(const ZoneModel& model, bool restarts)
+{
+    const double heats[] = { 20, 80, 45, 100, 10, 60 };
+    const double fans[] = { 30, 100, 0, 60, 20, 80, 45 };
+    ThermalSeries series;
+    double heat = heats[0], sink = model.sink(60, heat);
+    for (int t = 0; t < 3600; ++t) {
+        double fan = fans[(t / 70) % 7];
+        bool gap = restarts && t % 300 >= 270;
+        if (!gap) {
+            series.time.push_back(t);
+            series.temp.push_back(model.temperature(sink, heat));
+            series.heat.push_back(heat);
+            series.fan.push_back(restarts && t % 20 == 19 ? -1 : fan);
+        }
+        heat = heats[(t / 110) % 6];
+        sink = model.step(sink, heat, fan, 1.0);
+    }
+    return series;
+}
+
+// The curve tuner: fits known zone models back from synthetic recordings,
+// with and without the restarts a real trace has, then tunes curves for
+// the fitted models and times the search on one thread and on every core.
+// Returns 2 when a fit misses the model or the search depends on the
+// thread count.
+static int benchTune(const std::vector<std::string>& args)
+{
+    int threads = 0;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-t" && i + 1 < args.size()) threads = std::max(1, std::atoi(args[++i].c_str()));
+    }
+    bool ok = true;
+    auto check = [&](bool passed, const std::string& what) {
+        std::cout << (passed ? "ok    " : "FAIL  ") << what << std::endl;
+        if (!passed) ok = false;
+    };
+
+    ZoneModel truth;
+    truth.tau = 40;
+    truth.gain = 0.5;
+    truth.fanEffect = 3;
+    truth.ambient = 30;
+    truth.rise = 0.1;
+    auto close = [](double fitted, double expected) { return std::fabs(fitted - expected) <= 0.01 * std::fabs(expected) + 1e-3; };
+    std::vector<ZoneModel> models;
+    for (bool restarts : { false, true }) {
+        ThermalSeries series = syntheticSeries(truth, restarts);
+        ZoneModel fitted = fitZoneModel(series);
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(3) << "fit " << (restarts ? "with" : "without") << " restarts: tau " << fitted.tau
+             << ", gain " << fitted.gain << ", fan effect " << fitted.fanEffect << ", ambient " << fitted.ambient << ", rise "
+             << fitted.rise << ", rms " << std::setprecision(5) << fitted.rms << " C over " << fitted.samples << " steps";
+        check(close(fitted.tau, truth.tau) && close(fitted.gain, truth.gain) && close(fitted.fanEffect, truth.fanEffect) &&
+              close(fitted.ambient, truth.ambient) && close(fitted.rise, truth.rise) && fitted.rms < 0.01, text.str());
+        models.push_back(fitted);
+    }
+
+    // Two zones under steps of heat, for 20 minutes
+    TuneWorkload workload;
+    const double steps[][2] = { { 10, 10 }, { 90, 40 }, { 30, 100 }, { 60, 60 } };
+    for (int i = 0; i < 4; ++i) {
+        workload.time.push_back(i * 300.0);
+        workload.heat[CHANNEL_CPU].push_back(steps[i][0]);
+        workload.heat[CHANNEL_GPU].push_back(steps[i][1]);
+    }
+    workload.duration = 1200;
+    workload.startTemp[CHANNEL_CPU] = workload.startTemp[CHANNEL_GPU] = 40;
+    TuneLimits limits;
+    limits.maxTemp = 70;
+
+    // At least two threads, so the parallel search is compared even on one core
+    if (threads == 0) threads = static_cast<int>(std::max(2u, std::thread::hardware_concurrency()));
+    TuneResult results[2];
+    int counts[2] = { 1, threads };
+    for (int run = 0; run < 2; ++run) {
+        Clock::time_point start = Clock::now();
+        results[run] = tuneCurves(defaultFanConfig(), models, workload, limits, counts[run], 1);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::cout << std::fixed << std::setprecision(0) << results[run].evaluations << " curves on " << results[run].threads
+                  << " threads in " << std::setprecision(2) << seconds << " s, " << std::setprecision(0)
+                  << results[run].evaluations / seconds << " curves/s" << std::endl;
+    }
+    const TuneResult& tuned = results[1];
+    check(std::memcmp(&results[0].config, &results[1].config, sizeof(FanConfig)) == 0,
+          "the search picks the same curves on " + std::to_string(tuned.threads) + " threads as on one");
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(1) << "tuned curves keep the zones at " << tuned.tuned.peak[CHANNEL_CPU] << " and "
+         << tuned.tuned.peak[CHANNEL_GPU] << " C under " << limits.maxTemp << " C with a mean fan of " << tuned.tuned.cost
+         << "% (defaults: " << std::max(tuned.base.peak[CHANNEL_CPU], tuned.base.peak[CHANNEL_GPU]) << " C, " << tuned.base.cost << "%)";
+    check(tuned.tuned.feasible && (!tuned.base.feasible || tuned.tuned.cost <= tuned.base.cost), text.str());
+
+    if (!ok) std::cout << "the tuner fitted or searched wrongly" << std::endl;
+    return ok ? 0 : 2;
+}
+
+static void usage()
+{
+    std::cerr << "usage: FanBench ec [sim|inpout|devport|ecsys|all]... [-n iterations] [-r register]\n"
+              << "                  [--mode fixed|adaptive|both] [--write]\n"
+              << "       FanBench events [-p period_ms] [-s idle_seconds] [-c notifications] [-m max_us]\n"
+              << "       FanBench curve [-n evaluations] [--seed s]\n"
+              << "       FanBench pipeline [-n crossings] [-p period_ms] [--verify ms] [--latency us] [--seed s]\n"
+              << "       FanBench commands [-c clients] [-n updates] [--bad every]\n"
+              << "       FanBench stats [-n events] [-t threads] [--seed s]\n"
+              << "       FanBench settings [-d directory] [-n changes]\n"
+              << "       FanBench profiles [-n switches]\n"
+              << "       FanBench trace [-d directory] [-n ticks] [-p period_ms] [--file-kb KB]\n"
+              << "       FanBench tune [-t threads]" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    std::string command = argv[1];
+    std::vector<std::string> args(argv + 2, argv + argc);
+
+    try {
+        if (command == "ec") return benchEc(args);
+        if (command == "events") return benchEvents(args);
+        if (command == "curve") return benchCurve(args);
+        if (command == "pipeline") return benchPipeline(args);
+        if (command == "commands") return benchCommands(args);
+        if (command == "stats") return benchStats(args);
+        if (command == "settings") return benchSettings(args);
+        if (command == "profiles") return benchProfiles(args);
+        if (command == "trace") return benchTrace(args);
+        if (command == "tune") return benchTune(args);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    usage();
+    return 1;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <exception>
+
+#include "ControlEvents.h"
+#include "EcRegisters.h"
+#include "EcTransport.h"
+#include "LatencyHistogram.h"
+#include "Mailbox.h"
+#include "TelemetryRing.h"
+
+// Temperatures read by the acquisition stage for the control stage
+struct SensorFrame
+{
+    EcSnapshot snapshot;
+    double readUs;
+    double latenessUs;  // how late the control timer woke this read, 0 for other wakeups
+};
+
+// The acquisition stage of the backend, run on its own thread: reads once
+// at start-up, then again each time events wakes it (every control period
+// and on new settings) until shutdown. Each pass reads the temperature
+// register of every channel in registers through bus, normally the acquisition priority
+// client of an EcBusArbiter, and posts the frame to the control stage. A
+// failed read posts a frame of zeros, which the sensor pipelines reject
+// like any other bad reading. Each pass is timed into stats when given.
+inline void acquisitionStage(EcTransport& bus, const EcRegisterMap& registers, ControlEvents& events, Mailbox<SensorFrame>& frames, HotPathStats* stats = nullptr)
+{
+    short regs[MAX_CHANNELS];
+    for (int c = 0; c < registers.channelCount; ++c) regs[c] = registers.channels[c].tempReg;
+
+    WakeReason reason = WakeReason::ConfigChanged;
+    do {
+        SensorFrame frame = {};
+        if (reason == WakeReason::ControlTick) frame.latenessUs = events.latenessUs();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        try {
+            bus.snapshot(regs, registers.channelCount, frame.snapshot);
+        }
+        catch (const std::exception&) {
+            frame.snapshot = {};
+            frame.snapshot.timestamp = std::chrono::steady_clock::now();
+        }
+        frame.readUs = std::chrono::duration<double, std::micro>(frame.snapshot.timestamp - start).count();
+        if (stats) stats->phases[PHASE_ACQUIRE].record(frame.snapshot.timestamp - start);
+        frames.post(frame);
+    } while ((reason = events.wait()) != WakeReason::Shutdown);
+    frames.close();
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// FanCommand::type
+const uint32_t COMMAND_SET_CURVE_POINT = 1;     // args: point index, temperature C, fan %
+const uint32_t COMMAND_SET_POINT_COUNT = 2;     // args: points in use
+const uint32_t COMMAND_SET_HYSTERESIS = 3;      // args: C
+const uint32_t COMMAND_SET_MODE = 4;            // args: FAN_MODE_*, PID target C
+const uint32_t COMMAND_SET_INTERPOLATION = 5;   // args: CURVE_*
+const uint32_t COMMAND_SET_IDLE_MODE = 6;       // args: IDLE_*; channel is ignored
+const uint32_t COMMAND_SWITCH_PROFILE = 7;      // args: profile number; channel is ignored
+const uint32_t COMMAND_FORCE_SPEED = 8;         // args: fan %, or -1 to hand the fan back to its controller
+const uint32_t COMMAND_RESET_STATS = 9;         // no args; channel is ignored
+const uint32_t COMMAND_SAVE_PROFILE = 10;       // args: profile number, then its name in the other four; channel is ignored
+const uint32_t COMMAND_DELETE_PROFILE = 11;     // args: profile number; channel is ignored
+const uint32_t COMMAND_SET_COUPLING = 12;       // args: zone channel, weight of its demand on this fan in %
+const uint32_t COMMAND_SET_SLEW = 13;           // args: slew up %/s, slew down %/s (0 for no limit), min step %
+const uint32_t COMMAND_SET_COUPLING_MODE = 14;  // args: COUPLING_*; channel is ignored
+
+// CommandCompletion::status
+const int32_t COMMAND_ACCEPTED = 0;
+const int32_t COMMAND_BAD_TYPE = 1;
+const int32_t COMMAND_BAD_CHANNEL = 2;
+const int32_t COMMAND_BAD_VALUE = 3;
+const int32_t COMMAND_UNKNOWN_PROFILE = 4;
+
+// CommandQueue::completion, not statuses the backend reports
+const int32_t COMMAND_PENDING = -1;             // not run yet
+const int32_t COMMAND_OVERWRITTEN = -2;         // run, but the slot already holds a later completion
+
+// One typed change to the backend's settings. seq is chosen by the client
+// and echoed in the completion.
+struct FanCommand
+{
+    uint32_t seq;
+    uint32_t type;
+    int32_t channel;
+    int32_t args[5];
+};
+
+// The backend's answer to the command in the same lane slot
+struct CommandCompletion
+{
+    std::atomic<uint32_t> seq;              // seq of the command, written last
+    std::atomic<int32_t> status;            // COMMAND_*
+    std::atomic<uint32_t> configVersion;    // config seqlock version after the command
+    uint32_t reserved;
+};
+
+// One client's bounded single-producer/single-consumer queue. The client
+// writes commands at head; the backend runs them in order, writes each
+// one's completion to the matching slot and only then moves tail past it,
+// so tail is also how far the completions go. A completion stays readable
+// until the client has submitted Capacity more commands. A slot is never
+// reused before the backend is done with it, so commands need no per-word
+// atomics; completions do, because a client may still be reading one when
+// the backend reuses its slot.
+struct CommandLane
+{
+    static const uint32_t Capacity = 64;
+
+    std::atomic<uint32_t> ownerPid;         // 0 while free
+    std::atomic<uint32_t> head;             // commands written, client only
+    std::atomic<uint32_t> tail;             // commands completed, backend only
+    uint32_t reserved;
+    FanCommand commands[Capacity];
+    CommandCompletion completions[Capacity];
+};
+
+// Multi-client command queue in the shared mapping: a fixed set of lanes,
+// one per connected client, drained round-robin by the backend. Each lane
+// has exactly one producer, so submitting never waits for another client
+// and a client flooding its lane cannot take slots from the others. Lanes
+// are claimed and released under the FanControlConfigLock mutex, which is
+// also how clients without atomics (ui.py) take part.
+template <uint32_t Lanes>
+class CommandQueue
+{
+    static_assert((CommandLane::Capacity & (CommandLane::Capacity - 1)) == 0, "Capacity must be a power of two");
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "atomic words must match the shared layout");
+
+public:
+    void init()
+    {
+        laneCount = Lanes;
+        capacity = CommandLane::Capacity;
+        for (uint32_t l = 0; l < Lanes; ++l) {
+            CommandLane& lane = lanes[l];
+            lane.head.store(0, std::memory_order_relaxed);
+            lane.tail.store(0, std::memory_order_relaxed);
+            for (uint32_t i = 0; i < CommandLane::Capacity; ++i) {
+                lane.completions[i].seq.store(0, std::memory_order_relaxed);
+            }
+            lane.ownerPid.store(0, std::memory_order_release);
+        }
+    }
+
+    // Client side. Returns a free lane, or one whose owner isAlive says has
+    // exited, marked as owned by pid; -1 when every lane is taken.
+    template <typename IsAlive>
+    int claim(uint32_t pid, IsAlive isAlive)
+    {
+        for (int pass = 0; pass < 2; ++pass) {
+            for (uint32_t l = 0; l < Lanes; ++l) {
+                uint32_t owner = lanes[l].ownerPid.load(std::memory_order_acquire);
+                if (pass == 1 && owner != 0 && isAlive(owner)) continue;
+                if (pass == 0 && owner != 0) continue;
+                if (lanes[l].ownerPid.compare_exchange_strong(owner, pid, std::memory_order_acq_rel)) {
+                    return static_cast<int>(l);
+                }
+            }
+        }
+        return -1;
+    }
+
+    // Commands still queued in the lane run; their completions are not read
+    void release(int lane)
+    {
+        lanes[lane].ownerPid.store(0, std::memory_order_release);
+    }
+
+    // Client side; false when the lane is full
+    bool submit(int lane, const FanCommand& command)
+    {
+        CommandLane& l = lanes[lane];
+        uint32_t index = l.head.load(std::memory_order_relaxed);
+        if (index - l.tail.load(std::memory_order_acquire) >= CommandLane::Capacity) return false;
+        l.commands[index & (CommandLane::Capacity - 1)] = command;
+        l.head.store(index + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Client side: the index the next submit will use
+    uint32_t nextIndex(int lane) const { return lanes[lane].head.load(std::memory_order_relaxed); }
+
+    // Client side: the COMMAND_* status of the command submitted at index
+    // with seq, COMMAND_PENDING while it has not run, or
+    // COMMAND_OVERWRITTEN once its completion slot has been reused
+    int32_t completion(int lane, uint32_t index, uint32_t seq, uint32_t* configVersion = nullptr) const
+    {
+        const CommandLane& l = lanes[lane];
+        if (static_cast<int32_t>(l.tail.load(std::memory_order_acquire) - index) <= 0) return COMMAND_PENDING;
+
+        const CommandCompletion& done = l.completions[index & (CommandLane::Capacity - 1)];
+        if (done.seq.load(std::memory_order_acquire) != seq) return COMMAND_OVERWRITTEN;
+        int32_t status = done.status.load(std::memory_order_relaxed);
+        uint32_t version = done.configVersion.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (done.seq.load(std::memory_order_relaxed) != seq) return COMMAND_OVERWRITTEN;
+        if (configVersion) *configVersion = version;
+        return status;
+    }
+
+    // Backend side: whether any lane has a command waiting
+    bool pending() const
+    {
+        for (uint32_t l = 0; l < Lanes; ++l) {
+            if (lanes[l].head.load(std::memory_order_acquire) != lanes[l].tail.load(std::memory_order_relaxed)) return true;
+        }
+        return false;
+    }
+
+    // Backend side: runs up to one lane's worth of commands from every
+    // lane, one command per lane in turn, through
+    // int32_t handler(const FanCommand&), and completes each with its
+    // status and the config version version() returns afterwards. Returns
+    // the number of commands run.
+    template <typename Handler, typename Version>
+    size_t drain(Handler handler, Version version)
+    {
+        uint32_t start[Lanes], end[Lanes];
+        for (uint32_t l = 0; l < Lanes; ++l) {
+            start[l] = lanes[l].tail.load(std::memory_order_relaxed);
+            end[l] = lanes[l].head.load(std::memory_order_acquire);
+            // A head further ahead than the lane holds is a client bug; run what is there
+            if (end[l] - start[l] > CommandLane::Capacity) end[l] = start[l] + CommandLane::Capacity;
+        }
+
+        size_t count = 0;
+        for (bool more = true; more; ) {
+            more = false;
+            for (uint32_t l = 0; l < Lanes; ++l) {
+                if (start[l] == end[l]) continue;
+                CommandLane& lane = lanes[l];
+                uint32_t slot = start[l] & (CommandLane::Capacity - 1);
+                FanCommand command = lane.commands[slot];
+                int32_t status = handler(static_cast<const FanCommand&>(command));
+
+                CommandCompletion& done = lane.completions[slot];
+                done.seq.store(0, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                done.status.store(status, std::memory_order_relaxed);
+                done.configVersion.store(version(), std::memory_order_relaxed);
+                done.seq.store(command.seq, std::memory_order_release);
+
+                lane.tail.store(++start[l], std::memory_order_release);
+                ++count;
+                more = more || start[l] != end[l];
+            }
+        }
+        return count;
+    }
+
+private:
+    uint32_t laneCount;
+    uint32_t capacity;
+    uint32_t reserved[2];
+    CommandLane lanes[Lanes];
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+
+#include "CommandQueue.h"
+#include "FanController.h"
+#include "SharedData.h"
+
+inline bool commandArgInRange(int32_t value, int32_t low, int32_t high)
+{
+    return value >= low && value <= high;
+}
+
+// Whether the first count curve temperatures of a channel ascend
+inline bool curveAscending(const FanConfig& config, int channel, int count)
+{
+    for (int i = 1; i < count; ++i) {
+        if (config.curve_temp[channel][i] < config.curve_temp[channel][i - 1]) return false;
+    }
+    return true;
+}
+
+// Applies one client command to config and returns its COMMAND_* status;
+// config is unchanged unless the command is accepted. A curve point may
+// only move between its neighbours, so a client moving several points
+// sends them in an order that keeps the curve ascending throughout.
+// COMMAND_FORCE_SPEED and COMMAND_RESET_STATS act on the control loop
+// and the statistics, not the config, and are left to the caller, as are
+// saved profiles: switching to one, saving and deleting them. Switching
+// to a built-in profile is handled here.
+inline int32_t applyConfigCommand(FanConfig& config, const FanCommand& command)
+{
+    const int32_t* args = command.args;
+    int c = command.channel;
+    bool perChannel = command.type != COMMAND_SET_IDLE_MODE && command.type != COMMAND_SWITCH_PROFILE &&
+                      command.type != COMMAND_SET_COUPLING_MODE;
+    bool configType = (command.type >= COMMAND_SET_CURVE_POINT && command.type <= COMMAND_SWITCH_PROFILE) ||
+                      (command.type >= COMMAND_SET_COUPLING && command.type <= COMMAND_SET_COUPLING_MODE);
+    if (!configType) return COMMAND_BAD_TYPE;
+    if (perChannel && !commandArgInRange(c, 0, std::min<int32_t>(MAX_CHANNELS, config.channel_count) - 1)) return COMMAND_BAD_CHANNEL;
+
+    switch (command.type) {
+    case COMMAND_SET_CURVE_POINT: {
+        int index = args[0];
+        int count = config.point_count[c];
+        if (!commandArgInRange(index, 0, MAX_CURVE_POINTS - 1) || !commandArgInRange(args[1], 0, 100) || !commandArgInRange(args[2], 0, 100)) return COMMAND_BAD_VALUE;
+        if (index < count) {
+            if (index > 0 && args[1] < config.curve_temp[c][index - 1]) return COMMAND_BAD_VALUE;
+            if (index + 1 < count && args[1] > config.curve_temp[c][index + 1]) return COMMAND_BAD_VALUE;
+        }
+        config.curve_temp[c][index] = args[1];
+        config.curve_fan[c][index] = args[2];
+        return COMMAND_ACCEPTED;
+    }
+    case COMMAND_SET_POINT_COUNT:
+        if (!commandArgInRange(args[0], 2, MAX_CURVE_POINTS) || !curveAscending(config, c, args[0])) return COMMAND_BAD_VALUE;
+        config.point_count[c] = args[0];
+        return COMMAND_ACCEPTED;
+    case COMMAND_SET_HYSTERESIS:
+        if (!commandArgInRange(args[0], 0, 20)) return COMMAND_BAD_VALUE;
+        config.hysteresis[c] = args[0];
+        return COMMAND_ACCEPTED;
+    case COMMAND_SET_MODE:
+        if ((args[0] != FAN_MODE_CURVE && args[0] != FAN_MODE_PID) || !commandArgInRange(args[1], 20, 100)) return COMMAND_BAD_VALUE;
+        config.mode[c] = args[0];
+        config.target_temp[c] = args[1];
+        return COMMAND_ACCEPTED;
+    case COMMAND_SET_INTERPOLATION:
+        if (!commandArgInRange(args[0], CURVE_LINEAR, CURVE_CUBIC)) return COMMAND_BAD_VALUE;
+        config.interpolation[c] = args[0];
+        return COMMAND_ACCEPTED;
+    case COMMAND_SET_IDLE_MODE:
+        if (!commandArgInRange(args[0], IDLE_OFF, IDLE_ON_BATTERY)) return COMMAND_BAD_VALUE;
+        config.idle_mode = args[0];
+        return COMMAND_ACCEPTED;
+    case COMMAND_SWITCH_PROFILE:
+        if (!builtinFanConfig(args[0], config)) return COMMAND_UNKNOWN_PROFILE;
+        return COMMAND_ACCEPTED;
+    case COMMAND_SET_COUPLING:
+        if (!commandArgInRange(args[0], 0, std::min<int32_t>(MAX_CHANNELS, config.channel_count) - 1) || !commandArgInRange(args[1], 0, 200)) return COMMAND_BAD_VALUE;
+        config.coupling[c][args[0]] = args[1] / 100.0f;
+        return COMMAND_ACCEPTED;
+    case COMMAND_SET_SLEW:
+        if (!commandArgInRange(args[0], 0, 1000) || !commandArgInRange(args[1], 0, 1000) || !commandArgInRange(args[2], 0, 20)) return COMMAND_BAD_VALUE;
+        config.slew_up[c] = static_cast<float>(args[0]);
+        config.slew_down[c] = static_cast<float>(args[1]);
+        config.min_step[c] = args[2];
+        return COMMAND_ACCEPTED;
+    case COMMAND_SET_COUPLING_MODE:
+        if (!commandArgInRange(args[0], COUPLING_MAX, COUPLING_SUM)) return COMMAND_BAD_VALUE;
+        config.coupling_mode = args[0];
+        return COMMAND_ACCEPTED;
+    }
+    return COMMAND_BAD_TYPE;
+}
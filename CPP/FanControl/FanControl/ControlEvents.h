@@ -0,0 +1,191 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#else
+#error "ControlEvents needs Windows or Linux"
+#endif
+
+enum class WakeReason { ControlTick, ConfigChanged, Shutdown };
+
+// Everything the control loop waits on: a periodic control timer, a
+// config-changed event signalled by clients and a shutdown event. wait()
+// blocks until one of them fires, so an idle backend wakes exactly once per
+// control period. On Windows the config event is named so other processes
+// (ui.py) can signal it; on Linux it is an eventfd for in-process use.
+class ControlEvents
+{
+public:
+    explicit ControlEvents(std::chrono::milliseconds period, const wchar_t* configEventName = L"FanControlConfigChanged")
+        : wakeupCount(0), periodNs(0), dueNs(0), latenessNs(0)
+    {
+#ifdef _WIN32
+        timer = CreateWaitableTimerW(NULL, FALSE, NULL);
+        configChanged = CreateEventW(NULL, FALSE, FALSE, configEventName);
+        shutdown = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (!timer || !configChanged || !shutdown) {
+            closeHandles();
+            throw std::runtime_error("Could not create control loop events");
+        }
+#else
+        (void)configEventName;
+        timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        configChanged = eventfd(0, EFD_CLOEXEC);
+        shutdown = eventfd(0, EFD_CLOEXEC);
+        if (timer < 0 || configChanged < 0 || shutdown < 0) {
+            closeHandles();
+            throw std::runtime_error("Could not create control loop events");
+        }
+#endif
+        setPeriod(period);
+    }
+
+    ~ControlEvents()
+    {
+        closeHandles();
+    }
+
+    ControlEvents(const ControlEvents&) = delete;
+    ControlEvents& operator=(const ControlEvents&) = delete;
+
+    // Restarts the control timer; the next tick fires one period from now
+    void setPeriod(std::chrono::milliseconds period)
+    {
+        if (period.count() <= 0) {
+            throw std::invalid_argument("control period must be positive");
+        }
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(period).count();
+        periodNs.store(ns, std::memory_order_relaxed);
+        dueNs.store(clockNs() + ns, std::memory_order_relaxed);
+#ifdef _WIN32
+        LARGE_INTEGER due;
+        due.QuadPart = -static_cast<LONGLONG>(period.count()) * 10000; // relative, 100 ns units
+        SetWaitableTimer(timer, &due, static_cast<LONG>(period.count()), NULL, NULL, FALSE);
+#else
+        itimerspec spec = {};
+        spec.it_value.tv_sec = period.count() / 1000;
+        spec.it_value.tv_nsec = (period.count() % 1000) * 1000000;
+        spec.it_interval = spec.it_value;
+        timerfd_settime(timer, 0, &spec, NULL);
+#endif
+    }
+
+    WakeReason wait()
+    {
+#ifdef _WIN32
+        // Lower index wins when several objects are signalled
+        HANDLE handles[3] = { shutdown, configChanged, timer };
+        DWORD result = WaitForMultipleObjects(3, handles, FALSE, INFINITE);
+        wakeupCount.fetch_add(1, std::memory_order_relaxed);
+        if (result == WAIT_OBJECT_0 + 1) return WakeReason::ConfigChanged;
+        if (result == WAIT_OBJECT_0 + 2) {
+            timerFired();
+            return WakeReason::ControlTick;
+        }
+        return WakeReason::Shutdown;
+#else
+        pollfd fds[3] = { { shutdown, POLLIN, 0 }, { configChanged, POLLIN, 0 }, { timer, POLLIN, 0 } };
+        while (poll(fds, 3, -1) < 0) {
+            // Any failure but a signal would fail again; stop the loop as WAIT_FAILED does
+            if (errno != EINTR) {
+                wakeupCount.fetch_add(1, std::memory_order_relaxed);
+                return WakeReason::Shutdown;
+            }
+        }
+        wakeupCount.fetch_add(1, std::memory_order_relaxed);
+        if (fds[0].revents & POLLIN) return WakeReason::Shutdown;
+        if (fds[1].revents & POLLIN) {
+            drain(configChanged);
+            return WakeReason::ConfigChanged;
+        }
+        drain(timer);
+        timerFired();
+        return WakeReason::ControlTick;
+#endif
+    }
+
+    // Both are safe to call from any thread, including signal handlers
+    void notifyConfigChanged() { signal(configChanged); }
+    void requestShutdown() { signal(shutdown); }
+
+    uint64_t wakeups() const { return wakeupCount.load(std::memory_order_relaxed); }
+
+    // How late the control timer woke the last ControlTick wait, in
+    // microseconds after the tick was due
+    double latenessUs() const { return latenessNs.load(std::memory_order_relaxed) / 1000.0; }
+
+private:
+    static int64_t clockNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Lateness is measured from when this tick was due. The timer drops
+    // the periods that passed meanwhile, so the next tick is due one period
+    // after the last of them.
+    void timerFired()
+    {
+        int64_t now = clockNs();
+        int64_t period = periodNs.load(std::memory_order_relaxed);
+        int64_t due = dueNs.load(std::memory_order_relaxed);
+        int64_t late = now - due;
+        latenessNs.store(late > 0 ? late : 0, std::memory_order_relaxed);
+        if (late >= period) due += late / period * period;
+        dueNs.store(due + period, std::memory_order_relaxed);
+    }
+
+#ifdef _WIN32
+    typedef HANDLE Handle;
+
+    static void signal(HANDLE event) { SetEvent(event); }
+
+    void closeHandles()
+    {
+        if (timer) CloseHandle(timer);
+        if (configChanged) CloseHandle(configChanged);
+        if (shutdown) CloseHandle(shutdown);
+    }
+#else
+    typedef int Handle;
+
+    static void signal(int fd)
+    {
+        uint64_t one = 1;
+        ssize_t written = ::write(fd, &one, sizeof(one));
+        (void)written;
+    }
+
+    static void drain(int fd)
+    {
+        uint64_t value;
+        ssize_t bytes = ::read(fd, &value, sizeof(value));
+        (void)bytes;
+    }
+
+    void closeHandles()
+    {
+        if (timer >= 0) close(timer);
+        if (configChanged >= 0) close(configChanged);
+        if (shutdown >= 0) close(shutdown);
+    }
+#endif
+
+    Handle timer;
+    Handle configChanged;
+    Handle shutdown;
+    std::atomic<uint64_t> wakeupCount;
+    std::atomic<int64_t> periodNs;
+    std::atomic<int64_t> dueNs;
+    std::atomic<int64_t> latenessNs;
+};
@@ -0,0 +1,479 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "EcTransport.h"
+#include "EcRegisters.h"
+#include "EcWatchdog.h"
+#include "FanArbiter.h"
+#include "FanController.h"
+#include "IdleMode.h"
+#include "LatencyHistogram.h"
+#include "ProfileSet.h"
+#include "SensorFilter.h"
+#include "SharedData.h"
+
+// Everything one control tick observed and decided, indexed by channel
+struct ControlTickResult
+{
+    int channelCount;
+    double raw[MAX_CHANNELS];
+    double temp[MAX_CHANNELS];
+    double fast[MAX_CHANNELS];  // lightly filtered, for PID and the sample scheduler
+    int demand[MAX_CHANNELS];   // what the zone's controller asked for, -1 before its first reading
+    int fan[MAX_CHANNELS];      // -1 while the EC has the fan
+    SensorSample sensor[MAX_CHANNELS];
+    bool idle;                  // the fans are handed back to the EC after this tick
+    bool fallback;              // the EC has the fans because the watchdog tripped
+    bool ecFailed;              // an EC transaction of this tick failed after its retries
+    bool overran;               // the tick ran past the watchdog's time budget
+    uint32_t forced;            // bit per channel held at a forced speed
+    uint32_t held;              // bit per channel whose change the slew or step limit held back
+
+    // Time spent on the EC bus during the tick
+    double ecReadUs;
+    double ecWriteUs;
+
+    // When the temperatures were read and when the last fan write finished;
+    // actuatedAt stays at its epoch when the tick wrote nothing
+    std::chrono::steady_clock::time_point sampledAt;
+    std::chrono::steady_clock::time_point actuatedAt;
+};
+
+// One iteration of the fan control algorithm: snapshot the temperature
+// registers, run each reading through its channel's SensorPipeline, run
+// each channel's controller (curve or PID, as the config selects),
+// arbitrate the demands of those zones into fan speeds (FanArbiter) and
+// write the fan speeds that changed. Channels are described by an
+// EcRegisterMap and the config arrays; the per-tick work is one pass over
+// them, compiled for each built-in map with its registers as constants and
+// as a fixed-size loop for its channel count. When every channel idles
+// near the bottom of its curve the fans are handed back to the EC's
+// automatic mode (IdleGovernor) and taken back once a channel reaches its
+// guard temperature. With an EcWatchdog the loop survives a failing EC: a
+// tick whose EC transaction fails writes every fan again on the next tick,
+// and once the watchdog trips the fans go to the EC's automatic mode until
+// the EC answers reliably again. The backend and the simulator both drive
+// this class, so a simulated run exercises exactly the code that runs on
+// the laptop.
+class ControlLoop
+{
+public:
+    ControlLoop(EcTransport& ec, const FanConfig& config, const SensorPipeline::Params& sensorParams = SensorPipeline::Params())
+        : ec(ec), channelCount(0), registers(predator_phn16_72), builtin(&predator_phn16_72), running(nullptr),
+          pass(nullptr), sensors(MAX_CHANNELS, SensorPipeline(sensorParams)),
+          lastLoad(0), lastTick(0), ticked(false), watchdog(nullptr), fallback(false), handBackPending(false),
+          ecWriteUs(0), stats(nullptr)
+    {
+        snapshot = {};
+        for (int c = 0; c < MAX_CHANNELS; ++c) {
+            mode[c] = FAN_MODE_CURVE;
+            fanLast[c] = -1;
+            maxFan[c] = 100;
+            fast[c] = 0;
+            controlDt[c] = 0;
+            faulted[c] = false;
+            idleGuard[c] = 0;
+            forcedFan[c] = -1;
+            demand[c] = -1;
+        }
+        idleMargin = 0;
+        idleMaxFan = 0;
+        applyConfig(config);
+    }
+
+    // Compiles config into a profile of the loop's own and runs on it.
+    // Compiling allocates; the backend compiles its profiles on another
+    // thread and switches with applyProfile.
+    void applyConfig(const FanConfig& config)
+    {
+        buildProfile(config, -1, own);
+        applyProfile(own);
+    }
+
+    // Runs on a compiled profile from the next tick on, without allocating
+    // or copying its curves; profile must stay unchanged until the loop is
+    // given another one
+    void applyProfile(const CompiledProfile& profile)
+    {
+        const FanConfig& config = profile.config;
+        running = &profile;
+
+        // Only the channels this EC has registers for
+        channelCount = std::max(0, std::min(registers.channelCount, config.channel_count));
+        pass = selectPass();
+
+        for (int c = 0; c < channelCount; ++c) {
+            curve[c].use(profile.curves[c], config.hysteresis[c]);
+
+            int last = std::max(2, std::min(MAX_CURVE_POINTS, config.point_count[c])) - 1;
+            pid[c].configure(config.target_temp[c], config.kp[c], config.ki[c], config.kd[c], config.feedforward[c],
+                             config.curve_fan[c][0], config.curve_fan[c][last]);
+            maxFan[c] = *std::max_element(config.curve_fan[c], config.curve_fan[c] + last + 1);
+            idleGuard[c] = config.curve_temp[c][1];
+
+            // Entering PID mode picks up from the current fan speed
+            if (config.mode[c] == FAN_MODE_PID && mode[c] != FAN_MODE_PID && ticked) {
+                pid[c].reset(std::max(0, fanLast[c]), fast[c], lastLoad);
+            }
+            mode[c] = config.mode[c];
+        }
+
+        arbiter.configure(config, channelCount);
+        idle.configure(config);
+        idleMargin = config.idle_margin;
+        idleMaxFan = config.idle_max_fan;
+    }
+
+    // The registers of the EC the loop drives, the PHN16-72's until set.
+    // A map from ec_models runs the pass compiled for it; any other map is
+    // copied and read at run time. Set it before the first tick.
+    void setRegisters(const EcRegisterMap& map)
+    {
+        registers = map;
+        builtin = nullptr;
+        for (const EcModel& model : ec_models) {
+            if (&map == model.registers) builtin = model.registers;
+        }
+        applyProfile(*running);
+    }
+
+    const EcRegisterMap& ecRegisters() const { return registers; }
+
+    // Whether the loop runs the pass compiled for a built-in map
+    bool compiledRegisters() const { return builtin != nullptr; }
+
+    // IDLE_ON_BATTERY hands the fans back only while this is set
+    void setOnBattery(bool onBattery) { idle.setOnBattery(onBattery); }
+    const IdleGovernor& idleState() const { return idle; }
+
+    // Holds a channel at percent regardless of its controller, or hands it
+    // back with -1; a faulted sensor still runs the fan at the top of its
+    // range. False for a channel or speed out of range.
+    bool forceFan(int channel, int percent)
+    {
+        if (channel < 0 || channel >= channelCount || percent < -1 || percent > 100) return false;
+        forcedFan[channel] = percent;
+        return true;
+    }
+
+    // Times each channel's sensor pipeline and controller into stats
+    void setStats(HotPathStats* s) { stats = s; }
+
+    // Bounds each tick by the watchdog's budget and falls back to the EC
+    // while it is tripped; ec should retry through the same watchdog. Without
+    // one, a failed EC transaction throws out of tick().
+    void setWatchdog(EcWatchdog* w) { watchdog = w; }
+
+    int channels() const { return channelCount; }
+    const SensorPipeline& sensor(int channel) const { return sensors[channel]; }
+
+    // now is a monotonic time in seconds (sim time in the simulator) and
+    // cpuLoad the OS CPU utilization in percent over the last tick. The
+    // filters are scaled to the time since the previous tick, so their
+    // time constants hold when the control period changes.
+    ControlTickResult tick(double now, double cpuLoad = 0.0)
+    {
+        // Registers the control loop consumes, fetched in one pass per tick
+        short tickRegisters[MAX_CHANNELS];
+        for (int c = 0; c < channelCount; ++c) tickRegisters[c] = registers.channels[c].tempReg;
+
+        Clock::time_point start = Clock::now();
+        try {
+            ec.snapshot(tickRegisters, channelCount, snapshot);
+        }
+        catch (const std::runtime_error&) {
+            // Like a failed acquisition read: zeros the sensor pipelines reject
+            if (!watchdog) throw;
+            snapshot = {};
+            snapshot.timestamp = Clock::now();
+        }
+        double readUs = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+        ControlTickResult result = tick(now, cpuLoad, snapshot);
+        result.ecReadUs = readUs;
+        return result;
+    }
+
+    // The same tick on temperatures another thread has already read;
+    // frame must hold the tempReg of every configured channel
+    ControlTickResult tick(double now, double cpuLoad, const EcSnapshot& frame)
+    {
+        double dt = ticked ? now - lastTick : 1.0;
+        lastTick = now;
+        lastLoad = cpuLoad;
+
+        ecWriteUs = 0;
+
+        ControlTickResult result = {};
+        result.channelCount = channelCount;
+        result.sampledAt = frame.timestamp;
+        if (watchdog) watchdog->startTick(Clock::now());
+        try {
+            (this->*pass)(now, dt, cpuLoad, frame, result);
+        }
+        catch (const std::runtime_error&) {
+            if (!watchdog) throw;
+            // Whatever reached the EC, the next tick writes every fan again
+            for (int c = 0; c < channelCount; ++c) fanLast[c] = -1;
+            result.ecFailed = true;
+        }
+        ticked = true;
+
+        if (watchdog) {
+            if (watchdog->tripped() && !fallback) {
+                fallback = true;
+                handBackPending = true;
+            }
+            if (handBackPending) handBack(result);
+            result.overran = watchdog->finishTick(Clock::now());
+        }
+
+        result.ecWriteUs = ecWriteUs;
+        return result;
+    }
+
+    // The EC has the fans because its transactions kept failing
+    bool inFallback() const { return fallback; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void ec_write(short reg, short val)
+    {
+        Clock::time_point start = Clock::now();
+        ec.write(reg, val);
+        ecWriteUs += std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    }
+
+    // Puts every fan in the EC's automatic mode. The EC may not take the
+    // writes while it is failing, so they are tried again on every tick
+    // until all of them went through.
+    void handBack(ControlTickResult& result)
+    {
+        try {
+            for (int c = 0; c < channelCount; ++c) {
+                ec_write(registers.channels[c].fanModeReg, registers.channels[c].fanModeAuto);
+                fanLast[c] = -1;
+            }
+            handBackPending = false;
+            result.actuatedAt = Clock::now();
+        }
+        catch (const std::runtime_error&) {
+            result.ecFailed = true;
+        }
+        for (int c = 0; c < channelCount; ++c) result.fan[c] = -1;
+        result.fallback = true;
+    }
+
+    typedef void (ControlLoop::*Pass)(double, double, double, const EcSnapshot&, ControlTickResult&);
+
+    // The pass for the registers and channel count: the one compiled for
+    // builtin when it is set, else the one reading registers
+    template <int Model = 0>
+    Pass selectPass() const
+    {
+        if constexpr (Model == ec_model_count) {
+            return channelCount == 2 ? &ControlLoop::runChannels<2, nullptr> : &ControlLoop::runChannels<0, nullptr>;
+        }
+        else {
+            constexpr const EcRegisterMap* map = ec_models[Model].registers;
+            if (builtin != map) return selectPass<Model + 1>();
+            return channelCount == map->channelCount ? &ControlLoop::runChannels<map->channelCount, map>
+                                                     : &ControlLoop::runChannels<0, map>;
+        }
+    }
+
+    // Map's channel c, or the runtime copy's without a Map
+    template <const EcRegisterMap* Map>
+    const FanChannelRegisters& channel(int c) const
+    {
+        if constexpr (Map != nullptr) return Map->channels[c];
+        else return registers.channels[c];
+    }
+
+    // Channels is the channel count, or 0 to use the configured count; Map
+    // is the built-in register map, or nullptr to read registers
+    template <int Channels, const EcRegisterMap* Map>
+    void runChannels(double now, double dt, double load, const EcSnapshot& frame, ControlTickResult& result)
+    {
+        const int count = Channels ? Channels : channelCount;
+
+        bool idleReady = true;
+        bool guardReached = false;
+        for (int c = 0; c < count; ++c) {
+            double raw = static_cast<double>(frame[channel<Map>(c).tempReg]);
+            LatencyClock::time_point filterStart = latencyStart(stats);
+            const SensorSample& sample = sensors[c].update(raw, dt);
+            latencyEnd(stats, PHASE_FILTER, filterStart);
+            controlDt[c] += dt;
+
+            // The PID path sees the lightly filtered reading so it is not
+            // delayed by the curve's heavy low pass
+            fast[c] = sample.fast;
+
+            result.raw[c] = raw;
+            result.temp[c] = sample.output;
+            result.fast[c] = sample.fast;
+            result.sensor[c] = sample;
+
+            // Idle is left at the guard temperature, or as soon as the curve
+            // asks for more than an idle fan, and entered well below it
+            double idleTemp = std::max(sample.output, sample.fast);
+            if (sample.faulted || (sample.primed && (idleTemp >= idleGuard[c] || curve[c].curve().at(idleTemp) > idleMaxFan))) {
+                guardReached = true;
+            }
+            if (!sample.primed || sample.faulted || idleTemp > idleGuard[c] - idleMargin) idleReady = false;
+
+            // A forced speed is only kept while the loop has the fans
+            if (forcedFan[c] >= 0) {
+                guardReached = true;
+                idleReady = false;
+            }
+        }
+
+        // After a fallback the EC keeps the fans until the watchdog clears;
+        // the readings meanwhile keep probing it
+        if (fallback) {
+            if (watchdog->tripped()) {
+                for (int c = 0; c < count; ++c) result.fan[c] = -1;
+                result.fallback = true;
+                return;
+            }
+            fallback = false;
+            handBackPending = false;
+            for (int c = 0; c < count; ++c) {
+                if (mode[c] == FAN_MODE_PID) pid[c].reset(0, fast[c], load);
+                controlDt[c] = dt;
+            }
+        }
+
+        // While the EC has the fans there is nothing to write until a guard is reached
+        if (idle.active()) {
+            if (idle.update(now, false, guardReached)) {
+                for (int c = 0; c < count; ++c) result.fan[c] = -1;
+                result.idle = true;
+                return;
+            }
+            // Manual control again; PID starts over from a stopped fan
+            for (int c = 0; c < count; ++c) {
+                if (mode[c] == FAN_MODE_PID) pid[c].reset(0, fast[c], load);
+                controlDt[c] = dt;
+            }
+        }
+
+        for (int c = 0; c < count; ++c) {
+            const SensorSample& sample = result.sensor[c];
+            if (sample.faulted) {
+                // No believable reading for several ticks: run the fan at the top of its range
+                demand[c] = maxFan[c];
+            }
+            else if (sample.accepted) {
+                // Back from a fault, PID picks up from the fail-safe speed
+                if (faulted[c] && mode[c] == FAN_MODE_PID) pid[c].reset(std::max(0, fanLast[c]), fast[c], load);
+                LatencyClock::time_point controlStart = latencyStart(stats);
+                demand[c] = mode[c] == FAN_MODE_PID ? pid[c].update(fast[c], load, controlDt[c]) : curve[c].update(sample.output);
+                latencyEnd(stats, PHASE_CONTROL, controlStart);
+                controlDt[c] = 0;
+            }
+            // A dropped reading keeps the zone's last demand
+            faulted[c] = sample.faulted;
+            result.demand[c] = demand[c];
+        }
+
+        // Each fan follows the zones coupled to it, within its slew and step limits
+        for (int c = 0; c < count; ++c) {
+            const SensorSample& sample = result.sensor[c];
+            int target = arbiter.combine(c, demand, count);
+            if (sample.faulted) {
+                result.fan[c] = arbiter.jump(c, std::max(maxFan[c], target));
+            }
+            else if (!sample.primed) {
+                result.fan[c] = fanLast[c];
+            }
+            else {
+                result.fan[c] = arbiter.limit(c, target, fanLast[c], dt);
+                if (result.fan[c] != target) result.held |= 1u << c;
+            }
+        }
+
+        for (int c = 0; c < count; ++c) {
+            if (forcedFan[c] >= 0 && !result.sensor[c].faulted) {
+                result.fan[c] = arbiter.jump(c, forcedFan[c]);
+                result.forced |= 1u << c;
+                result.held &= ~(1u << c);
+            }
+        }
+
+        for (int c = 0; c < count; ++c) {
+            // Nothing to write until the channel has a reading, a fault or a forced speed
+            if (!result.sensor[c].primed && !result.sensor[c].faulted && forcedFan[c] < 0) continue;
+            if (result.fan[c] != fanLast[c]) {
+                set_fan_manual(channel<Map>(c), result.fan[c]);
+                fanLast[c] = result.fan[c];
+                result.actuatedAt = Clock::now();
+            }
+            if (result.fan[c] > idleMaxFan) idleReady = false;
+        }
+
+        if (idle.update(now, idleReady, guardReached)) {
+            // Every fan goes back to the EC; the next manual write sets mode and speed again
+            for (int c = 0; c < count; ++c) {
+                ec_write(channel<Map>(c).fanModeReg, channel<Map>(c).fanModeAuto);
+                fanLast[c] = -1;
+            }
+            result.actuatedAt = Clock::now();
+            result.idle = true;
+        }
+    }
+
+    void set_fan_manual(const FanChannelRegisters& channel, int percent)
+    {
+        ec_write(channel.fanModeReg, channel.fanModeManual);
+        ec_write(channel.fanSpeedReg, percent);
+    }
+
+    EcTransport& ec;
+    int channelCount;
+    EcRegisterMap registers;
+    const EcRegisterMap* builtin;       // registers when they are a built-in map
+    const CompiledProfile* running;
+    Pass pass;
+
+    // Per-channel state, indexed like FanConfig
+    FanController curve[MAX_CHANNELS];
+    PidController pid[MAX_CHANNELS];
+    std::vector<SensorPipeline> sensors;
+    int32_t mode[MAX_CHANNELS];
+    int fanLast[MAX_CHANNELS];
+    int maxFan[MAX_CHANNELS];
+    double fast[MAX_CHANNELS];
+    double controlDt[MAX_CHANNELS];     // time since the controller last ran
+    bool faulted[MAX_CHANNELS];
+    double idleGuard[MAX_CHANNELS];     // C; reaching it ends idle
+    int forcedFan[MAX_CHANNELS];        // percent, -1 when the controller runs the fan
+    int demand[MAX_CHANNELS];           // percent the zone's controller asked for, -1 before its first reading
+
+    FanArbiter arbiter;
+    CompiledProfile own;    // what applyConfig compiles
+
+    IdleGovernor idle;
+    int idleMargin;
+    int idleMaxFan;
+
+    double lastLoad;
+    double lastTick;
+    bool ticked;
+
+    EcWatchdog* watchdog;
+    bool fallback;          // the EC has the fans until the watchdog clears
+    bool handBackPending;   // not every fan has been put in automatic mode yet
+
+    EcSnapshot snapshot;
+    double ecWriteUs;
+    HotPathStats* stats;
+};
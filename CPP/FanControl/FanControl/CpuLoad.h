@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <fstream>
+#include <string>
+#else
+#error "CpuLoadMonitor needs Windows or Linux"
+#endif
+
+// Whole-system CPU utilization from the OS counters (GetSystemTimes on
+// Windows, the aggregate line of /proc/stat on Linux). sample() returns
+// the busy percentage since the previous call, so calling it once per
+// control tick yields the average load over that tick.
+class CpuLoadMonitor
+{
+public:
+    CpuLoadMonitor() : lastIdle(0), lastTotal(0), primed(false)
+    {
+        sample();
+    }
+
+    double sample()
+    {
+        uint64_t idle, total;
+        if (!readCounters(idle, total)) return 0.0;
+
+        double load = 0.0;
+        if (primed && total > lastTotal) {
+            uint64_t totalDelta = total - lastTotal;
+            uint64_t idleDelta = idle >= lastIdle ? idle - lastIdle : 0;
+            if (idleDelta > totalDelta) idleDelta = totalDelta;
+            load = 100.0 * (totalDelta - idleDelta) / totalDelta;
+        }
+        lastIdle = idle;
+        lastTotal = total;
+        primed = true;
+        return load;
+    }
+
+private:
+#ifdef _WIN32
+    static uint64_t toTicks(const FILETIME& time)
+    {
+        return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+    }
+
+    static bool readCounters(uint64_t& idle, uint64_t& total)
+    {
+        FILETIME idleTime, kernelTime, userTime;
+        if (!GetSystemTimes(&idleTime, &kernelTime, &userTime)) return false;
+
+        // Kernel time includes idle time
+        idle = toTicks(idleTime);
+        total = toTicks(kernelTime) + toTicks(userTime);
+        return true;
+    }
+#else
+    static bool readCounters(uint64_t& idle, uint64_t& total)
+    {
+        std::ifstream stat("/proc/stat");
+        std::string cpu;
+        uint64_t user, nice, system, idleTicks, iowait, irq, softirq, steal;
+        if (!(stat >> cpu >> user >> nice >> system >> idleTicks >> iowait >> irq >> softirq >> steal) || cpu != "cpu") {
+            return false;
+        }
+        idle = idleTicks + iowait;
+        total = user + nice + system + idleTicks + iowait + irq + softirq + steal;
+        return true;
+    }
+#endif
+
+    uint64_t lastIdle;
+    uint64_t lastTotal;
+    bool primed;
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "SharedData.h"
+
+// A fan curve compiled into a lookup table. The user's points are sampled
+// once, every 1 / STEPS_PER_DEGREE C from the first to the last point,
+// with the curve's interpolation; at() then costs one index computation
+// and one blend of two neighbouring entries, whatever the point count.
+// Below the first point the fan holds the first point's speed, above the
+// last point the last point's speed.
+class CurveTable
+{
+public:
+    static const int STEPS_PER_DEGREE = 10;     // table entries per C, a 0.1 C resolution
+
+    CurveTable() : interpolation(CURVE_LINEAR), origin(0), lastIndex(0)
+    {
+        values.push_back(0);
+    }
+
+    // Compiles count points (temperatures ascending) with one of the
+    // CURVE_* interpolations. Segments whose temperatures do not increase
+    // are skipped.
+    void build(const int32_t* temps, const int32_t* fans, int count, int32_t mode)
+    {
+        pointTemps.assign(temps, temps + count);
+        pointFans.assign(fans, fans + count);
+        interpolation = mode;
+        if (interpolation == CURVE_CUBIC) computeTangents();
+
+        origin = pointTemps.front();
+        double span = std::max(0.0, static_cast<double>(pointTemps.back()) - origin);
+        lastIndex = static_cast<size_t>(span * STEPS_PER_DEGREE);
+
+        // Whole degrees land exactly on an entry, so a curve point is never
+        // sampled a rounding error before its temperature
+        values.resize(lastIndex + 1);
+        for (size_t i = 0; i <= lastIndex; ++i) {
+            values[i] = evaluate((origin * STEPS_PER_DEGREE + i) / STEPS_PER_DEGREE);
+        }
+    }
+
+    // True when build() with these arguments would produce this table
+    bool matches(const int32_t* temps, const int32_t* fans, int count, int32_t mode) const
+    {
+        return mode == interpolation && static_cast<size_t>(count) == pointTemps.size() &&
+               std::equal(temps, temps + count, pointTemps.begin()) && std::equal(fans, fans + count, pointFans.begin());
+    }
+
+    // Fan speed in percent at temp
+    double at(double temp) const
+    {
+        double x = (temp - origin) * STEPS_PER_DEGREE;
+        if (!(x > 0)) return values.front();
+        if (x >= lastIndex) return values[lastIndex];
+
+        size_t i = static_cast<size_t>(x);
+        // A step curve jumps at its points, so it must not blend across them
+        if (interpolation == CURVE_STEP) return values[i];
+        return values[i] + (x - i) * (values[i + 1] - values[i]);
+    }
+
+    // The curve evaluated directly from its points, as the table samples it
+    double evaluate(double temp) const
+    {
+        size_t count = pointTemps.size();
+        if (temp < pointTemps.front()) return pointFans.front();
+
+        for (size_t i = 0; i + 1 < count; ++i) {
+            double t0 = pointTemps[i], t1 = pointTemps[i + 1];
+            if (!(temp >= t0 && temp < t1)) continue;
+
+            double f0 = pointFans[i], f1 = pointFans[i + 1];
+            if (interpolation == CURVE_STEP) return f0;
+            if (interpolation == CURVE_CUBIC) return hermite(i, temp);
+
+            double temp_range = t1 - t0;
+            double fan_range = f1 - f0;
+            return f0 + (temp - t0) * fan_range / temp_range;
+        }
+        return pointFans.back();
+    }
+
+    size_t size() const { return values.size(); }
+
+private:
+    // Fritsch-Carlson tangents: the interpolant stays monotone wherever the
+    // points are, so the fan never overshoots a point or dips between two
+    // rising ones
+    void computeTangents()
+    {
+        size_t count = pointTemps.size();
+        std::vector<double> secant(count > 1 ? count - 1 : 0, 0.0);
+        for (size_t i = 0; i + 1 < count; ++i) {
+            double width = static_cast<double>(pointTemps[i + 1]) - pointTemps[i];
+            if (width > 0) secant[i] = (static_cast<double>(pointFans[i + 1]) - pointFans[i]) / width;
+        }
+
+        tangent.assign(count, 0.0);
+        if (count < 2) return;
+        tangent.front() = secant.front();
+        tangent.back() = secant.back();
+        for (size_t i = 1; i + 1 < count; ++i) {
+            tangent[i] = secant[i - 1] * secant[i] <= 0 ? 0.0 : (secant[i - 1] + secant[i]) / 2;
+        }
+
+        for (size_t i = 0; i + 1 < count; ++i) {
+            if (secant[i] == 0) {
+                tangent[i] = 0;
+                tangent[i + 1] = 0;
+                continue;
+            }
+            double a = tangent[i] / secant[i];
+            double b = tangent[i + 1] / secant[i];
+            double norm = a * a + b * b;
+            if (norm > 9) {
+                double tau = 3 / std::sqrt(norm);
+                tangent[i] = tau * a * secant[i];
+                tangent[i + 1] = tau * b * secant[i];
+            }
+        }
+    }
+
+    double hermite(size_t i, double temp) const
+    {
+        double t0 = pointTemps[i], width = pointTemps[i + 1] - t0;
+        double s = (temp - t0) / width;
+        double s2 = s * s, s3 = s2 * s;
+        return (2 * s3 - 3 * s2 + 1) * pointFans[i] + (s3 - 2 * s2 + s) * width * tangent[i] +
+               (-2 * s3 + 3 * s2) * pointFans[i + 1] + (s3 - s2) * width * tangent[i + 1];
+    }
+
+    std::vector<int32_t> pointTemps;
+    std::vector<int32_t> pointFans;
+    std::vector<double> tangent;
+    int32_t interpolation;
+
+    std::vector<double> values;
+    double origin;
+    size_t lastIndex;
+};
@@ -0,0 +1,504 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "ControlLoop.h"
+#include "SampleScheduler.h"
+#include "SimulatedEc.h"
+#include "TraceFile.h"
+
+// Offline fan curve tuning: a thermal model is fitted to each zone from
+// recorded temperatures, heat input and fan commands, and curve shapes
+// are searched for the lowest fan effort that keeps every zone under a
+// temperature limit without the fans hunting. Everything runs on the
+// recorded data and the models; nothing touches an EC.
+
+// One zone's recording, a sample per control tick. heat[k] is the heat
+// input over the interval ending at time[k], in whatever unit the
+// workload is given in (CPU load % from a trace, W in the simulator);
+// fan[k] is the command the tick at time[k] sent, -1 while the EC had
+// the fan.
+struct ThermalSeries
+{
+    std::vector<double> time;   // s
+    std::vector<double> temp;   // C, as the EC reported it
+    std::vector<double> heat;
+    std::vector<double> fan;    // %
+};
+
+// First-order model of a zone: the heat sink's temperature S follows
+//
+//   tau dS/dt = gain heat - (1 + fanEffect fan / 100) (S - ambient)
+//
+// and the sensor reads T = S + rise heat. The fan raises the sink's
+// conductance to the air; fanEffect is the conductance a fan at full
+// speed adds, relative to a stopped fan. rise is the die's lead over its
+// sink, which follows the heat within seconds, faster than a control
+// period can act on.
+struct ZoneModel
+{
+    double tau = 60;            // s with the fan stopped
+    double gain = 0;            // C per unit of heat, fan stopped
+    double fanEffect = 0;
+    double ambient = 25;        // C
+    double rise = 0;            // C per unit of heat
+    double rms = 0;             // C, error of the model's prediction of the recording
+    size_t samples = 0;         // steps the fit used
+
+    // The sink temperature dt s on with heat and fan held
+    double step(double sink, double heat, double fan, double dt) const
+    {
+        double conductance = 1 + fanEffect * std::max(0.0, fan) / 100;
+        double settled = ambient + gain * heat / conductance;
+        return settled + (sink - settled) * std::exp(-dt * conductance / tau);
+    }
+
+    double temperature(double sink, double heat) const { return sink + rise * heat; }
+    double sink(double temperature, double heat) const { return temperature - rise * heat; }
+};
+
+// Fits a ZoneModel by least squares on the temperatures it predicts, run
+// from the recording's inputs: each stretch of steps with the fan under
+// control starts from the temperature recorded and is not corrected by it
+// again, so the fit follows the slow response rather than the sensor's
+// 1 C steps. For a given tau and fanEffect the prediction is linear in
+// ambient, gain and rise; tau and fanEffect are searched over a grid and
+// then refined. Throws std::invalid_argument when the series has too few
+// such steps, neither its heat nor its fan varied enough to tell them
+// apart, or the zone does not warm with the heat given for it.
+inline ZoneModel fitZoneModel(const ThermalSeries& series)
+{
+    struct Step { double dt, from, to, heatBefore, heat, fan; bool restart; };
+    std::vector<Step> steps;
+    double heatMin = std::numeric_limits<double>::max(), heatMax = -heatMin;
+    double fanMin = heatMin, fanMax = -heatMin;
+    bool restart = true;
+    for (size_t k = 0; k + 1 < series.time.size(); ++k) {
+        double dt = series.time[k + 1] - series.time[k];
+        // A gap in the recording is not a step the model can take
+        if (series.fan[k] < 0 || dt <= 0 || dt > 10) {
+            restart = true;
+            continue;
+        }
+        steps.push_back({ dt, series.temp[k], series.temp[k + 1], series.heat[k], series.heat[k + 1], series.fan[k], restart });
+        restart = false;
+        heatMin = std::min(heatMin, series.heat[k + 1]);
+        heatMax = std::max(heatMax, series.heat[k + 1]);
+        fanMin = std::min(fanMin, series.fan[k]);
+        fanMax = std::max(fanMax, series.fan[k]);
+    }
+    if (steps.size() < 50) throw std::invalid_argument("too few samples with the fan under control to fit a model");
+    if (heatMax - heatMin < 1e-6 && fanMax - fanMin < 1) {
+        throw std::invalid_argument("neither the heat input nor the fan changed; there is no response to fit");
+    }
+
+    // Sum of squared prediction errors for tau and fanEffect, with ambient,
+    // gain and rise fitted. Along a stretch the prediction is
+    // decay first + ambient a + gain b + rise r, with first the
+    // temperature the stretch started from, carried step by step.
+    auto solve = [&](double tau, double fanEffect, ZoneModel& model) {
+        double m[3][4] = {};
+        double decay = 1, a = 0, b = 0, first = 0, before = 0;
+        for (const Step& s : steps) {
+            if (s.restart) {
+                decay = 1;
+                a = b = 0;
+                first = s.from;
+                before = s.heatBefore;
+            }
+            double conductance = 1 + fanEffect * s.fan / 100;
+            double e = std::exp(-s.dt * conductance / tau);
+            decay *= e;
+            a = e * a + (1 - e);
+            b = e * b + (1 - e) * s.heat / conductance;
+            const double x[3] = { a, b, s.heat - decay * before };
+            double y = s.to - decay * first;
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 3; ++j) m[i][j] += x[i] * x[j];
+                m[i][3] += x[i] * y;
+            }
+        }
+        // Without heat variation gain and rise are not told apart from the
+        // ambient; the slight ridge keeps them at zero then
+        double scale = m[0][0] + m[1][1] + m[2][2];
+        for (int i = 0; i < 3; ++i) m[i][i] += 1e-9 * scale + 1e-300;
+        for (int i = 0; i < 3; ++i) {
+            int pivot = i;
+            for (int r = i + 1; r < 3; ++r) {
+                if (std::fabs(m[r][i]) > std::fabs(m[pivot][i])) pivot = r;
+            }
+            std::swap(m[i], m[pivot]);
+            for (int r = 0; r < 3; ++r) {
+                if (r == i) continue;
+                double f = m[r][i] / m[i][i];
+                for (int j = i; j < 4; ++j) m[r][j] -= f * m[i][j];
+            }
+        }
+        model.ambient = m[0][3] / m[0][0];
+        model.gain = m[1][3] / m[1][1];
+        model.rise = m[2][3] / m[2][2];
+        model.tau = tau;
+        model.fanEffect = fanEffect;
+
+        double error = 0, sink = 0;
+        for (const Step& s : steps) {
+            if (s.restart) sink = model.sink(s.from, s.heatBefore);
+            sink = model.step(sink, s.heat, s.fan, s.dt);
+            double miss = model.temperature(sink, s.heat) - s.to;
+            error += miss * miss;
+        }
+        return error;
+    };
+
+    ZoneModel best, trial;
+    double bestError = std::numeric_limits<double>::max();
+    double logTau = 0, effect = 0;
+    for (int i = 0; i < 40; ++i) {
+        double lt = std::log(3.0) + i * (std::log(3000.0) - std::log(3.0)) / 39;
+        for (int j = 0; j <= 48; ++j) {
+            double error = solve(std::exp(lt), j * 0.25, trial);
+            if (error < bestError) {
+                bestError = error;
+                best = trial;
+                logTau = lt;
+                effect = j * 0.25;
+            }
+        }
+    }
+    // Pattern search around the best grid point
+    double tauStep = (std::log(3000.0) - std::log(3.0)) / 39, effectStep = 0.25;
+    for (int iteration = 0; iteration < 200 && (tauStep > 1e-4 || effectStep > 1e-4); ++iteration) {
+        bool moved = false;
+        const double moves[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+        for (const auto& m : moves) {
+            double lt = logTau + m[0] * tauStep, fe = std::max(0.0, effect + m[1] * effectStep);
+            double error = solve(std::exp(lt), fe, trial);
+            if (error < bestError) {
+                bestError = error;
+                best = trial;
+                logTau = lt;
+                effect = fe;
+                moved = true;
+            }
+        }
+        if (!moved) {
+            tauStep /= 2;
+            effectStep /= 2;
+        }
+    }
+    if (best.gain <= 0 || heatMax - heatMin < 1e-6) {
+        throw std::invalid_argument("the temperature does not follow the heat input; its heat is not in the recording");
+    }
+    best.rms = std::sqrt(bestError / steps.size());
+    best.samples = steps.size();
+    return best;
+}
+
+// The zones' recordings in trace files of one run (orderTraceFiles): per
+// tick, the temperature each channel read, its fan command and the CPU
+// load. The trace has no other measure of heat, so the CPU load is every
+// zone's heat input; for the GPU that only holds while it follows the
+// CPU's work, and fitZoneModel turns down a GPU that did not. Ticks on a
+// failed read or cut off by a file are left out.
+inline std::vector<ThermalSeries> thermalSeriesFromTrace(const std::vector<TraceFile>& files)
+{
+    int channels = std::max(0, std::min(MAX_CHANNELS, static_cast<int>(files.front().header.channelCount)));
+    std::vector<ThermalSeries> zones(channels);
+    double load = 0, now = 0;
+    double temps[MAX_CHANNELS], fans[MAX_CHANNELS];
+    int frames = 0, commands = 0;
+    bool inTick = false, failed = false;
+    for (const TraceFile& file : files) {
+        for (size_t i = 0; i < file.records.size(); ++i) {
+            const TraceRecord& r = file.records[i];
+            switch (traceKind(r.kind)) {
+            case TRACE_CONFIG: i += r.arg; break;
+            case TRACE_LOAD:
+                load = r.number;
+                frames = commands = 0;
+                inTick = true;
+                failed = false;
+                break;
+            case TRACE_TICK: now = r.number; break;
+            case TRACE_FRAME:
+                if (r.kind & TRACE_FAILED) failed = true;
+                if (frames < MAX_CHANNELS) temps[frames++] = r.value;
+                break;
+            case TRACE_FAN:
+                if (r.arg < MAX_CHANNELS) fans[r.arg] = r.value;
+                ++commands;
+                break;
+            case TRACE_DONE:
+                if (inTick && !failed && frames >= channels && commands >= channels) {
+                    for (int c = 0; c < channels; ++c) {
+                        zones[c].time.push_back(now);
+                        zones[c].temp.push_back(temps[c]);
+                        zones[c].heat.push_back(load);
+                        zones[c].fan.push_back(fans[c]);
+                    }
+                }
+                inTick = false;
+                break;
+            }
+        }
+    }
+    return zones;
+}
+
+// The heat input to run the models on: heat[c][i] from time[i] until time[i + 1]
+struct TuneWorkload
+{
+    std::vector<double> time;
+    std::vector<double> heat[MAX_CHANNELS];
+    double startTemp[MAX_CHANNELS];
+    double duration = 0;
+};
+
+// The workload a recording was made under
+inline TuneWorkload workloadFromSeries(const std::vector<ThermalSeries>& zones)
+{
+    TuneWorkload workload;
+    const ThermalSeries& first = zones.front();
+    if (first.time.size() < 2) throw std::invalid_argument("the recording is too short for a workload");
+    double origin = first.time.front();
+    for (size_t k = 0; k + 1 < first.time.size(); ++k) {
+        workload.time.push_back(first.time[k] - origin);
+        for (size_t c = 0; c < zones.size(); ++c) workload.heat[c].push_back(zones[c].heat[k + 1]);
+    }
+    for (size_t c = 0; c < zones.size(); ++c) workload.startTemp[c] = zones[c].temp.front();
+    workload.duration = first.time.back() - origin;
+    return workload;
+}
+
+// What a tuned config must achieve
+struct TuneLimits
+{
+    double maxTemp = 85;            // C no zone may exceed
+    double maxReversals = 20;       // fan direction changes under a steady heat input, per hour per fan
+};
+
+// One config run in closed loop on the models
+struct TuneScore
+{
+    double peak[MAX_CHANNELS];
+    double meanFan[MAX_CHANNELS];       // %
+    double reversals[MAX_CHANNELS];     // per hour, under a steady heat input
+    double cost;                        // mean fan % over the fans
+    bool feasible;
+    double excess;                      // C over maxTemp, summed over the zones
+};
+
+// Runs config's control loop on a simulated EC whose temperatures come
+// from the models under the workload, and scores it. Between ticks the
+// fans and the heat are constant, so each model is stepped exactly.
+// Channels without a model read 0 C and do not count.
+inline TuneScore evaluateTuning(const FanConfig& config, const std::vector<ZoneModel>& models, const TuneWorkload& workload,
+                                const TuneLimits& limits)
+{
+    SimulatedEc::Timing timing;
+    timing.inputLatency = std::chrono::microseconds(0);
+    timing.outputLatency = std::chrono::microseconds(0);
+    SimulatedEc ec(timing);
+    ControlLoop loop(ec, config);
+    SampleScheduler scheduler(config);
+    const EcRegisterMap& registers = loop.ecRegisters();
+    int zones = std::min(static_cast<int>(models.size()), registers.channelCount);
+
+    TuneScore score = {};
+    double sinks[MAX_CHANNELS], effort[MAX_CHANNELS] = {};
+    int lastFan[MAX_CHANNELS], lastDirection[MAX_CHANNELS] = {};
+    unsigned long long reversals[MAX_CHANNELS] = {};
+    size_t segment = 0;
+    auto heat = [&](int c) { return workload.heat[c].empty() ? 0.0 : workload.heat[c][segment]; };
+    // A reversal is the fan hunting: no zone's heat has moved by more than
+    // a tenth of its range since the fan last changed direction (a fan may
+    // answer every zone's heat through the coupling)
+    double heatTolerance[MAX_CHANNELS] = {};
+    size_t lastTurn[MAX_CHANNELS] = {};
+    for (int c = 0; c < zones; ++c) {
+        if (workload.heat[c].empty()) continue;
+        auto range = std::minmax_element(workload.heat[c].begin(), workload.heat[c].end());
+        heatTolerance[c] = 0.1 * (*range.second - *range.first);
+    }
+    auto steady = [&](size_t since) {
+        for (int z = 0; z < zones; ++z) {
+            if (!workload.heat[z].empty() && std::fabs(workload.heat[z][segment] - workload.heat[z][since]) > heatTolerance[z]) return false;
+        }
+        return true;
+    };
+    for (int c = 0; c < zones; ++c) {
+        sinks[c] = models[c].sink(workload.startTemp[c], heat(c));
+        score.peak[c] = workload.startTemp[c];
+        lastFan[c] = -1;
+    }
+
+    const double epsilon = 1e-9;
+    double now = 0, nextTick = 0;
+    while (now < workload.duration - epsilon) {
+        while (segment + 1 < workload.time.size() && workload.time[segment + 1] <= now + epsilon) ++segment;
+        for (int c = 0; c < zones; ++c) score.peak[c] = std::max(score.peak[c], models[c].temperature(sinks[c], heat(c)));
+        if (now >= nextTick - epsilon) {
+            for (int c = 0; c < zones; ++c) {
+                double temp = models[c].temperature(sinks[c], heat(c));
+                ec.poke(registers.channels[c].tempReg, static_cast<short>(std::max(0.0, std::min(255.0, std::round(temp)))));
+            }
+            ControlTickResult tick = loop.tick(now);
+            for (int c = 0; c < zones; ++c) {
+                int fan = tick.fan[c];
+                if (lastFan[c] >= 0 && fan >= 0 && fan != lastFan[c]) {
+                    int direction = fan > lastFan[c] ? 1 : -1;
+                    if (direction != lastDirection[c]) {
+                        if (lastDirection[c] && steady(lastTurn[c])) ++reversals[c];
+                        lastTurn[c] = segment;
+                    }
+                    lastDirection[c] = direction;
+                }
+                if (fan >= 0) lastFan[c] = fan;
+            }
+            nextTick = now + scheduler.next(now, tick.fast, tick.channelCount, 0.0, tick.idle || tick.fallback) / 1000.0;
+        }
+
+        double until = std::min(nextTick, workload.duration);
+        if (segment + 1 < workload.time.size()) until = std::min(until, workload.time[segment + 1]);
+        double dt = std::max(until - now, epsilon);
+        for (int c = 0; c < zones; ++c) {
+            const FanChannelRegisters& channel = registers.channels[c];
+            // The EC's own fan control is not modelled; it only runs while idle and cool
+            double fan = ec.peek(channel.fanModeReg) == channel.fanModeManual ? std::min(100.0, static_cast<double>(ec.peek(channel.fanSpeedReg))) : 0.0;
+            sinks[c] = models[c].step(sinks[c], heat(c), fan, dt);
+            effort[c] += fan * dt;
+            score.peak[c] = std::max(score.peak[c], models[c].temperature(sinks[c], heat(c)));
+        }
+        now += dt;
+    }
+
+    double hours = std::max(workload.duration, 1.0) / 3600;
+    score.feasible = true;
+    for (int c = 0; c < zones; ++c) {
+        score.meanFan[c] = effort[c] / std::max(workload.duration, 1.0);
+        score.reversals[c] = reversals[c] / hours;
+        score.cost += score.meanFan[c] / zones;
+        score.excess += std::max(0.0, score.peak[c] - limits.maxTemp);
+        if (score.peak[c] > limits.maxTemp || score.reversals[c] > limits.maxReversals) score.feasible = false;
+    }
+    return score;
+}
+
+// The curves searched: from 0% at 0 C to startFan at start, endFan at end
+// and 100% at 100 C, with a middle point bent towards either end
+struct CurveShape
+{
+    int start;
+    int end;
+    int startFan;
+    int endFan;
+    double bend;        // 1 is a straight line from start to end, more keeps the fan lower longer
+    int hysteresis;
+};
+
+inline void applyCurveShape(FanConfig& config, int channel, const CurveShape& shape)
+{
+    int middle = (shape.start + shape.end) / 2;
+    int middleFan = shape.startFan + static_cast<int>(std::lround((shape.endFan - shape.startFan) * std::pow(0.5, shape.bend)));
+    const int32_t temps[] = { 0, shape.start, middle, shape.end, 100 };
+    const int32_t fans[] = { 0, shape.startFan, middleFan, shape.endFan, 100 };
+    config.point_count[channel] = 5;
+    std::copy(temps, temps + 5, config.curve_temp[channel]);
+    std::copy(fans, fans + 5, config.curve_fan[channel]);
+    config.hysteresis[channel] = shape.hysteresis;
+    config.mode[channel] = FAN_MODE_CURVE;
+}
+
+inline std::vector<CurveShape> curveShapes()
+{
+    std::vector<CurveShape> shapes;
+    for (int start = 45; start <= 65; start += 5) {
+        for (int span = 10; span <= 30; span += 10) {
+            for (int startFan : { 0, 10 }) {
+                for (int endFan : { 30, 60, 100 }) {
+                    for (double bend : { 0.5, 1.0, 2.0 }) {
+                        for (int hysteresis : { 1, 3, 5 }) shapes.push_back({ start, start + span, startFan, endFan, bend, hysteresis });
+                    }
+                }
+            }
+        }
+    }
+    return shapes;
+}
+
+struct TuneResult
+{
+    FanConfig config;
+    TuneScore base;
+    TuneScore tuned;
+    unsigned long long evaluations = 0;
+    int threads = 0;
+};
+
+// Whether a is the better of two scores: feasible first, then the lowest
+// fan effort; among infeasible ones the least over the limit
+inline bool betterTuning(const TuneScore& a, const TuneScore& b)
+{
+    if (a.feasible != b.feasible) return a.feasible;
+    if (a.feasible) return a.cost < b.cost;
+    if (a.excess != b.excess) return a.excess < b.excess;
+    return a.cost < b.cost;
+}
+
+// Searches curveShapes() for each zone with a model in turn, the others
+// holding their current curves, for the given number of rounds. Channels
+// past models.size() are not modelled and keep their curves. A zone's
+// shapes are scored in parallel on threads threads (0 for one per core);
+// the result does not depend on how many. When base scores better than
+// the search's result, the result is base.
+inline TuneResult tuneCurves(const FanConfig& base, const std::vector<ZoneModel>& models, const TuneWorkload& workload,
+                             const TuneLimits& limits, int threads = 0, int rounds = 2)
+{
+    std::vector<CurveShape> shapes = curveShapes();
+    if (threads <= 0) threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+    TuneResult result;
+    result.threads = threads;
+    result.config = base;
+    result.base = evaluateTuning(base, models, workload, limits);
+    int zones = std::min(static_cast<int>(models.size()), base.channel_count);
+
+    std::vector<TuneScore> scores(shapes.size());
+    for (int round = 0; round < rounds; ++round) {
+        for (int c = 0; c < zones; ++c) {
+            std::atomic<size_t> next(0);
+            auto worker = [&]() {
+                for (size_t i = next++; i < shapes.size(); i = next++) {
+                    FanConfig trial = result.config;
+                    applyCurveShape(trial, c, shapes[i]);
+                    scores[i] = evaluateTuning(trial, models, workload, limits);
+                }
+            };
+            std::vector<std::thread> pool;
+            for (int t = 1; t < threads; ++t) pool.emplace_back(worker);
+            worker();
+            for (std::thread& t : pool) t.join();
+            result.evaluations += shapes.size();
+
+            size_t best = 0;
+            for (size_t i = 1; i < shapes.size(); ++i) {
+                if (betterTuning(scores[i], scores[best])) best = i;
+            }
+            applyCurveShape(result.config, c, shapes[best]);
+        }
+    }
+    result.tuned = evaluateTuning(result.config, models, workload, limits);
+    // The base curves need not be among the shapes searched
+    if (betterTuning(result.base, result.tuned)) {
+        result.config = base;
+        result.tuned = result.base;
+    }
+    return result;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "EcTransport.h"
+#include "LatencyHistogram.h"
+
+// Who is asking for the bus; lower values are served first
+enum class EcPriority { Actuation = 0, Acquisition = 1, Background = 2 };
+
+const int EC_PRIORITY_COUNT = 3;
+
+// Owns an EcTransport and runs every transaction on it from one worker
+// thread, highest priority first and in arrival order within a priority.
+// Threads reach the bus through client(priority), an EcTransport that
+// queues each call and blocks until the worker has run it, so a fan write
+// never waits behind more than the one transaction already on the bus.
+// Block reads are queued as one transaction per register, which lets a
+// write cut in between the registers of a long acquisition pass.
+class EcBusArbiter
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Bus statistics of one priority
+    struct Stats
+    {
+        unsigned long long transactions = 0;
+        double queueWaitUs = 0;         // summed time from queueing to reaching the bus
+        double maxQueueWaitUs = 0;
+        double busUs = 0;               // summed time on the bus
+    };
+
+    explicit EcBusArbiter(EcTransport& bus)
+        : bus(bus), stopping(false), nextOrder(0), hotPath(nullptr)
+    {
+        for (int p = 0; p < EC_PRIORITY_COUNT; ++p) {
+            clients.emplace_back(new Client(*this, static_cast<EcPriority>(p)));
+        }
+        worker = std::thread(&EcBusArbiter::run, this);
+    }
+
+    ~EcBusArbiter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        worker.join();
+    }
+
+    EcBusArbiter(const EcBusArbiter&) = delete;
+    EcBusArbiter& operator=(const EcBusArbiter&) = delete;
+
+    EcTransport& client(EcPriority priority) { return *clients[static_cast<int>(priority)]; }
+
+    // Also records every request's wait for the bus in stats
+    void setStats(HotPathStats* stats)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        hotPath = stats;
+    }
+
+    Stats stats(EcPriority priority) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters[static_cast<int>(priority)];
+    }
+
+private:
+    struct Request
+    {
+        EcPriority priority;
+        bool write;
+        short reg;
+        short value;                    // written value, or the value read
+        Clock::time_point queuedAt;
+        bool done;
+        std::exception_ptr error;
+    };
+
+    struct Pending
+    {
+        Request* request;
+        uint64_t order;
+
+        // std::priority_queue pops the largest element
+        bool operator<(const Pending& other) const
+        {
+            if (request->priority != other.request->priority) return request->priority > other.request->priority;
+            return order > other.order;
+        }
+    };
+
+    class Client : public EcTransport
+    {
+    public:
+        Client(EcBusArbiter& arbiter, EcPriority priority) : arbiter(arbiter), priority(priority) {}
+
+        const char* name() const override { return arbiter.bus.name(); }
+
+        short read(short reg) override
+        {
+            Request request = { priority, false, reg, 0, Clock::now(), false, nullptr };
+            arbiter.execute(&request, 1);
+            return request.value;
+        }
+
+        void write(short reg, short val) override
+        {
+            Request request = { priority, true, reg, val, Clock::now(), false, nullptr };
+            arbiter.execute(&request, 1);
+        }
+
+        void readBlock(const short* regs, size_t count, short* values) override
+        {
+            std::vector<Request> requests(count);
+            Clock::time_point now = Clock::now();
+            for (size_t i = 0; i < count; ++i) requests[i] = { priority, false, regs[i], 0, now, false, nullptr };
+            arbiter.execute(requests.data(), count);
+            for (size_t i = 0; i < count; ++i) values[i] = requests[i].value;
+        }
+
+    private:
+        EcBusArbiter& arbiter;
+        EcPriority priority;
+    };
+
+    // Queues count requests and waits until all of them have run
+    void execute(Request* requests, size_t count)
+    {
+        if (count == 0) return;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (size_t i = 0; i < count; ++i) queue.push({ &requests[i], nextOrder++ });
+        queued.notify_one();
+        completed.wait(lock, [&] { return requests[count - 1].done; });
+
+        for (size_t i = 0; i < count; ++i) {
+            if (requests[i].error) std::rethrow_exception(requests[i].error);
+        }
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            queued.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+
+            Request* request = queue.top().request;
+            queue.pop();
+            HotPathStats* timing = hotPath;
+            lock.unlock();
+
+            Clock::time_point start = Clock::now();
+            if (timing) timing->phases[PHASE_BUS_QUEUE].record(start - request->queuedAt);
+            try {
+                if (request->write) bus.write(request->reg, request->value);
+                else request->value = bus.read(request->reg);
+            }
+            catch (...) {
+                request->error = std::current_exception();
+            }
+            Clock::time_point end = Clock::now();
+
+            lock.lock();
+            Stats& stats = counters[static_cast<int>(request->priority)];
+            double waitUs = std::chrono::duration<double, std::micro>(start - request->queuedAt).count();
+            ++stats.transactions;
+            stats.queueWaitUs += waitUs;
+            stats.maxQueueWaitUs = std::max(stats.maxQueueWaitUs, waitUs);
+            stats.busUs += std::chrono::duration<double, std::micro>(end - start).count();
+            request->done = true;
+            completed.notify_all();
+        }
+    }
+
+    EcTransport& bus;
+    std::vector<std::unique_ptr<Client> > clients;
+
+    mutable std::mutex mutex;
+    std::condition_variable queued;
+    std::condition_variable completed;
+    std::priority_queue<Pending> queue;
+    bool stopping;
+    uint64_t nextOrder;
+    Stats counters[EC_PRIORITY_COUNT];
+    HotPathStats* hotPath;
+
+    std::thread worker;
+};
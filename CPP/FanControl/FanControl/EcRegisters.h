@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "TelemetryRing.h"
+
+// Register layout of the Predator PHN16-72 EC
+const short gpu_fan_mode_reg = 33;
+const short gpu_fan_mode_auto = 0x10;
+const short gpu_fan_mode_manual = 0x30;
+
+const short cpu_fan_mode_reg = 34;
+const short cpu_fan_mode_auto = 0x04;
+const short cpu_fan_mode_manual = 0x0c;
+
+const short fan_mode_reg = 44;
+const short fan_mode_full_manual = 0x00;
+
+const short gpu_fan_speed_reg = 58;
+const short cpu_fan_speed_reg = 55;
+
+const short cpu_temp_reg_1 = 176;
+const short gpu_temp_reg_1 = 180;
+
+// One temperature sensor and the fan that cools it
+struct FanChannelRegisters
+{
+    const char* name;
+    short tempReg;
+    short fanModeReg;
+    short fanModeAuto;
+    short fanModeManual;
+    short fanSpeedReg;
+};
+
+// Channel names, indexed by channel
+constexpr const char* ec_channel_names[MAX_CHANNELS] = { "CPU", "GPU", "Fan 3", "Fan 4" };
+
+// Every channel of one EC, indexed by channel in the order FanConfig uses
+struct EcRegisterMap
+{
+    int channelCount;
+    FanChannelRegisters channels[MAX_CHANNELS];
+};
+
+constexpr EcRegisterMap predator_phn16_72 = { 2, {
+    { "CPU", cpu_temp_reg_1, cpu_fan_mode_reg, cpu_fan_mode_auto, cpu_fan_mode_manual, cpu_fan_speed_reg },
+    { "GPU", gpu_temp_reg_1, gpu_fan_mode_reg, gpu_fan_mode_auto, gpu_fan_mode_manual, gpu_fan_speed_reg },
+} };
+
+// A supported laptop, as its DMI (BIOS) system information names it
+struct EcModel
+{
+    const char* manufacturer;
+    const char* product;
+    const EcRegisterMap* registers;
+};
+
+// Every model with a built-in map. The control loop has a pass compiled
+// for each of these maps, with its registers as constants; a map from a
+// register file runs the same pass reading them from memory.
+constexpr EcModel ec_models[] = {
+    { "Acer", "Predator PHN16-72", &predator_phn16_72 },
+};
+constexpr int ec_model_count = sizeof(ec_models) / sizeof(ec_models[0]);
+
+// The built-in map of a model, nullptr for a model not in ec_models
+inline const EcRegisterMap* findEcRegisters(const std::string& manufacturer, const std::string& product)
+{
+    for (const EcModel& model : ec_models) {
+        if (manufacturer == model.manufacturer && product == model.product) return model.registers;
+    }
+    return nullptr;
+}
+
+// A register file: the map of one model, for a model that is not built in
+// or to correct a built-in one. The file names the model it is for and
+// gives one line per channel, from cpu on:
+//
+//   manufacturer <DMI system manufacturer>
+//   product <DMI system product name>
+//   <cpu|gpu|fan3|fan4> <temperature> <fan mode> <automatic> <manual> <fan speed>
+//
+// The temperature, fan mode and fan speed are register numbers; automatic
+// and manual are the values of the fan mode register that give the fan to
+// the EC and take it over. Numbers are decimal or 0x hex. Lines starting
+// with # are comments.
+struct EcRegisterFile
+{
+    std::string manufacturer;
+    std::string product;
+    EcRegisterMap registers;
+
+    bool matches(const std::string& systemManufacturer, const std::string& systemProduct) const
+    {
+        return manufacturer == systemManufacturer && product == systemProduct;
+    }
+};
+
+// Throws std::invalid_argument naming the line of the first error
+inline EcRegisterFile parseEcRegisterFile(const std::string& text)
+{
+    auto fail = [](int number, const std::string& what) {
+        throw std::invalid_argument("registers line " + std::to_string(number) + ": " + what);
+    };
+    auto trim = [](const std::string& s) {
+        size_t start = s.find_first_not_of(" \t\r\n");
+        if (start == std::string::npos) return std::string();
+        return s.substr(start, s.find_last_not_of(" \t\r\n") - start + 1);
+    };
+    static const char* keys[MAX_CHANNELS] = { "cpu", "gpu", "fan3", "fan4" };
+
+    EcRegisterFile file = {};
+    bool given[MAX_CHANNELS] = {};
+    std::istringstream lines(text);
+    std::string line;
+    for (int number = 1; std::getline(lines, line); ++number) {
+        std::istringstream words(line);
+        std::string key;
+        if (!(words >> key) || key[0] == '#') continue;
+
+        if (key == "manufacturer" || key == "product") {
+            std::string rest;
+            std::getline(words, rest);
+            (key == "manufacturer" ? file.manufacturer : file.product) = trim(rest);
+            continue;
+        }
+
+        int c = 0;
+        while (c < MAX_CHANNELS && key != keys[c]) ++c;
+        if (c == MAX_CHANNELS) fail(number, "unknown channel '" + key + "'");
+        if (given[c]) fail(number, "channel " + key + " given twice");
+
+        short values[5];
+        for (short& value : values) {
+            std::string word;
+            unsigned int parsed = 0;
+            char extra = 0;
+            if (!(words >> word)) fail(number, key + " needs five registers and values");
+            bool hex = word.size() > 2 && word[0] == '0' && (word[1] == 'x' || word[1] == 'X');
+            if (std::sscanf(word.c_str(), hex ? "%x%c" : "%u%c", &parsed, &extra) != 1 || word[0] == '-' || parsed > 0xff) {
+                fail(number, "bad register or value '" + word + "'");
+            }
+            value = static_cast<short>(parsed);
+        }
+        std::string extra;
+        if (words >> extra) fail(number, "unexpected '" + extra + "'");
+
+        file.registers.channels[c] = { ec_channel_names[c], values[0], values[1], values[2], values[3], values[4] };
+        given[c] = true;
+    }
+
+    if (file.manufacturer.empty() || file.product.empty()) {
+        throw std::invalid_argument("registers: the file must name the manufacturer and product it is for");
+    }
+    while (file.registers.channelCount < MAX_CHANNELS && given[file.registers.channelCount]) ++file.registers.channelCount;
+    if (file.registers.channelCount == 0) throw std::invalid_argument("registers: no cpu channel");
+    for (int c = file.registers.channelCount; c < MAX_CHANNELS; ++c) {
+        if (given[c]) throw std::invalid_argument(std::string("registers: ") + keys[c] + " without the channels before it");
+    }
+    return file;
+}
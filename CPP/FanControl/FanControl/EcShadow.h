@@ -0,0 +1,125 @@
+#pragma once
+
+#include "EcTransport.h"
+#include "LatencyHistogram.h"
+
+#include <array>
+#include <chrono>
+
+// Write-through shadow of the EC register file. Writes of a value that is
+// already known to be in the register are dropped. Registers written
+// through the shadow are periodically read back, so a change made behind
+// our back (PredatorSense, the EC firmware taking over) invalidates the
+// shadow and the next write goes to the bus again.
+class ShadowedEcTransport : public EcTransport
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit ShadowedEcTransport(EcTransport& inner,
+                                 std::chrono::milliseconds verifyInterval = std::chrono::seconds(10))
+        : inner(inner), verifyBus(&inner), verifyInterval(verifyInterval), lastVerify(Clock::now()),
+          writesIssued(0), writesElided(0), verifyMismatches(0), stats(nullptr)
+    {
+        invalidate();
+    }
+
+    const char* name() const override { return inner.name(); }
+
+    short read(short reg) override
+    {
+        short value = inner.read(reg);
+        remember(reg, value);
+        return value;
+    }
+
+    void readBlock(const short* regs, size_t count, short* values) override
+    {
+        inner.readBlock(regs, count, values);
+        for (size_t i = 0; i < count; ++i) {
+            remember(regs[i], values[i]);
+        }
+    }
+
+    void write(short reg, short val) override
+    {
+        int index = reg & 0xff;
+        if (known[index] && values[index] == val) {
+            ++writesElided;
+            countEvent(stats, &HotPathStats::ecWritesElided);
+            return;
+        }
+        inner.write(reg, val);
+        remember(reg, val);
+        written[index] = true;
+        ++writesIssued;
+    }
+
+    // Forget everything, e.g. after an EC error or resume from sleep
+    void invalidate()
+    {
+        known.fill(false);
+        written.fill(false);
+        values.fill(0);
+    }
+
+    // Send the read-backs of verify() through another transport, e.g. a
+    // low priority EcBusArbiter client, so they never hold up a fan write
+    void verifyThrough(EcTransport& bus) { verifyBus = &bus; }
+
+    // Also counts elided writes in stats, where clients can reset them
+    void setStats(HotPathStats* s) { stats = s; }
+
+    // Read back every register we have written and correct the shadow
+    void verify()
+    {
+        short regs[256];
+        short actual[256];
+        size_t count = 0;
+        for (int reg = 0; reg < 256; ++reg) {
+            if (written[reg]) regs[count++] = static_cast<short>(reg);
+        }
+
+        verifyBus->readBlock(regs, count, actual);
+        for (size_t i = 0; i < count; ++i) {
+            if (actual[i] != values[regs[i]]) {
+                ++verifyMismatches;
+                values[regs[i]] = actual[i];
+            }
+        }
+        lastVerify = Clock::now();
+    }
+
+    void verify_if_due()
+    {
+        if (Clock::now() - lastVerify >= verifyInterval) {
+            verify();
+        }
+    }
+
+    unsigned long long issued() const { return writesIssued; }
+    unsigned long long elided() const { return writesElided; }
+    unsigned long long mismatches() const { return verifyMismatches; }
+
+private:
+    void remember(short reg, short val)
+    {
+        int index = reg & 0xff;
+        values[index] = val;
+        known[index] = true;
+    }
+
+    EcTransport& inner;
+    EcTransport* verifyBus;
+    std::chrono::milliseconds verifyInterval;
+    Clock::time_point lastVerify;
+
+    std::array<short, 256> values;
+    std::array<bool, 256> known;
+    std::array<bool, 256> written;
+
+    unsigned long long writesIssued;
+    unsigned long long writesElided;
+    unsigned long long verifyMismatches;
+    HotPathStats* stats;
+};
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <thread>
+#include <chrono>
+#include <string>
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <stdexcept>
+
+#include "LatencyHistogram.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// ACPI EC ports and commands
+const short EC_DATA_PORT = 0x62;
+const short EC_COMMAND_PORT = 0x66;
+const short EC_READ_CMD = 0x80;
+const short EC_WRITE_CMD = 0x81;
+
+// EC status register bits (read from EC_COMMAND_PORT)
+const short EC_STATUS_OBF = 0x01;
+const short EC_STATUS_IBF = 0x02;
+
+// Register values fetched in one pass, with the time the pass finished.
+// Only registers marked valid were part of the request.
+struct EcSnapshot
+{
+    std::array<short, 256> values;
+    std::bitset<256> valid;
+    std::chrono::steady_clock::time_point timestamp;
+
+    short operator[](short reg) const { return values[reg & 0xff]; }
+};
+
+// Register level access to the embedded controller. Every backend
+// (real hardware, kernel interfaces or the simulator) implements this,
+// so the control loop never talks to a port directly.
+class EcTransport
+{
+public:
+    virtual ~EcTransport() = default;
+
+    virtual const char* name() const = 0;
+    virtual short read(short reg) = 0;
+    virtual void write(short reg, short val) = 0;
+
+    // Reads count registers in one pass. Backends override this when they
+    // can do better than one full transaction per register.
+    virtual void readBlock(const short* regs, size_t count, short* values)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            values[i] = read(regs[i]);
+        }
+    }
+
+    void snapshot(const short* regs, size_t count, EcSnapshot& out)
+    {
+        if (count > 256) {
+            throw std::invalid_argument("snapshot of more than 256 registers");
+        }
+        short values[256];
+        readBlock(regs, count, values);
+        for (size_t i = 0; i < count; ++i) {
+            out.values[regs[i] & 0xff] = values[i];
+            out.valid.set(regs[i] & 0xff);
+        }
+        out.timestamp = std::chrono::steady_clock::now();
+    }
+
+    // The whole 256 byte EC space
+    void snapshotAll(EcSnapshot& out)
+    {
+        short regs[256];
+        for (short reg = 0; reg < 256; ++reg) regs[reg] = reg;
+        snapshot(regs, 256, out);
+    }
+};
+
+// How PortIoEcTransport waits for the EC to finish each handshake step.
+// FixedSleep is the original behaviour: poll IBF every 10 ms and sleep a
+// fixed 50 ms per transaction. Adaptive spins on the IBF/OBF bits for up to
+// spin, then polls every sleepStep until the transaction exceeds timeout.
+enum class EcCompletionMode { FixedSleep, Adaptive };
+
+struct EcCompletionPolicy
+{
+    EcCompletionMode mode = EcCompletionMode::Adaptive;
+    std::chrono::microseconds spin{ 200 };
+    std::chrono::microseconds sleepStep{ 500 };
+    std::chrono::milliseconds timeout{ 100 };
+};
+
+// Backends that speak the ACPI EC handshake over the 0x62/0x66 ports.
+// Subclasses only provide raw port access.
+class PortIoEcTransport : public EcTransport
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    PortIoEcTransport() : stats(nullptr) {}
+
+    void setCompletionPolicy(const EcCompletionPolicy& p) { policy = p; }
+    const EcCompletionPolicy& completionPolicy() const { return policy; }
+
+    // Times every transaction and handshake wait into stats, and counts
+    // busy polls and timeouts; null stops it
+    void setStats(HotPathStats* s) { stats = s; }
+
+    short read(short reg) override
+    {
+        LatencyClock::time_point start = latencyStart(stats);
+        short value = readTransaction(reg);
+        latencyEnd(stats, PHASE_EC_READ, start);
+        return value;
+    }
+
+    void write(short reg, short val) override
+    {
+        LatencyClock::time_point start = latencyStart(stats);
+        writeTransaction(reg, val);
+        latencyEnd(stats, PHASE_EC_WRITE, start);
+    }
+
+    // Back-to-back read transactions paced only by the status bits, with no
+    // per-register sleeps regardless of the completion mode
+    void readBlock(const short* regs, size_t count, short* values) override
+    {
+        drain_output();
+        for (size_t i = 0; i < count; ++i) {
+            LatencyClock::time_point start = latencyStart(stats);
+            Clock::time_point deadline = Clock::now() + policy.timeout;
+            wait_for_status(EC_STATUS_IBF, 0, deadline);
+            outb(EC_COMMAND_PORT, EC_READ_CMD);
+            wait_for_status(EC_STATUS_IBF, 0, deadline);
+            outb(EC_DATA_PORT, regs[i]);
+            wait_for_status(EC_STATUS_OBF, EC_STATUS_OBF, deadline);
+            values[i] = inb(EC_DATA_PORT);
+            latencyEnd(stats, PHASE_EC_READ, start);
+        }
+    }
+
+protected:
+    virtual short inb(short port) = 0;
+    virtual void outb(short port, short data) = 0;
+
+    short readTransaction(short reg)
+    {
+        if (policy.mode == EcCompletionMode::FixedSleep) {
+            wait_for_ibf_clear();
+            outb(EC_COMMAND_PORT, EC_READ_CMD);
+            wait_for_ibf_clear();
+            outb(EC_DATA_PORT, reg);
+            wait_for_ibf_clear();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            short temp = inb(EC_DATA_PORT);
+            std::this_thread::sleep_for(std::chrono::milliseconds(40));
+            return temp;
+        }
+
+        Clock::time_point deadline = Clock::now() + policy.timeout;
+        drain_output();
+        wait_for_status(EC_STATUS_IBF, 0, deadline);
+        outb(EC_COMMAND_PORT, EC_READ_CMD);
+        wait_for_status(EC_STATUS_IBF, 0, deadline);
+        outb(EC_DATA_PORT, reg);
+        wait_for_status(EC_STATUS_OBF, EC_STATUS_OBF, deadline);
+        return inb(EC_DATA_PORT);
+    }
+
+    void writeTransaction(short reg, short val)
+    {
+        if (policy.mode == EcCompletionMode::FixedSleep) {
+            wait_for_ibf_clear();
+            outb(EC_COMMAND_PORT, EC_WRITE_CMD);
+            wait_for_ibf_clear();
+            outb(EC_DATA_PORT, reg);
+            wait_for_ibf_clear();
+            outb(EC_DATA_PORT, val);
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            return;
+        }
+
+        Clock::time_point deadline = Clock::now() + policy.timeout;
+        wait_for_status(EC_STATUS_IBF, 0, deadline);
+        outb(EC_COMMAND_PORT, EC_WRITE_CMD);
+        wait_for_status(EC_STATUS_IBF, 0, deadline);
+        outb(EC_DATA_PORT, reg);
+        wait_for_status(EC_STATUS_IBF, 0, deadline);
+        outb(EC_DATA_PORT, val);
+        // The write is complete once the EC has consumed the data byte
+        wait_for_status(EC_STATUS_IBF, 0, deadline);
+    }
+
+    void wait_for_ibf_clear()
+    {
+        LatencyClock::time_point start = latencyStart(stats);
+        for (int i = 0; i < 100; ++i) {
+            if ((inb(EC_COMMAND_PORT) & EC_STATUS_IBF) == 0) {
+                latencyEnd(stats, PHASE_EC_WAIT, start);
+                return;
+            }
+            countEvent(stats, &HotPathStats::ecRetries);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        latencyEnd(stats, PHASE_EC_WAIT, start);
+        countEvent(stats, &HotPathStats::ecTimeouts);
+        throw std::runtime_error("EC input buffer busy");
+    }
+
+    // Wait until (status & mask) == expected: spin first, then back off to
+    // short sleeps. Throws once the transaction deadline has passed.
+    void wait_for_status(short mask, short expected, Clock::time_point deadline)
+    {
+        Clock::time_point start = Clock::now();
+        Clock::time_point spinUntil = start + policy.spin;
+        for (;;) {
+            if ((inb(EC_COMMAND_PORT) & mask) == expected) {
+                if (stats) stats->phases[PHASE_EC_WAIT].record(Clock::now() - start);
+                return;
+            }
+            countEvent(stats, &HotPathStats::ecRetries);
+            Clock::time_point now = Clock::now();
+            if (now >= deadline)
+                break;
+            if (now >= spinUntil)
+                std::this_thread::sleep_for(policy.sleepStep);
+        }
+        if (stats) stats->phases[PHASE_EC_WAIT].record(Clock::now() - start);
+        countEvent(stats, &HotPathStats::ecTimeouts);
+        throw std::runtime_error(mask == EC_STATUS_IBF ? "EC input buffer busy" : "EC output buffer empty");
+    }
+
+    // Discard a stale byte left in the output buffer by an aborted read
+    void drain_output()
+    {
+        if (inb(EC_COMMAND_PORT) & EC_STATUS_OBF)
+            inb(EC_DATA_PORT);
+    }
+
+private:
+    EcCompletionPolicy policy;
+    HotPathStats* stats;
+};
+
+#ifdef _WIN32
+
+typedef short(__stdcall* InpFunc)(short port);
+typedef void(__stdcall* OutFunc)(short port, short data);
+
+// Port I/O through the inpoutx64.dll kernel driver
+class InpOutEcTransport : public PortIoEcTransport
+{
+public:
+    InpOutEcTransport(const char* dllName = "inpoutx64.dll")
+    {
+        hDll = LoadLibraryA(dllName);
+        if (!hDll) {
+            throw std::runtime_error(std::string("Failed to load ") + dllName);
+        }
+        Inp32 = (InpFunc)GetProcAddress(hDll, "Inp32");
+        Out32 = (OutFunc)GetProcAddress(hDll, "Out32");
+        if (!Inp32 || !Out32) {
+            FreeLibrary(hDll);
+            throw std::runtime_error("Failed to get Inp32 or Out32 function");
+        }
+    }
+
+    ~InpOutEcTransport() override
+    {
+        FreeLibrary(hDll);
+    }
+
+    InpOutEcTransport(const InpOutEcTransport&) = delete;
+    InpOutEcTransport& operator=(const InpOutEcTransport&) = delete;
+
+    const char* name() const override { return "inpout"; }
+
+protected:
+    short inb(short port) override { return Inp32(port); }
+    void outb(short port, short data) override { Out32(port, data); }
+
+private:
+    HMODULE hDll;
+    InpFunc Inp32;
+    OutFunc Out32;
+};
+
+#endif // _WIN32
+
+#ifdef __linux__
+
+// Port I/O through /dev/port (needs root or CAP_SYS_RAWIO)
+class DevPortEcTransport : public PortIoEcTransport
+{
+public:
+    DevPortEcTransport(const char* path = "/dev/port")
+    {
+        fd = open(path, O_RDWR);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("Could not open ") + path);
+        }
+    }
+
+    ~DevPortEcTransport() override
+    {
+        close(fd);
+    }
+
+    DevPortEcTransport(const DevPortEcTransport&) = delete;
+    DevPortEcTransport& operator=(const DevPortEcTransport&) = delete;
+
+    const char* name() const override { return "devport"; }
+
+protected:
+    short inb(short port) override
+    {
+        unsigned char value = 0;
+        if (pread(fd, &value, 1, port) != 1) {
+            throw std::runtime_error("Could not read from /dev/port");
+        }
+        return value;
+    }
+
+    void outb(short port, short data) override
+    {
+        unsigned char value = static_cast<unsigned char>(data);
+        if (pwrite(fd, &value, 1, port) != 1) {
+            throw std::runtime_error("Could not write to /dev/port");
+        }
+    }
+
+private:
+    int fd;
+};
+
+// Register access through the ec_sys debugfs file. The kernel driver does
+// the handshake itself; writes need the module loaded with write_support=1.
+class EcSysTransport : public EcTransport
+{
+public:
+    EcSysTransport(const char* path = "/sys/kernel/debug/ec/ec0/io")
+    {
+        fd = open(path, O_RDWR);
+        if (fd < 0) {
+            fd = open(path, O_RDONLY);
+        }
+        if (fd < 0) {
+            throw std::runtime_error(std::string("Could not open ") + path);
+        }
+    }
+
+    ~EcSysTransport() override
+    {
+        close(fd);
+    }
+
+    EcSysTransport(const EcSysTransport&) = delete;
+    EcSysTransport& operator=(const EcSysTransport&) = delete;
+
+    const char* name() const override { return "ecsys"; }
+
+    short read(short reg) override
+    {
+        unsigned char value = 0;
+        if (pread(fd, &value, 1, reg) != 1) {
+            throw std::runtime_error("Could not read from ec_sys");
+        }
+        return value;
+    }
+
+    void write(short reg, short val) override
+    {
+        unsigned char value = static_cast<unsigned char>(val);
+        if (pwrite(fd, &value, 1, reg) != 1) {
+            throw std::runtime_error("Could not write to ec_sys (is write_support enabled?)");
+        }
+    }
+
+    // One pread covering the lowest to the highest requested register
+    void readBlock(const short* regs, size_t count, short* values) override
+    {
+        if (count == 0) return;
+        int first = 255, last = 0;
+        for (size_t i = 0; i < count; ++i) {
+            int reg = regs[i] & 0xff;
+            if (reg < first) first = reg;
+            if (reg > last) last = reg;
+        }
+
+        unsigned char buffer[256];
+        ssize_t length = last - first + 1;
+        if (pread(fd, buffer, length, first) != length) {
+            throw std::runtime_error("Could not read from ec_sys");
+        }
+        for (size_t i = 0; i < count; ++i) {
+            values[i] = buffer[(regs[i] & 0xff) - first];
+        }
+    }
+
+private:
+    int fd;
+};
+
+#endif // __linux__
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "EcTransport.h"
+
+// How failed EC transactions are retried and when the EC gets the fans
+struct EcWatchdogParams
+{
+    int attempts = 3;                               // tries per transaction
+    std::chrono::microseconds backoff{ 2000 };      // before the second try, doubling for each one after
+    int failLimit = 3;                              // failed transactions in a row that trip the watchdog
+    int recoverAfter = 3;                           // successful transactions in a row that clear it
+    std::chrono::milliseconds tickBudget{ 150 };    // time a control tick may take, retries included
+
+    EcWatchdogParams() {}
+};
+
+// The EC's health as every stage that talks to it sees it. A transaction
+// that still fails after its retries counts against the EC; failLimit of
+// those in a row trip the watchdog and the control loop hands the fans to
+// the EC's automatic mode. The stages keep reading meanwhile, so those
+// reads probe the EC, and recoverAfter of them succeeding in a row clear
+// the watchdog again.
+class EcWatchdog
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit EcWatchdog(const EcWatchdogParams& params = EcWatchdogParams())
+        : settings(params), failedInRow(0), succeededInRow(0), isTripped(false), tickDeadline(Clock::time_point::max()),
+          retryCount(0), failureCount(0), tripCount(0), missCount(0)
+    {
+    }
+
+    const EcWatchdogParams& params() const { return settings; }
+
+    void succeeded()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        failedInRow = 0;
+        if (++succeededInRow >= settings.recoverAfter) isTripped = false;
+    }
+
+    void failed()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        succeededInRow = 0;
+        ++failureCount;
+        if (++failedInRow >= settings.failLimit && !isTripped) {
+            isTripped = true;
+            ++tripCount;
+        }
+    }
+
+    void retried()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++retryCount;
+    }
+
+    bool tripped() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return isTripped;
+    }
+
+    // The control stage's tick runs from startTick until its budget is
+    // used up; retries that would start after that are not attempted
+    void startTick(Clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tickDeadline = now + settings.tickBudget;
+    }
+
+    Clock::time_point deadline() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return tickDeadline;
+    }
+
+    // True, and counted, when the tick ran past its budget
+    bool finishTick(Clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool missed = now > tickDeadline;
+        if (missed) ++missCount;
+        tickDeadline = Clock::time_point::max();
+        return missed;
+    }
+
+    unsigned long long retries() const { std::lock_guard<std::mutex> lock(mutex); return retryCount; }
+    unsigned long long failures() const { std::lock_guard<std::mutex> lock(mutex); return failureCount; }
+    unsigned long long trips() const { std::lock_guard<std::mutex> lock(mutex); return tripCount; }
+    unsigned long long deadlineMisses() const { std::lock_guard<std::mutex> lock(mutex); return missCount; }
+
+private:
+    EcWatchdogParams settings;
+    mutable std::mutex mutex;
+    int failedInRow;
+    int succeededInRow;
+    bool isTripped;
+    Clock::time_point tickDeadline;
+    unsigned long long retryCount;
+    unsigned long long failureCount;
+    unsigned long long tripCount;
+    unsigned long long missCount;
+};
+
+// Retries every transaction that throws, with a doubling backoff, and
+// reports each outcome to an EcWatchdog. The control stage's transport is
+// tickBounded: it does not retry past the current tick's deadline.
+class RetryingEcTransport : public EcTransport
+{
+public:
+    RetryingEcTransport(EcTransport& inner, EcWatchdog& watchdog, bool tickBounded = false)
+        : inner(inner), watchdog(watchdog), tickBounded(tickBounded)
+    {
+    }
+
+    const char* name() const override { return inner.name(); }
+
+    short read(short reg) override
+    {
+        return attempt([&] { return inner.read(reg); });
+    }
+
+    void write(short reg, short val) override
+    {
+        attempt([&] { inner.write(reg, val); return val; });
+    }
+
+    void readBlock(const short* regs, size_t count, short* values) override
+    {
+        attempt([&] { inner.readBlock(regs, count, values); return short(0); });
+    }
+
+private:
+    typedef EcWatchdog::Clock Clock;
+
+    template <typename Transaction>
+    short attempt(Transaction transaction)
+    {
+        const EcWatchdogParams& params = watchdog.params();
+        std::chrono::microseconds backoff = params.backoff;
+        for (int tries = 1;; ++tries) {
+            try {
+                short value = transaction();
+                watchdog.succeeded();
+                return value;
+            }
+            catch (const std::runtime_error&) {
+                bool pastDeadline = tickBounded && Clock::now() + backoff >= watchdog.deadline();
+                if (tries >= params.attempts || pastDeadline) {
+                    watchdog.failed();
+                    throw;
+                }
+            }
+            watchdog.retried();
+            std::this_thread::sleep_for(backoff);
+            backoff *= 2;
+        }
+    }
+
+    EcTransport& inner;
+    EcWatchdog& watchdog;
+    bool tickBounded;
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "SharedData.h"
+
+// Turns the demands of the zones' controllers into fan commands. Each fan
+// combines the demands through its row of the coupling matrix, then
+// follows the combined speed at a limited slew rate and holds back
+// changes smaller than its minimum step, so a fan does not hunt around
+// a temperature and the EC is not written for every percent. Zone and
+// fan indices are channels; zone c is the temperature of channel c.
+class FanArbiter
+{
+public:
+    FanArbiter() : mode(COUPLING_MAX)
+    {
+        for (int f = 0; f < MAX_CHANNELS; ++f) {
+            for (int z = 0; z < MAX_CHANNELS; ++z) weight[f][z] = f == z ? 1.0 : 0.0;
+            slewUp[f] = 0;
+            slewDown[f] = 0;
+            minStep[f] = 0;
+            low[f] = 0;
+            high[f] = 100;
+            position[f] = -1;
+        }
+    }
+
+    void configure(const FanConfig& config, int channelCount)
+    {
+        for (int f = 0; f < channelCount; ++f) {
+            for (int z = 0; z < MAX_CHANNELS; ++z) weight[f][z] = std::max(0.0f, config.coupling[f][z]);
+            slewUp[f] = std::max(0.0f, config.slew_up[f]);
+            slewDown[f] = std::max(0.0f, config.slew_down[f]);
+            minStep[f] = std::max(0, config.min_step[f]);
+
+            int last = std::max(2, std::min(MAX_CURVE_POINTS, config.point_count[f])) - 1;
+            low[f] = *std::min_element(config.curve_fan[f], config.curve_fan[f] + last + 1);
+            high[f] = *std::max_element(config.curve_fan[f], config.curve_fan[f] + last + 1);
+        }
+        mode = config.coupling_mode;
+    }
+
+    // What fan f asks for given every zone's demand in percent; a negative
+    // demand (no reading yet) is left out. -1 when no zone has a demand.
+    int combine(int fan, const int* demand, int count) const
+    {
+        double combined = -1;
+        for (int z = 0; z < count; ++z) {
+            if (demand[z] < 0 || weight[fan][z] <= 0) continue;
+            double part = weight[fan][z] * demand[z];
+            if (combined < 0) combined = part;
+            else combined = mode == COUPLING_SUM ? combined + part : std::max(combined, part);
+        }
+        if (combined < 0) return -1;
+        return static_cast<int>(std::lround(std::min(100.0, combined)));
+    }
+
+    // The command for fan f after dt seconds, given the speed it asks for
+    // and the speed last written (-1 when the EC has the fan or nothing was
+    // written yet, which writes target at once). Returns last while the
+    // change is held back.
+    int limit(int fan, int target, int last, double dt)
+    {
+        if (target < 0) return last;
+        if (last < 0 || position[fan] < 0) {
+            position[fan] = target;
+            return target;
+        }
+
+        // The slewed position moves every tick, whether or not it is written
+        double step = target - position[fan];
+        if (step > 0 && slewUp[fan] > 0) step = std::min(step, slewUp[fan] * dt);
+        if (step < 0 && slewDown[fan] > 0) step = std::max(step, -slewDown[fan] * dt);
+        position[fan] += step;
+
+        int next = static_cast<int>(std::lround(position[fan]));
+        if (next == last) return last;
+        bool atEnd = next == target && (target <= low[fan] || target >= high[fan]);
+        if (std::abs(next - last) < minStep[fan] && !atEnd) return last;
+        return next;
+    }
+
+    // Writes target at once, bypassing the limits, and follows on from it
+    int jump(int fan, int target)
+    {
+        position[fan] = target;
+        return target;
+    }
+
+    // The next limit() starts from the speed written then
+    void reset(int fan) { position[fan] = -1; }
+
+private:
+    double weight[MAX_CHANNELS][MAX_CHANNELS];
+    double slewUp[MAX_CHANNELS];        // % per s, 0 for no limit
+    double slewDown[MAX_CHANNELS];
+    int minStep[MAX_CHANNELS];          // %
+    int low[MAX_CHANNELS];              // ends of the fan's curve, always reached exactly
+    int high[MAX_CHANNELS];
+    int32_t mode;
+    double position[MAX_CHANNELS];      // slewed speed, -1 until the first command
+};
@@ -7,244 +7,43 @@
 #include <atomic>
 #include <string>
 #include <fstream>
+#include <memory>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <iterator>
+#include <sstream>
 #include <shlobj.h>  // Add this include for SHGetFolderPath
-
-typedef short(__stdcall* InpFunc)(short port);
-typedef void(__stdcall* OutFunc)(short port, short data);
-
-InpFunc Inp32;
-OutFunc Out32;
-
-// EC Registers
-const short EC_DATA_PORT = 0x62;
-const short EC_COMMAND_PORT = 0x66;
-const short EC_READ_CMD = 0x80;
-const short EC_WRITE_CMD = 0x81;
-
-const short gpu_fan_mode_reg = 33;
-const short gpu_fan_mode_auto = 0x10;
-const short gpu_fan_mode_manual = 0x30;
-
-const short cpu_fan_mode_reg = 34;
-const short cpu_fan_mode_auto = 0x04;
-const short cpu_fan_mode_manual = 0x0c;
-
-const short fan_mode_reg = 44;
-const short fan_mode_full_manual = 0x00;
-
-const short gpu_fan_speed_reg = 58;
-const short cpu_fan_speed_reg = 55;
-
-const short cpu_temp_reg_1 = 176;
-const short gpu_temp_reg_1 = 180;
-
-struct SharedData 
-{
-    std::atomic<double> cpuTemp;
-    std::atomic<double> gpuTemp;
-    std::atomic<int> cpuFanSpeed;
-    std::atomic<int> gpuFanSpeed;
-
-    std::atomic<int> cpu_hysteresis;
-    std::atomic<int> gpu_hysteresis;
-
-    std::atomic<int> cpu_temp_point_2;
-    std::atomic<int> cpu_temp_point_3;
-    std::atomic<int> cpu_temp_point_4;
-
-    std::atomic<int> gpu_temp_point_2;
-    std::atomic<int> gpu_temp_point_3;
-    std::atomic<int> gpu_temp_point_4;
-
-    std::atomic<int> cpu_fan_point_1;
-    std::atomic<int> cpu_fan_point_2;
-    std::atomic<int> cpu_fan_point_3;
-    std::atomic<int> cpu_fan_point_4;
-    std::atomic<int> cpu_fan_point_5;
-                         
-    std::atomic<int> gpu_fan_point_1;
-    std::atomic<int> gpu_fan_point_2;
-    std::atomic<int> gpu_fan_point_3;
-    std::atomic<int> gpu_fan_point_4;
-    std::atomic<int> gpu_fan_point_5;
-
-    std::atomic<bool> write_sync;
-};
+#include <tlhelp32.h>
+
+#include "EcTransport.h"
+#include "EcArbiter.h"
+#include "EcShadow.h"
+#include "EcWatchdog.h"
+#include "Mailbox.h"
+#include "AcquisitionStage.h"
+#include "SharedData.h"
+#include "ConfigCommands.h"
+#include "ControlEvents.h"
+#include "EcRegisters.h"
+#include "FanController.h"
+#include "ControlLoop.h"
+#include "CpuLoad.h"
+#include "SampleScheduler.h"
+#include "SettingsStore.h"
+#include "ProfileSet.h"
+#include "ProfileRules.h"
+#include "TraceRecorder.h"
 
 // Global variables for cleanup
 std::atomic<bool> g_running(true);
 SharedData* g_sharedData = nullptr;
 HANDLE g_hMapFile = nullptr;
-
-void wait_for_ibf_clear()
-{
-    for (int i = 0; i < 100; ++i) {
-        if ((Inp32(EC_COMMAND_PORT) & 0x02) == 0)
-            return;
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    }
-    throw std::runtime_error("EC input buffer busy");
-}
-
-void ec_write(short reg, short val)
-{
-    wait_for_ibf_clear();
-    Out32(EC_COMMAND_PORT, EC_WRITE_CMD);
-    wait_for_ibf_clear();
-    Out32(EC_DATA_PORT, reg);
-    wait_for_ibf_clear();
-    Out32(EC_DATA_PORT, val);
-    std::this_thread::sleep_for(std::chrono::milliseconds(50));
-}
-
-short ec_read(short reg)
-{
-    wait_for_ibf_clear();
-    Out32(EC_COMMAND_PORT, EC_READ_CMD);
-    wait_for_ibf_clear();
-    Out32(EC_DATA_PORT, reg);
-    wait_for_ibf_clear();
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    short temp = Inp32(EC_DATA_PORT);
-    std::this_thread::sleep_for(std::chrono::milliseconds(40));
-    return temp;
-}
-
-class LowPassFilter
-{
-public:
-    LowPassFilter(double alpha) : alpha(alpha), initialized(false), filtered(0) {}
-
-    double filter(double value) {
-        if (!initialized) {
-            filtered = value;
-            initialized = true;
-        }
-        else {
-            filtered = alpha * value + (1 - alpha) * filtered;
-        }
-        return filtered;
-    }
-
-private:
-    double alpha;
-    bool initialized;
-    double filtered;
-};
-
-class FanController
-{
-public:
-    FanController(std::vector<int> tempSet, std::vector<int> fanSet, int hyst)
-        : tempSetpoints(tempSet), fanSetpoints(fanSet), hysteresis(hyst), fanSpeed(0), lastTemp(0) 
-    {
-        if ((fanSet.size() != tempSetpoints.size()) || (fanSet.size() != 5))
-        {
-            throw std::invalid_argument("tempSetpoints and fanSetpoints must be 5");
-		}
-    }
-
-    int update(double temp) 
-    {
-        if ((lastTemp - temp > hysteresis) || (temp > lastTemp)) {
-            for (size_t i = 0; i < tempSetpoints.size() - 1; ++i) {
-                if (temp >= tempSetpoints[i] && temp < tempSetpoints[i + 1]) {
-                    double temp_range = tempSetpoints[i + 1] - tempSetpoints[i];
-                    double fan_range = fanSetpoints[i + 1] - fanSetpoints[i];
-                    fanSpeed = static_cast<int>(fanSetpoints[i] + (temp - tempSetpoints[i]) * fan_range / temp_range);
-                    break;
-                }
-            }
-            lastTemp = temp;
-        }
-        return fanSpeed;
-    }
-
-    void syncToSharedData(SharedData* sharedData, bool isCpuController)
-    {
-        if (isCpuController) 
-        {
-            sharedData->cpu_hysteresis.store(hysteresis);
-            sharedData->cpu_temp_point_2.store(tempSetpoints[1]);
-            sharedData->cpu_temp_point_3.store(tempSetpoints[2]);
-            sharedData->cpu_temp_point_4.store(tempSetpoints[3]);
-            sharedData->cpu_fan_point_1.store(fanSetpoints[0]);
-            sharedData->cpu_fan_point_2.store(fanSetpoints[1]);
-            sharedData->cpu_fan_point_3.store(fanSetpoints[2]);
-            sharedData->cpu_fan_point_4.store(fanSetpoints[3]);
-            sharedData->cpu_fan_point_5.store(fanSetpoints[4]);
-        } 
-        else 
-        {
-            sharedData->gpu_hysteresis.store(hysteresis);
-            sharedData->gpu_temp_point_2.store(tempSetpoints[1]);
-            sharedData->gpu_temp_point_3.store(tempSetpoints[2]);
-            sharedData->gpu_temp_point_4.store(tempSetpoints[3]);
-            sharedData->gpu_fan_point_1.store(fanSetpoints[0]);
-            sharedData->gpu_fan_point_2.store(fanSetpoints[1]);
-            sharedData->gpu_fan_point_3.store(fanSetpoints[2]);
-            sharedData->gpu_fan_point_4.store(fanSetpoints[3]);
-            sharedData->gpu_fan_point_5.store(fanSetpoints[4]);
-        }
-    }
-    void syncFromSharedData(SharedData* sharedData, bool isCpuController)
-    {
-        if (isCpuController) 
-        {
-            hysteresis = sharedData->cpu_hysteresis.load();
-            tempSetpoints[1] = sharedData->cpu_temp_point_2.load();
-            tempSetpoints[2] = sharedData->cpu_temp_point_3.load();
-            tempSetpoints[3] = sharedData->cpu_temp_point_4.load();
-            fanSetpoints[0] = sharedData->cpu_fan_point_1.load();
-            fanSetpoints[1] = sharedData->cpu_fan_point_2.load();
-            fanSetpoints[2] = sharedData->cpu_fan_point_3.load();
-            fanSetpoints[3] = sharedData->cpu_fan_point_4.load();
-            fanSetpoints[4] = sharedData->cpu_fan_point_5.load();
-        } 
-        else 
-        {
-            hysteresis = sharedData->gpu_hysteresis.load();
-            tempSetpoints[1] = sharedData->gpu_temp_point_2.load();
-            tempSetpoints[2] = sharedData->gpu_temp_point_3.load();
-            tempSetpoints[3] = sharedData->gpu_temp_point_4.load();
-            fanSetpoints[0] = sharedData->gpu_fan_point_1.load();
-            fanSetpoints[1] = sharedData->gpu_fan_point_2.load();
-            fanSetpoints[2] = sharedData->gpu_fan_point_3.load();
-            fanSetpoints[3] = sharedData->gpu_fan_point_4.load();
-            fanSetpoints[4] = sharedData->gpu_fan_point_5.load();
-			
-        }
-        lastTemp = 0; // Reset lastTemp to avoid stale data
-    }
-private:
-    std::vector<int> tempSetpoints;
-    std::vector<int> fanSetpoints;
-    int hysteresis;
-    int fanSpeed;
-    double lastTemp;
-};
-
-void set_cpu_fan_manual(int percent)
-{
-    ec_write(cpu_fan_mode_reg, cpu_fan_mode_manual);
-    ec_write(cpu_fan_speed_reg, percent);
-}
-
-void set_gpu_fan_manual(int percent)
-{
-    ec_write(gpu_fan_mode_reg, gpu_fan_mode_manual);
-    ec_write(gpu_fan_speed_reg, percent);
-}
-
-double get_cpu_temp()
-{
-    return static_cast<double>(ec_read(cpu_temp_reg_1));
-}
-
-double get_gpu_temp()
-{
-    return static_cast<double>(ec_read(gpu_temp_reg_1));
-}
+HANDLE g_hConfigLock = nullptr;
+ControlEvents* g_events = nullptr;
+// Set once WinMain has saved the settings and is about to return
+HANDLE g_hStopped = nullptr;
+std::atomic<int32_t> g_automaticProfile(-1);
 
 std::string getRegistryValue(HKEY hKey, const std::string& subKey, const std::string& valueName) {
     HKEY hSubKey;
@@ -265,171 +64,164 @@ std::string getRegistryValue(HKEY hKey, const std::string& subKey, const std::st
     return result;
 }
 
-bool checkSystem() 
+// The EC register map of this laptop, from the BIOS system information:
+// the map in the register file at path when the file is for this model,
+// else the model's built-in map. nullptr, after telling the user, when
+// there is neither or the file cannot be used; file receives the map
+// read from the file.
+const EcRegisterMap* resolveRegisters(const std::string& path, EcRegisterFile& file)
 {
     std::string manufacturer = getRegistryValue(HKEY_LOCAL_MACHINE, 
         "HARDWARE\\DESCRIPTION\\System\\BIOS", "SystemManufacturer");
     std::string model = getRegistryValue(HKEY_LOCAL_MACHINE, 
         "HARDWARE\\DESCRIPTION\\System\\BIOS", "SystemProductName");
-    
-    if(manufacturer == "Acer" && model == "Predator PHN16-72") 
-    {
-        return true;
-    } 
-    else 
-    {
-        std::string message = "Detected unsupported motherboard: " + manufacturer + " " + model;
+
+    std::ifstream in(path, std::ios::binary);
+    if (in) {
+        try {
+            file = parseEcRegisterFile(std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()));
+        }
+        catch (const std::invalid_argument& e) {
+            std::string message = path + ": " + e.what();
+            MessageBoxA(NULL, message.c_str(), "Invalid Register File", MB_OK | MB_ICONERROR);
+            return nullptr;
+        }
+        if (file.matches(manufacturer, model)) return &file.registers;
+    }
+
+    const EcRegisterMap* registers = findEcRegisters(manufacturer, model);
+    if (!registers) {
+        std::string message = "Detected unsupported motherboard: " + manufacturer + " " + model +
+                              "\n\nThe fans of another model can be controlled once its EC registers are given in " + path;
         MessageBoxA(NULL, message.c_str(), "Unsupported System", MB_OK | MB_ICONWARNING);
-        return false;
-	}
+    }
+    return registers;
 }
 
-void saveSharedDataToFile(SharedData* sharedData, const std::string& filename) 
+// Config writers are serialized across processes by a named mutex
+void publishConfig(SharedData* sharedData, const FanConfig& config)
 {
-    std::ofstream file(filename, std::ios::binary);
-    if (!file) {
+    WaitForSingleObject(g_hConfigLock, INFINITE);
+    sharedData->config.store(config);
+    ReleaseMutex(g_hConfigLock);
+}
+
+// Publishes the settings file's current settings and profiles, and puts
+// a missing, old or damaged file in the current format right away
+void loadSettings(SharedData* sharedData, SettingsStore& settings)
+{
+    SettingsLoad loaded = settings.load();
+    if (loaded == SettingsLoad::Corrupt) {
+        MessageBoxA(NULL, "The settings file was damaged and has been kept as fanctrl_settings.dat.corrupt; "
+                    "starting from the default settings", "Warning", MB_OK | MB_ICONWARNING);
+    }
+    FanConfig config = settings.current();
+
+    Telemetry telemetry = {};
+    telemetry.channelCount = config.channel_count;
+    sharedData->telemetry.store(telemetry);
+    publishConfig(sharedData, config);
+
+    if (loaded != SettingsLoad::Loaded && !settings.flush()) {
         MessageBoxA(NULL, "Could not save settings to file", "Warning", MB_OK | MB_ICONWARNING);
-        return;
     }
-    
-    // Save non-atomic values
-    double cpuTemp = sharedData->cpuTemp.load();
-    double gpuTemp = sharedData->gpuTemp.load();
-    int cpuFanSpeed = sharedData->cpuFanSpeed.load();
-    int gpuFanSpeed = sharedData->gpuFanSpeed.load();
-    int cpu_hysteresis = sharedData->cpu_hysteresis.load();
-    int gpu_hysteresis = sharedData->gpu_hysteresis.load();
-    int cpu_temp_point_2 = sharedData->cpu_temp_point_2.load();
-    int cpu_temp_point_3 = sharedData->cpu_temp_point_3.load();
-    int cpu_temp_point_4 = sharedData->cpu_temp_point_4.load();
-    int gpu_temp_point_2 = sharedData->gpu_temp_point_2.load();
-    int gpu_temp_point_3 = sharedData->gpu_temp_point_3.load();
-    int gpu_temp_point_4 = sharedData->gpu_temp_point_4.load();
-    int cpu_fan_point_1 = sharedData->cpu_fan_point_1.load();
-    int cpu_fan_point_2 = sharedData->cpu_fan_point_2.load();
-    int cpu_fan_point_3 = sharedData->cpu_fan_point_3.load();
-    int cpu_fan_point_4 = sharedData->cpu_fan_point_4.load();
-    int cpu_fan_point_5 = sharedData->cpu_fan_point_5.load();
-    int gpu_fan_point_1 = sharedData->gpu_fan_point_1.load();
-    int gpu_fan_point_2 = sharedData->gpu_fan_point_2.load();
-    int gpu_fan_point_3 = sharedData->gpu_fan_point_3.load();
-    int gpu_fan_point_4 = sharedData->gpu_fan_point_4.load();
-    int gpu_fan_point_5 = sharedData->gpu_fan_point_5.load();
-    
-    file.write(reinterpret_cast<const char*>(&cpuTemp), sizeof(cpuTemp));
-    file.write(reinterpret_cast<const char*>(&gpuTemp), sizeof(gpuTemp));
-    file.write(reinterpret_cast<const char*>(&cpuFanSpeed), sizeof(cpuFanSpeed));
-    file.write(reinterpret_cast<const char*>(&gpuFanSpeed), sizeof(gpuFanSpeed));
-    file.write(reinterpret_cast<const char*>(&cpu_hysteresis), sizeof(cpu_hysteresis));
-    file.write(reinterpret_cast<const char*>(&gpu_hysteresis), sizeof(gpu_hysteresis));
-    file.write(reinterpret_cast<const char*>(&cpu_temp_point_2), sizeof(cpu_temp_point_2));
-    file.write(reinterpret_cast<const char*>(&cpu_temp_point_3), sizeof(cpu_temp_point_3));
-    file.write(reinterpret_cast<const char*>(&cpu_temp_point_4), sizeof(cpu_temp_point_4));
-    file.write(reinterpret_cast<const char*>(&gpu_temp_point_2), sizeof(gpu_temp_point_2));
-    file.write(reinterpret_cast<const char*>(&gpu_temp_point_3), sizeof(gpu_temp_point_3));
-    file.write(reinterpret_cast<const char*>(&gpu_temp_point_4), sizeof(gpu_temp_point_4));
-    file.write(reinterpret_cast<const char*>(&cpu_fan_point_1), sizeof(cpu_fan_point_1));
-    file.write(reinterpret_cast<const char*>(&cpu_fan_point_2), sizeof(cpu_fan_point_2));
-    file.write(reinterpret_cast<const char*>(&cpu_fan_point_3), sizeof(cpu_fan_point_3));
-    file.write(reinterpret_cast<const char*>(&cpu_fan_point_4), sizeof(cpu_fan_point_4));
-    file.write(reinterpret_cast<const char*>(&cpu_fan_point_5), sizeof(cpu_fan_point_5));
-    file.write(reinterpret_cast<const char*>(&gpu_fan_point_1), sizeof(gpu_fan_point_1));
-    file.write(reinterpret_cast<const char*>(&gpu_fan_point_2), sizeof(gpu_fan_point_2));
-    file.write(reinterpret_cast<const char*>(&gpu_fan_point_3), sizeof(gpu_fan_point_3));
-    file.write(reinterpret_cast<const char*>(&gpu_fan_point_4), sizeof(gpu_fan_point_4));
-    file.write(reinterpret_cast<const char*>(&gpu_fan_point_5), sizeof(gpu_fan_point_5));
+    sharedData->profiles.store(settings.directory());
 }
 
-void loadSharedDataFromFile(SharedData* sharedData, const std::string& filename) 
+// The profile list clients see, with what the rules selected and how
+// many settings were rejected
+ProfileDirectory profileDirectory(const SettingsStore& settings, const ProfileSet& profiles)
 {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file) {
-        // File doesn't exist, create with default values
-        sharedData->cpuTemp.store(0.0);
-        sharedData->gpuTemp.store(0.0);
-        sharedData->cpuFanSpeed.store(0);
-        sharedData->gpuFanSpeed.store(0);
-        sharedData->cpu_hysteresis.store(3);
-        sharedData->gpu_hysteresis.store(3);
-        sharedData->cpu_temp_point_2.store(55);
-        sharedData->cpu_temp_point_3.store(70);
-        sharedData->cpu_temp_point_4.store(80);
-        sharedData->gpu_temp_point_2.store(50);
-        sharedData->gpu_temp_point_3.store(65);
-        sharedData->gpu_temp_point_4.store(75);
-        sharedData->cpu_fan_point_1.store(0);
-        sharedData->cpu_fan_point_2.store(5);
-        sharedData->cpu_fan_point_3.store(8);
-        sharedData->cpu_fan_point_4.store(30);
-        sharedData->cpu_fan_point_5.store(100);
-        sharedData->gpu_fan_point_1.store(0);
-        sharedData->gpu_fan_point_2.store(5);
-        sharedData->gpu_fan_point_3.store(8);
-        sharedData->gpu_fan_point_4.store(30);
-        sharedData->gpu_fan_point_5.store(100);
-        sharedData->write_sync.store(false);
-        
-        // Save default values to file
-        saveSharedDataToFile(sharedData, filename);
-        return;
+    ProfileDirectory directory = settings.directory();
+    directory.automatic = g_automaticProfile.load();
+    directory.rejectedConfigs = profiles.rejected();
+    return directory;
+}
+
+// True while the laptop runs from its battery; unknown counts as mains
+bool onBatteryPower()
+{
+    SYSTEM_POWER_STATUS status;
+    if (!GetSystemPowerStatus(&status)) return false;
+    return status.ACLineStatus == 0;
+}
+
+// Local time in minutes after midnight
+int minuteOfDay()
+{
+    SYSTEMTIME now;
+    GetLocalTime(&now);
+    return now.wHour * 60 + now.wMinute;
+}
+
+// Executables running, in lower case
+std::vector<std::string> runningProcesses()
+{
+    std::vector<std::string> names;
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (snapshot == INVALID_HANDLE_VALUE) return names;
+
+    PROCESSENTRY32W entry;
+    entry.dwSize = sizeof(entry);
+    for (BOOL more = Process32FirstW(snapshot, &entry); more; more = Process32NextW(snapshot, &entry)) {
+        std::string name;
+        for (const wchar_t* c = entry.szExeFile; *c; ++c) {
+            name += *c < 128 ? static_cast<char>(std::tolower(static_cast<int>(*c))) : '?';
+        }
+        names.push_back(name);
+    }
+    CloseHandle(snapshot);
+    return names;
+}
+
+// Automatic profile selection, on its own thread: every 10 s the rules in
+// path (ProfileRules) are evaluated, and when they select another profile
+// than last time it is switched to with COMMAND_SWITCH_PROFILE on the
+// backend's own command lane, like a client would. Only changes are acted
+// on, so a profile picked by hand stays until the rules select another
+// one. The file is read on every pass, so edits apply without a restart.
+void rulesStage(const std::string& path, int lane, ControlEvents& events)
+{
+    std::string text;
+    ProfileRules rules;
+    int32_t selected = -1;
+    uint32_t seq = 0;
+    while (g_running.load()) {
+        std::ifstream file(path, std::ios::binary);
+        std::string current = file ? std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()) : std::string();
+        if (current != text) {
+            text = current;
+            selected = -1;
+            try {
+                rules = ProfileRules::parse(text);
+            }
+            catch (const std::invalid_argument& e) {
+                rules = ProfileRules();
+                MessageBoxA(NULL, e.what(), "Profile rules ignored", MB_OK | MB_ICONWARNING);
+            }
+        }
+
+        int32_t choice = -1;
+        if (!rules.empty()) {
+            RuleInputs inputs;
+            inputs.onBattery = onBatteryPower();
+            inputs.minuteOfDay = minuteOfDay();
+            if (rules.needsProcesses()) inputs.processes = runningProcesses();
+            choice = rules.select(inputs, g_sharedData->profiles.load());
+        }
+        if (choice != selected) {
+            selected = choice;
+            g_automaticProfile.store(choice);
+            if (choice >= 0) {
+                FanCommand command = { ++seq, COMMAND_SWITCH_PROFILE, 0, { choice, 0, 0, 0, 0 } };
+                // A full lane tries again on the next pass
+                if (g_sharedData->commands.submit(lane, command)) events.notifyConfigChanged();
+                else selected = -1;
+            }
+        }
+
+        for (int i = 0; i < 40 && g_running.load(); ++i) Sleep(250);
     }
-    
-    // Load values from file
-    double cpuTemp, gpuTemp;
-    int cpuFanSpeed, gpuFanSpeed;
-    int cpu_hysteresis, gpu_hysteresis;
-    int cpu_temp_point_2, cpu_temp_point_3, cpu_temp_point_4;
-    int gpu_temp_point_2, gpu_temp_point_3, gpu_temp_point_4;
-    int cpu_fan_point_1, cpu_fan_point_2, cpu_fan_point_3, cpu_fan_point_4, cpu_fan_point_5;
-    int gpu_fan_point_1, gpu_fan_point_2, gpu_fan_point_3, gpu_fan_point_4, gpu_fan_point_5;
-    
-    file.read(reinterpret_cast<char*>(&cpuTemp), sizeof(cpuTemp));
-    file.read(reinterpret_cast<char*>(&gpuTemp), sizeof(gpuTemp));
-    file.read(reinterpret_cast<char*>(&cpuFanSpeed), sizeof(cpuFanSpeed));
-    file.read(reinterpret_cast<char*>(&gpuFanSpeed), sizeof(gpuFanSpeed));
-    file.read(reinterpret_cast<char*>(&cpu_hysteresis), sizeof(cpu_hysteresis));
-    file.read(reinterpret_cast<char*>(&gpu_hysteresis), sizeof(gpu_hysteresis));
-    file.read(reinterpret_cast<char*>(&cpu_temp_point_2), sizeof(cpu_temp_point_2));
-    file.read(reinterpret_cast<char*>(&cpu_temp_point_3), sizeof(cpu_temp_point_3));
-    file.read(reinterpret_cast<char*>(&cpu_temp_point_4), sizeof(cpu_temp_point_4));
-    file.read(reinterpret_cast<char*>(&gpu_temp_point_2), sizeof(gpu_temp_point_2));
-    file.read(reinterpret_cast<char*>(&gpu_temp_point_3), sizeof(gpu_temp_point_3));
-    file.read(reinterpret_cast<char*>(&gpu_temp_point_4), sizeof(gpu_temp_point_4));
-    file.read(reinterpret_cast<char*>(&cpu_fan_point_1), sizeof(cpu_fan_point_1));
-    file.read(reinterpret_cast<char*>(&cpu_fan_point_2), sizeof(cpu_fan_point_2));
-    file.read(reinterpret_cast<char*>(&cpu_fan_point_3), sizeof(cpu_fan_point_3));
-    file.read(reinterpret_cast<char*>(&cpu_fan_point_4), sizeof(cpu_fan_point_4));
-    file.read(reinterpret_cast<char*>(&cpu_fan_point_5), sizeof(cpu_fan_point_5));
-    file.read(reinterpret_cast<char*>(&gpu_fan_point_1), sizeof(gpu_fan_point_1));
-    file.read(reinterpret_cast<char*>(&gpu_fan_point_2), sizeof(gpu_fan_point_2));
-    file.read(reinterpret_cast<char*>(&gpu_fan_point_3), sizeof(gpu_fan_point_3));
-    file.read(reinterpret_cast<char*>(&gpu_fan_point_4), sizeof(gpu_fan_point_4));
-    file.read(reinterpret_cast<char*>(&gpu_fan_point_5), sizeof(gpu_fan_point_5));
-    
-    // Store loaded values
-    sharedData->cpuTemp.store(cpuTemp);
-    sharedData->gpuTemp.store(gpuTemp);
-    sharedData->cpuFanSpeed.store(cpuFanSpeed);
-    sharedData->gpuFanSpeed.store(gpuFanSpeed);
-    sharedData->cpu_hysteresis.store(cpu_hysteresis);
-    sharedData->gpu_hysteresis.store(gpu_hysteresis);
-    sharedData->cpu_temp_point_2.store(cpu_temp_point_2);
-    sharedData->cpu_temp_point_3.store(cpu_temp_point_3);
-    sharedData->cpu_temp_point_4.store(cpu_temp_point_4);
-    sharedData->gpu_temp_point_2.store(gpu_temp_point_2);
-    sharedData->gpu_temp_point_3.store(gpu_temp_point_3);
-    sharedData->gpu_temp_point_4.store(gpu_temp_point_4);
-    sharedData->cpu_fan_point_1.store(cpu_fan_point_1);
-    sharedData->cpu_fan_point_2.store(cpu_fan_point_2);
-    sharedData->cpu_fan_point_3.store(cpu_fan_point_3);
-    sharedData->cpu_fan_point_4.store(cpu_fan_point_4);
-    sharedData->cpu_fan_point_5.store(cpu_fan_point_5);
-    sharedData->gpu_fan_point_1.store(gpu_fan_point_1);
-    sharedData->gpu_fan_point_2.store(gpu_fan_point_2);
-    sharedData->gpu_fan_point_3.store(gpu_fan_point_3);
-    sharedData->gpu_fan_point_4.store(gpu_fan_point_4);
-    sharedData->gpu_fan_point_5.store(gpu_fan_point_5);
-    sharedData->write_sync.store(false);
 }
 
 std::string getAppDataPath() {
@@ -454,6 +246,23 @@ std::string getAppDataPath() {
     return exeDir + "\\fanctrl_settings.dat";
 }
 
+// The EC trace options on the command line: --trace records every EC
+// transaction and control decision, --trace-size MB caps each file and
+// --trace-keep N is how many files besides the first one are kept. False
+// without --trace.
+bool parseTraceOptions(const std::string& commandLine, TraceRecorderParams& params)
+{
+    std::istringstream words(commandLine);
+    std::string word;
+    bool tracing = false;
+    while (words >> word) {
+        if (word == "--trace") tracing = true;
+        else if (word == "--trace-size" && words >> word) params.fileBytes = static_cast<size_t>(std::max(0.0, std::atof(word.c_str())) * (1u << 20));
+        else if (word == "--trace-keep" && words >> word) params.keepFiles = std::max(1, std::atoi(word.c_str()));
+    }
+    return tracing;
+}
+
 BOOL WINAPI ConsoleHandler(DWORD signal) {
     switch (signal) {
     case CTRL_C_EVENT:
@@ -462,20 +271,16 @@ BOOL WINAPI ConsoleHandler(DWORD signal) {
     case CTRL_LOGOFF_EVENT:
     case CTRL_SHUTDOWN_EVENT:
         g_running.store(false);
-        
-        // Save settings before exit - use AppData path
-        if (g_sharedData) {
-            saveSharedDataToFile(g_sharedData, getAppDataPath());
-        }
-        
-        // Cleanup
-        if (g_sharedData) {
-            UnmapViewOfFile(g_sharedData);
+        if (g_events) {
+            g_events->requestShutdown();
         }
-        if (g_hMapFile) {
-            CloseHandle(g_hMapFile);
+
+        // WinMain saves the settings and cleans up. Windows ends the
+        // process when this returns from a close, logoff or shutdown, so
+        // give it the time it gets before then.
+        if (g_hStopped) {
+            WaitForSingleObject(g_hStopped, 4000);
         }
-        
         return TRUE;
     default:
         return FALSE;
@@ -491,25 +296,58 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
     // freopen_s((FILE**)stdin, "CONIN$", "r", stdin);
     
     // Set console control handler - still needed for Windows signals
+    g_hStopped = CreateEventA(NULL, TRUE, FALSE, NULL);
     if (!SetConsoleCtrlHandler(ConsoleHandler, TRUE)) {
         // Use MessageBox instead of std::cerr
         MessageBoxA(NULL, "Could not set control handler", "Error", MB_OK | MB_ICONERROR);
         return 1;
     }
 
+    // The EC's registers, resolved once and before anything is published:
+    // a model in the built-in table, or one described by
+    // fanctrl_registers.txt next to the settings file. resolveRegisters
+    // reports an unsupported model or a broken file.
+    std::string settingsPath = getAppDataPath();
+    std::string settingsDir = settingsPath.substr(0, settingsPath.find_last_of('\\') + 1);
+    EcRegisterFile registerFile;
+    const EcRegisterMap* registers = resolveRegisters(settingsDir + "fanctrl_registers.txt", registerFile);
+    if (!registers) return 1;
+
     // Load inpoutx64.dll
-    HINSTANCE hDll = LoadLibraryA("inpoutx64.dll");
-    if (!hDll) {
-        MessageBoxA(NULL, "Failed to load inpoutx64.dll", "Error", MB_OK | MB_ICONERROR);
-        return 1;
+    std::unique_ptr<InpOutEcTransport> ec;
+    try {
+        ec.reset(new InpOutEcTransport());
     }
-    Inp32 = (InpFunc)GetProcAddress(hDll, "Inp32");
-    Out32 = (OutFunc)GetProcAddress(hDll, "Out32");
-    if (!Inp32 || !Out32) {
-        MessageBoxA(NULL, "Failed to get Inp32 or Out32 function", "Error", MB_OK | MB_ICONERROR);
+    catch (const std::exception& e) {
+        MessageBoxA(NULL, e.what(), "Error", MB_OK | MB_ICONERROR);
         return 1;
     }
 
+    // Recorded when the backend runs with --trace, from where the bus is owned
+    TraceRecorderParams traceParams;
+    bool tracing = parseTraceOptions(lpCmdLine ? lpCmdLine : "", traceParams);
+    RecordingEcTransport busTrace(*ec);
+
+    // One worker thread owns the EC port and serves fan writes ahead of
+    // temperature reads, and both ahead of the shadow's read-backs
+    EcBusArbiter arbiter(busTrace);
+
+    // Failed EC transactions are retried with backoff; when they keep
+    // failing the control loop hands the fans to the EC until it recovers.
+    // Fan writes never retry past the end of their tick's budget.
+    EcWatchdog watchdog;
+    RetryingEcTransport acquisitionBus(arbiter.client(EcPriority::Acquisition), watchdog);
+    RetryingEcTransport actuationBus(arbiter.client(EcPriority::Actuation), watchdog, true);
+    RetryingEcTransport backgroundBus(arbiter.client(EcPriority::Background), watchdog);
+
+    // Skip mode/speed writes the EC already has
+    ShadowedEcTransport shadow(actuationBus);
+    shadow.verifyThrough(backgroundBus);
+
+    // What the control loop reads and writes, and what it decides, while tracing
+    TickTrace tickTrace(shadow);
+    tickTrace.setWatchdog(&watchdog);
+
     // Create shared memory for IPC
     g_hMapFile = CreateFileMapping(
         INVALID_HANDLE_VALUE,    // use paging file
@@ -537,106 +375,323 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
         return 1;
     }
 
-    // Initialize shared data
-    g_sharedData->cpuTemp = 0.0;
-    g_sharedData->gpuTemp = 0.0;
-    g_sharedData->cpuFanSpeed = 0;
-    g_sharedData->gpuFanSpeed = 0;
-
-    // Initialize shared data from file - use AppData path
-    std::string settingsPath = getAppDataPath();
-    loadSharedDataFromFile(g_sharedData, settingsPath);
+    // Serializes config writers (this process and every client)
+    g_hConfigLock = CreateMutexW(NULL, FALSE, L"FanControlConfigLock");
+    if (g_hConfigLock == NULL) {
+        MessageBoxA(NULL, "Could not create config lock", "Error", MB_OK | MB_ICONERROR);
+        UnmapViewOfFile(g_sharedData);
+        CloseHandle(g_hMapFile);
+        return 1;
+    }
 
-    // Print system information
-    if (!checkSystem()) return -1;
+    // Hide the layout from clients until both blocks are initialized
+    g_sharedData->header.magic = 0;
+
+    // Initialize shared data from file - use AppData path. Changes are
+    // written once they stop coming, always to a new file renamed over
+    // the old one.
+    SettingsStore settings(settingsPath);
+    loadSettings(g_sharedData, settings);
+    g_sharedData->history.init();
+    g_sharedData->commands.init();
+    g_sharedData->stats.init();
+
+    // Every EC transaction, bus wait and skipped write is counted where clients can read it
+    ec->setStats(&g_sharedData->stats);
+    arbiter.setStats(&g_sharedData->stats);
+    shadow.setStats(&g_sharedData->stats);
+
+    g_sharedData->header.layoutVersion = SHARED_LAYOUT_VERSION;
+    g_sharedData->header.size = sizeof(SharedData);
+    g_sharedData->header.magic = SHARED_MAGIC;
+
+    FanConfig config;
+    uint32_t configVersion = g_sharedData->config.load(config);
+
+    // Every profile is compiled ahead of time; the control loop switches
+    // between them by picking up a pointer at the start of a tick. A
+    // settings file the loop cannot run with starts from the defaults.
+    ProfileSet profiles;
+    profiles.refresh(settings);
+    if (!profiles.publish(config, settings.directory().active)) {
+        config = defaultFanConfig();
+        publishConfig(g_sharedData, config);
+        configVersion = g_sharedData->config.version();
+        profiles.publish(config, PROFILE_DEFAULTS);
+    }
 
-    FanController cpuPID({ 0, g_sharedData->cpu_temp_point_2.load(), g_sharedData->cpu_temp_point_3.load(), g_sharedData->cpu_temp_point_4.load(), 100 }, 
-                        { g_sharedData->cpu_fan_point_1.load(), g_sharedData->cpu_fan_point_2.load(), g_sharedData->cpu_fan_point_3.load(), g_sharedData->cpu_fan_point_4.load(), g_sharedData->cpu_fan_point_5.load() },
-                        g_sharedData->cpu_hysteresis.load());
-    FanController gpuPID({ 0, g_sharedData->gpu_temp_point_2.load(), g_sharedData->gpu_temp_point_3.load(), g_sharedData->gpu_temp_point_4.load(), 100 }, 
-                        { g_sharedData->gpu_fan_point_1.load(), g_sharedData->gpu_fan_point_2.load(), g_sharedData->gpu_fan_point_3.load(), g_sharedData->gpu_fan_point_4.load(), g_sharedData->gpu_fan_point_5.load() },
-                        g_sharedData->gpu_hysteresis.load());
-    
-    cpuPID.syncToSharedData(g_sharedData, true);
-    gpuPID.syncToSharedData(g_sharedData, false);
+    ControlLoop loop(tickTrace, config);
+    loop.setRegisters(*registers);
+    loop.setStats(&g_sharedData->stats);
+    loop.setWatchdog(&watchdog);
+
+    // CPU utilization drives the PID feedforward
+    CpuLoadMonitor cpuLoad;
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    // The trace goes next to the settings file, a new set of files for
+    // every run. Without it the backend runs as it would untraced.
+    std::unique_ptr<TraceRecorder> recorder;
+    if (tracing) {
+        traceParams.prefix = settingsDir + "fanctrl_trace";
+        TraceStart traceStart = { config, -1, loop.ecRegisters(), SensorPipeline::Params() };
+        try {
+            recorder.reset(new TraceRecorder(traceParams, traceStart, startTime));
+            busTrace.setRecorder(recorder.get());
+            tickTrace.setRecorder(recorder.get());
+        }
+        catch (const std::exception& e) {
+            MessageBoxA(NULL, e.what(), "EC trace", MB_OK | MB_ICONWARNING);
+        }
+    }
 
-    LowPassFilter cpuFilter(0.1);
-    LowPassFilter gpuFilter(0.1);
+    // Picks the control period from how fast the temperatures are moving
+    SampleScheduler scheduler(config);
+    int periodMs = scheduler.period();
 
-    int cpuFanLast = -1, gpuFanLast = -1;
+    // The acquisition stage wakes once per control period, or immediately on
+    // new settings or shutdown
+    std::unique_ptr<ControlEvents> events;
+    try {
+        events.reset(new ControlEvents(std::chrono::milliseconds(periodMs)));
+    }
+    catch (const std::exception& e) {
+        MessageBoxA(NULL, e.what(), "Error", MB_OK | MB_ICONERROR);
+        return 1;
+    }
+    g_events = events.get();
 
     // Remove this console message
     // std::cout << "Fan control started. Press Ctrl+C to stop." << std::endl;
 
-    while (g_running.load()) 
+    // Temperatures are read on their own thread; this thread is the control
+    // stage and runs a tick for every frame the acquisition stage posts
+    Mailbox<SensorFrame> frames;
+    std::thread acquisition(acquisitionStage, std::ref(acquisitionBus), std::cref(loop.ecRegisters()), std::ref(*events), std::ref(frames), &g_sharedData->stats);
+
+    // New settings are validated and compiled on their own thread, which
+    // also marks them for saving once they run
+    Mailbox<ProfileRequest> requests;
+    std::thread compiler([&] {
+        profileStage(profiles, settings, requests, *events, [&](const FanConfig& published) {
+            settings.update(published, std::chrono::steady_clock::now());
+        });
+    });
+
+    // A burst of changes, such as a curve point being dragged, is written
+    // once it is over, on a thread of its own so the disk never holds up
+    // a tick. The control stage publishes the write counts it reports.
+    Mailbox<ProfileDirectory> savedProfiles;
+    std::thread saver([&] {
+        while (settings.flushWhenDue()) savedProfiles.post(profileDirectory(settings, profiles));
+    });
+
+    // Rules from fanctrl_rules.txt next to the settings file switch
+    // profiles through a command lane of the backend's own
+    std::string rulesPath = settingsDir + "fanctrl_rules.txt";
+    WaitForSingleObject(g_hConfigLock, INFINITE);
+    int rulesLane = g_sharedData->commands.claim(GetCurrentProcessId(), [](uint32_t) { return true; });
+    ReleaseMutex(g_hConfigLock);
+    std::thread rules;
+    if (rulesLane >= 0) rules = std::thread(rulesStage, rulesPath, rulesLane, std::ref(*events));
+
+    SensorFrame frame;
+    const CompiledProfile* running = nullptr;
+    ProfileDirectory shownProfiles = g_sharedData->profiles.load();
+    double actuationLatencyUs = 0;
+    double maxLoopJitterUs = 0;
+    uint32_t fallbacks = 0;
+    bool inFallback = false;
+    while (g_running.load() && frames.take(frame))
     {
-        #define retry_count 3
+        LatencyClock::time_point tickBegin = LatencyClock::now();
 
-        double cpuTemp = cpuFilter.filter(get_cpu_temp());
-        for (int i = 0; (cpuTemp == 0 || cpuTemp > 110) && i < retry_count + 1; i++)
+        // A client published new settings; they run once compiled
+        if (g_sharedData->config.version() != configVersion)
         {
-            if (i != retry_count) cpuTemp = cpuFilter.filter(get_cpu_temp());
-            else cpuTemp = 100;
+            configVersion = g_sharedData->config.load(config);
+            requests.post(ProfileRequest{ config, -1 });
         }
 
-        double gpuTemp = gpuFilter.filter(get_gpu_temp());
-        for (int i = 0; (gpuTemp == 0 || gpuTemp > 110) && i < retry_count + 1; i++)
+        // Commands from clients. They apply to the newest config under the
+        // config lock, so a whole-config write from a client that does not
+        // use the queue is never lost in between, and each accepted change
+        // is published before its completion reports the new version.
+        if (g_sharedData->commands.pending())
         {
-            if (i != retry_count) gpuTemp = gpuFilter.filter(get_gpu_temp());
-            else gpuTemp = 100;
+            WaitForSingleObject(g_hConfigLock, INFINITE);
+            bool changed = g_sharedData->config.load(config) != configVersion;
+            bool profilesChanged = false;
+            int32_t switchedTo = -1;
+            g_sharedData->commands.drain([&](const FanCommand& command) {
+                if (command.type == COMMAND_FORCE_SPEED) {
+                    if (!loop.forceFan(command.channel, command.args[0])) return COMMAND_BAD_VALUE;
+                    tickTrace.recordForce(command.channel, command.args[0]);
+                    return COMMAND_ACCEPTED;
+                }
+                if (command.type == COMMAND_RESET_STATS) {
+                    g_sharedData->stats.reset();
+                    return COMMAND_ACCEPTED;
+                }
+                // Saved profiles need the settings file; other changes go to applyConfigCommand
+                int32_t status = settings.applyProfileCommand(config, command, std::chrono::steady_clock::now());
+                if (status != COMMAND_ACCEPTED) return status;
+                if (command.type == COMMAND_SWITCH_PROFILE || command.type == COMMAND_SAVE_PROFILE || command.type == COMMAND_DELETE_PROFILE) {
+                    profilesChanged = true;
+                    if (command.type != COMMAND_SWITCH_PROFILE) return status;
+                }
+                // A switch with nothing edited after it runs the precompiled profile
+                switchedTo = command.type == COMMAND_SWITCH_PROFILE ? command.args[0] : -1;
+                g_sharedData->config.store(config);
+                changed = true;
+                return status;
+            }, [&] { return g_sharedData->config.version(); });
+            configVersion = g_sharedData->config.version();
+            ReleaseMutex(g_hConfigLock);
+
+            if (changed) requests.post(ProfileRequest{ config, switchedTo });
+            if (profilesChanged) {
+                shownProfiles = profileDirectory(settings, profiles);
+                g_sharedData->profiles.store(shownProfiles);
+            }
+        }
+
+        // Compiled settings are switched to with a pointer swap; nothing
+        // here allocates or waits for the compiler
+        const CompiledProfile* profile = profiles.acquire();
+        if (profile != running) {
+            loop.applyProfile(*profile);
+            scheduler.configure(profile->config);
+            tickTrace.recordConfig(profile->config, profile->number);
+            running = profile;
         }
 
-        int cpuFan = cpuPID.update(cpuTemp);
-        int gpuFan = gpuPID.update(gpuTemp);
-
-        // else if (gpuFan > cpuFan + 10) cpuFan = gpuFan - 10;
-        // if (cpuFan > gpuFan + 10) gpuFan = cpuFan - 10;
-        // else if (gpuFan > cpuFan + 10) cpuFan = gpuFan - 10;
-
-		if (cpuTemp > 80 && gpuTemp < 75 ) gpuFan = cpuFanLast - 10;
-		if (gpuTemp > 75 && cpuTemp < 80 ) cpuFan = gpuFanLast - 10;
-		//if (cpuTemp > 80 && gpuFanLast >= cpuFanLast) gpuFan = gpuFanLast - 10;
-		//if (gpuTemp > 75 && cpuFanLast < gpuFanLast) cpuFan = cpuFanLast + 10;
-		//if (gpuTemp > 75 && cpuFanLast >= gpuFanLast) cpuFan = cpuFanLast - 10;
-		
-        if (cpuFan != cpuFanLast) {
-            set_cpu_fan_manual(cpuFan);
-            cpuFanLast = cpuFan;
+        if (savedProfiles.tryTake(shownProfiles)) g_sharedData->profiles.store(shownProfiles);
+        if (shownProfiles.automatic != g_automaticProfile.load() || shownProfiles.rejectedConfigs != profiles.rejected()) {
+            shownProfiles = profileDirectory(settings, profiles);
+            g_sharedData->profiles.store(shownProfiles);
         }
-        if (gpuFan != gpuFanLast) {
-            set_gpu_fan_manual(gpuFan);
-            gpuFanLast = gpuFan;
+
+        double load = cpuLoad.sample();
+        bool onBattery = onBatteryPower();
+        loop.setOnBattery(onBattery);
+        std::chrono::steady_clock::time_point tickStart = std::chrono::steady_clock::now();
+        double now = std::chrono::duration<double>(tickStart - startTime).count();
+        tickTrace.beginTick(now, load, onBattery, watchdog.tripped());
+        tickTrace.recordFrame(frame.snapshot, loop.ecRegisters(), loop.channels());
+        ControlTickResult tick = loop.tick(now, load, frame.snapshot);
+
+        // After a failed transaction or a fallback the shadow no longer
+        // knows what the EC holds, so every register is written again
+        if (tick.ecFailed || tick.fallback != inFallback) shadow.invalidate();
+        if (tick.fallback && !inFallback) ++fallbacks;
+        inFallback = tick.fallback;
+
+        // Read-backs go after this tick's writes; while the EC has the fans
+        // there is nothing to verify and the bus stays quiet
+        if (!tick.idle && !tick.fallback) {
+            try {
+                shadow.verify_if_due();
+            }
+            catch (const std::runtime_error&) {
+                shadow.invalidate();
+            }
         }
-		
-        g_sharedData->cpuTemp.store(cpuTemp);
-        g_sharedData->gpuTemp.store(gpuTemp);
-        g_sharedData->cpuFanSpeed.store(cpuFan);
-        g_sharedData->gpuFanSpeed.store(gpuFan);
-
-        // Use shorter sleep and check for exit condition
-        for (int i = 0; i < 10 && g_running.load(); i++) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        double sampleAgeUs = std::chrono::duration<double, std::micro>(tickStart - tick.sampledAt).count();
+        double actuationUs = 0;
+        if (tick.actuatedAt.time_since_epoch().count() != 0) {
+            actuationUs = std::chrono::duration<double, std::micro>(tick.actuatedAt - tick.sampledAt).count();
+            actuationLatencyUs = actuationUs;
         }
 
-        if (g_sharedData->write_sync.load())
-        {
-            cpuPID.syncFromSharedData(g_sharedData, true);
-            gpuPID.syncFromSharedData(g_sharedData, false);
-            g_sharedData->write_sync.store(false);
-            
-            // Save settings when they change - use AppData path
-            saveSharedDataToFile(g_sharedData, settingsPath);
+        // A failing EC is probed at the idle period
+        int nextPeriodMs = scheduler.next(now, tick.fast, tick.channelCount, load, tick.idle || tick.fallback);
+        tickTrace.endTick(tick, watchdog.tripped(), nextPeriodMs);
+        if (nextPeriodMs != periodMs) {
+            periodMs = nextPeriodMs;
+            events->setPeriod(std::chrono::milliseconds(periodMs));
         }
+
+        Telemetry telemetry = {};
+        telemetry.channelCount = tick.channelCount;
+        for (int c = 0; c < tick.channelCount; ++c) {
+            const SensorSample& sensor = tick.sensor[c];
+            telemetry.temp[c] = tick.temp[c];
+            telemetry.fanSpeed[c] = tick.fan[c];
+            telemetry.rawTemp[c] = static_cast<float>(sensor.raw);
+            telemetry.medianTemp[c] = static_cast<float>(sensor.median);
+            telemetry.emaTemp[c] = static_cast<float>(sensor.ema);
+            telemetry.kalmanTemp[c] = static_cast<float>(sensor.kalman);
+            telemetry.sensorRejects[c] = static_cast<uint32_t>(loop.sensor(c).rejects());
+            if (sensor.faulted) telemetry.sensorFaulted |= 1u << c;
+        }
+        telemetry.fanForced = tick.forced;
+        telemetry.ecWritesIssued = shadow.issued();
+        telemetry.ecWritesElided = shadow.elided();
+        telemetry.ecShadowMismatches = shadow.mismatches();
+        telemetry.loopWakeups = events->wakeups();
+        telemetry.cpuLoad = load;
+        telemetry.controlPeriodMs = periodMs;
+        telemetry.scheduleReasons = scheduler.reasons();
+        telemetry.sampleAgeUs = static_cast<float>(sampleAgeUs);
+        telemetry.actuationLatencyUs = static_cast<float>(actuationLatencyUs);
+        telemetry.idleActive = tick.idle ? 1 : 0;
+        telemetry.idleEntries = static_cast<uint32_t>(loop.idleState().entries());
+        telemetry.idleSeconds = loop.idleState().seconds();
+        maxLoopJitterUs = std::max(maxLoopJitterUs, frame.latenessUs);
+        telemetry.loopJitterUs = static_cast<float>(frame.latenessUs);
+        telemetry.maxLoopJitterUs = static_cast<float>(maxLoopJitterUs);
+        telemetry.deadlineMisses = static_cast<uint32_t>(watchdog.deadlineMisses());
+        telemetry.ecFailures = static_cast<uint32_t>(watchdog.failures());
+        telemetry.ecFallback = tick.fallback ? 1 : 0;
+        telemetry.ecFallbacks = fallbacks;
+        g_sharedData->telemetry.store(telemetry);
+
+        TelemetryRecord record = {};
+        record.timestampUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        for (int c = 0; c < tick.channelCount; ++c) {
+            record.rawTemp[c] = static_cast<float>(tick.raw[c]);
+            record.filteredTemp[c] = static_cast<float>(tick.temp[c]);
+            record.fanCommand[c] = tick.fan[c];
+            if (!tick.sensor[c].accepted) record.sensorRejected |= 1u << c;
+            if (tick.sensor[c].faulted) record.sensorFaulted |= 1u << c;
+        }
+        record.ecReadUs = static_cast<float>(frame.readUs);
+        record.ecWriteUs = static_cast<float>(tick.ecWriteUs);
+        record.periodMs = periodMs;
+        record.scheduleReasons = scheduler.reasons();
+        record.sampleAgeUs = static_cast<float>(sampleAgeUs);
+        record.actuationUs = static_cast<float>(actuationUs);
+        g_sharedData->history.push(record);
+        g_sharedData->stats.phases[PHASE_TICK].record(LatencyClock::now() - tickBegin);
+    }
+    g_running.store(false);
+    events->requestShutdown();
+    acquisition.join();
+    if (recorder) {
+        busTrace.setRecorder(nullptr);
+        recorder->close();
     }
+    requests.close();
+    profiles.close();
+    compiler.join();
+    settings.stopSaving();
+    saver.join();
+    if (rules.joinable()) rules.join();
     
     // Remove these console messages
     // std::cout << "Cleaning up..." << std::endl;
     
     // Save before exit - use AppData path
-    saveSharedDataToFile(g_sharedData, settingsPath);
+    settings.flush();
+    g_events = nullptr;
+    SetEvent(g_hStopped);
     
     UnmapViewOfFile(g_sharedData);
     CloseHandle(g_hMapFile);
+    CloseHandle(g_hConfigLock);
     
     // Remove console cleanup
     // FreeConsole();
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+#include "CurveTable.h"
+#include "SharedData.h"
+
+// Fan curve of one channel, evaluated through a precompiled CurveTable
+// the controller does not own (see CompiledProfile). A falling
+// temperature only moves the fan once it has dropped by more than the
+// hysteresis.
+class FanController
+{
+public:
+    FanController() : table(nullptr), hysteresis(0), fanSpeed(0), lastTemp(0), changed(true) {}
+
+    int update(double temp) 
+    {
+        if (changed || (lastTemp - temp > hysteresis) || (temp > lastTemp)) {
+            fanSpeed = static_cast<int>(table->at(temp));
+            lastTemp = temp;
+            changed = false;
+        }
+        return fanSpeed;
+    }
+
+    // Switches to another curve, which must outlive its use here. Nothing
+    // is copied or rebuilt; the next reading is looked up on the new
+    // curve whatever the hysteresis.
+    void use(const CurveTable& curve, int hysteresisC)
+    {
+        table = &curve;
+        hysteresis = hysteresisC;
+        changed = true;
+    }
+
+    const CurveTable& curve() const { return *table; }
+
+private:
+    const CurveTable* table;
+    int hysteresis;
+    int fanSpeed;
+    double lastTemp;
+    bool changed;   // a new curve, not yet evaluated
+};
+
+// Closed-loop alternative to the curve: tracks a target temperature with
+// PID, plus an optional feedforward term from CPU utilization so the fan
+// starts ramping when load appears instead of after the heat reaches the
+// sensor. The derivative acts on the measurement, so a target change does
+// not kick the fan. The integrator only runs while the output is inside
+// its limits (or the error drives it back inside), so long stretches at
+// full or minimum speed do not wind it up.
+class PidController
+{
+public:
+    PidController()
+        : target(75), kp(0), ki(0), kd(0), feedforward(0), minOutput(0), maxOutput(100),
+          integral(0), derivative(0), lastTemp(0), initialized(false)
+    {
+    }
+
+    void configure(double targetTemp, double kpGain, double kiGain, double kdGain, double feedforwardGain,
+                   double minFan, double maxFan)
+    {
+        target = targetTemp;
+        kp = kpGain;
+        ki = kiGain;
+        kd = kdGain;
+        feedforward = feedforwardGain;
+        minOutput = std::min(minFan, maxFan);
+        maxOutput = std::max(minFan, maxFan);
+    }
+
+    // Bumpless transfer: preload the integrator so the next output equals
+    // the speed the fan is already running at
+    void reset(double currentOutput, double temp, double load)
+    {
+        integral = currentOutput - kp * (temp - target) - feedforward * load;
+        derivative = 0;
+        lastTemp = temp;
+        initialized = true;
+    }
+
+    int update(double temp, double load, double dt)
+    {
+        if (!initialized) reset(minOutput, temp, load);
+        if (dt <= 0) dt = 1e-3;
+
+        double error = temp - target;
+        derivative = 0.7 * derivative + 0.3 * (temp - lastTemp) / dt;
+        lastTemp = temp;
+
+        double proportional = kp * error;
+        double ahead = kd * derivative + feedforward * load;
+        double step = ki * error * dt;
+
+        double unclamped = proportional + integral + step + ahead;
+        bool saturatedHigh = unclamped > maxOutput && step > 0;
+        bool saturatedLow = unclamped < minOutput && step < 0;
+        if (!saturatedHigh && !saturatedLow) {
+            integral += step;
+        }
+        integral = std::max(-maxOutput, std::min(2 * maxOutput, integral));
+
+        double output = proportional + integral + ahead;
+        return static_cast<int>(std::lround(std::max(minOutput, std::min(maxOutput, output))));
+    }
+
+private:
+    double target;
+    double kp;
+    double ki;
+    double kd;
+    double feedforward;
+    double minOutput;
+    double maxOutput;
+
+    double integral;
+    double derivative;
+    double lastTemp;
+    bool initialized;
+};
+
+// The settings the backend starts with when there is no settings file:
+// the CPU and GPU channels on five-point curves, PID gains ready for when
+// a channel is switched to FAN_MODE_PID, idle hand-back on battery power
+inline FanConfig defaultFanConfig()
+{
+    const int32_t cpuTemps[] = { 0, 55, 70, 80, 100 };
+    const int32_t gpuTemps[] = { 0, 50, 65, 75, 100 };
+    const int32_t fans[] = { 0, 5, 8, 30, 100 };
+
+    FanConfig config = {};
+    config.channel_count = 2;
+    for (int c = 0; c < MAX_CHANNELS; ++c) {
+        bool gpu = c == CHANNEL_GPU;
+        const int32_t* temps = gpu ? gpuTemps : cpuTemps;
+        config.point_count[c] = 5;
+        config.hysteresis[c] = 3;
+        config.mode[c] = FAN_MODE_CURVE;
+        config.interpolation[c] = CURVE_LINEAR;
+        config.target_temp[c] = gpu ? 70 : 75;
+        config.kp[c] = 4.0f;
+        config.ki[c] = 0.05f;
+        config.kd[c] = 10.0f;
+        config.feedforward[c] = c == CHANNEL_CPU ? 0.3f : 0.0f;
+        std::copy(temps, temps + 5, config.curve_temp[c]);
+        std::copy(fans, fans + 5, config.curve_fan[c]);
+
+        // Rising fans follow their zones at once; falling ones ramp down
+        config.coupling[c][c] = 1.0f;
+        config.slew_up[c] = 0.0f;
+        config.slew_down[c] = 5.0f;
+        config.min_step[c] = 4;
+    }
+    // Each fan follows its own zone only. The CPU and GPU share heat
+    // pipes, but pulling the other fan along costs fan effort without
+    // lowering the peaks (FanSim arbitration --coupling w).
+    config.coupling_mode = COUPLING_MAX;
+    config.min_period_ms = 250;
+    config.max_period_ms = 3000;
+
+    config.idle_mode = IDLE_ON_BATTERY;
+    config.idle_margin = 5;
+    config.idle_max_fan = 5;
+    config.idle_dwell_s = 30;
+    config.idle_period_ms = 5000;
+    return config;
+}
+
+inline bool isBuiltinProfile(int32_t number)
+{
+    return number == PROFILE_DEFAULTS || (number > PROFILE_SLOTS && number < PROFILE_COUNT);
+}
+
+// Name a built-in profile is listed under, nullptr for other numbers
+inline const char* builtinProfileName(int32_t number)
+{
+    switch (number) {
+    case PROFILE_DEFAULTS: return "Balanced";
+    case PROFILE_QUIET: return "Quiet";
+    case PROFILE_PERFORMANCE: return "Performance";
+    case PROFILE_BATTERY: return "Battery";
+    }
+    return nullptr;
+}
+
+// The settings of a built-in profile, all variations on the defaults
+// (which are the balanced profile): quiet lets the machine run warmer and
+// moves the fans in larger, slower steps, performance cools early and
+// never hands the fans to the EC, battery is quiet, hands idle fans back
+// whatever the power source and samples less often. False for a number
+// that is not built in; config is then unchanged.
+inline bool builtinFanConfig(int32_t number, FanConfig& config)
+{
+    if (!isBuiltinProfile(number)) return false;
+
+    FanConfig result = defaultFanConfig();
+    if (number == PROFILE_QUIET || number == PROFILE_BATTERY) {
+        const int32_t cpuTemps[] = { 0, 60, 75, 85, 100 };
+        const int32_t gpuTemps[] = { 0, 55, 70, 80, 100 };
+        const int32_t fans[] = { 0, 5, 8, 25, 100 };
+        for (int c = 0; c < MAX_CHANNELS; ++c) {
+            const int32_t* temps = c == CHANNEL_GPU ? gpuTemps : cpuTemps;
+            std::copy(temps, temps + 5, result.curve_temp[c]);
+            std::copy(fans, fans + 5, result.curve_fan[c]);
+            result.hysteresis[c] = 4;
+            result.target_temp[c] += 5;
+            result.slew_up[c] = 10.0f;
+            result.slew_down[c] = 3.0f;
+            result.min_step[c] = 6;
+        }
+    }
+    if (number == PROFILE_PERFORMANCE) {
+        const int32_t cpuTemps[] = { 0, 45, 60, 72, 90 };
+        const int32_t gpuTemps[] = { 0, 40, 55, 68, 90 };
+        const int32_t fans[] = { 0, 15, 30, 60, 100 };
+        for (int c = 0; c < MAX_CHANNELS; ++c) {
+            const int32_t* temps = c == CHANNEL_GPU ? gpuTemps : cpuTemps;
+            std::copy(temps, temps + 5, result.curve_temp[c]);
+            std::copy(fans, fans + 5, result.curve_fan[c]);
+            result.hysteresis[c] = 2;
+            result.target_temp[c] -= 5;
+            result.slew_down[c] = 10.0f;
+            result.min_step[c] = 2;
+        }
+        result.idle_mode = IDLE_OFF;
+    }
+    if (number == PROFILE_BATTERY) {
+        result.idle_mode = IDLE_ALWAYS;
+        result.idle_dwell_s = 15;
+        result.idle_max_fan = 8;
+        result.max_period_ms = 5000;
+    }
+    config = result;
+    return true;
+}
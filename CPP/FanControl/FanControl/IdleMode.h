@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+
+#include "SharedData.h"
+
+// Decides when the fans are idle enough to hand back to the EC's automatic
+// control. The caller reports, once per tick, whether every channel is
+// ready to idle (well below its guard temperature, fan at most
+// idle_max_fan) and whether any channel has reached its guard. Idle starts
+// after the channels have been ready for idle_dwell_s without a break and
+// ends on the first tick a guard is reached, so the margin between the two
+// temperatures and the dwell keep it from flapping.
+class IdleGovernor
+{
+public:
+    IdleGovernor()
+        : mode(IDLE_OFF), dwell(30), onBattery(false), idle(false), readySince(-1),
+          enteredAt(0), lastNow(0), entryCount(0), idleTotal(0)
+    {
+    }
+
+    void configure(const FanConfig& config)
+    {
+        mode = config.idle_mode;
+        dwell = std::max(0, config.idle_dwell_s);
+    }
+
+    // The backend reports the power source; IDLE_ON_BATTERY only idles on battery
+    void setOnBattery(bool battery) { onBattery = battery; }
+
+    bool allowed() const
+    {
+        return mode == IDLE_ALWAYS || (mode == IDLE_ON_BATTERY && onBattery);
+    }
+
+    // Returns whether the fans belong to the EC after this tick. now is in
+    // seconds, on the same clock as ControlLoop::tick.
+    bool update(double now, bool ready, bool guardReached)
+    {
+        lastNow = now;
+        if (idle) {
+            if (guardReached || !allowed()) {
+                idle = false;
+                idleTotal += now - enteredAt;
+                readySince = -1;
+            }
+            return idle;
+        }
+
+        if (!ready || !allowed()) {
+            readySince = -1;
+            return false;
+        }
+        if (readySince < 0) readySince = now;
+        if (now - readySince >= dwell) {
+            idle = true;
+            enteredAt = now;
+            ++entryCount;
+        }
+        return idle;
+    }
+
+    bool active() const { return idle; }
+    unsigned long long entries() const { return entryCount; }
+
+    // Total time idle, including the current idle period up to the last update
+    double seconds() const { return idleTotal + (idle ? lastNow - enteredAt : 0.0); }
+
+private:
+    int32_t mode;
+    int dwell;
+    bool onBattery;
+    bool idle;
+    double readySince;
+    double enteredAt;
+    double lastNow;
+    unsigned long long entryCount;
+    double idleTotal;
+};
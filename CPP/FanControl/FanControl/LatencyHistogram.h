@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// HotPathStats::phases
+const int PHASE_EC_READ = 0;        // one EC read transaction
+const int PHASE_EC_WRITE = 1;       // one EC write transaction
+const int PHASE_EC_WAIT = 2;        // one wait for the EC's IBF/OBF handshake bit
+const int PHASE_BUS_QUEUE = 3;      // an EC request waiting for the bus arbiter
+const int PHASE_ACQUIRE = 4;        // the acquisition stage reading every temperature
+const int PHASE_FILTER = 5;         // one channel's sensor pipeline
+const int PHASE_CONTROL = 6;        // one channel's curve or PID evaluation
+const int PHASE_TICK = 7;           // a whole control tick, from its frame to the published record
+const int PHASE_COUNT = 8;
+
+// Four buckets per power of two of nanoseconds, so a bucket is at most a
+// quarter of its lower bound wide. Buckets 0-3 hold 0-3 ns; the last one
+// also takes everything from 2^32 ns (4.3 s) up.
+const int LATENCY_BUCKETS = 128;
+
+typedef std::chrono::steady_clock LatencyClock;
+
+inline int latencyBucket(uint64_t ns)
+{
+    if (ns < 4) return static_cast<int>(ns);
+    int msb = 0;
+    uint64_t v = ns;
+    if (v >> 32) { v >>= 32; msb += 32; }
+    if (v >> 16) { v >>= 16; msb += 16; }
+    if (v >> 8) { v >>= 8; msb += 8; }
+    if (v >> 4) { v >>= 4; msb += 4; }
+    if (v >> 2) { v >>= 2; msb += 2; }
+    if (v >> 1) msb += 1;
+    if (msb > 32) return LATENCY_BUCKETS - 1;
+    return (msb - 1) * 4 + static_cast<int>((ns >> (msb - 2)) & 3);
+}
+
+// Smallest value in a bucket; the bucket ends where the next one starts
+inline uint64_t latencyBucketStart(int bucket)
+{
+    if (bucket < 4) return static_cast<uint64_t>(bucket);
+    int msb = bucket / 4 + 1;
+    return static_cast<uint64_t>(4 + bucket % 4) << (msb - 2);
+}
+
+// Log-bucketed histogram of event durations in the shared mapping. Any
+// number of threads may record at once; recording is three relaxed atomic
+// adds and never blocks or allocates. The count is the sum of the buckets,
+// so a reader never sees a count that disagrees with them.
+struct LatencyHistogram
+{
+    std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+    std::atomic<uint64_t> sumNs;
+    std::atomic<uint64_t> maxNs;
+
+    void record(uint64_t ns)
+    {
+        buckets[latencyBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        sumNs.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = maxNs.load(std::memory_order_relaxed);
+        while (ns > max && !maxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+    }
+
+    void record(LatencyClock::duration elapsed)
+    {
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        record(static_cast<uint64_t>(ns > 0 ? ns : 0));
+    }
+
+    // An event recorded while this runs may keep its bucket or its sum
+    void reset()
+    {
+        for (int b = 0; b < LATENCY_BUCKETS; ++b) buckets[b].store(0, std::memory_order_relaxed);
+        sumNs.store(0, std::memory_order_relaxed);
+        maxNs.store(0, std::memory_order_relaxed);
+    }
+};
+
+// Hot path timings and EC error counters, written by the backend and
+// reset by clients with COMMAND_RESET_STATS
+struct HotPathStats
+{
+    std::atomic<uint64_t> ecRetries;        // handshake polls that found the EC still busy
+    std::atomic<uint64_t> ecTimeouts;       // transactions given up at the handshake timeout
+    std::atomic<uint64_t> ecWritesElided;   // fan writes the shadow skipped
+    std::atomic<uint32_t> resets;           // times the statistics were reset
+    uint32_t reserved;
+    LatencyHistogram phases[PHASE_COUNT];
+
+    void init()
+    {
+        reset();
+        resets.store(0, std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        ecRetries.store(0, std::memory_order_relaxed);
+        ecTimeouts.store(0, std::memory_order_relaxed);
+        ecWritesElided.store(0, std::memory_order_relaxed);
+        for (int p = 0; p < PHASE_COUNT; ++p) phases[p].reset();
+        resets.fetch_add(1, std::memory_order_release);
+    }
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "histograms in the shared mapping need lock-free 64-bit atomics");
+
+// Timing helpers for code that may run without statistics: no clock is
+// read when stats is null
+inline LatencyClock::time_point latencyStart(const HotPathStats* stats)
+{
+    return stats ? LatencyClock::now() : LatencyClock::time_point();
+}
+
+inline void latencyEnd(HotPathStats* stats, int phase, LatencyClock::time_point start)
+{
+    if (stats) stats->phases[phase].record(LatencyClock::now() - start);
+}
+
+inline void countEvent(HotPathStats* stats, std::atomic<uint64_t> HotPathStats::* counter)
+{
+    if (stats) (stats->*counter).fetch_add(1, std::memory_order_relaxed);
+}
+
+// What a reader makes of one histogram; percentiles are interpolated
+// within their bucket
+struct LatencySummary
+{
+    uint64_t count;
+    double meanUs;
+    double p50Us;
+    double p90Us;
+    double p99Us;
+    double maxUs;
+};
+
+inline LatencySummary summarizeLatency(const LatencyHistogram& histogram)
+{
+    uint64_t counts[LATENCY_BUCKETS];
+    LatencySummary summary = {};
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+        counts[b] = histogram.buckets[b].load(std::memory_order_relaxed);
+        summary.count += counts[b];
+    }
+    double maxNs = static_cast<double>(histogram.maxNs.load(std::memory_order_relaxed));
+    summary.maxUs = maxNs / 1000;
+    if (summary.count == 0) return summary;
+    summary.meanUs = histogram.sumNs.load(std::memory_order_relaxed) / 1000.0 / summary.count;
+
+    const double quantiles[3] = { 0.5, 0.9, 0.99 };
+    double* results[3] = { &summary.p50Us, &summary.p90Us, &summary.p99Us };
+    for (int q = 0; q < 3; ++q) {
+        double rank = quantiles[q] * summary.count;
+        uint64_t below = 0;
+        int b = 0;
+        while (b < LATENCY_BUCKETS - 1 && below + counts[b] < rank) below += counts[b++];
+        double start = static_cast<double>(latencyBucketStart(b));
+        double end = b < LATENCY_BUCKETS - 1 ? static_cast<double>(latencyBucketStart(b + 1)) : maxNs;
+        double within = counts[b] ? (rank - below) / counts[b] : 0;
+        double ns = start + (end - start) * within;
+        *results[q] = (maxNs > 0 && ns > maxNs ? maxNs : ns) / 1000;
+    }
+    return summary;
+}
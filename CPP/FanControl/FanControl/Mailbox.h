@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Single-producer/single-consumer mailbox that always holds the latest
+// value: a triple buffer. The producer fills a back buffer and swaps it
+// with the middle one in a single atomic exchange; the consumer swaps the
+// middle buffer for its front buffer when the exchange flagged it fresh.
+// Neither side ever waits for the other to finish copying, and a value
+// the consumer did not get to in time is simply replaced by a newer one.
+// The condition variable only parks a consumer that has nothing to read,
+// and a post only takes its mutex while a consumer is parked.
+template <typename T>
+class Mailbox
+{
+public:
+    Mailbox() : middle(1), back(2), front(0), closed(false), waiting(false)
+    {
+    }
+
+    // Producer side
+    void post(const T& value)
+    {
+        buffers[back] = value;
+        // Sequentially consistent, against the flag and check in take()
+        back = middle.exchange(back | FRESH) & INDEX;
+        if (waiting.load()) wake();
+    }
+
+    // Consumer side: the newest value since the last take, if there is one
+    bool tryTake(T& out)
+    {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH)) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        out = buffers[front];
+        return true;
+    }
+
+    // Consumer side: waits for a value; false once the mailbox is closed
+    // and drained
+    bool take(T& out)
+    {
+        for (;;) {
+            if (tryTake(out)) return true;
+            std::unique_lock<std::mutex> lock(mutex);
+            if (closed.load(std::memory_order_acquire)) return false;
+
+            // Flagged before the check below, so a post either sees the
+            // flag and wakes us or was there for the check to see
+            waiting.store(true);
+            ready.wait(lock, [this] {
+                return (middle.load() & FRESH) || closed.load(std::memory_order_acquire);
+            });
+            waiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Wakes the consumer for good; take() returns false once drained
+    void close()
+    {
+        closed.store(true, std::memory_order_release);
+        wake();
+    }
+
+private:
+    static const int INDEX = 3;
+    static const int FRESH = 4;
+
+    void wake()
+    {
+        // Taking the lock orders the notify after a consumer's check
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.notify_one();
+    }
+
+    T buffers[3];
+    std::atomic<int> middle;    // buffer index, plus FRESH while unread
+    int back;                   // producer only
+    int front;                  // consumer only
+    std::atomic<bool> closed;
+    std::atomic<bool> waiting;  // a consumer is parked on ready
+
+    std::mutex mutex;
+    std::condition_variable ready;
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "SharedData.h"
+
+// What the profile selection rules look at, gathered by the backend
+struct RuleInputs
+{
+    bool onBattery;
+    int minuteOfDay;                        // local time, 0 to 1439
+    std::vector<std::string> processes;     // executables running, in lower case
+};
+
+// Automatic profile selection, from a rules file with one rule per line:
+//
+//   battery <profile>                      while on battery power
+//   mains <profile>                        while on mains power
+//   process <executable> <profile>         while the executable runs
+//   time <HH:MM>-<HH:MM> <profile>         between two times of day
+//
+// The first rule that matches selects its profile. A profile is given by
+// number or by name (case does not matter, spaces are allowed); an
+// executable with spaces in its name is quoted. Lines starting with # are
+// comments. A time range ending before it starts runs past midnight.
+class ProfileRules
+{
+public:
+    // Throws std::invalid_argument naming the line of the first error
+    static ProfileRules parse(const std::string& text)
+    {
+        ProfileRules rules;
+        std::istringstream lines(text);
+        std::string line;
+        for (int number = 1; std::getline(lines, line); ++number) {
+            size_t at = 0;
+            std::string kind = word(line, at, number);
+            if (kind.empty() || kind[0] == '#') continue;
+
+            Rule rule = {};
+            if (kind == "battery" || kind == "mains") {
+                rule.kind = kind == "battery" ? Battery : Mains;
+            }
+            else if (kind == "process") {
+                rule.kind = Process;
+                rule.process = lower(word(line, at, number));
+                if (rule.process.empty()) fail(number, "process needs an executable name");
+            }
+            else if (kind == "time") {
+                rule.kind = Time;
+                std::string range = word(line, at, number);
+                size_t dash = range.find('-');
+                if (dash == std::string::npos) fail(number, "time needs a range like 22:00-07:00");
+                rule.from = minutes(range.substr(0, dash), number);
+                rule.to = minutes(range.substr(dash + 1), number);
+            }
+            else {
+                fail(number, "unknown rule '" + kind + "'");
+            }
+
+            rule.profile = trim(line.substr(at));
+            if (rule.profile.empty()) fail(number, "the rule names no profile");
+            rules.rules.push_back(rule);
+        }
+        return rules;
+    }
+
+    bool empty() const { return rules.empty(); }
+
+    // Whether any rule needs RuleInputs::processes, which is the costly input
+    bool needsProcesses() const
+    {
+        for (const Rule& rule : rules) {
+            if (rule.kind == Process) return true;
+        }
+        return false;
+    }
+
+    // The number of the profile the first matching rule names, -1 when
+    // no rule matches. A rule naming a profile profiles does not have is
+    // skipped.
+    int32_t select(const RuleInputs& inputs, const ProfileDirectory& profiles) const
+    {
+        for (const Rule& rule : rules) {
+            if (!matches(rule, inputs)) continue;
+            int32_t number = resolve(rule.profile, profiles);
+            if (number >= 0) return number;
+        }
+        return -1;
+    }
+
+private:
+    enum Kind { Battery, Mains, Process, Time };
+
+    struct Rule
+    {
+        Kind kind;
+        std::string process;    // Process: the executable, in lower case
+        int from;               // Time: minutes after midnight
+        int to;
+        std::string profile;    // name or number
+    };
+
+    static bool matches(const Rule& rule, const RuleInputs& inputs)
+    {
+        switch (rule.kind) {
+        case Battery: return inputs.onBattery;
+        case Mains: return !inputs.onBattery;
+        case Process: return std::find(inputs.processes.begin(), inputs.processes.end(), rule.process) != inputs.processes.end();
+        case Time:
+            if (rule.from <= rule.to) return inputs.minuteOfDay >= rule.from && inputs.minuteOfDay < rule.to;
+            return inputs.minuteOfDay >= rule.from || inputs.minuteOfDay < rule.to;
+        }
+        return false;
+    }
+
+    static int32_t resolve(const std::string& profile, const ProfileDirectory& profiles)
+    {
+        bool digits = std::all_of(profile.begin(), profile.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)) != 0; });
+        for (int32_t p = 0; p < PROFILE_COUNT; ++p) {
+            if (!(profiles.used & (1u << p))) continue;
+            std::string name(profiles.names[p], strnlen(profiles.names[p], PROFILE_NAME_LENGTH));
+            if (digits ? std::to_string(p) == profile : lower(name) == lower(profile)) return p;
+        }
+        return -1;
+    }
+
+    // The next word of line from at, or the quoted text; empty at the end of the line
+    static std::string word(const std::string& line, size_t& at, int number)
+    {
+        while (at < line.size() && std::isspace(static_cast<unsigned char>(line[at]))) ++at;
+        if (at == line.size()) return std::string();
+        if (line[at] == '"') {
+            size_t end = line.find('"', at + 1);
+            if (end == std::string::npos) fail(number, "unterminated quote");
+            std::string quoted = line.substr(at + 1, end - at - 1);
+            at = end + 1;
+            return quoted;
+        }
+        size_t start = at;
+        while (at < line.size() && !std::isspace(static_cast<unsigned char>(line[at]))) ++at;
+        return line.substr(start, at - start);
+    }
+
+    static int minutes(const std::string& text, int number)
+    {
+        int hours = 0, mins = 0;
+        char colon = 0, extra = 0;
+        if (std::sscanf(text.c_str(), "%d%c%d%c", &hours, &colon, &mins, &extra) != 3 || colon != ':' ||
+            hours < 0 || hours > 24 || mins < 0 || mins > 59 || hours * 60 + mins > 24 * 60) {
+            fail(number, "bad time '" + text + "'");
+        }
+        return hours * 60 + mins;
+    }
+
+    static std::string trim(const std::string& text)
+    {
+        size_t start = text.find_first_not_of(" \t\r\n");
+        if (start == std::string::npos) return std::string();
+        return text.substr(start, text.find_last_not_of(" \t\r\n") - start + 1);
+    }
+
+    static std::string lower(std::string text)
+    {
+        for (char& c : text) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        return text;
+    }
+
+    static void fail(int number, const std::string& what)
+    {
+        throw std::invalid_argument("rules line " + std::to_string(number) + ": " + what);
+    }
+
+    std::vector<Rule> rules;
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ControlEvents.h"
+#include "CurveTable.h"
+#include "FanController.h"
+#include "Mailbox.h"
+#include "SharedData.h"
+
+// Settings ready for the control loop: the FanConfig and every configured
+// channel's curve compiled into a CurveTable. The loop only reads one;
+// compiling, which allocates, happens before it gets there.
+struct CompiledProfile
+{
+    FanConfig config;
+    CurveTable curves[MAX_CHANNELS];
+    int32_t number;     // profile these are the settings of, -1 for edited settings
+};
+
+// Throws std::invalid_argument naming the first setting the control loop
+// cannot run with. Client commands are checked as they arrive; this also
+// catches whole configs written directly to the shared memory.
+inline void validateFanConfig(const FanConfig& config)
+{
+    auto require = [](bool valid, const char* what, int channel) {
+        if (valid) return;
+        std::string message = std::string("invalid ") + what;
+        if (channel >= 0) message += " on channel " + std::to_string(channel);
+        throw std::invalid_argument(message);
+    };
+    auto finite = [](float value, float low) { return std::isfinite(value) && value >= low; };
+
+    require(config.channel_count >= 1 && config.channel_count <= MAX_CHANNELS, "channel count", -1);
+    for (int c = 0; c < config.channel_count; ++c) {
+        int points = config.point_count[c];
+        require(points >= 2 && points <= MAX_CURVE_POINTS, "curve point count", c);
+        for (int i = 0; i < points; ++i) {
+            require(config.curve_temp[c][i] >= 0 && config.curve_temp[c][i] <= 150, "curve temperature", c);
+            require(config.curve_fan[c][i] >= 0 && config.curve_fan[c][i] <= 100, "curve fan speed", c);
+            require(i == 0 || config.curve_temp[c][i] >= config.curve_temp[c][i - 1], "curve order", c);
+        }
+        require(config.hysteresis[c] >= 0 && config.hysteresis[c] <= 50, "hysteresis", c);
+        require(config.mode[c] == FAN_MODE_CURVE || config.mode[c] == FAN_MODE_PID, "fan mode", c);
+        require(config.interpolation[c] >= CURVE_LINEAR && config.interpolation[c] <= CURVE_CUBIC, "interpolation", c);
+        require(config.target_temp[c] >= 0 && config.target_temp[c] <= 150, "PID target", c);
+        require(finite(config.kp[c], 0) && finite(config.ki[c], 0) && finite(config.kd[c], 0) &&
+                finite(config.feedforward[c], 0), "PID gains", c);
+        for (int z = 0; z < MAX_CHANNELS; ++z) require(finite(config.coupling[c][z], 0), "coupling weight", c);
+        require(finite(config.slew_up[c], 0) && finite(config.slew_down[c], 0), "slew limit", c);
+        require(config.min_step[c] >= 0 && config.min_step[c] <= 100, "minimum step", c);
+    }
+    require(config.coupling_mode == COUPLING_MAX || config.coupling_mode == COUPLING_SUM, "coupling mode", -1);
+    require(config.idle_mode >= IDLE_OFF && config.idle_mode <= IDLE_ON_BATTERY, "idle mode", -1);
+    require(config.min_period_ms >= 0 && config.max_period_ms >= 0 && config.idle_period_ms >= 0, "control period", -1);
+    require(config.idle_dwell_s >= 0 && config.idle_max_fan >= 0 && config.idle_max_fan <= 100, "idle settings", -1);
+}
+
+// Compiles config's curves into profile without checking it; tables that
+// already hold the same curve are kept
+inline void buildProfile(const FanConfig& config, int32_t number, CompiledProfile& profile)
+{
+    profile.config = config;
+    profile.number = number;
+    int count = std::max(0, std::min(MAX_CHANNELS, config.channel_count));
+    for (int c = 0; c < count; ++c) {
+        int points = std::max(2, std::min(MAX_CURVE_POINTS, config.point_count[c]));
+        const int32_t* temps = config.curve_temp[c];
+        const int32_t* fans = config.curve_fan[c];
+        if (!profile.curves[c].matches(temps, fans, points, config.interpolation[c])) {
+            profile.curves[c].build(temps, fans, points, config.interpolation[c]);
+        }
+    }
+}
+
+// Validates config (validateFanConfig) and compiles it into profile
+inline void compileProfile(const FanConfig& config, int32_t number, CompiledProfile& profile)
+{
+    validateFanConfig(config);
+    buildProfile(config, number, profile);
+}
+
+// Every profile the backend can switch to, compiled ahead of time, and the
+// one the control loop runs, handed over through one atomic pointer. A
+// single compiler thread publishes; the control thread picks up the
+// current profile with acquire() at the start of a tick, which neither
+// waits nor allocates. acquire() marks the profile adopted before it
+// checks that it is still current, so the compiler, which checks adopted
+// after replacing current, either sees the mark or the loop sees the
+// replacement. A compiled profile is never changed or freed while it is
+// current or adopted: a switch to a built-in or saved profile publishes
+// its precompiled copy, a saved profile that changed is recompiled into a
+// fresh buffer, and edited settings are compiled into whichever of two
+// scratch buffers the loop is not using.
+class ProfileSet
+{
+public:
+    ProfileSet() : front(nullptr), adopted(nullptr), rejectCount(0), closed(false)
+    {
+        for (int p = 0; p < PROFILE_COUNT; ++p) {
+            FanConfig config;
+            if (!builtinFanConfig(p, config)) continue;
+            library[p].reset(new CompiledProfile());
+            compileProfile(config, p, *library[p]);
+        }
+    }
+
+    // The profile published last
+    const CompiledProfile* current() const { return front.load(std::memory_order_acquire); }
+
+    // Control thread: the profile to run. From here on the loop uses no
+    // other profile, and this one is not changed or freed until the next
+    // call. The stores and loads of front and adopted are sequentially
+    // consistent, which is what makes the mark-then-check hand-over safe.
+    const CompiledProfile* acquire()
+    {
+        const CompiledProfile* profile = front.load();
+        for (;;) {
+            adopted.store(profile);
+            const CompiledProfile* again = front.load();
+            if (again == profile) return profile;
+            profile = again;
+        }
+    }
+
+    // Compiler thread: recompiles the saved profiles whose settings
+    // changed. source.profile(number, out) gives a profile's settings, false
+    // when there is none (SettingsStore). A saved profile that fails
+    // validation is left out; switching to it compiles it like edited
+    // settings and rejects it there.
+    template <typename Source>
+    void refresh(const Source& source)
+    {
+        for (int p = 1; p <= PROFILE_SLOTS; ++p) {
+            FanConfig config;
+            bool saved = source.profile(p, config);
+            if (saved && library[p] && std::memcmp(&library[p]->config, &config, sizeof(FanConfig)) == 0) continue;
+
+            if (library[p]) retired.push_back(std::move(library[p]));
+            if (!saved) continue;
+            std::unique_ptr<CompiledProfile> compiled(new CompiledProfile());
+            try {
+                compileProfile(config, p, *compiled);
+                library[p] = std::move(compiled);
+            }
+            catch (const std::invalid_argument&) {
+            }
+        }
+        collect();
+    }
+
+    // Compiler thread: makes config the current profile. number is the
+    // profile config was switched to from, -1 for edited settings. A
+    // config identical to that profile's publishes its precompiled copy;
+    // anything else is validated and compiled into a scratch buffer,
+    // waiting for the control loop to adopt the last one if both are in
+    // use. False when config was rejected (counted in rejected()) or the
+    // set was closed meanwhile; the loop then keeps its profile.
+    bool publish(const FanConfig& config, int32_t number)
+    {
+        if (number >= 0 && number < PROFILE_COUNT && library[number] &&
+            std::memcmp(&library[number]->config, &config, sizeof(FanConfig)) == 0) {
+            front.store(library[number].get());
+            collect();
+            return true;
+        }
+
+        try {
+            validateFanConfig(config);
+        }
+        catch (const std::invalid_argument&) {
+            rejectCount.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        CompiledProfile* target = nullptr;
+        while (!(target = freeScratch())) {
+            if (closed.load(std::memory_order_acquire)) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        buildProfile(config, number, *target);
+        front.store(target);
+        collect();
+        return true;
+    }
+
+    // Settings that failed validation since start-up
+    uint32_t rejected() const { return rejectCount.load(std::memory_order_relaxed); }
+
+    // Ends a publish() waiting for the control loop, for shutdown
+    void close() { closed.store(true, std::memory_order_release); }
+
+private:
+    bool inUse(const CompiledProfile* profile) const
+    {
+        return profile == front.load() || profile == adopted.load();
+    }
+
+    CompiledProfile* freeScratch()
+    {
+        for (CompiledProfile& profile : scratch) {
+            if (!inUse(&profile)) return &profile;
+        }
+        return nullptr;
+    }
+
+    // Frees the replaced saved profiles the loop has moved on from
+    void collect()
+    {
+        retired.erase(std::remove_if(retired.begin(), retired.end(),
+                                     [this](const std::unique_ptr<CompiledProfile>& p) { return !inUse(p.get()); }),
+                      retired.end());
+    }
+
+    std::unique_ptr<CompiledProfile> library[PROFILE_COUNT];
+    CompiledProfile scratch[2];
+    std::vector<std::unique_ptr<CompiledProfile>> retired;
+
+    std::atomic<const CompiledProfile*> front;
+    std::atomic<const CompiledProfile*> adopted;
+    std::atomic<uint32_t> rejectCount;
+    std::atomic<bool> closed;
+};
+
+// Settings for the compiler thread to publish; number as in ProfileSet::publish
+struct ProfileRequest
+{
+    FanConfig config;
+    int32_t number;
+};
+
+// The profile compiler of the backend, run on its own thread: publishes
+// the newest settings the control stage posts and wakes it through events
+// to pick them up, until requests is closed. Saved profiles are
+// recompiled from source first, so a switch to one just saved is a swap
+// too. onPublished(config) runs after each published change, e.g. to
+// save the settings that are now running.
+template <typename Source, typename OnPublished>
+void profileStage(ProfileSet& profiles, const Source& source, Mailbox<ProfileRequest>& requests, ControlEvents& events,
+                  OnPublished onPublished)
+{
+    ProfileRequest request;
+    while (requests.take(request)) {
+        profiles.refresh(source);
+        if (!profiles.publish(request.config, request.number)) continue;
+        onPublished(request.config);
+        events.notifyConfigChanged();
+    }
+}
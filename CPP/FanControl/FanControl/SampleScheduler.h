@@ -0,0 +1,188 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "SharedData.h"
+
+// Chooses the next control period from how fast the temperatures move and
+// how close they are to the next point where the controller output
+// changes slope (a curve point, or the PID target). A flat, idle machine
+// is sampled at max_period_ms; a temperature that is rising, or about to
+// cross a setpoint, shortens the period immediately. The period grows back
+// by at most one backoff step per tick. While the fans are handed back to
+// the EC the period is idle_period_ms, and leaving idle starts again from
+// min_period_ms. Nothing allocates, so configure() can run between ticks.
+class SampleScheduler
+{
+public:
+    struct Params
+    {
+        double stepBudget = 1.0;    // C a temperature may move between two samples
+        double setpointSamples = 2; // samples to take before reaching the next setpoint
+        double backoff = 1.5;       // largest period growth per tick
+        double rateAlpha = 0.5;     // smoothing of the temperature rate
+        double flatRate = 0.02;     // C/s below which a temperature counts as flat
+        double loadStep = 15.0;     // CPU utilization jump, in percent, that drops to min_period_ms
+    };
+
+    explicit SampleScheduler(const FanConfig& config) : SampleScheduler(config, Params()) {}
+
+    SampleScheduler(const FanConfig& config, const Params& params)
+        : params(params), currentMs(1000), reasonBits(0), lastTime(0), lastLoad(0), primed(false), wasIdle(false)
+    {
+        configure(config);
+    }
+
+    void configure(const FanConfig& config)
+    {
+        minMs = config.min_period_ms > 0 ? config.min_period_ms : 250;
+        maxMs = config.max_period_ms > 0 ? config.max_period_ms : 3000;
+        minMs = std::max(50, minMs);
+        maxMs = std::max(minMs, maxMs);
+        idleMs = std::max(minMs, config.idle_period_ms > 0 ? config.idle_period_ms : maxMs);
+
+        int count = std::max(0, std::min(MAX_CHANNELS, config.channel_count));
+        for (int c = 0; c < MAX_CHANNELS; ++c) {
+            Channel& channel = channels[c];
+            channel.setpointCount = 0;
+            if (c >= count) {
+                // A channel the config does not describe is tracked without setpoints
+                channel.last = 0;
+                channel.rate = 0;
+            }
+            else if (config.mode[c] == FAN_MODE_PID) {
+                channel.setpoints[channel.setpointCount++] = config.target_temp[c];
+            }
+            else {
+                // Where the curve changes slope; the end points are 0 and 100 C
+                int points = std::max(2, std::min(MAX_CURVE_POINTS, config.point_count[c]));
+                for (int i = 1; i < points - 1; ++i) channel.setpoints[channel.setpointCount++] = config.curve_temp[c][i];
+            }
+        }
+
+        currentMs = std::max(minMs, std::min(maxMs, currentMs));
+    }
+
+    // Feeds the per-channel temperatures and the CPU utilization seen at
+    // time now (seconds) and returns the period in milliseconds until the
+    // next tick.
+    // A jump in utilization arrives before any heat does, so it goes
+    // straight to the shortest period. idle is whether the EC has the fans
+    // after this tick.
+    int next(double now, const double* temps, int count, double cpuLoad = 0.0, bool idle = false)
+    {
+        double dt = primed ? now - lastTime : 0.0;
+        lastTime = now;
+
+        reasonBits = 0;
+        if (idle) {
+            // Only the guard temperatures matter; keep the rates current for when idle ends
+            for (int c = 0; c < count; ++c) {
+                if (primed && dt > 0) channel(c).rate += params.rateAlpha * ((temps[c] - channel(c).last) / dt - channel(c).rate);
+                channel(c).last = temps[c];
+            }
+            lastLoad = cpuLoad;
+            primed = true;
+            wasIdle = true;
+            reasonBits = SCHEDULE_IDLE;
+            currentMs = idleMs;
+            return currentMs;
+        }
+
+        double wantedSeconds = maxMs / 1000.0;
+        if (wasIdle) {
+            // A guard temperature was just reached
+            wantedSeconds = 0;
+            reasonBits |= SCHEDULE_SETPOINT;
+            wasIdle = false;
+        }
+        else if (primed && dt > 0) {
+            for (int c = 0; c < count; ++c) {
+                wantedSeconds = std::min(wantedSeconds, channelPeriod(channel(c), temps[c], dt));
+            }
+            if (std::fabs(cpuLoad - lastLoad) >= params.loadStep) {
+                wantedSeconds = 0;
+                reasonBits |= SCHEDULE_LOAD;
+            }
+        }
+        lastLoad = cpuLoad;
+        for (int c = 0; c < count; ++c) channel(c).last = temps[c];
+        primed = true;
+        if (!(reasonBits & (SCHEDULE_RATE | SCHEDULE_SETPOINT | SCHEDULE_LOAD))) reasonBits |= SCHEDULE_STEADY;
+
+        int wanted = static_cast<int>(std::lround(wantedSeconds * 1000.0));
+        int ceiling = static_cast<int>(std::lround(currentMs * params.backoff));
+        if (wanted > ceiling) {
+            wanted = ceiling;
+            reasonBits |= SCHEDULE_BACKOFF;
+        }
+        if (wanted <= minMs) {
+            wanted = minMs;
+            reasonBits |= SCHEDULE_AT_MIN;
+        }
+        if (wanted >= maxMs) {
+            wanted = maxMs;
+            reasonBits |= SCHEDULE_AT_MAX;
+        }
+        currentMs = wanted;
+        return currentMs;
+    }
+
+    int period() const { return currentMs; }
+    uint32_t reasons() const { return reasonBits; }
+
+private:
+    struct Channel
+    {
+        double setpoints[MAX_CURVE_POINTS];
+        int setpointCount = 0;
+        double last = 0;
+        double rate = 0;
+    };
+
+    Channel& channel(int index) { return channels[index]; }
+
+    // Longest period that keeps this channel within its step budget and
+    // samples it a few times before it reaches the next setpoint
+    double channelPeriod(Channel& channel, double temp, double dt)
+    {
+        channel.rate += params.rateAlpha * ((temp - channel.last) / dt - channel.rate);
+        double speed = std::fabs(channel.rate);
+        if (speed < params.flatRate) return maxMs / 1000.0;
+
+        double seconds = params.stepBudget / speed;
+        bool byRate = true;
+
+        // Nearest setpoint in the direction the temperature is moving
+        double distance = -1;
+        for (int i = 0; i < channel.setpointCount; ++i) {
+            double setpoint = channel.setpoints[i];
+            double ahead = channel.rate > 0 ? setpoint - temp : temp - setpoint;
+            if (ahead > 0 && (distance < 0 || ahead < distance)) distance = ahead;
+        }
+        if (distance > 0) {
+            double bySetpoint = distance / speed / params.setpointSamples;
+            if (bySetpoint < seconds) {
+                seconds = bySetpoint;
+                byRate = false;
+            }
+        }
+
+        if (seconds < maxMs / 1000.0) reasonBits |= byRate ? SCHEDULE_RATE : SCHEDULE_SETPOINT;
+        return seconds;
+    }
+
+    Params params;
+    int minMs;
+    int maxMs;
+    int idleMs;
+    int currentMs;
+    uint32_t reasonBits;
+    double lastTime;
+    double lastLoad;
+    bool primed;
+    bool wasIdle;
+    Channel channels[MAX_CHANNELS];
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Exponential moving average, alpha per nominal one-second sample
+class LowPassFilter
+{
+public:
+    LowPassFilter(double alpha) : alpha(alpha), initialized(false), filtered(0) {}
+
+    double filter(double value) {
+        if (!initialized) {
+            filtered = value;
+            initialized = true;
+        }
+        else {
+            filtered = alpha * value + (1 - alpha) * filtered;
+        }
+        return filtered;
+    }
+
+    // Same filter for a sample taken dt nominal periods after the last
+    // one, so its time constant does not change with the sampling rate
+    double filter(double value, double dt) {
+        if (!initialized || dt == 1.0) return filter(value);
+        double scaled = 1 - std::pow(1 - alpha, std::max(0.0, dt));
+        filtered = scaled * value + (1 - scaled) * filtered;
+        return filtered;
+    }
+
+private:
+    double alpha;
+    bool initialized;
+    double filtered;
+};
+
+// Median of the last window samples. A spike shorter than half the window
+// never reaches the output, at the cost of half a window of delay.
+class MedianFilter
+{
+public:
+    explicit MedianFilter(int window = 3) : window(std::max(1, window)), next(0) {}
+
+    double filter(double value)
+    {
+        if (static_cast<int>(samples.size()) < window) samples.push_back(value);
+        else samples[next] = value;
+        next = (next + 1) % window;
+
+        sorted = samples;
+        size_t middle = sorted.size() / 2;
+        std::nth_element(sorted.begin(), sorted.begin() + middle, sorted.end());
+        if (sorted.size() % 2) return sorted[middle];
+
+        // Still filling an even window: average the two middle samples
+        double upper = sorted[middle];
+        double lower = *std::max_element(sorted.begin(), sorted.begin() + middle);
+        return (lower + upper) / 2;
+    }
+
+private:
+    int window;
+    int next;
+    std::vector<double> samples;
+    std::vector<double> sorted;
+};
+
+// One-dimensional Kalman filter for a temperature modelled as a random
+// walk: it drifts by processNoise C^2 per second and every reading carries
+// measurementNoise C^2 of noise. Unlike the EMA its gain adapts, so it
+// settles quickly after start-up and then smooths as hard as the noise
+// ratio allows.
+class KalmanFilter1D
+{
+public:
+    KalmanFilter1D(double processNoise, double measurementNoise)
+        : q(processNoise), r(measurementNoise), estimate(0), variance(0), initialized(false)
+    {
+    }
+
+    double filter(double value, double dt)
+    {
+        if (!initialized) {
+            estimate = value;
+            variance = r;
+            initialized = true;
+            return estimate;
+        }
+        variance += q * std::max(0.0, dt);
+        double gain = variance / (variance + r);
+        estimate += gain * (value - estimate);
+        variance *= 1 - gain;
+        return estimate;
+    }
+
+private:
+    double q;
+    double r;
+    double estimate;
+    double variance;
+    bool initialized;
+};
+
+// What one channel's sensor pipeline made of one reading
+struct SensorSample
+{
+    double raw;         // as read from the EC
+    bool accepted;      // passed the range check
+    bool primed;        // at least one reading has ever been accepted
+    bool faulted;       // too many consecutive readings rejected
+    double median;      // after the glitch rejector
+    double ema;         // after the EMA, what the curve sees unless the Kalman stage is on
+    double fast;        // lightly smoothed, for PID and the sample scheduler
+    double kalman;      // after the Kalman stage, or the EMA when it is off
+    double output;      // the temperature the curve controller uses
+};
+
+// Per-channel sensor processing: range check, then a median-of-N glitch
+// rejector, then the EMA and, optionally, a Kalman stage. A reading that
+// fails the range check is dropped before any stage sees it, so it costs
+// no extra EC transaction and leaves every filter state untouched; the
+// stages hold their last output and the time it was dropped for is
+// credited to the next accepted reading. faultSamples consecutive drops
+// mark the sensor faulted until a reading is accepted again.
+class SensorPipeline
+{
+public:
+    struct Params
+    {
+        double minValid = 1.0;      // C; the EC reads 0 when a read failed or a sensor is missing
+        double maxValid = 110.0;    // C
+        int medianWindow = 3;       // samples; 1 disables the glitch rejector
+        double alpha = 0.1;         // EMA feeding the curve, per nominal one-second sample
+        double fastAlpha = 0.5;     // EMA feeding PID and the sample scheduler
+        double kalmanQ = 0.0;       // C^2/s process noise; 0 disables the Kalman stage
+        double kalmanR = 1.0;       // C^2 measurement noise
+        int faultSamples = 3;       // consecutive rejected readings that fault the sensor
+    };
+
+    SensorPipeline() : SensorPipeline(Params()) {}
+
+    explicit SensorPipeline(const Params& params)
+        : params(params), median(params.medianWindow), ema(params.alpha), fast(params.fastAlpha),
+          kalman(params.kalmanQ, params.kalmanR), pendingDt(0), consecutiveRejects(0), rejectCount(0)
+    {
+        sample = {};
+    }
+
+    // raw is the EC reading, dt the nominal periods since the previous call
+    const SensorSample& update(double raw, double dt)
+    {
+        sample.raw = raw;
+        sample.accepted = raw >= params.minValid && raw <= params.maxValid;
+        pendingDt += dt;
+
+        if (!sample.accepted) {
+            ++rejectCount;
+            ++consecutiveRejects;
+            sample.faulted = consecutiveRejects >= params.faultSamples;
+            return sample;
+        }
+
+        // Only the first accepted reading starts the filters without a time step
+        double elapsed = sample.primed ? pendingDt : 1.0;
+        pendingDt = 0;
+        consecutiveRejects = 0;
+        sample.faulted = false;
+
+        sample.median = median.filter(raw);
+        sample.ema = ema.filter(sample.median, elapsed);
+        sample.fast = fast.filter(sample.median, elapsed);
+        sample.kalman = params.kalmanQ > 0 ? kalman.filter(sample.median, elapsed) : sample.ema;
+        sample.output = sample.kalman;
+        sample.primed = true;
+        return sample;
+    }
+
+    const SensorSample& last() const { return sample; }
+    unsigned long long rejects() const { return rejectCount; }
+
+private:
+    Params params;
+    MedianFilter median;
+    LowPassFilter ema;
+    LowPassFilter fast;
+    KalmanFilter1D kalman;
+    SensorSample sample;
+    double pendingDt;
+    int consecutiveRejects;
+    unsigned long long rejectCount;
+};
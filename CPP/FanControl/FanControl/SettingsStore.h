@@ -0,0 +1,550 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "CommandQueue.h"
+#include "ConfigCommands.h"
+#include "FanController.h"
+#include "SharedData.h"
+
+// Settings file: a header, the current settings and the saved profiles.
+// The header carries a CRC-32 over the whole file, so a damaged or
+// partly written file is recognized instead of misloaded.
+//
+//   SettingsFileHeader
+//   FanConfig                  the current settings, configSize bytes
+//   profileCount times:
+//     SettingsProfileHeader    profile number and name
+//     FanConfig                configSize bytes
+//
+// A FanConfig saved before fields were appended is a prefix of the current
+// one; the missing fields get their defaults. Version 1 files (a 16-byte
+// header and the FanConfig) and the headerless files from before channels
+// were arrays are still read and rewritten in this format.
+const uint32_t SETTINGS_MAGIC = 0x53435446; // "FTCS"
+const uint32_t SETTINGS_VERSION = 2;
+
+struct SettingsFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t configSize;    // sizeof(FanConfig) of the writer
+    uint32_t profileCount;
+    int32_t activeProfile;
+    uint32_t fileSize;
+    uint32_t checksum;      // CRC-32 of the file with this field zero
+    uint32_t reserved;
+};
+
+struct SettingsProfileHeader
+{
+    int32_t number;
+    char name[PROFILE_NAME_LENGTH];
+};
+
+// What SettingsStore::load found
+enum class SettingsLoad { Loaded, Migrated, Missing, Corrupt };
+
+// CRC-32 as in zip and PNG
+inline uint32_t settingsChecksum(const char* data, size_t size)
+{
+    struct Table
+    {
+        uint32_t entries[256];
+
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int bit = 0; bit < 8; ++bit) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                entries[i] = c;
+            }
+        }
+    };
+    static const Table table;
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) crc = table.entries[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Profile names travel in the last four args of COMMAND_SAVE_PROFILE
+inline void packProfileName(const std::string& name, int32_t* args)
+{
+    char bytes[PROFILE_NAME_LENGTH] = {};
+    std::memcpy(bytes, name.data(), std::min<size_t>(name.size(), PROFILE_NAME_LENGTH - 1));
+    std::memcpy(args, bytes, PROFILE_NAME_LENGTH);
+}
+
+inline std::string unpackProfileName(const int32_t* args)
+{
+    char bytes[PROFILE_NAME_LENGTH];
+    std::memcpy(bytes, args, PROFILE_NAME_LENGTH);
+    bytes[PROFILE_NAME_LENGTH - 1] = 0;
+    return bytes;
+}
+
+// Replaces path with bytes so that a crash at any point leaves either the
+// old file or the new one: the bytes go to path.tmp, are flushed to disk
+// and the temporary file is then renamed over path
+inline bool writeFileAtomically(const std::string& path, const std::string& bytes)
+{
+    std::string temp = path + ".tmp";
+#ifdef _WIN32
+    HANDLE file = CreateFileA(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    DWORD written = 0;
+    bool ok = WriteFile(file, bytes.data(), static_cast<DWORD>(bytes.size()), &written, NULL) &&
+              written == bytes.size() && FlushFileBuffers(file);
+    CloseHandle(file);
+    ok = ok && MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    if (!ok) DeleteFileA(temp.c_str());
+    return ok;
+#else
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    size_t done = 0;
+    while (done < bytes.size()) {
+        ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+        if (n <= 0) break;
+        done += static_cast<size_t>(n);
+    }
+    bool ok = done == bytes.size() && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    ok = ok && std::rename(temp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        std::remove(temp.c_str());
+        return false;
+    }
+
+    // The rename itself is durable once the directory is
+    size_t slash = path.find_last_of('/');
+    int dir = ::open(slash == std::string::npos ? "." : path.substr(0, slash + 1).c_str(), O_RDONLY | O_CLOEXEC);
+    if (dir >= 0) {
+        ::fsync(dir);
+        ::close(dir);
+    }
+    return true;
+#endif
+}
+
+// The settings file of the backend: the current settings and up to
+// PROFILE_SLOTS named profiles. Changes are only marked here; the file is
+// replaced once the settings have been quiet for quietTime, or maxDelay
+// after the first unsaved change, so a client dragging a curve point
+// causes one write instead of one per step. A saver thread runs
+// flushWhenDue() to write them. All members may be called from any
+// thread, and none waits for the disk while another writes the file.
+class SettingsStore
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit SettingsStore(const std::string& path,
+                           std::chrono::milliseconds quietTime = std::chrono::seconds(2),
+                           std::chrono::milliseconds maxDelay = std::chrono::seconds(10))
+        : path(path), quietTime(quietTime), maxDelay(maxDelay), settings(defaultFanConfig()), active(PROFILE_DEFAULTS),
+          dirty(false), stopping(false), changeCount(0), writeCount(0), failureCount(0)
+    {
+        for (int p = 0; p <= PROFILE_SLOTS; ++p) used[p] = false;
+    }
+
+    // Reads the file; everything not in it keeps its default. A damaged
+    // file is kept as path.corrupt and the defaults are used instead.
+    // Anything other than Loaded leaves a write pending, so the next flush
+    // puts the file in the current format.
+    SettingsLoad load()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            dirty = true;
+            return SettingsLoad::Missing;
+        }
+        std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+
+        SettingsLoad result = decode(bytes);
+        if (result == SettingsLoad::Corrupt) {
+            std::string kept = path + ".corrupt";
+            std::remove(kept.c_str());
+            std::rename(path.c_str(), kept.c_str());
+        }
+        dirty = result != SettingsLoad::Loaded;
+        return result;
+    }
+
+    FanConfig current() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return settings;
+    }
+
+    // The backend's settings changed; they are written once the changes stop
+    void update(const FanConfig& config, Clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        settings = config;
+        touch(now);
+    }
+
+    // COMMAND_SWITCH_PROFILE, COMMAND_SAVE_PROFILE and COMMAND_DELETE_PROFILE.
+    // Switching replaces config with the profile; saving stores config
+    // under the number and name the command gives. Built-in profiles can
+    // be switched to but not saved over or deleted. Other commands go to
+    // applyConfigCommand.
+    int32_t applyProfileCommand(FanConfig& config, const FanCommand& command, Clock::time_point now)
+    {
+        int32_t number = command.args[0];
+        if (command.type != COMMAND_SWITCH_PROFILE && command.type != COMMAND_SAVE_PROFILE && command.type != COMMAND_DELETE_PROFILE) {
+            return applyConfigCommand(config, command);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (command.type == COMMAND_SWITCH_PROFILE) {
+            if (isBuiltinProfile(number)) {
+                int32_t status = applyConfigCommand(config, command);
+                if (status != COMMAND_ACCEPTED) return status;
+            }
+            else if (number < 1 || number > PROFILE_SLOTS || !used[number]) {
+                return COMMAND_UNKNOWN_PROFILE;
+            }
+            else {
+                config = profiles[number];
+            }
+            settings = config;
+            active = number;
+        }
+        else if (number < 1 || number > PROFILE_SLOTS) {
+            return COMMAND_UNKNOWN_PROFILE;
+        }
+        else if (command.type == COMMAND_SAVE_PROFILE) {
+            std::string name = unpackProfileName(command.args + 1);
+            if (name.empty()) return COMMAND_BAD_VALUE;
+            profiles[number] = config;
+            std::memset(names[number], 0, PROFILE_NAME_LENGTH);
+            std::memcpy(names[number], name.data(), name.size());
+            used[number] = true;
+            active = number;
+        }
+        else {
+            if (!used[number]) return COMMAND_UNKNOWN_PROFILE;
+            used[number] = false;
+            if (active == number) active = PROFILE_DEFAULTS;
+        }
+        touch(now);
+        return COMMAND_ACCEPTED;
+    }
+
+    ProfileDirectory directory() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ProfileDirectory result = {};
+        result.active = active;
+        for (int p = 0; p < PROFILE_COUNT; ++p) {
+            if (!isBuiltinProfile(p)) continue;
+            result.used |= 1u << p;
+            std::strcpy(result.names[p], builtinProfileName(p));
+        }
+        for (int p = 1; p <= PROFILE_SLOTS; ++p) {
+            if (!used[p]) continue;
+            result.used |= 1u << p;
+            std::memcpy(result.names[p], names[p], PROFILE_NAME_LENGTH);
+        }
+        result.settingsWrites = static_cast<uint32_t>(writeCount);
+        result.settingsWriteFailures = static_cast<uint32_t>(failureCount);
+        result.automatic = -1;
+        return result;
+    }
+
+    // The settings profile number switches to; false when it has none
+    bool profile(int32_t number, FanConfig& out) const
+    {
+        if (builtinFanConfig(number, out)) return true;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (number < 1 || number > PROFILE_SLOTS || !used[number]) return false;
+        out = profiles[number];
+        return true;
+    }
+
+    bool pending() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dirty;
+    }
+
+    // Writes the file if changes are pending and have been quiet long
+    // enough, or have waited maxDelay; true when it was written
+    bool flushIfDue(Clock::time_point now)
+    {
+        std::lock_guard<std::mutex> file(fileMutex);
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!dirty || now < dueAt()) return false;
+        return write(lock);
+    }
+
+    // Writes pending changes now, e.g. at shutdown. A failed write stays
+    // pending and is tried again by the next flush.
+    bool flush()
+    {
+        std::lock_guard<std::mutex> file(fileMutex);
+        std::unique_lock<std::mutex> lock(mutex);
+        return !dirty || write(lock);
+    }
+
+    // For the saver thread: waits until pending changes are due and tries
+    // to write them. False, without writing, once stopSaving() was called.
+    bool flushWhenDue()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                if (stopping) return false;
+                if (!dirty) changed.wait(lock);
+                else if (Clock::now() < dueAt()) changed.wait_until(lock, dueAt());
+                else break;
+            }
+        }
+        flushIfDue(Clock::now());
+        return true;
+    }
+
+    void stopSaving()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        changed.notify_all();
+    }
+
+    unsigned long long writes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return writeCount;
+    }
+
+    // The file as it would be written now
+    std::string encode() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return encodeLocked();
+    }
+
+private:
+    void touch(Clock::time_point now)
+    {
+        if (!dirty) firstChange = now;
+        lastChange = now;
+        dirty = true;
+        ++changeCount;
+        changed.notify_all();
+    }
+
+    Clock::time_point dueAt() const
+    {
+        return std::min(lastChange + quietTime, firstChange + maxDelay);
+    }
+
+    // Called holding fileMutex and lock. The file is written with only
+    // fileMutex held; changes made meanwhile stay pending.
+    bool write(std::unique_lock<std::mutex>& lock)
+    {
+        std::string bytes = encodeLocked();
+        unsigned long long written = changeCount;
+        lock.unlock();
+        bool ok = writeFileAtomically(path, bytes);
+        lock.lock();
+        if (!ok) {
+            ++failureCount;
+            // Retried quietTime from now rather than right away
+            firstChange = lastChange = Clock::now();
+            return false;
+        }
+        ++writeCount;
+        dirty = changeCount != written;
+        if (dirty) firstChange = lastChange;
+        return true;
+    }
+
+    std::string encodeLocked() const
+    {
+        SettingsFileHeader header = {};
+        header.magic = SETTINGS_MAGIC;
+        header.version = SETTINGS_VERSION;
+        header.configSize = sizeof(FanConfig);
+        header.activeProfile = active;
+
+        std::string body(reinterpret_cast<const char*>(&settings), sizeof(FanConfig));
+        for (int p = 1; p <= PROFILE_SLOTS; ++p) {
+            if (!used[p]) continue;
+            SettingsProfileHeader profile = {};
+            profile.number = p;
+            std::memcpy(profile.name, names[p], PROFILE_NAME_LENGTH);
+            body.append(reinterpret_cast<const char*>(&profile), sizeof(profile));
+            body.append(reinterpret_cast<const char*>(&profiles[p]), sizeof(FanConfig));
+            ++header.profileCount;
+        }
+        header.fileSize = static_cast<uint32_t>(sizeof(header) + body.size());
+
+        std::string bytes(reinterpret_cast<const char*>(&header), sizeof(header));
+        bytes += body;
+        header.checksum = settingsChecksum(bytes.data(), bytes.size());
+        std::memcpy(&bytes[offsetof(SettingsFileHeader, checksum)], &header.checksum, sizeof(header.checksum));
+        return bytes;
+    }
+
+    SettingsLoad decode(const std::string& bytes)
+    {
+        uint32_t magic = 0, version = 0;
+        if (bytes.size() >= 8) {
+            std::memcpy(&magic, bytes.data(), 4);
+            std::memcpy(&version, bytes.data() + 4, 4);
+        }
+        if (magic != SETTINGS_MAGIC) {
+            // Legacy files have one of three sizes, so a damaged magic does
+            // not pass for one
+            const size_t curves = 2 * (8 + 4 + 4 + 12 + 20), pid = 2 * (4 + 4 + 16), periods = 8;
+            size_t size = bytes.size();
+            if (size != curves && size != curves + pid && size != curves + pid + periods) return SettingsLoad::Corrupt;
+            std::istringstream legacy(bytes);
+            FanConfig config;
+            if (!loadLegacySettings(legacy, config)) return SettingsLoad::Corrupt;
+            settings = config;
+            return SettingsLoad::Migrated;
+        }
+
+        if (version == 1) {
+            // A 16-byte header with the FanConfig size, then the FanConfig
+            uint32_t configSize = 0;
+            if (bytes.size() < 16) return SettingsLoad::Corrupt;
+            std::memcpy(&configSize, bytes.data() + 8, 4);
+            if (configSize == 0 || bytes.size() < 16 + configSize) return SettingsLoad::Corrupt;
+            settings = readConfig(bytes.data() + 16, configSize);
+            return SettingsLoad::Migrated;
+        }
+
+        SettingsFileHeader header = {};
+        if (version != SETTINGS_VERSION || bytes.size() < sizeof(header)) return SettingsLoad::Corrupt;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        if (header.fileSize != bytes.size() || header.configSize == 0 || header.profileCount > PROFILE_SLOTS) {
+            return SettingsLoad::Corrupt;
+        }
+        std::string check = bytes;
+        std::memset(&check[offsetof(SettingsFileHeader, checksum)], 0, sizeof(header.checksum));
+        if (settingsChecksum(check.data(), check.size()) != header.checksum) return SettingsLoad::Corrupt;
+        size_t profileSize = sizeof(SettingsProfileHeader) + header.configSize;
+        if (bytes.size() != sizeof(header) + header.configSize + header.profileCount * profileSize) return SettingsLoad::Corrupt;
+
+        const char* at = bytes.data() + sizeof(header);
+        settings = readConfig(at, header.configSize);
+        at += header.configSize;
+        for (uint32_t i = 0; i < header.profileCount; ++i, at += profileSize) {
+            SettingsProfileHeader profile;
+            std::memcpy(&profile, at, sizeof(profile));
+            if (profile.number < 1 || profile.number > PROFILE_SLOTS) continue;
+            profiles[profile.number] = readConfig(at + sizeof(profile), header.configSize);
+            std::memcpy(names[profile.number], profile.name, PROFILE_NAME_LENGTH);
+            names[profile.number][PROFILE_NAME_LENGTH - 1] = 0;
+            used[profile.number] = true;
+        }
+        int32_t number = header.activeProfile;
+        active = isBuiltinProfile(number) || (number >= 1 && number <= PROFILE_SLOTS && used[number]) ? number : PROFILE_DEFAULTS;
+        return header.configSize == sizeof(FanConfig) ? SettingsLoad::Loaded : SettingsLoad::Migrated;
+    }
+
+    static FanConfig readConfig(const char* data, uint32_t size)
+    {
+        FanConfig config = defaultFanConfig();
+        std::memcpy(&config, data, std::min<size_t>(size, sizeof(FanConfig)));
+        return config;
+    }
+
+    template <typename T>
+    static bool readValue(std::istream& file, T& value)
+    {
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+
+    // Files written before channels were arrays: a telemetry snapshot, the
+    // CPU then GPU five-point curve as named fields, and optionally the PID
+    // settings and period bounds appended by later versions
+    static bool loadLegacySettings(std::istream& file, FanConfig& config)
+    {
+        double temps[2];
+        int32_t fanSpeeds[2];
+        int32_t hysteresis[2];
+        int32_t tempPoints[2][3];
+        int32_t fanPoints[2][5];
+        if (!readValue(file, temps) || !readValue(file, fanSpeeds) || !readValue(file, hysteresis) ||
+            !readValue(file, tempPoints) || !readValue(file, fanPoints)) {
+            return false;
+        }
+
+        config = defaultFanConfig();
+        for (int c = 0; c < 2; ++c) {
+            config.point_count[c] = 5;
+            config.hysteresis[c] = hysteresis[c];
+            config.curve_temp[c][0] = 0;
+            std::copy(tempPoints[c], tempPoints[c] + 3, config.curve_temp[c] + 1);
+            config.curve_temp[c][4] = 100;
+            std::copy(fanPoints[c], fanPoints[c] + 5, config.curve_fan[c]);
+        }
+
+        // Mode and target per channel, then kp, ki, kd and feedforward per channel
+        int32_t modes[2], targets[2];
+        float gains[2][4];
+        if (readValue(file, modes) && readValue(file, targets) && readValue(file, gains)) {
+            for (int c = 0; c < 2; ++c) {
+                config.mode[c] = modes[c];
+                config.target_temp[c] = targets[c];
+                config.kp[c] = gains[c][0];
+                config.ki[c] = gains[c][1];
+                config.kd[c] = gains[c][2];
+                config.feedforward[c] = gains[c][3];
+            }
+            int32_t periods[2];
+            if (readValue(file, periods)) {
+                config.min_period_ms = periods[0];
+                config.max_period_ms = periods[1];
+            }
+        }
+        return true;
+    }
+
+    std::string path;
+    std::chrono::milliseconds quietTime;
+    std::chrono::milliseconds maxDelay;
+    mutable std::mutex mutex;
+    std::mutex fileMutex;       // taken before mutex
+    std::condition_variable changed;
+
+    FanConfig settings;
+    FanConfig profiles[PROFILE_SLOTS + 1];  // by profile number; 0 is unused
+    char names[PROFILE_SLOTS + 1][PROFILE_NAME_LENGTH];
+    bool used[PROFILE_SLOTS + 1];
+    int32_t active;
+
+    bool dirty;
+    bool stopping;
+    unsigned long long changeCount;
+    Clock::time_point firstChange;
+    Clock::time_point lastChange;
+    unsigned long long writeCount;
+    unsigned long long failureCount;
+};
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+#include "CommandQueue.h"
+#include "LatencyHistogram.h"
+#include "TelemetryRing.h"
+
+// Layout of the "MySharedMemory" mapping shared with ui.py and other
+// clients. Every field has a fixed size so the layout can be mirrored with
+// ctypes; ui.py must be updated whenever this file changes.
+//
+//   SharedHeader          magic, layout version and total size
+//   Seqlock<FanConfig>    per-channel settings, written by clients
+//   Seqlock<Telemetry>    live readings, written only by the backend
+//   TelemetryRing         per-tick history, written only by the backend
+//   CommandQueue          typed setting changes from clients, with completions
+//   HotPathStats          latency histograms and EC error counters, written by the backend
+//   Seqlock<ProfileDirectory>  named profiles in the settings file, written by the backend
+
+const uint32_t SHARED_MAGIC = 0x4C435446; // "FTCL"
+const uint32_t SHARED_LAYOUT_VERSION = 17;
+const uint32_t TELEMETRY_HISTORY_CAPACITY = 4096;
+const uint32_t COMMAND_LANES = 8;
+
+// Named profiles the settings file keeps, numbered 1 to PROFILE_SLOTS.
+// Profile 0 (balanced, the defaults) and the ones after the slots are
+// built in.
+const int32_t PROFILE_DEFAULTS = 0;
+const int PROFILE_SLOTS = 8;
+const int PROFILE_QUIET = PROFILE_SLOTS + 1;
+const int PROFILE_PERFORMANCE = PROFILE_SLOTS + 2;
+const int PROFILE_BATTERY = PROFILE_SLOTS + 3;
+const int PROFILE_COUNT = PROFILE_SLOTS + 4;
+const int PROFILE_NAME_LENGTH = 16;     // bytes, including the terminating zero
+
+// Curve points a channel can have; MAX_CHANNELS comes with TelemetryRecord
+const int MAX_CURVE_POINTS = 8;
+
+// Channel index of the CPU and GPU fans
+const int32_t CHANNEL_CPU = 0;
+const int32_t CHANNEL_GPU = 1;
+
+// FanConfig::mode
+const int32_t FAN_MODE_CURVE = 0;
+const int32_t FAN_MODE_PID = 1;
+
+// FanConfig::interpolation, how a curve runs between its points
+const int32_t CURVE_LINEAR = 0;
+const int32_t CURVE_STEP = 1;       // hold each point's speed until the next point
+const int32_t CURVE_CUBIC = 2;      // monotone cubic, never overshoots a point
+
+// FanConfig::idle_mode, when idle fans are handed back to the EC
+const int32_t IDLE_OFF = 0;
+const int32_t IDLE_ALWAYS = 1;
+const int32_t IDLE_ON_BATTERY = 2;
+
+// FanConfig::coupling_mode, how a fan combines the zones' demands
+const int32_t COUPLING_MAX = 0;     // the largest weighted demand
+const int32_t COUPLING_SUM = 1;     // the sum of the weighted demands
+
+// Telemetry::scheduleReasons, why the control period is what it is
+const uint32_t SCHEDULE_STEADY = 0x01;      // temperatures flat, period backing off
+const uint32_t SCHEDULE_RATE = 0x02;        // a temperature is changing quickly
+const uint32_t SCHEDULE_SETPOINT = 0x04;    // a temperature is closing in on a curve point or PID target
+const uint32_t SCHEDULE_BACKOFF = 0x08;     // period growth limited to one step per tick
+const uint32_t SCHEDULE_AT_MIN = 0x10;      // clamped to min_period_ms
+const uint32_t SCHEDULE_AT_MAX = 0x20;      // clamped to max_period_ms
+const uint32_t SCHEDULE_LOAD = 0x40;        // CPU utilization jumped
+const uint32_t SCHEDULE_IDLE = 0x80;        // fans handed back to the EC, polling every idle_period_ms
+
+struct SharedHeader
+{
+    uint32_t magic;
+    uint32_t layoutVersion;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+// Channels are described as data: every per-channel setting is an array
+// indexed by channel (0 is the CPU fan, 1 the GPU fan on every supported
+// model) and each curve is a row of curve_temp/curve_fan. Entries at or
+// past channel_count, and curve points at or past a channel's point_count,
+// are ignored. New fields go at the end, so a shorter config from an older
+// settings file is a valid prefix.
+struct FanConfig
+{
+    int32_t channel_count;
+    int32_t reserved;
+
+    // Curve points in use per channel, 2 to MAX_CURVE_POINTS
+    int32_t point_count[MAX_CHANNELS];
+    int32_t hysteresis[MAX_CHANNELS];
+
+    // Controller per channel. In FAN_MODE_PID the fan tracks the target
+    // temperature; the first and last curve fan points still bound its output.
+    int32_t mode[MAX_CHANNELS];
+    int32_t target_temp[MAX_CHANNELS];
+
+    // PID gains in % per C, % per C*s and % per C/s; feedforward in fan %
+    // per % of CPU utilization
+    float kp[MAX_CHANNELS];
+    float ki[MAX_CHANNELS];
+    float kd[MAX_CHANNELS];
+    float feedforward[MAX_CHANNELS];
+
+    // Curve points, temperatures ascending. The UI keeps the first and last
+    // temperature at 0 and 100 C.
+    int32_t curve_temp[MAX_CHANNELS][MAX_CURVE_POINTS];
+    int32_t curve_fan[MAX_CHANNELS][MAX_CURVE_POINTS];
+
+    // Bounds for the adaptive control period
+    int32_t min_period_ms;
+    int32_t max_period_ms;
+
+    // CURVE_* per channel
+    int32_t interpolation[MAX_CHANNELS];
+
+    // Idle hand-back, IDLE_*. Once every channel has stayed idle_margin C
+    // below its guard temperature (the first inner curve point) with a
+    // command of at most idle_max_fan % for idle_dwell_s seconds, the fans
+    // go back to the EC's automatic mode and the temperatures are polled
+    // every idle_period_ms. Manual control resumes as soon as a channel
+    // reaches its guard temperature.
+    int32_t idle_mode;
+    int32_t idle_margin;
+    int32_t idle_max_fan;
+    int32_t idle_dwell_s;
+    int32_t idle_period_ms;
+    int32_t reserved2;
+
+    // Arbitration between the zones' controllers and the fans. Fan f asks
+    // for the largest (COUPLING_MAX) or the sum (COUPLING_SUM) of
+    // coupling[f][z] times the demand of zone z's controller, so a hot zone
+    // pulls the fans that share its heat pipes along; the diagonal is
+    // normally 1. The command then moves toward that speed at up to
+    // slew_up and slew_down % per second (0 for no limit), and a change of
+    // less than min_step % is held back unless it reaches either end of
+    // the fan's curve.
+    float coupling[MAX_CHANNELS][MAX_CHANNELS];
+    float slew_up[MAX_CHANNELS];
+    float slew_down[MAX_CHANNELS];
+    int32_t min_step[MAX_CHANNELS];
+    int32_t coupling_mode;
+    int32_t reserved3;
+};
+
+struct Telemetry
+{
+    int32_t channelCount;
+    uint32_t reserved;
+    double temp[MAX_CHANNELS];
+    int32_t fanSpeed[MAX_CHANNELS];
+
+    // EC write shadow statistics
+    uint64_t ecWritesIssued;
+    uint64_t ecWritesElided;
+    uint64_t ecShadowMismatches;
+
+    // Control loop wakeups since the backend started
+    uint64_t loopWakeups;
+
+    // OS CPU utilization over the last tick, percent
+    double cpuLoad;
+
+    // Current control period and the SCHEDULE_* reasons for it
+    int32_t controlPeriodMs;
+    uint32_t scheduleReasons;
+
+    // Sensor pipeline stages per channel (SensorSample)
+    float rawTemp[MAX_CHANNELS];
+    float medianTemp[MAX_CHANNELS];
+    float emaTemp[MAX_CHANNELS];
+    float kalmanTemp[MAX_CHANNELS];
+    uint32_t sensorRejects[MAX_CHANNELS];   // readings dropped by the range check since start
+    uint32_t sensorFaulted;                 // bit per channel, set while its sensor is faulted
+    uint32_t fanForced;                     // bit per channel held at a COMMAND_FORCE_SPEED speed
+
+    // From the end of the temperature read to the control stage picking it
+    // up, and to the last fan write reaching the EC, microseconds
+    float sampleAgeUs;
+    float actuationLatencyUs;
+
+    // Idle hand-back: whether the EC has the fans now, how often it got
+    // them and for how long in total since the backend started
+    uint32_t idleActive;
+    uint32_t idleEntries;
+    double idleSeconds;
+
+    // How late the control timer woke the loop for the last tick and at
+    // most since the backend started, microseconds, and ticks that ran
+    // past their time budget
+    float loopJitterUs;
+    float maxLoopJitterUs;
+    uint32_t deadlineMisses;
+
+    // EC watchdog: transactions that failed after their retries, whether
+    // the EC has the fans because of them and how often it got them
+    uint32_t ecFailures;
+    uint32_t ecFallback;
+    uint32_t ecFallbacks;
+};
+
+// The profiles as clients see them: the built-in ones, which always
+// exist, and the ones saved in the settings file
+struct ProfileDirectory
+{
+    int32_t active;                     // profile last switched to or saved
+    uint32_t used;                      // bit per profile number that holds a profile
+    char names[PROFILE_COUNT][PROFILE_NAME_LENGTH];
+    uint32_t settingsWrites;            // times the settings file was replaced
+    uint32_t settingsWriteFailures;     // writes that failed and are retried later
+    int32_t automatic;                  // profile the selection rules last chose, -1 for none
+    uint32_t rejectedConfigs;           // settings that failed validation and were not applied
+};
+
+// Sequence lock around a block of plain data. Readers never block: they
+// copy the block and retry if the sequence was odd or changed meanwhile.
+// Writers must be serialized externally (the backend is the only telemetry
+// writer; config writers hold the FanControlConfigLock mutex). The payload
+// is stored as relaxed atomic words so concurrent copies are well defined.
+template <typename T>
+class Seqlock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "Seqlock payload must be trivially copyable");
+    static_assert(sizeof(T) % 8 == 0, "Seqlock payload must be a multiple of 8 bytes");
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "atomic words must match the shared layout");
+
+public:
+    // Copies a consistent snapshot into out and returns its version
+    uint32_t load(T& out) const
+    {
+        uint32_t words[WordCount];
+        for (;;) {
+            uint32_t before = seq.load(std::memory_order_acquire);
+            if (before & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            for (size_t i = 0; i < WordCount; ++i) {
+                words[i] = data[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == before) {
+                std::memcpy(&out, words, sizeof(T));
+                return before;
+            }
+        }
+    }
+
+    T load() const
+    {
+        T out;
+        load(out);
+        return out;
+    }
+
+    void store(const T& value)
+    {
+        uint32_t words[WordCount];
+        std::memcpy(words, &value, sizeof(T));
+
+        uint32_t current = seq.load(std::memory_order_relaxed);
+        seq.store(current + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WordCount; ++i) {
+            data[i].store(words[i], std::memory_order_relaxed);
+        }
+        seq.store(current + 2, std::memory_order_release);
+    }
+
+    // Changes every time the block is written; cheap to poll
+    uint32_t version() const
+    {
+        return seq.load(std::memory_order_acquire);
+    }
+
+private:
+    static const size_t WordCount = sizeof(T) / sizeof(uint32_t);
+
+    std::atomic<uint32_t> seq;
+    uint32_t reserved;
+    std::atomic<uint32_t> data[WordCount];
+};
+
+struct SharedData
+{
+    SharedHeader header;
+    Seqlock<FanConfig> config;
+    Seqlock<Telemetry> telemetry;
+    TelemetryRing<TELEMETRY_HISTORY_CAPACITY> history;
+    CommandQueue<COMMAND_LANES> commands;
+    HotPathStats stats;
+    Seqlock<ProfileDirectory> profiles;
+};
+
+static_assert(sizeof(FanConfig) == 560, "FanConfig layout changed, update ui.py");
+static_assert(sizeof(Telemetry) == 240, "Telemetry layout changed, update ui.py");
+static_assert(offsetof(SharedData, config) == 16, "SharedData layout changed, update ui.py");
+static_assert(offsetof(SharedData, telemetry) == 584, "SharedData layout changed, update ui.py");
+static_assert(sizeof(TelemetryRecord) == 88, "TelemetryRecord layout changed, update ui.py");
+static_assert(offsetof(SharedData, history) == 832, "SharedData layout changed, update ui.py");
+static_assert(sizeof(FanCommand) == 32, "FanCommand layout changed, update ui.py");
+static_assert(sizeof(CommandLane) == 3088, "CommandLane layout changed, update ui.py");
+static_assert(offsetof(SharedData, commands) == 832 + 16 + 96 * TELEMETRY_HISTORY_CAPACITY, "SharedData layout changed, update ui.py");
+static_assert(sizeof(LatencyHistogram) == 8 * LATENCY_BUCKETS + 16, "LatencyHistogram layout changed, update ui.py");
+static_assert(offsetof(SharedData, stats) == 832 + 16 + 96 * TELEMETRY_HISTORY_CAPACITY + 16 + 3088 * COMMAND_LANES, "SharedData layout changed, update ui.py");
+static_assert(sizeof(ProfileDirectory) == 216, "ProfileDirectory layout changed, update ui.py");
+static_assert(offsetof(SharedData, profiles) == offsetof(SharedData, stats) + 32 + sizeof(LatencyHistogram) * PHASE_COUNT, "SharedData layout changed, update ui.py");
+static_assert(sizeof(SharedData) == offsetof(SharedData, profiles) + 8 + sizeof(ProfileDirectory), "SharedData layout changed, update ui.py");
@@ -0,0 +1,204 @@
+#pragma once
+
+#include "EcTransport.h"
+
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <random>
+
+// In-process model of an ACPI embedded controller. It implements the
+// command/address/data state machine behind ports 0x62/0x66, keeps IBF set
+// for inputLatency after every byte the host writes and raises OBF
+// outputLatency after a read address has been consumed. The register file
+// can be inspected and modified directly by tests and the simulator.
+// Faults can be injected: an unresponsive EC never clears IBF, and with a
+// stall rate each command byte may be dropped while IBF stays set for a
+// stall time, so the host's transaction times out.
+class SimulatedEc : public PortIoEcTransport
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Timing
+    {
+        std::chrono::microseconds inputLatency{ 50 };
+        std::chrono::microseconds outputLatency{ 100 };
+    };
+
+    SimulatedEc() : SimulatedEc(Timing()) {}
+
+    explicit SimulatedEc(Timing timing)
+        : timing(timing), state(State::Idle), address(0), dataOut(0), pendingData(0),
+          pendingOutput(false), obf(false), ibfUntil(Clock::now()), obfAt(Clock::now()),
+          readCount(0), writeCount(0), protocolErrorCount(0),
+          unresponsive(false), stallRate(0), stallTime(0), stallCount(0)
+    {
+        registers.fill(0);
+    }
+
+    const char* name() const override { return "sim"; }
+
+    unsigned char peek(short reg) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return registers[reg & 0xff];
+    }
+
+    void poke(short reg, short val)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        registers[reg & 0xff] = static_cast<unsigned char>(val);
+    }
+
+    // Completed read/write transactions and bytes written while IBF was set
+    unsigned long long reads() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return readCount;
+    }
+
+    unsigned long long writes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return writeCount;
+    }
+
+    unsigned long long protocolErrors() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return protocolErrorCount;
+    }
+
+    void setUnresponsive(bool wedged)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        unresponsive = wedged;
+    }
+
+    // Drops each command byte with probability rate and holds IBF for stall
+    void setStalls(double rate, std::chrono::microseconds stall, unsigned seed = 1)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stallRate = rate;
+        stallTime = stall;
+        random.seed(seed);
+    }
+
+    // Command bytes dropped by setStalls
+    unsigned long long stalls() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stallCount;
+    }
+
+protected:
+    short inb(short port) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Clock::time_point now = Clock::now();
+        latchOutput(now);
+
+        if (port == EC_COMMAND_PORT) {
+            short status = 0;
+            if (obf) status |= EC_STATUS_OBF;
+            if (unresponsive || now < ibfUntil) status |= EC_STATUS_IBF;
+            return status;
+        }
+        if (port == EC_DATA_PORT) {
+            obf = false;
+            return dataOut;
+        }
+        return 0xff;
+    }
+
+    void outb(short port, short data) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Clock::time_point now = Clock::now();
+        latchOutput(now);
+
+        if (now < ibfUntil) {
+            ++protocolErrorCount;
+        }
+        ibfUntil = now + timing.inputLatency;
+        unsigned char value = static_cast<unsigned char>(data);
+
+        if (unresponsive) {
+            state = State::Idle;
+            return;
+        }
+
+        if (port == EC_COMMAND_PORT) {
+            if (value == EC_READ_CMD) state = State::ReadAwaitAddress;
+            else if (value == EC_WRITE_CMD) state = State::WriteAwaitAddress;
+            else state = State::Idle;
+            if (stallRate > 0 && std::uniform_real_distribution<double>(0, 1)(random) < stallRate) {
+                ibfUntil = now + stallTime;
+                state = State::Idle;
+                ++stallCount;
+            }
+            return;
+        }
+        if (port != EC_DATA_PORT) {
+            return;
+        }
+
+        switch (state) {
+        case State::ReadAwaitAddress:
+            pendingData = registers[value];
+            pendingOutput = true;
+            obfAt = ibfUntil + timing.outputLatency;
+            ++readCount;
+            state = State::Idle;
+            break;
+        case State::WriteAwaitAddress:
+            address = value;
+            state = State::WriteAwaitData;
+            break;
+        case State::WriteAwaitData:
+            registers[address] = value;
+            ++writeCount;
+            state = State::Idle;
+            break;
+        default:
+            ++protocolErrorCount;
+            break;
+        }
+    }
+
+private:
+    enum class State { Idle, ReadAwaitAddress, WriteAwaitAddress, WriteAwaitData };
+
+    void latchOutput(Clock::time_point now)
+    {
+        if (pendingOutput && now >= obfAt) {
+            dataOut = pendingData;
+            pendingOutput = false;
+            obf = true;
+        }
+    }
+
+    Timing timing;
+    mutable std::mutex mutex;
+    std::array<unsigned char, 256> registers;
+
+    State state;
+    unsigned char address;
+    unsigned char dataOut;
+    unsigned char pendingData;
+    bool pendingOutput;
+    bool obf;
+    Clock::time_point ibfUntil;
+    Clock::time_point obfAt;
+
+    unsigned long long readCount;
+    unsigned long long writeCount;
+    unsigned long long protocolErrorCount;
+
+    bool unresponsive;
+    double stallRate;
+    std::chrono::microseconds stallTime;
+    std::mt19937 random;
+    unsigned long long stallCount;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+// Fan channels the shared layout has room for
+const int MAX_CHANNELS = 4;
+
+// One control tick as seen by the history ring
+struct TelemetryRecord
+{
+    uint64_t timestampUs;               // wall clock, microseconds since the Unix epoch
+    float rawTemp[MAX_CHANNELS];        // per channel, as read from the EC
+    float filteredTemp[MAX_CHANNELS];   // what the curve controller used
+    int32_t fanCommand[MAX_CHANNELS];   // percent sent to the EC
+    float ecReadUs;                     // time spent reading the temperatures
+    float ecWriteUs;                    // time spent in EC writes during the tick
+    int32_t periodMs;                   // control period chosen after the tick
+    uint32_t scheduleReasons;           // SCHEDULE_* bits behind periodMs
+    uint32_t sensorRejected;            // bit per channel whose reading was dropped this tick
+    uint32_t sensorFaulted;             // bit per channel whose sensor is faulted
+    float sampleAgeUs;                  // temperature read to control stage
+    float actuationUs;                  // temperature read to fan write done, 0 when nothing was written
+};
+
+// Fixed-size single-producer/multi-consumer history of TelemetryRecord in
+// the shared mapping. The backend appends one record per tick; each reader
+// keeps its own cursor (the index of the next record it wants) and pulls
+// only the records it has not seen yet. Every slot carries the sequence of
+// the record it holds, so a reader that falls behind detects overwritten
+// slots instead of returning torn data.
+template <uint32_t Capacity>
+class TelemetryRing
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static_assert(sizeof(TelemetryRecord) % 8 == 0, "TelemetryRecord must be a multiple of 8 bytes");
+
+public:
+    void init()
+    {
+        capacity = Capacity;
+        recordSize = sizeof(TelemetryRecord);
+        for (uint32_t i = 0; i < Capacity; ++i) {
+            slots[i].seq.store(0, std::memory_order_relaxed);
+        }
+        head.store(0, std::memory_order_release);
+    }
+
+    // Producer side; only the backend calls this
+    void push(const TelemetryRecord& record)
+    {
+        uint64_t index = head.load(std::memory_order_relaxed);
+        Slot& slot = slots[index & (Capacity - 1)];
+
+        uint32_t words[WordCount];
+        std::memcpy(words, &record, sizeof(record));
+
+        slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WordCount; ++i) {
+            slot.data[i].store(words[i], std::memory_order_relaxed);
+        }
+        slot.seq.store(2 * index + 2, std::memory_order_release);
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    // Index one past the newest record
+    uint64_t end() const { return head.load(std::memory_order_acquire); }
+
+    // Copies up to max records starting at cursor into out and advances the
+    // cursor past them. Records that were overwritten before they could be
+    // read are skipped and added to *lost. Returns the number copied.
+    size_t read(uint64_t& cursor, TelemetryRecord* out, size_t max, uint64_t* lost = nullptr) const
+    {
+        uint64_t newest = end();
+        uint64_t oldest = newest > Capacity ? newest - Capacity : 0;
+        if (cursor > newest) {
+            // The backend restarted and the ring began again from zero
+            cursor = oldest;
+        }
+        if (cursor < oldest) {
+            if (lost) *lost += oldest - cursor;
+            cursor = oldest;
+        }
+
+        size_t count = 0;
+        uint32_t words[WordCount];
+        while (cursor < newest && count < max) {
+            const Slot& slot = slots[cursor & (Capacity - 1)];
+            uint64_t expected = 2 * cursor + 2;
+
+            bool ok = slot.seq.load(std::memory_order_acquire) == expected;
+            if (ok) {
+                for (size_t i = 0; i < WordCount; ++i) {
+                    words[i] = slot.data[i].load(std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                ok = slot.seq.load(std::memory_order_relaxed) == expected;
+            }
+            if (ok) {
+                std::memcpy(&out[count++], words, sizeof(TelemetryRecord));
+            }
+            else if (lost) {
+                ++*lost;
+            }
+            ++cursor;
+        }
+        return count;
+    }
+
+private:
+    static const size_t WordCount = sizeof(TelemetryRecord) / sizeof(uint32_t);
+
+    struct Slot
+    {
+        std::atomic<uint64_t> seq;
+        std::atomic<uint32_t> data[WordCount];
+    };
+
+    std::atomic<uint64_t> head;
+    uint32_t capacity;
+    uint32_t recordSize;
+    Slot slots[Capacity];
+};
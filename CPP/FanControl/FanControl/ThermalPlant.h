@@ -0,0 +1,289 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "EcRegisters.h"
+#include "SharedData.h"
+#include "SimulatedEc.h"
+
+// Lumped thermal model of one heat source: the die heats a heat sink
+// through a fixed conductance, and the sink loses heat to the ambient air
+// through a conductance that grows with fan airflow. The fan follows its
+// command with a first-order spin-up lag.
+struct ThermalZoneParams
+{
+    double dieCapacity;         // J/K
+    double dieToSink;           // W/K
+    double sinkCapacity;        // J/K
+    double sinkToAmbientIdle;   // W/K with the fan stopped
+    double sinkToAmbientFan;    // additional W/K at 100% fan
+    double fanLag;              // s, time constant of the fan spin-up
+
+    // What the EC firmware does when the channel is not in manual mode
+    double autoStartTemp;       // C at which the EC curve leaves 0%
+    double autoSlope;           // % per C above autoStartTemp
+};
+
+struct ThermalZone
+{
+    ThermalZoneParams params;
+    double power;       // W dissipated by the die
+    double dieTemp;     // C
+    double sinkTemp;    // C
+    double fanActual;   // % the fan is actually spinning at
+};
+
+// How the EC's temperature registers misreport the die: gaussian noise,
+// glitches (the register reads 0 or 255 for one sample, as after a failed
+// EC read) and in-range spikes of spikeSize C in either direction
+struct SensorNoiseParams
+{
+    double sensorNoise = 0.0;       // C, standard deviation added to the readings
+    double glitchRate = 0.0;        // probability per reading
+    double spikeRate = 0.0;         // probability per reading
+    double spikeSize = 15.0;        // C
+    unsigned int seed = 1;
+};
+
+class SensorNoise
+{
+public:
+    explicit SensorNoise(const SensorNoiseParams& params)
+        : params(params), rng(params.seed), noise(0.0, params.sensorNoise > 0 ? params.sensorNoise : 1.0), uniform(0.0, 1.0)
+    {
+    }
+
+    // The EC reports whole degrees in a byte
+    short reading(double temp)
+    {
+        if (params.sensorNoise > 0) temp += noise(rng);
+        if (params.spikeRate > 0 && uniform(rng) < params.spikeRate) {
+            temp += uniform(rng) < 0.5 ? -params.spikeSize : params.spikeSize;
+        }
+        if (params.glitchRate > 0 && uniform(rng) < params.glitchRate) {
+            return uniform(rng) < 0.5 ? 0 : 255;
+        }
+        return static_cast<short>(std::min(255.0, std::max(0.0, std::round(temp))));
+    }
+
+private:
+    SensorNoiseParams params;
+    std::mt19937 rng;
+    std::normal_distribution<double> noise;
+    std::uniform_real_distribution<double> uniform;
+};
+
+struct ThermalPlantParams
+{
+    double ambient = 25.0;          // C
+    double sinkCoupling = 0.5;      // W/K through the shared heat pipes
+    SensorNoiseParams sensor;
+
+    ThermalZoneParams cpu = { 50.0, 4.0, 400.0, 0.3, 1.5, 1.5, 50.0, 2.5 };
+    ThermalZoneParams gpu = { 80.0, 6.0, 500.0, 0.4, 3.5, 1.5, 45.0, 2.5 };
+};
+
+// The laptop as seen through the EC: temperatures go into the temperature
+// registers of a SimulatedEc and fan commands are taken from its mode and
+// speed registers, so the control loop cannot tell it from the real thing.
+class ThermalPlant
+{
+public:
+    // The CPU and GPU channels of registers are the two zones
+    ThermalPlant(SimulatedEc& ec, const ThermalPlantParams& params = ThermalPlantParams(),
+                 const EcRegisterMap& registers = predator_phn16_72)
+        : ec(ec), params(params), sensor(params.sensor), cpuChannel(registers.channels[CHANNEL_CPU]),
+          gpuChannel(registers.channels[CHANNEL_GPU])
+    {
+        cpuZone = { params.cpu, 0.0, params.ambient, params.ambient, 0.0 };
+        gpuZone = { params.gpu, 0.0, params.ambient, params.ambient, 0.0 };
+
+        // Power-on state: both fans under EC control
+        ec.poke(cpuChannel.fanModeReg, cpuChannel.fanModeAuto);
+        ec.poke(gpuChannel.fanModeReg, gpuChannel.fanModeAuto);
+        publish();
+    }
+
+    void setLoad(double cpuWatts, double gpuWatts)
+    {
+        cpuZone.power = cpuWatts;
+        gpuZone.power = gpuWatts;
+    }
+
+    // Start from the steady state of the current load and fan commands
+    // instead of a cold machine
+    void settle(double seconds = 3600.0, double dt = 0.5)
+    {
+        for (double t = 0; t < seconds; t += dt) step(dt);
+    }
+
+    // Advances the physics by dt seconds (explicit Euler; keep dt well
+    // below the die time constant, about 10 s with the defaults)
+    void step(double dt)
+    {
+        updateFan(cpuZone, fanTarget(cpuZone, cpuChannel), dt);
+        updateFan(gpuZone, fanTarget(gpuZone, gpuChannel), dt);
+
+        double coupling = params.sinkCoupling * (cpuZone.sinkTemp - gpuZone.sinkTemp);
+        updateZone(cpuZone, -coupling, dt);
+        updateZone(gpuZone, coupling, dt);
+        publish();
+    }
+
+    const ThermalZone& cpu() const { return cpuZone; }
+    const ThermalZone& gpu() const { return gpuZone; }
+
+private:
+    void publish()
+    {
+        ec.poke(cpuChannel.tempReg, sensor.reading(cpuZone.dieTemp));
+        ec.poke(gpuChannel.tempReg, sensor.reading(gpuZone.dieTemp));
+    }
+
+    double fanTarget(const ThermalZone& zone, const FanChannelRegisters& channel) const
+    {
+        if (ec.peek(channel.fanModeReg) == channel.fanModeManual) {
+            // The register is a byte; the EC caps anything above 100%
+            return std::min(100.0, static_cast<double>(ec.peek(channel.fanSpeedReg)));
+        }
+        double target = (zone.dieTemp - zone.params.autoStartTemp) * zone.params.autoSlope;
+        return std::min(100.0, std::max(0.0, target));
+    }
+
+    static void updateFan(ThermalZone& zone, double target, double dt)
+    {
+        double k = std::min(1.0, dt / zone.params.fanLag);
+        zone.fanActual += (target - zone.fanActual) * k;
+    }
+
+    void updateZone(ThermalZone& zone, double sinkInflow, double dt)
+    {
+        const ThermalZoneParams& p = zone.params;
+        double toSink = p.dieToSink * (zone.dieTemp - zone.sinkTemp);
+        double toAir = (p.sinkToAmbientIdle + p.sinkToAmbientFan * zone.fanActual / 100.0) * (zone.sinkTemp - params.ambient);
+
+        zone.dieTemp += (zone.power - toSink) * dt / p.dieCapacity;
+        zone.sinkTemp += (toSink + sinkInflow - toAir) * dt / p.sinkCapacity;
+    }
+
+    SimulatedEc& ec;
+    ThermalPlantParams params;
+    SensorNoise sensor;
+    FanChannelRegisters cpuChannel;
+    FanChannelRegisters gpuChannel;
+    ThermalZone cpuZone;
+    ThermalZone gpuZone;
+};
+
+// Piecewise-constant CPU/GPU power over time
+struct LoadSegment
+{
+    double duration;    // s
+    double cpuWatts;
+    double gpuWatts;
+};
+
+class LoadTrace
+{
+public:
+    LoadTrace() {}
+
+    LoadTrace(const std::string& name, const std::vector<LoadSegment>& segments)
+        : traceName(name), traceSegments(segments)
+    {
+    }
+
+    // Built-in scenarios: idle, step, gaming, bursty
+    static LoadTrace builtin(const std::string& name)
+    {
+        if (name == "idle") {
+            return LoadTrace(name, { { 1800, 8, 5 } });
+        }
+        if (name == "step") {
+            return LoadTrace(name, { { 600, 8, 5 }, { 1200, 65, 5 }, { 600, 8, 5 }, { 1200, 8, 120 }, { 600, 8, 5 } });
+        }
+        if (name == "gaming") {
+            return LoadTrace(name, { { 300, 10, 8 }, { 1800, 45, 130 }, { 600, 30, 60 }, { 1800, 50, 140 }, { 300, 10, 8 } });
+        }
+        if (name == "bursty") {
+            // Compile-like bursts: 20 s flat out, 40 s idle, for 30 minutes
+            std::vector<LoadSegment> segments;
+            for (int i = 0; i < 30; ++i) {
+                segments.push_back({ 20, 90, 5 });
+                segments.push_back({ 40, 10, 5 });
+            }
+            return LoadTrace(name, segments);
+        }
+        throw std::invalid_argument("Unknown load scenario: " + name);
+    }
+
+    static std::vector<std::string> builtinNames()
+    {
+        return { "idle", "step", "gaming", "bursty" };
+    }
+
+    // CSV with one "time_s,cpu_w,gpu_w" row per change; the last row
+    // holds until end_s, which is the time of an optional final row with
+    // no power values. A header line is skipped.
+    static LoadTrace fromCsv(const std::string& path)
+    {
+        std::ifstream file(path);
+        if (!file) {
+            throw std::runtime_error("Could not open load trace " + path);
+        }
+
+        std::vector<double> times, cpu, gpu;
+        std::string line;
+        while (std::getline(file, line)) {
+            std::replace(line.begin(), line.end(), ',', ' ');
+            std::istringstream fields(line);
+            double t, c, g;
+            if (!(fields >> t)) continue;
+            if (fields >> c >> g) {
+                times.push_back(t);
+                cpu.push_back(c);
+                gpu.push_back(g);
+            }
+            else {
+                times.push_back(t);
+                break;
+            }
+        }
+        if (cpu.empty()) {
+            throw std::runtime_error("Load trace " + path + " has no rows");
+        }
+        if (times.size() == cpu.size()) {
+            times.push_back(times.back() + 60);
+        }
+
+        std::vector<LoadSegment> segments;
+        for (size_t i = 0; i < cpu.size(); ++i) {
+            if (times[i + 1] <= times[i]) {
+                throw std::runtime_error("Load trace " + path + " times must increase");
+            }
+            segments.push_back({ times[i + 1] - times[i], cpu[i], gpu[i] });
+        }
+        return LoadTrace(path, segments);
+    }
+
+    const std::string& name() const { return traceName; }
+    const std::vector<LoadSegment>& segments() const { return traceSegments; }
+
+    double duration() const
+    {
+        double total = 0;
+        for (const LoadSegment& s : traceSegments) total += s.duration;
+        return total;
+    }
+
+private:
+    std::string traceName;
+    std::vector<LoadSegment> traceSegments;
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "EcRegisters.h"
+#include "SensorFilter.h"
+#include "SharedData.h"
+
+// EC trace file: a header with everything a replay starts from, then
+// fixed-size records in the order they were written. The records of one
+// thread are in time order; those of different threads are written in
+// batches and only roughly interleaved.
+//
+//   TraceFileHeader            headerSize bytes
+//   TraceRecord                recordCount times
+//
+// A file is created at its full size and filled through a memory mapping;
+// recordCount is updated after every batch, so a file cut short by a crash
+// still reads up to its last batch. Closing cuts the file to its records.
+const uint32_t TRACE_MAGIC = 0x52544346;    // "FCTR"
+const uint32_t TRACE_VERSION = 1;
+
+// TraceRecord::kind. EC transactions on the bus, from the thread that owns it:
+const uint16_t TRACE_EC_READ = 1;       // arg register, value the byte read, number us the transaction took
+const uint16_t TRACE_EC_WRITE = 2;      // arg register, value the byte written, number us
+// The control loop, from the control thread. A tick is the records from
+// TRACE_LOAD to TRACE_DONE; the others come between ticks.
+const uint16_t TRACE_CONFIG = 10;       // value profile number, arg the records of raw FanConfig bytes that follow
+const uint16_t TRACE_FORCE = 11;        // arg channel, value fan % (-1 hands the fan back to its controller)
+const uint16_t TRACE_LOAD = 12;         // number CPU load %
+const uint16_t TRACE_TICK = 13;         // number tick time s, value TRACE_TICK_* bits
+const uint16_t TRACE_FRAME = 14;        // arg temperature register, value the reading the tick used
+const uint16_t TRACE_LOOP_WRITE = 15;   // arg register, value the loop wrote (before the shadow elides it)
+const uint16_t TRACE_FAN = 16;          // arg channel, value fan command (-1 with the EC), number filtered temperature C
+const uint16_t TRACE_DONE = 17;         // value TRACE_DONE_* bits, held mask << 8, forced mask << 16; number next period ms
+
+// Added to the kind of an EC transaction, loop write or frame that failed
+const uint16_t TRACE_FAILED = 0x100;
+// Added to the kind of a frame or loop write after which the EC watchdog
+// was tripped
+const uint16_t TRACE_TRIPPED = 0x200;
+
+// The TRACE_* kind without the flags
+inline uint16_t traceKind(uint16_t kind) { return kind & 0xff; }
+
+// TRACE_TICK::value
+const int32_t TRACE_TICK_TRIPPED = 1;   // the EC watchdog was tripped as the tick started
+const int32_t TRACE_TICK_BATTERY = 2;   // on battery power
+
+// TRACE_DONE::value
+const int32_t TRACE_DONE_IDLE = 1;
+const int32_t TRACE_DONE_FALLBACK = 2;
+const int32_t TRACE_DONE_EC_FAILED = 4;
+const int32_t TRACE_DONE_TRIPPED = 8;   // the EC watchdog was tripped as the tick ended
+
+struct TraceRecord
+{
+    uint64_t timeUs;    // since the run started
+    uint16_t kind;      // TRACE_*
+    uint16_t arg;
+    int32_t value;
+    double number;
+};
+static_assert(sizeof(TraceRecord) == 24, "TraceRecord is part of the trace file format");
+
+// Records of raw bytes a FanConfig takes in a TRACE_CONFIG group
+const uint16_t TRACE_CONFIG_RECORDS = static_cast<uint16_t>((sizeof(FanConfig) + sizeof(TraceRecord) - 1) / sizeof(TraceRecord));
+
+struct TraceFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;        // offset of the first record
+    uint32_t recordSize;
+    uint64_t runId;             // us since the epoch the run started, the same in every file of the run
+    uint32_t sequence;          // 0 for the file the run started with
+    uint32_t complete;          // 1 once the file was closed
+    uint64_t recordCount;       // records in the file, updated after every batch
+    uint64_t dropped;           // records lost to full buffers in the run up to this file's last batch
+
+    // The state the file starts from
+    int32_t profile;                        // of config, -1 for edited settings
+    int32_t forced[MAX_CHANNELS];           // % per channel, -1 when not forced
+    int32_t channelCount;                   // registers in use
+    int16_t registers[MAX_CHANNELS][5];     // per channel: temperature, fan mode, automatic, manual, fan speed
+    uint32_t configSize;
+    uint32_t sensorSize;
+    FanConfig config;
+    SensorPipeline::Params sensor;
+};
+
+inline uint32_t traceHeaderSize() { return static_cast<uint32_t>((sizeof(TraceFileHeader) + 63) & ~size_t(63)); }
+
+inline void setTraceRegisters(TraceFileHeader& header, const EcRegisterMap& registers)
+{
+    header.channelCount = registers.channelCount;
+    for (int c = 0; c < registers.channelCount; ++c) {
+        const FanChannelRegisters& channel = registers.channels[c];
+        int16_t values[5] = { channel.tempReg, channel.fanModeReg, channel.fanModeAuto, channel.fanModeManual, channel.fanSpeedReg };
+        std::memcpy(header.registers[c], values, sizeof(values));
+    }
+}
+
+inline EcRegisterMap traceRegisters(const TraceFileHeader& header)
+{
+    EcRegisterMap registers = {};
+    registers.channelCount = std::max(0, std::min(MAX_CHANNELS, static_cast<int>(header.channelCount)));
+    for (int c = 0; c < registers.channelCount; ++c) {
+        const int16_t* r = header.registers[c];
+        registers.channels[c] = { ec_channel_names[c], r[0], r[1], r[2], r[3], r[4] };
+    }
+    return registers;
+}
+
+// A trace file being written. Throws std::runtime_error when the file
+// cannot be created or mapped.
+class MappedTraceFile
+{
+public:
+    MappedTraceFile(const std::string& path, size_t capacity, const TraceFileHeader& header)
+        : path(path), capacity(capacity), view(nullptr)
+    {
+        if (capacity < traceHeaderSize() + sizeof(TraceRecord)) throw std::runtime_error("trace file cap too small");
+        map();
+        std::memset(view, 0, traceHeaderSize());
+        std::memcpy(view, &header, sizeof(header));
+        TraceFileHeader& h = head();
+        h.magic = TRACE_MAGIC;
+        h.version = TRACE_VERSION;
+        h.headerSize = traceHeaderSize();
+        h.recordSize = sizeof(TraceRecord);
+        h.complete = 0;
+        h.recordCount = 0;
+        h.configSize = sizeof(FanConfig);
+        h.sensorSize = sizeof(SensorPipeline::Params);
+        used = 0;
+    }
+
+    ~MappedTraceFile() { close(); }
+
+    MappedTraceFile(const MappedTraceFile&) = delete;
+    MappedTraceFile& operator=(const MappedTraceFile&) = delete;
+
+    const std::string& name() const { return path; }
+
+    // Records that still fit
+    size_t room() const { return (capacity - traceHeaderSize()) / sizeof(TraceRecord) - used; }
+
+    // count must not exceed room(); the records are counted by publish
+    void append(const TraceRecord* records, size_t count)
+    {
+        std::memcpy(view + traceHeaderSize() + used * sizeof(TraceRecord), records, count * sizeof(TraceRecord));
+        used += count;
+    }
+
+    // Makes the appended records part of the file
+    void publish(uint64_t dropped)
+    {
+        std::atomic_thread_fence(std::memory_order_release);
+        head().dropped = dropped;
+        head().recordCount = used;
+    }
+
+    // Marks the file complete and cuts it to its records
+    void close()
+    {
+        if (!view) return;
+        head().complete = 1;
+        unmap(traceHeaderSize() + used * sizeof(TraceRecord));
+    }
+
+private:
+    TraceFileHeader& head() { return *reinterpret_cast<TraceFileHeader*>(view); }
+
+#ifdef _WIN32
+    void map()
+    {
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("Could not create trace file " + path);
+        LARGE_INTEGER size;
+        size.QuadPart = static_cast<LONGLONG>(capacity);
+        mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, static_cast<DWORD>(size.HighPart), size.LowPart, NULL);
+        if (mapping) view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, capacity));
+        if (!view) {
+            if (mapping) CloseHandle(mapping);
+            CloseHandle(file);
+            DeleteFileA(path.c_str());
+            throw std::runtime_error("Could not map trace file " + path);
+        }
+    }
+
+    void unmap(size_t length)
+    {
+        FlushViewOfFile(view, 0);
+        UnmapViewOfFile(view);
+        CloseHandle(mapping);
+        view = nullptr;
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(length);
+        SetFilePointerEx(file, end, NULL, FILE_BEGIN);
+        SetEndOfFile(file);
+        CloseHandle(file);
+    }
+
+    HANDLE file;
+    HANDLE mapping;
+#else
+    void map()
+    {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) throw std::runtime_error("Could not create trace file " + path);
+        void* mapped = MAP_FAILED;
+        if (::ftruncate(fd, static_cast<off_t>(capacity)) == 0) {
+            mapped = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (mapped == MAP_FAILED) {
+            ::close(fd);
+            std::remove(path.c_str());
+            throw std::runtime_error("Could not map trace file " + path);
+        }
+        view = static_cast<char*>(mapped);
+    }
+
+    void unmap(size_t length)
+    {
+        ::msync(view, capacity, MS_SYNC);
+        ::munmap(view, capacity);
+        view = nullptr;
+        if (::ftruncate(fd, static_cast<off_t>(length)) != 0) {
+            // The file keeps its unused tail; recordCount still says where the records end
+        }
+        ::close(fd);
+    }
+
+    int fd;
+#endif
+
+    std::string path;
+    size_t capacity;
+    char* view;
+    size_t used;
+};
+
+// A trace file read back
+struct TraceFile
+{
+    std::string path;
+    TraceFileHeader header;
+    std::vector<TraceRecord> records;
+};
+
+// Throws std::runtime_error for a file that is not a trace this build can read
+inline TraceFile readTraceFile(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Could not open trace file " + path);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    TraceFile trace;
+    trace.path = path;
+    if (bytes.size() < sizeof(TraceFileHeader)) throw std::runtime_error(path + " is not a trace file");
+    std::memcpy(&trace.header, bytes.data(), sizeof(TraceFileHeader));
+    const TraceFileHeader& h = trace.header;
+    if (h.magic != TRACE_MAGIC) throw std::runtime_error(path + " is not a trace file");
+    if (h.version != TRACE_VERSION || h.recordSize != sizeof(TraceRecord) || h.configSize != sizeof(FanConfig) ||
+        h.sensorSize != sizeof(SensorPipeline::Params) || h.headerSize < sizeof(TraceFileHeader) || h.headerSize > bytes.size()) {
+        throw std::runtime_error(path + " was written by another version of the backend");
+    }
+
+    size_t count = std::min<uint64_t>(h.recordCount, (bytes.size() - h.headerSize) / sizeof(TraceRecord));
+    trace.records.resize(count);
+    if (count) std::memcpy(trace.records.data(), bytes.data() + h.headerSize, count * sizeof(TraceRecord));
+    return trace;
+}
@@ -0,0 +1,502 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ControlLoop.h"
+#include "EcTransport.h"
+#include "EcWatchdog.h"
+#include "TraceFile.h"
+
+// One thread's records on their way to the trace file: a bounded
+// single-producer/single-consumer ring. Posting never waits; a group of
+// records that does not fit is dropped whole and counted.
+class TraceLane
+{
+public:
+    static const size_t Capacity = 16384;
+
+    TraceLane() : ring(new TraceRecord[Capacity]), head(0), tail(0), dropCount(0) {}
+
+    // Producer: all count records or none of them
+    bool post(const TraceRecord* records, size_t count)
+    {
+        uint64_t index = head.load(std::memory_order_relaxed);
+        if (Capacity - (index - tail.load(std::memory_order_acquire)) < count) {
+            dropCount.fetch_add(count, std::memory_order_relaxed);
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i) ring[(index + i) & (Capacity - 1)] = records[i];
+        head.store(index + count, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: moves every record posted so far to out, which holds Capacity
+    size_t take(TraceRecord* out)
+    {
+        uint64_t start = tail.load(std::memory_order_relaxed);
+        uint64_t end = head.load(std::memory_order_acquire);
+        for (uint64_t i = start; i < end; ++i) out[i - start] = ring[i & (Capacity - 1)];
+        tail.store(end, std::memory_order_release);
+        return static_cast<size_t>(end - start);
+    }
+
+    uint64_t dropped() const { return dropCount.load(std::memory_order_relaxed); }
+
+    // Producer: count records lost before they could be posted
+    void drop(size_t count) { dropCount.fetch_add(count, std::memory_order_relaxed); }
+
+    // Records posted and not taken yet
+    size_t pending() const
+    {
+        return static_cast<size_t>(head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire));
+    }
+
+private:
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    std::unique_ptr<TraceRecord[]> ring;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropCount;
+};
+
+// TraceRecorder lanes
+const int TRACE_LANE_BUS = 0;       // the thread that owns the EC bus
+const int TRACE_LANE_CONTROL = 1;   // the control stage
+const int TRACE_LANES = 2;
+
+struct TraceRecorderParams
+{
+    std::string prefix;                 // files are <prefix>_<YYYYMMDD-HHMMSS>_<sequence>.bin
+    size_t fileBytes = 16u << 20;       // a file this full is closed and the next one started
+    int keepFiles = 4;                  // newest files of the run kept besides its first
+    std::chrono::milliseconds flushInterval = std::chrono::milliseconds(200);
+
+    TraceRecorderParams() {}
+};
+
+// What a trace starts from
+struct TraceStart
+{
+    FanConfig config;
+    int32_t profile;
+    EcRegisterMap registers;
+    SensorPipeline::Params sensor;
+};
+
+// Appends what the lanes are given to memory-mapped trace files. The
+// threads being recorded only copy records into their lane; a thread of
+// the recorder's own moves them to the file every flushInterval, so
+// recording costs a tick no system calls. When a file reaches fileBytes
+// it is closed and the next one is started with the settings and forced
+// speeds in effect, as a TRACE_CONFIG group is never split. The first
+// file of a run is always kept, since a replay starts from it, and so
+// are the newest keepFiles others.
+class TraceRecorder
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Throws std::runtime_error when the first file cannot be created
+    TraceRecorder(const TraceRecorderParams& params, const TraceStart& start, Clock::time_point origin = Clock::now())
+        : params(params), origin(origin), staging(new TraceRecord[TraceLane::Capacity]), stopping(false), draining(false),
+          drains(0), wanted(0), broken(false)
+    {
+        // Room for the largest group, a TRACE_CONFIG, and then some
+        this->params.fileBytes = std::max<size_t>(params.fileBytes, 64u << 10);
+        header = {};
+        header.runId = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        header.profile = start.profile;
+        for (int c = 0; c < MAX_CHANNELS; ++c) header.forced[c] = -1;
+        setTraceRegisters(header, start.registers);
+        header.config = start.config;
+        header.sensor = start.sensor;
+
+        std::time_t now = std::time(nullptr);
+        std::tm local = {};
+#ifdef _WIN32
+        localtime_s(&local, &now);
+#else
+        localtime_r(&now, &local);
+#endif
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+        stem = params.prefix + "_" + stamp + "_";
+
+        open();
+        writer = std::thread([this] { run(); });
+    }
+
+    ~TraceRecorder() { close(); }
+
+    TraceLane& lane(int index) { return lanes[index]; }
+
+    // Time stamp for a record made now
+    uint64_t elapsedUs() const
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - origin).count());
+    }
+
+    // Writes what the lanes still hold and closes the file. Nothing may be
+    // posted afterwards.
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return;
+            stopping = true;
+        }
+        wake.notify_all();
+        drained.notify_all();
+        writer.join();
+    }
+
+    // A lane is more than half full. Recording faster than real time, as
+    // the simulator does, flushes then instead of losing records.
+    bool backlogged() const
+    {
+        for (const TraceLane& l : lanes) {
+            if (l.pending() > TraceLane::Capacity / 2) return true;
+        }
+        return false;
+    }
+
+    // Waits until everything posted before the call is in the file
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        // A drain under way may have taken the lanes before the last post
+        uint64_t target = drains + (draining ? 2 : 1);
+        wanted = std::max(wanted, target);
+        wake.notify_all();
+        drained.wait(lock, [&] { return drains >= target || stopping; });
+    }
+
+    uint64_t dropped() const
+    {
+        uint64_t count = 0;
+        for (const TraceLane& l : lanes) count += l.dropped();
+        return count;
+    }
+
+    // The files written so far, oldest first; only complete after close()
+    std::vector<std::string> files() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return written;
+    }
+
+    // The recorder gave up because a file could not be created
+    bool failed() const { return broken.load(); }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            wake.wait_for(lock, params.flushInterval, [this] { return stopping || wanted > drains; });
+            draining = true;
+            lock.unlock();
+            drain();
+            lock.lock();
+            draining = false;
+            ++drains;
+            drained.notify_all();
+        }
+        lock.unlock();
+        drain();
+        if (file) file->close();
+    }
+
+    void drain()
+    {
+        for (TraceLane& l : lanes) {
+            size_t count = l.take(staging.get());
+            if (!broken) append(staging.get(), count);
+        }
+        if (file) file->publish(dropped());
+    }
+
+    // Appends records, starting the next file when one is full. A group
+    // too large for an empty file cannot be recorded and is left out.
+    void append(const TraceRecord* records, size_t count)
+    {
+        size_t empty = (params.fileBytes - traceHeaderSize()) / sizeof(TraceRecord);
+        for (size_t i = 0; i < count; ) {
+            size_t group = records[i].kind == TRACE_CONFIG ? std::min<size_t>(count - i, 1u + records[i].arg) : 1;
+            if (group > file->room() && file->room() < empty) {
+                try {
+                    rotate();
+                }
+                catch (const std::runtime_error&) {
+                    broken = true;
+                    return;
+                }
+            }
+            if (group <= file->room()) {
+                track(records + i, group);
+                file->append(records + i, group);
+            }
+            i += group;
+        }
+    }
+
+    // Follows the state the next file starts from
+    void track(const TraceRecord* group, size_t count)
+    {
+        if (group->kind == TRACE_CONFIG && count == 1u + TRACE_CONFIG_RECORDS) {
+            std::memcpy(&header.config, group + 1, sizeof(FanConfig));
+            header.profile = group->value;
+        }
+        else if (group->kind == TRACE_FORCE && group->arg < MAX_CHANNELS) {
+            header.forced[group->arg] = group->value;
+        }
+    }
+
+    void open()
+    {
+        std::string path = stem + std::to_string(header.sequence) + ".bin";
+        file.reset(new MappedTraceFile(path, params.fileBytes, header));
+        std::lock_guard<std::mutex> lock(mutex);
+        written.push_back(path);
+    }
+
+    void rotate()
+    {
+        file->publish(dropped());
+        file->close();
+        file.reset();
+        ++header.sequence;
+        open();
+
+        // Keeps the first file and the newest keepFiles others
+        std::lock_guard<std::mutex> lock(mutex);
+        while (written.size() > static_cast<size_t>(std::max(1, params.keepFiles)) + 1) {
+            std::remove(written[1].c_str());
+            written.erase(written.begin() + 1);
+        }
+    }
+
+    TraceRecorderParams params;
+    Clock::time_point origin;
+    TraceFileHeader header;     // of the next file, following the records written
+    std::string stem;
+    TraceLane lanes[TRACE_LANES];
+    std::unique_ptr<TraceRecord[]> staging;
+    std::unique_ptr<MappedTraceFile> file;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    bool stopping;
+    bool draining;
+    uint64_t drains;
+    uint64_t wanted;
+    std::atomic<bool> broken;
+    std::vector<std::string> written;
+    std::thread writer;
+};
+
+// Records every transaction on the EC bus into the recorder's bus lane,
+// once one is set. Wraps the EC driver under the EcBusArbiter, whose
+// worker is the only thread to call it.
+class RecordingEcTransport : public EcTransport
+{
+public:
+    explicit RecordingEcTransport(EcTransport& inner) : inner(inner), recorder(nullptr) {}
+
+    const char* name() const override { return inner.name(); }
+
+    // nullptr stops recording
+    void setRecorder(TraceRecorder* r) { recorder.store(r, std::memory_order_release); }
+
+    short read(short reg) override
+    {
+        short value = 0;
+        readBlock(&reg, 1, &value);
+        return value;
+    }
+
+    void write(short reg, short val) override
+    {
+        TraceRecorder* r = recorder.load(std::memory_order_acquire);
+        if (!r) {
+            inner.write(reg, val);
+            return;
+        }
+        uint64_t start = r->elapsedUs();
+        try {
+            inner.write(reg, val);
+        }
+        catch (const std::runtime_error&) {
+            record(*r, TRACE_EC_WRITE | TRACE_FAILED, reg, val, start);
+            throw;
+        }
+        record(*r, TRACE_EC_WRITE, reg, val, start);
+    }
+
+    void readBlock(const short* regs, size_t count, short* values) override
+    {
+        TraceRecorder* r = recorder.load(std::memory_order_acquire);
+        if (!r) {
+            inner.readBlock(regs, count, values);
+            return;
+        }
+        uint64_t start = r->elapsedUs();
+        try {
+            inner.readBlock(regs, count, values);
+        }
+        catch (const std::runtime_error&) {
+            // Which register failed is not known; the block is one record
+            record(*r, TRACE_EC_READ | TRACE_FAILED, count ? regs[0] : 0, -1, start);
+            throw;
+        }
+        for (size_t i = 0; i < count; ++i) record(*r, TRACE_EC_READ, regs[i], values[i], start);
+    }
+
+private:
+    void record(TraceRecorder& r, uint16_t kind, short reg, short value, uint64_t start)
+    {
+        TraceRecord entry = { start, kind, static_cast<uint16_t>(reg & 0xff), value, static_cast<double>(r.elapsedUs() - start) };
+        r.lane(TRACE_LANE_BUS).post(&entry, 1);
+    }
+
+    EcTransport& inner;
+    std::atomic<TraceRecorder*> recorder;
+};
+
+// The control loop's transport while recording, and what records its
+// ticks: each tick's inputs (load, battery, watchdog, the temperatures it
+// read), the writes the loop made and its decisions go to the control lane
+// as one group, which is what a replay needs to run the tick again. Every
+// call does nothing but pass EC transactions on until a recorder is set.
+class TickTrace : public EcTransport
+{
+public:
+    explicit TickTrace(EcTransport& inner) : inner(inner), recorder(nullptr), watchdog(nullptr), count(0) {}
+
+    const char* name() const override { return inner.name(); }
+
+    // Set before the first tick; nullptr stops recording
+    void setRecorder(TraceRecorder* r) { recorder = r; }
+
+    // The loop's watchdog, whose state after each of the loop's
+    // transactions is recorded with it
+    void setWatchdog(const EcWatchdog* w) { watchdog = w; }
+
+    short read(short reg) override { return inner.read(reg); }
+
+    // The loop reading its own temperatures records them as the tick's frame
+    void readBlock(const short* regs, size_t n, short* values) override
+    {
+        try {
+            inner.readBlock(regs, n, values);
+        }
+        catch (const std::runtime_error&) {
+            // The loop runs the tick on zeros
+            for (size_t i = 0; i < n; ++i) add(TRACE_FRAME | TRACE_FAILED | trippedFlag(), regs[i], 0, 0);
+            throw;
+        }
+        for (size_t i = 0; i < n; ++i) add(TRACE_FRAME | trippedFlag(), regs[i], values[i], 0);
+    }
+
+    void write(short reg, short val) override
+    {
+        try {
+            inner.write(reg, val);
+        }
+        catch (const std::runtime_error&) {
+            add(TRACE_LOOP_WRITE | TRACE_FAILED | trippedFlag(), reg, val, 0);
+            throw;
+        }
+        add(TRACE_LOOP_WRITE | trippedFlag(), reg, val, 0);
+    }
+
+    // The loop runs on config from the next tick on
+    void recordConfig(const FanConfig& config, int32_t profile)
+    {
+        if (!recorder) return;
+        TraceRecord group[1 + TRACE_CONFIG_RECORDS] = {};
+        group[0] = { recorder->elapsedUs(), TRACE_CONFIG, TRACE_CONFIG_RECORDS, profile, 0 };
+        std::memcpy(group + 1, &config, sizeof(FanConfig));
+        recorder->lane(TRACE_LANE_CONTROL).post(group, 1 + TRACE_CONFIG_RECORDS);
+    }
+
+    // ControlLoop::forceFan accepted percent for channel
+    void recordForce(int channel, int percent)
+    {
+        if (!recorder) return;
+        TraceRecord entry = { recorder->elapsedUs(), TRACE_FORCE, static_cast<uint16_t>(channel), percent, 0 };
+        recorder->lane(TRACE_LANE_CONTROL).post(&entry, 1);
+    }
+
+    // Before ControlLoop::tick(now, cpuLoad, ...); tripped is the
+    // watchdog's state, false without one
+    void beginTick(double now, double cpuLoad, bool onBattery, bool tripped)
+    {
+        count = 0;
+        add(TRACE_LOAD, 0, 0, cpuLoad);
+        add(TRACE_TICK, 0, (tripped ? TRACE_TICK_TRIPPED : 0) | (onBattery ? TRACE_TICK_BATTERY : 0), now);
+    }
+
+    // The temperatures of a tick run on a frame read by another thread
+    void recordFrame(const EcSnapshot& frame, const EcRegisterMap& registers, int channels)
+    {
+        for (int c = 0; c < channels; ++c) {
+            short reg = registers.channels[c].tempReg;
+            add(TRACE_FRAME | trippedFlag(), reg, frame[reg], 0);
+        }
+    }
+
+    // After the tick, with the period the scheduler picked from it
+    void endTick(const ControlTickResult& result, bool tripped, int periodMs)
+    {
+        for (int c = 0; c < result.channelCount; ++c) add(TRACE_FAN, static_cast<short>(c), result.fan[c], result.temp[c]);
+        int32_t state = (result.idle ? TRACE_DONE_IDLE : 0) | (result.fallback ? TRACE_DONE_FALLBACK : 0) |
+                        (result.ecFailed ? TRACE_DONE_EC_FAILED : 0) | (tripped ? TRACE_DONE_TRIPPED : 0) |
+                        static_cast<int32_t>((result.held & 0xff) << 8) | static_cast<int32_t>((result.forced & 0xff) << 16);
+        add(TRACE_DONE, 0, state, periodMs);
+        if (recorder) {
+            // A tick that outgrew the buffer cannot be replayed; it is lost like one that did not fit the lane
+            if (count <= MaxRecords) recorder->lane(TRACE_LANE_CONTROL).post(records, count);
+            else recorder->lane(TRACE_LANE_CONTROL).drop(count);
+        }
+        count = 0;
+    }
+
+private:
+    // More than any tick makes: load, tick and done, and per channel a
+    // frame, a fan and at most four writes (mode and speed, then the
+    // hand-back's)
+    static const size_t MaxRecords = 64;
+    static_assert(MaxRecords >= 3 + 6 * MAX_CHANNELS, "a tick's records must fit");
+
+    uint16_t trippedFlag() const { return recorder && watchdog && watchdog->tripped() ? TRACE_TRIPPED : 0; }
+
+    void add(uint16_t kind, short arg, int32_t value, double number)
+    {
+        if (!recorder) return;
+        if (count < MaxRecords) records[count] = { recorder->elapsedUs(), kind, static_cast<uint16_t>(arg & 0xff), value, number };
+        ++count;
+    }
+
+    EcTransport& inner;
+    TraceRecorder* recorder;
+    const EcWatchdog* watchdog;
+    TraceRecord records[MaxRecords];
+    size_t count;
+};
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ControlLoop.h"
+#include "EcWatchdog.h"
+#include "SampleScheduler.h"
+#include "SimulatedEc.h"
+#include "TraceFile.h"
+
+// What replaying a trace found
+struct TraceReplayResult
+{
+    unsigned long long ticks = 0;
+    unsigned long long mismatches = 0;      // ticks whose decisions differ from the trace
+    unsigned long long busTransactions = 0; // EC transactions in the trace
+    unsigned long long busFailures = 0;
+    unsigned long long dropped = 0;         // records the recorder lost
+    bool fromStart = false;                 // the trace starts with the run, so the loop starts where it did
+    double traceSeconds = 0;                // tick time covered
+    double wallSeconds = 0;
+    std::string firstMismatch;
+};
+
+// The EC a replayed tick runs against: a SimulatedEc holding the
+// temperatures the tick read. Writes go to the simulated EC and are
+// checked against the ones the trace has the loop making; a read or write
+// the trace has failing fails again. After each of them the watchdog is
+// put in the state the trace has after it, which is where the loop looks.
+class ReplayEc : public EcTransport
+{
+public:
+    ReplayEc(SimulatedEc& ec, EcWatchdog& watchdog) : ec(ec), watchdog(watchdog), next(0), readFails(false), readTripped(false), wrong(false) {}
+
+    const char* name() const override { return "replay"; }
+
+    // The tick to come: its frame's first record and the writes the trace has
+    void expect(const TraceRecord& frame, const std::vector<TraceRecord>& tickWrites)
+    {
+        readFails = (frame.kind & TRACE_FAILED) != 0;
+        readTripped = (frame.kind & TRACE_TRIPPED) != 0;
+        writes = tickWrites;
+        next = 0;
+        wrong = false;
+    }
+
+    // The writes differed from the trace's
+    bool mismatched() const { return wrong || next != writes.size(); }
+
+    short read(short reg) override { return ec.read(reg); }
+
+    void readBlock(const short* regs, size_t count, short* values) override
+    {
+        follow(readTripped);
+        if (readFails) throw std::runtime_error("EC read failed in the trace");
+        ec.readBlock(regs, count, values);
+    }
+
+    void write(short reg, short val) override
+    {
+        if (next >= writes.size() || writes[next].arg != (reg & 0xff) || writes[next].value != val) {
+            wrong = true;
+            ec.write(reg, val);
+            return;
+        }
+        const TraceRecord& recorded = writes[next++];
+        follow((recorded.kind & TRACE_TRIPPED) != 0);
+        if (recorded.kind & TRACE_FAILED) throw std::runtime_error("EC write failed in the trace");
+        ec.write(reg, val);
+    }
+
+    // The watchdog trips on one failure and clears on one success
+    void follow(bool tripped)
+    {
+        if (tripped && !watchdog.tripped()) watchdog.failed();
+        if (!tripped && watchdog.tripped()) watchdog.succeeded();
+    }
+
+private:
+    SimulatedEc& ec;
+    EcWatchdog& watchdog;
+    std::vector<TraceRecord> writes;
+    size_t next;
+    bool readFails;
+    bool readTripped;
+    bool wrong;
+};
+
+// Puts the files of one run in order; throws std::invalid_argument when
+// they are from different runs or one in between is missing
+inline void orderTraceFiles(std::vector<TraceFile>& files)
+{
+    if (files.empty()) throw std::invalid_argument("no trace files");
+    std::sort(files.begin(), files.end(), [](const TraceFile& a, const TraceFile& b) { return a.header.sequence < b.header.sequence; });
+    for (size_t i = 1; i < files.size(); ++i) {
+        if (files[i].header.runId != files[0].header.runId) throw std::invalid_argument(files[i].path + " is from another run");
+        if (files[i].header.sequence != files[i - 1].header.sequence + 1) {
+            throw std::invalid_argument("the trace file after " + files[i - 1].path + " is missing");
+        }
+    }
+}
+
+// Runs the control loop of the trace again, tick by tick, on the
+// temperatures, load and battery state each tick had, through a
+// simulated EC, and compares every decision with the recorded one: the
+// fan commands, filtered temperatures (bit for bit), EC writes, idle,
+// fallback and forced states and the next control period. files are the
+// consecutive files of one run (orderTraceFiles). The loop starts from
+// the state of the first file; only a trace from the start of a run
+// starts it where the backend's was, so later files may disagree until
+// the filters have forgotten the difference.
+inline TraceReplayResult replayTrace(const std::vector<TraceFile>& files)
+{
+    typedef std::chrono::steady_clock Clock;
+    const TraceFileHeader& start = files.front().header;
+
+    TraceReplayResult result;
+    result.fromStart = start.sequence == 0;
+    result.dropped = files.back().header.dropped;
+
+    SimulatedEc::Timing timing;
+    timing.inputLatency = std::chrono::microseconds(0);
+    timing.outputLatency = std::chrono::microseconds(0);
+    SimulatedEc ec(timing);
+
+    // Trips on one failure and clears on one success, so its state follows the trace's
+    EcWatchdogParams watchdogParams;
+    watchdogParams.failLimit = 1;
+    watchdogParams.recoverAfter = 1;
+    EcWatchdog watchdog(watchdogParams);
+    ReplayEc replay(ec, watchdog);
+
+    ControlLoop loop(replay, start.config, start.sensor);
+    EcRegisterMap registers = traceRegisters(start);
+    loop.setRegisters(registers);
+    loop.setWatchdog(&watchdog);
+    for (int c = 0; c < MAX_CHANNELS; ++c) {
+        if (start.forced[c] >= 0) loop.forceFan(c, start.forced[c]);
+    }
+    SampleScheduler scheduler(start.config);
+
+    double firstTick = -1, lastTick = 0;
+    std::vector<TraceRecord> tick, writes;
+    Clock::time_point wallStart = Clock::now();
+
+    auto mismatch = [&](double now, const std::string& what) {
+        if (result.firstMismatch.empty()) {
+            std::ostringstream text;
+            text << "tick " << result.ticks << " at " << now << " s: " << what;
+            result.firstMismatch = text.str();
+        }
+    };
+
+    auto runTick = [&]() {
+        double load = 0, now = 0;
+        int32_t inputs = 0, done = -1;
+        bool haveTick = false, haveFrame = false;
+        TraceRecord frame = {};
+        double periodMs = 0;
+        int fans[MAX_CHANNELS];
+        double temps[MAX_CHANNELS];
+        int fanCount = 0;
+        writes.clear();
+        for (const TraceRecord& r : tick) {
+            switch (traceKind(r.kind)) {
+            case TRACE_LOAD: load = r.number; break;
+            case TRACE_TICK: now = r.number; inputs = r.value; haveTick = true; break;
+            case TRACE_FRAME:
+                ec.poke(static_cast<short>(r.arg), static_cast<short>(r.value));
+                if (!haveFrame) frame = r;
+                haveFrame = true;
+                break;
+            case TRACE_LOOP_WRITE: writes.push_back(r); break;
+            case TRACE_FAN:
+                if (fanCount < MAX_CHANNELS) {
+                    fans[fanCount] = r.value;
+                    temps[fanCount++] = r.number;
+                }
+                break;
+            case TRACE_DONE: done = r.value; periodMs = r.number; break;
+            }
+        }
+        tick.clear();
+        // A tick cut off by the start of the first file
+        if (!haveTick || done < 0) return;
+
+        bool trippedBefore = (inputs & TRACE_TICK_TRIPPED) != 0;
+        bool trippedAfter = (done & TRACE_DONE_TRIPPED) != 0;
+        replay.follow(trippedBefore);
+        loop.setOnBattery((inputs & TRACE_TICK_BATTERY) != 0);
+        // A tick without a frame had no channels to read; it keeps the state it started with
+        if (!haveFrame) frame.kind = TRACE_FRAME | (trippedBefore ? TRACE_TRIPPED : 0);
+        replay.expect(frame, writes);
+
+        ControlTickResult replayed = loop.tick(now, load);
+        int nextPeriod = scheduler.next(now, replayed.fast, replayed.channelCount, load, replayed.idle || replayed.fallback);
+
+        int32_t state = (replayed.idle ? TRACE_DONE_IDLE : 0) | (replayed.fallback ? TRACE_DONE_FALLBACK : 0) |
+                        (replayed.ecFailed ? TRACE_DONE_EC_FAILED : 0) | (trippedAfter ? TRACE_DONE_TRIPPED : 0) |
+                        static_cast<int32_t>((replayed.held & 0xff) << 8) | static_cast<int32_t>((replayed.forced & 0xff) << 16);
+        bool same = true;
+        if (replayed.channelCount != fanCount) {
+            mismatch(now, "channel count differs");
+            same = false;
+        }
+        for (int c = 0; c < std::min(fanCount, replayed.channelCount) && same; ++c) {
+            if (replayed.fan[c] != fans[c]) {
+                mismatch(now, std::string(registers.channels[c].name) + " fan " + std::to_string(replayed.fan[c]) +
+                         "%, recorded " + std::to_string(fans[c]) + "%");
+                same = false;
+            }
+            else if (std::memcmp(&replayed.temp[c], &temps[c], sizeof(double)) != 0) {
+                mismatch(now, std::string(registers.channels[c].name) + " filtered temperature differs");
+                same = false;
+            }
+        }
+        if (same && state != done) {
+            mismatch(now, "idle, fallback, held or forced state differs");
+            same = false;
+        }
+        if (same && replay.mismatched()) {
+            mismatch(now, "EC writes differ");
+            same = false;
+        }
+        if (same && nextPeriod != static_cast<int>(periodMs)) {
+            mismatch(now, "control period " + std::to_string(nextPeriod) + " ms, recorded " + std::to_string(static_cast<int>(periodMs)) + " ms");
+            same = false;
+        }
+        if (!same) ++result.mismatches;
+        ++result.ticks;
+        if (firstTick < 0) firstTick = now;
+        lastTick = now;
+    };
+
+    for (const TraceFile& file : files) {
+        const std::vector<TraceRecord>& records = file.records;
+        for (size_t i = 0; i < records.size(); ++i) {
+            const TraceRecord& r = records[i];
+            switch (traceKind(r.kind)) {
+            case TRACE_EC_READ:
+            case TRACE_EC_WRITE:
+                ++result.busTransactions;
+                if (r.kind & TRACE_FAILED) ++result.busFailures;
+                break;
+            case TRACE_CONFIG:
+                if (r.arg == TRACE_CONFIG_RECORDS && i + r.arg < records.size()) {
+                    FanConfig config;
+                    std::memcpy(&config, &records[i + 1], sizeof(FanConfig));
+                    loop.applyConfig(config);
+                    scheduler.configure(config);
+                }
+                i += r.arg;
+                break;
+            case TRACE_FORCE:
+                loop.forceFan(r.arg, r.value);
+                break;
+            case TRACE_LOAD:
+                tick.clear();
+                tick.push_back(r);
+                break;
+            case TRACE_DONE:
+                tick.push_back(r);
+                runTick();
+                break;
+            default:
+                tick.push_back(r);
+                break;
+            }
+        }
+    }
+
+    result.traceSeconds = firstTick < 0 ? 0 : lastTick - firstTick;
+    result.wallSeconds = std::chrono::duration<double>(Clock::now() - wallStart).count();
+    return result;
+}
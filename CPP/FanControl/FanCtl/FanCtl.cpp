@@ -0,0 +1,1055 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SharedData.h"
+#include "EcRegisters.h"
+#include "ConfigCommands.h"
+#include "ControlLoop.h"
+#include "EcWatchdog.h"
+#include "SettingsStore.h"
+#include "SimulatedEc.h"
+#include "ThermalPlant.h"
+
+// Headless client for the backend's shared memory. It reads the same
+// SharedData layout the backend writes, through the same Seqlock and
+// TelemetryRing readers. status prints one snapshot, stats the hot path
+// latency histograms, watch streams every tick record as CSV or JSON lines
+// and serve answers Prometheus scrapes on a loopback port. Between samples
+// it sleeps, so watching or exporting costs next to no CPU. Only
+// reset-stats and profile write to the mapping, through a command lane.
+
+typedef std::chrono::steady_clock Clock;
+
+// SCHEDULE_* bits, lowest first
+static const char* const scheduleReasonNames[] = { "steady", "rate", "setpoint", "backoff", "at-min", "at-max", "load", "idle" };
+
+// HotPathStats::phases, by PHASE_*
+static const char* const phaseNames[PHASE_COUNT] = { "ec_read", "ec_write", "ec_wait", "bus_queue", "acquire", "filter", "control", "tick" };
+
+static std::string channelLabel(int channel)
+{
+    if (channel < MAX_CHANNELS) {
+        std::string name = ec_channel_names[channel];
+        name.erase(std::remove(name.begin(), name.end(), ' '), name.end());
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return name;
+    }
+    return "fan" + std::to_string(channel + 1);
+}
+
+static int channelCount(const Telemetry& telemetry)
+{
+    return std::max(0, std::min(MAX_CHANNELS, static_cast<int>(telemetry.channelCount)));
+}
+
+static std::string reasonList(uint32_t reasons, const char* separator)
+{
+    std::string list;
+    for (int bit = 0; bit < 8; ++bit) {
+        if (!(reasons & (1u << bit))) continue;
+        if (!list.empty()) list += separator;
+        list += scheduleReasonNames[bit];
+    }
+    return list;
+}
+
+// The backend's mapping, read-only. Closed until open() succeeds.
+class SharedView
+{
+public:
+    SharedView() : shared(nullptr), writable(false)
+    {
+#ifdef _WIN32
+        mapping = NULL;
+#endif
+    }
+
+    ~SharedView()
+    {
+        close();
+    }
+
+    SharedView(const SharedView&) = delete;
+    SharedView& operator=(const SharedView&) = delete;
+
+    const SharedData* data() const { return shared; }
+
+    // Null unless the mapping was opened writable
+    SharedData* writableData() const { return writable ? shared : nullptr; }
+
+    // False with the reason when the backend is not running or speaks
+    // another layout
+    bool open(std::string& error, bool forWriting = false)
+    {
+        close();
+        void* view = nullptr;
+#ifdef _WIN32
+        DWORD access = forWriting ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ;
+        mapping = OpenFileMappingW(access, FALSE, L"MySharedMemory");
+        if (mapping == NULL) {
+            error = "FanControl backend is not running";
+            return false;
+        }
+        view = MapViewOfFile(mapping, access, 0, 0, sizeof(SharedData));
+#else
+        int fd = shm_open("/MySharedMemory", forWriting ? O_RDWR : O_RDONLY, 0);
+        if (fd < 0) {
+            error = "FanControl backend is not running";
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(SharedData)) {
+            view = mmap(nullptr, sizeof(SharedData), forWriting ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            if (view == MAP_FAILED) view = nullptr;
+        }
+        ::close(fd);
+#endif
+        if (view == nullptr) {
+            error = "Could not map the backend's shared memory";
+            close();
+            return false;
+        }
+        shared = static_cast<SharedData*>(view);
+        writable = forWriting;
+        if (!check(*shared, error)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    static bool check(const SharedData& shared, std::string& error)
+    {
+        if (shared.header.magic != SHARED_MAGIC) {
+            error = "FanControl backend is starting or not running";
+            return false;
+        }
+        if (shared.header.layoutVersion != SHARED_LAYOUT_VERSION || shared.header.size != sizeof(SharedData)) {
+            error = "FanControl backend uses shared memory layout " + std::to_string(shared.header.layoutVersion) +
+                    ", this client layout " + std::to_string(SHARED_LAYOUT_VERSION);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void close()
+    {
+#ifdef _WIN32
+        if (shared) UnmapViewOfFile(shared);
+        if (mapping) CloseHandle(mapping);
+        mapping = NULL;
+#else
+        if (shared) munmap(shared, sizeof(SharedData));
+#endif
+        shared = nullptr;
+    }
+
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+    SharedData* shared;
+    bool writable;
+};
+
+static void printStatus(const Telemetry& telemetry, std::ostream& out)
+{
+    out << std::fixed;
+    for (int c = 0; c < channelCount(telemetry); ++c) {
+        out << std::left << std::setw(6) << channelLabel(c) << std::right << std::setprecision(1)
+            << std::setw(6) << telemetry.temp[c] << " C (raw " << telemetry.rawTemp[c] << ")  fan ";
+        if (telemetry.fanSpeed[c] < 0) out << "EC auto";
+        else out << telemetry.fanSpeed[c] << '%';
+        if (telemetry.fanForced & (1u << c)) out << " forced";
+        if (telemetry.sensorFaulted & (1u << c)) out << "  SENSOR FAULT";
+        out << "  " << telemetry.sensorRejects[c] << " readings rejected" << '\n';
+    }
+    out << std::setprecision(0) << "CPU load " << telemetry.cpuLoad << "%, control period " << telemetry.controlPeriodMs
+        << " ms (" << reasonList(telemetry.scheduleReasons, ", ") << ")\n"
+        << "EC writes " << telemetry.ecWritesIssued << " issued, " << telemetry.ecWritesElided << " elided, "
+        << telemetry.ecShadowMismatches << " read-back mismatches; " << telemetry.loopWakeups << " wakeups\n"
+        << std::setprecision(2) << "read to fan write " << telemetry.actuationLatencyUs / 1000 << " ms, sample age "
+        << telemetry.sampleAgeUs / 1000 << " ms\n"
+        << "loop jitter " << telemetry.loopJitterUs / 1000 << " ms (max " << telemetry.maxLoopJitterUs / 1000 << " ms), "
+        << telemetry.deadlineMisses << " deadline misses\n"
+        << "EC idle " << (telemetry.idleActive ? "now" : "no") << ", " << telemetry.idleEntries << " times, "
+        << std::setprecision(0) << telemetry.idleSeconds << " s in total\n"
+        << "EC fallback " << (telemetry.ecFallback ? "now" : "no") << ", " << telemetry.ecFallbacks << " times; "
+        << telemetry.ecFailures << " failed transactions" << std::endl;
+}
+
+static void printStatusJson(const Telemetry& telemetry, std::ostream& out)
+{
+    out << std::defaultfloat << std::setprecision(6) << "{\"channels\":[";
+    for (int c = 0; c < channelCount(telemetry); ++c) {
+        if (c) out << ',';
+        out << "{\"name\":\"" << channelLabel(c) << "\",\"temp\":" << telemetry.temp[c]
+            << ",\"raw\":" << telemetry.rawTemp[c] << ",\"median\":" << telemetry.medianTemp[c]
+            << ",\"ema\":" << telemetry.emaTemp[c] << ",\"kalman\":" << telemetry.kalmanTemp[c]
+            << ",\"fan\":" << telemetry.fanSpeed[c]
+            << ",\"ecAuto\":" << (telemetry.fanSpeed[c] < 0 ? "true" : "false")
+            << ",\"forced\":" << ((telemetry.fanForced >> c) & 1 ? "true" : "false")
+            << ",\"faulted\":" << ((telemetry.sensorFaulted >> c) & 1 ? "true" : "false")
+            << ",\"rejects\":" << telemetry.sensorRejects[c] << '}';
+    }
+    out << "],\"cpuLoad\":" << telemetry.cpuLoad << ",\"periodMs\":" << telemetry.controlPeriodMs
+        << ",\"reasons\":[" << (telemetry.scheduleReasons ? "\"" + reasonList(telemetry.scheduleReasons, "\",\"") + "\"" : "")
+        << "],\"ecWritesIssued\":" << telemetry.ecWritesIssued << ",\"ecWritesElided\":" << telemetry.ecWritesElided
+        << ",\"ecShadowMismatches\":" << telemetry.ecShadowMismatches << ",\"loopWakeups\":" << telemetry.loopWakeups
+        << ",\"sampleAgeUs\":" << telemetry.sampleAgeUs << ",\"actuationLatencyUs\":" << telemetry.actuationLatencyUs
+        << ",\"idle\":{\"active\":" << (telemetry.idleActive ? "true" : "false") << ",\"entries\":" << telemetry.idleEntries
+        << ",\"seconds\":" << telemetry.idleSeconds << "},\"loopJitterUs\":" << telemetry.loopJitterUs
+        << ",\"maxLoopJitterUs\":" << telemetry.maxLoopJitterUs << ",\"deadlineMisses\":" << telemetry.deadlineMisses
+        << ",\"ecFailures\":" << telemetry.ecFailures << ",\"fallback\":{\"active\":" << (telemetry.ecFallback ? "true" : "false")
+        << ",\"count\":" << telemetry.ecFallbacks << "}}" << std::endl;
+}
+
+static void printStats(const HotPathStats& stats, std::ostream& out)
+{
+    out << std::left << std::setw(12) << "phase" << std::right << std::setw(12) << "events" << std::setw(11) << "mean us"
+        << std::setw(11) << "p50 us" << std::setw(11) << "p90 us" << std::setw(11) << "p99 us" << std::setw(11) << "max us" << '\n';
+    out << std::fixed << std::setprecision(1);
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        LatencySummary summary = summarizeLatency(stats.phases[p]);
+        out << std::left << std::setw(12) << phaseNames[p] << std::right << std::setw(12) << summary.count
+            << std::setw(11) << summary.meanUs << std::setw(11) << summary.p50Us << std::setw(11) << summary.p90Us
+            << std::setw(11) << summary.p99Us << std::setw(11) << summary.maxUs << '\n';
+    }
+    out << "EC busy polls " << stats.ecRetries.load() << ", timeouts " << stats.ecTimeouts.load() << ", writes elided "
+        << stats.ecWritesElided.load() << "; reset " << stats.resets.load() << " times" << std::endl;
+}
+
+static void writeRecordCsvHeader(std::ostream& out, int channels)
+{
+    out << "time_s,period_ms,reasons,ec_read_us,ec_write_us,sample_age_us,actuation_us";
+    for (int c = 0; c < channels; ++c) {
+        std::string name = channelLabel(c);
+        out << ',' << name << "_raw," << name << "_temp," << name << "_fan," << name << "_rejected," << name << "_faulted";
+    }
+    out << '\n';
+}
+
+static void writeRecordCsv(std::ostream& out, const TelemetryRecord& record, int channels)
+{
+    out << std::fixed << std::setprecision(6) << record.timestampUs / 1e6 << std::setprecision(1) << ','
+        << record.periodMs << ',' << record.scheduleReasons << ',' << record.ecReadUs << ',' << record.ecWriteUs << ','
+        << record.sampleAgeUs << ',' << record.actuationUs;
+    for (int c = 0; c < channels; ++c) {
+        out << ',' << record.rawTemp[c] << ',' << record.filteredTemp[c] << ',' << record.fanCommand[c] << ','
+            << ((record.sensorRejected >> c) & 1) << ',' << ((record.sensorFaulted >> c) & 1);
+    }
+    out << '\n';
+}
+
+static void writeRecordJson(std::ostream& out, const TelemetryRecord& record, int channels)
+{
+    out << std::fixed << std::setprecision(6) << "{\"time\":" << record.timestampUs / 1e6 << std::setprecision(1)
+        << ",\"periodMs\":" << record.periodMs << ",\"reasons\":" << record.scheduleReasons
+        << ",\"ecReadUs\":" << record.ecReadUs << ",\"ecWriteUs\":" << record.ecWriteUs
+        << ",\"sampleAgeUs\":" << record.sampleAgeUs << ",\"actuationUs\":" << record.actuationUs << ",\"channels\":[";
+    for (int c = 0; c < channels; ++c) {
+        if (c) out << ',';
+        out << "{\"name\":\"" << channelLabel(c) << "\",\"raw\":" << record.rawTemp[c] << ",\"temp\":" << record.filteredTemp[c]
+            << ",\"fan\":" << record.fanCommand[c] << ",\"rejected\":" << ((record.sensorRejected >> c) & 1 ? "true" : "false")
+            << ",\"faulted\":" << ((record.sensorFaulted >> c) & 1 ? "true" : "false") << '}';
+    }
+    out << "]}\n";
+}
+
+struct WatchOptions
+{
+    bool json = false;
+    bool history = false;           // start with the records already in the ring
+    unsigned long long count = 0;   // records to write, 0 for no limit
+    int pollMs = 250;
+    double timeoutSeconds = 0;      // 0 for no limit
+};
+
+// Streams tick records from the history ring until count records were
+// written or the timeout passed. Returns the number written; records the
+// ring overwrote before they were read are added to lost.
+static unsigned long long watch(const SharedData& shared, std::ostream& out, const WatchOptions& options, uint64_t& lost)
+{
+    // Telemetry is empty until the backend's first tick; the config is there from the start
+    int channels = std::max(0, std::min(MAX_CHANNELS, static_cast<int>(shared.config.load().channel_count)));
+    if (!options.json) writeRecordCsvHeader(out, channels);
+    out.flush();
+
+    uint64_t cursor = options.history ? 0 : shared.history.end();
+    TelemetryRecord batch[64];
+    unsigned long long written = 0;
+    Clock::time_point deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.timeoutSeconds));
+    while (options.count == 0 || written < options.count) {
+        size_t max = options.count ? static_cast<size_t>(std::min<unsigned long long>(64, options.count - written)) : 64;
+        size_t read = shared.history.read(cursor, batch, max, &lost);
+        for (size_t i = 0; i < read; ++i) {
+            if (options.json) writeRecordJson(out, batch[i], channels);
+            else writeRecordCsv(out, batch[i], channels);
+        }
+        written += read;
+        if (read) out.flush();
+        if (read < max) {
+            if (options.timeoutSeconds > 0 && Clock::now() >= deadline) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(options.pollMs));
+        }
+    }
+    return written;
+}
+
+static void metricFamily(std::ostream& out, const char* name, const char* type, const char* help)
+{
+    out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+}
+
+template <typename T>
+static void metric(std::ostream& out, const char* name, T value, int channel = -1)
+{
+    out << name;
+    if (channel >= 0) out << "{channel=\"" << channelLabel(channel) << "\"}";
+    out << ' ' << value << '\n';
+}
+
+// Prometheus text exposition format 0.0.4. shared is null while the
+// backend is not running, which only fancontrol_up reports.
+static void writeMetrics(const SharedData* shared, std::ostream& out)
+{
+    out << std::defaultfloat << std::setprecision(10);
+    metricFamily(out, "fancontrol_up", "gauge", "Whether the FanControl backend's shared memory could be read.");
+    metric(out, "fancontrol_up", shared ? 1 : 0);
+    if (!shared) return;
+
+    Telemetry telemetry = shared->telemetry.load();
+    int channels = channelCount(telemetry);
+
+    metricFamily(out, "fancontrol_temperature_celsius", "gauge", "Filtered temperature the controller uses.");
+    for (int c = 0; c < channels; ++c) metric(out, "fancontrol_temperature_celsius", telemetry.temp[c], c);
+    metricFamily(out, "fancontrol_raw_temperature_celsius", "gauge", "Temperature as read from the EC.");
+    for (int c = 0; c < channels; ++c) metric(out, "fancontrol_raw_temperature_celsius", telemetry.rawTemp[c], c);
+    metricFamily(out, "fancontrol_fan_percent", "gauge", "Fan speed command; absent while the EC runs the fan.");
+    for (int c = 0; c < channels; ++c) {
+        if (telemetry.fanSpeed[c] >= 0) metric(out, "fancontrol_fan_percent", telemetry.fanSpeed[c], c);
+    }
+    metricFamily(out, "fancontrol_fan_ec_auto", "gauge", "Whether the fan is handed back to the EC's automatic control.");
+    for (int c = 0; c < channels; ++c) metric(out, "fancontrol_fan_ec_auto", telemetry.fanSpeed[c] < 0 ? 1 : 0, c);
+    metricFamily(out, "fancontrol_fan_forced", "gauge", "Whether a client forced the fan speed.");
+    for (int c = 0; c < channels; ++c) metric(out, "fancontrol_fan_forced", (telemetry.fanForced >> c) & 1, c);
+    metricFamily(out, "fancontrol_sensor_faulted", "gauge", "Whether the temperature sensor is faulted.");
+    for (int c = 0; c < channels; ++c) metric(out, "fancontrol_sensor_faulted", (telemetry.sensorFaulted >> c) & 1, c);
+    metricFamily(out, "fancontrol_sensor_rejects_total", "counter", "Temperature readings dropped by the range check.");
+    for (int c = 0; c < channels; ++c) metric(out, "fancontrol_sensor_rejects_total", telemetry.sensorRejects[c], c);
+
+    metricFamily(out, "fancontrol_cpu_load_percent", "gauge", "OS CPU utilization over the last control tick.");
+    metric(out, "fancontrol_cpu_load_percent", telemetry.cpuLoad);
+    metricFamily(out, "fancontrol_control_period_seconds", "gauge", "Current control period.");
+    metric(out, "fancontrol_control_period_seconds", telemetry.controlPeriodMs / 1000.0);
+    metricFamily(out, "fancontrol_ec_writes_issued_total", "counter", "EC writes sent to the EC.");
+    metric(out, "fancontrol_ec_writes_issued_total", telemetry.ecWritesIssued);
+    metricFamily(out, "fancontrol_ec_writes_elided_total", "counter", "EC writes skipped because the EC already had the value.");
+    metric(out, "fancontrol_ec_writes_elided_total", telemetry.ecWritesElided);
+    metricFamily(out, "fancontrol_ec_shadow_mismatches_total", "counter", "EC read-backs that differed from the last write.");
+    metric(out, "fancontrol_ec_shadow_mismatches_total", telemetry.ecShadowMismatches);
+    metricFamily(out, "fancontrol_loop_wakeups_total", "counter", "Control loop wakeups.");
+    metric(out, "fancontrol_loop_wakeups_total", telemetry.loopWakeups);
+    metricFamily(out, "fancontrol_sample_age_seconds", "gauge", "Time from the temperature read to the control stage.");
+    metric(out, "fancontrol_sample_age_seconds", telemetry.sampleAgeUs / 1e6);
+    metricFamily(out, "fancontrol_actuation_latency_seconds", "gauge", "Time from the temperature read to the last fan write.");
+    metric(out, "fancontrol_actuation_latency_seconds", telemetry.actuationLatencyUs / 1e6);
+    metricFamily(out, "fancontrol_idle_active", "gauge", "Whether the fans are handed back to the EC.");
+    metric(out, "fancontrol_idle_active", telemetry.idleActive);
+    metricFamily(out, "fancontrol_idle_entries_total", "counter", "Times the fans were handed back to the EC.");
+    metric(out, "fancontrol_idle_entries_total", telemetry.idleEntries);
+    metricFamily(out, "fancontrol_idle_seconds_total", "counter", "Time the fans spent with the EC.");
+    metric(out, "fancontrol_idle_seconds_total", telemetry.idleSeconds);
+    metricFamily(out, "fancontrol_loop_jitter_seconds", "gauge", "How late the control timer woke the last tick.");
+    metric(out, "fancontrol_loop_jitter_seconds", telemetry.loopJitterUs / 1e6);
+    metricFamily(out, "fancontrol_loop_jitter_max_seconds", "gauge", "Latest the control timer woke a tick since the backend started.");
+    metric(out, "fancontrol_loop_jitter_max_seconds", telemetry.maxLoopJitterUs / 1e6);
+    metricFamily(out, "fancontrol_deadline_misses_total", "counter", "Control ticks that ran past their time budget.");
+    metric(out, "fancontrol_deadline_misses_total", telemetry.deadlineMisses);
+    metricFamily(out, "fancontrol_ec_failures_total", "counter", "EC transactions that failed after their retries.");
+    metric(out, "fancontrol_ec_failures_total", telemetry.ecFailures);
+    metricFamily(out, "fancontrol_ec_fallback_active", "gauge", "Whether the EC has the fans because its transactions kept failing.");
+    metric(out, "fancontrol_ec_fallback_active", telemetry.ecFallback);
+    metricFamily(out, "fancontrol_ec_fallbacks_total", "counter", "Times the fans fell back to the EC after failed transactions.");
+    metric(out, "fancontrol_ec_fallbacks_total", telemetry.ecFallbacks);
+
+    const HotPathStats& stats = shared->stats;
+    metricFamily(out, "fancontrol_ec_busy_polls_total", "counter", "EC handshake polls that found the EC still busy.");
+    metric(out, "fancontrol_ec_busy_polls_total", stats.ecRetries.load());
+    metricFamily(out, "fancontrol_ec_timeouts_total", "counter", "EC transactions given up at the handshake timeout.");
+    metric(out, "fancontrol_ec_timeouts_total", stats.ecTimeouts.load());
+    metricFamily(out, "fancontrol_stats_resets_total", "counter", "Times a client reset the hot path statistics.");
+    metric(out, "fancontrol_stats_resets_total", stats.resets.load());
+
+    // Every fourth bucket boundary is a power of two; export those from
+    // about 1 us to 4 s. The counters restart when a client resets them.
+    metricFamily(out, "fancontrol_phase_duration_seconds", "histogram", "Duration of hot path events by phase.");
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        const LatencyHistogram& histogram = stats.phases[p];
+        uint64_t cumulative = 0;
+        int bucket = 0;
+        for (int bit = 10; bit <= 32; ++bit) {
+            int end = (bit - 1) * 4;
+            while (bucket < end) cumulative += histogram.buckets[bucket++].load(std::memory_order_relaxed);
+            out << "fancontrol_phase_duration_seconds_bucket{phase=\"" << phaseNames[p] << "\",le=\""
+                << static_cast<double>(1ull << bit) / 1e9 << "\"} " << cumulative << '\n';
+        }
+        while (bucket < LATENCY_BUCKETS) cumulative += histogram.buckets[bucket++].load(std::memory_order_relaxed);
+        out << "fancontrol_phase_duration_seconds_bucket{phase=\"" << phaseNames[p] << "\",le=\"+Inf\"} " << cumulative << '\n'
+            << "fancontrol_phase_duration_seconds_sum{phase=\"" << phaseNames[p] << "\"} " << histogram.sumNs.load() / 1e9 << '\n'
+            << "fancontrol_phase_duration_seconds_count{phase=\"" << phaseNames[p] << "\"} " << cumulative << '\n';
+    }
+
+    // A backend that stopped leaves its last values behind; the tick time shows it
+    uint64_t end = shared->history.end();
+    TelemetryRecord newest;
+    uint64_t cursor = end ? end - 1 : 0;
+    metricFamily(out, "fancontrol_ticks_total", "counter", "Control ticks since the backend started.");
+    metric(out, "fancontrol_ticks_total", end);
+    if (end && shared->history.read(cursor, &newest, 1) == 1) {
+        metricFamily(out, "fancontrol_last_tick_timestamp_seconds", "gauge", "Wall clock time of the newest control tick.");
+        metric(out, "fancontrol_last_tick_timestamp_seconds", newest.timestampUs / 1e6);
+    }
+}
+
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+const SocketHandle NO_SOCKET = INVALID_SOCKET;
+static void closeSocket(SocketHandle s) { closesocket(s); }
+#else
+typedef int SocketHandle;
+const SocketHandle NO_SOCKET = -1;
+static void closeSocket(SocketHandle s) { ::close(s); }
+#endif
+
+static void setReceiveTimeout(SocketHandle s, int ms)
+{
+#ifdef _WIN32
+    DWORD timeout = ms;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+#else
+    timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+}
+
+static bool sendAll(SocketHandle s, const std::string& data)
+{
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int n = send(s, data.data() + sent, static_cast<int>(data.size() - sent), 0);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Minimal HTTP/1.0 endpoint on 127.0.0.1: one connection at a time, one
+// request per connection, GET /metrics only. Scrapers ask every few
+// seconds, so a blocking accept loop is all it takes.
+class MetricsServer
+{
+public:
+    // port 0 picks a free port
+    explicit MetricsServer(int port) : listener(NO_SOCKET)
+    {
+#ifdef _WIN32
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) throw std::runtime_error("Could not start Winsock");
+#endif
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == NO_SOCKET) throw std::runtime_error("Could not create a socket");
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<unsigned short>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 4) != 0) {
+            closeSocket(listener);
+            throw std::runtime_error("Could not listen on 127.0.0.1:" + std::to_string(port));
+        }
+    }
+
+    ~MetricsServer()
+    {
+        if (listener != NO_SOCKET) closeSocket(listener);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    int port() const
+    {
+        sockaddr_in address = {};
+        socklen_t length = sizeof(address);
+        getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length);
+        return ntohs(address.sin_port);
+    }
+
+    // Answers one connection; metrics builds the body of GET /metrics
+    void serveOne(const std::function<std::string()>& metrics)
+    {
+        SocketHandle client = accept(listener, nullptr, nullptr);
+        if (client == NO_SOCKET) return;
+        setReceiveTimeout(client, 2000);
+
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos && request.size() < 8192) {
+            int n = recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            request.append(buffer, n);
+        }
+
+        std::istringstream line(request.substr(0, request.find('\n')));
+        std::string method, path;
+        line >> method >> path;
+        std::string status = "200 OK", type = "text/plain; version=0.0.4; charset=utf-8", body;
+        if (method == "GET" && path == "/metrics") body = metrics();
+        else if (method == "GET" && path == "/") body = "FanCtl: metrics are at /metrics\n";
+        else {
+            status = "404 Not Found";
+            type = "text/plain";
+            body = "not found\n";
+        }
+        sendAll(client, "HTTP/1.0 " + status + "\r\nContent-Type: " + type + "\r\nContent-Length: " +
+                        std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+        closeSocket(client);
+    }
+
+private:
+    SocketHandle listener;
+};
+
+static std::string httpGet(int port, const std::string& path)
+{
+    SocketHandle s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == NO_SOCKET) return std::string();
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<unsigned short>(port));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::string response;
+    if (connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 &&
+        sendAll(s, "GET " + path + " HTTP/1.0\r\nHost: localhost\r\n\r\n")) {
+        setReceiveTimeout(s, 2000);
+        char buffer[4096];
+        int n;
+        while ((n = recv(s, buffer, sizeof(buffer), 0)) > 0) response.append(buffer, n);
+    }
+    closeSocket(s);
+    return response;
+}
+
+static bool processAlive(uint32_t pid)
+{
+#ifdef _WIN32
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (process == NULL) return false;
+    DWORD code = 0;
+    bool alive = GetExitCodeProcess(process, &code) && code == STILL_ACTIVE;
+    CloseHandle(process);
+    return alive;
+#else
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+#endif
+}
+
+// Runs one command through a lane of the command queue and returns its
+// COMMAND_* status, or COMMAND_PENDING when the backend did not answer in
+// time. Lanes are claimed under the config lock, like ui.py does.
+static int32_t sendCommand(SharedData& shared, FanCommand command, double timeoutSeconds = 2.0)
+{
+#ifdef _WIN32
+    uint32_t pid = GetCurrentProcessId();
+    HANDLE lock = CreateMutexW(NULL, FALSE, L"FanControlConfigLock");
+    if (lock) WaitForSingleObject(lock, INFINITE);
+    int lane = shared.commands.claim(pid, processAlive);
+    if (lock) {
+        ReleaseMutex(lock);
+        CloseHandle(lock);
+    }
+#else
+    uint32_t pid = static_cast<uint32_t>(getpid());
+    int lane = shared.commands.claim(pid, processAlive);
+#endif
+    if (lane < 0) throw std::runtime_error("Every command lane is taken");
+
+    uint32_t index = shared.commands.nextIndex(lane);
+    command.seq = index + 1;
+    int32_t status = COMMAND_PENDING;
+    if (shared.commands.submit(lane, command)) {
+        Clock::time_point deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeoutSeconds));
+        while ((status = shared.commands.completion(lane, index, command.seq)) == COMMAND_PENDING && Clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+    shared.commands.release(lane);
+    return status;
+}
+
+static int runStatus(const std::vector<std::string>& args)
+{
+    bool json = std::find(args.begin(), args.end(), "--json") != args.end();
+    SharedView view;
+    std::string error;
+    if (!view.open(error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    Telemetry telemetry = view.data()->telemetry.load();
+    if (json) printStatusJson(telemetry, std::cout);
+    else printStatus(telemetry, std::cout);
+    return 0;
+}
+
+static int runStats(const std::vector<std::string>& args)
+{
+    if (!args.empty()) throw std::invalid_argument("unknown stats option: " + args[0]);
+    SharedView view;
+    std::string error;
+    if (!view.open(error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    printStats(view.data()->stats, std::cout);
+    return 0;
+}
+
+static int runResetStats(const std::vector<std::string>& args)
+{
+    if (!args.empty()) throw std::invalid_argument("unknown reset-stats option: " + args[0]);
+    SharedView view;
+    std::string error;
+    if (!view.open(error, true)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    FanCommand command = { 0, COMMAND_RESET_STATS, 0, { 0, 0, 0, 0, 0 } };
+    int32_t status = sendCommand(*view.writableData(), command);
+    if (status != COMMAND_ACCEPTED) {
+        std::cerr << (status == COMMAND_PENDING ? "FanControl backend did not answer" : "FanControl backend rejected the reset") << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static const char* commandStatusName(int32_t status)
+{
+    switch (status) {
+    case COMMAND_BAD_TYPE: return "unknown command";
+    case COMMAND_BAD_CHANNEL: return "bad channel";
+    case COMMAND_BAD_VALUE: return "bad value";
+    case COMMAND_UNKNOWN_PROFILE: return "unknown profile";
+    case COMMAND_PENDING: return "no answer from the backend";
+    default: return "rejected";
+    }
+}
+
+// profile lists the built-in and saved profiles; use switches to one,
+// save and delete change the saved ones, through a command lane
+static int runProfile(const std::vector<std::string>& args)
+{
+    std::string action = args.empty() ? "list" : args[0];
+    size_t expected = action == "list" ? 1 : action == "save" ? 3 : 2;
+    if (action != "list" && action != "use" && action != "save" && action != "delete") throw std::invalid_argument("unknown profile action: " + action);
+    if (args.size() > expected || (action != "list" && args.size() < expected)) throw std::invalid_argument("usage: FanCtl profile " + action + (action == "list" ? "" : action == "save" ? " number name" : " number"));
+
+    SharedView view;
+    std::string error;
+    if (!view.open(error, action != "list")) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    if (action == "list") {
+        ProfileDirectory directory = view.data()->profiles.load();
+        for (int n = 0; n < PROFILE_COUNT; ++n) {
+            if (!(directory.used & (1u << n))) continue;
+            std::cout << (n == directory.active ? "* " : "  ") << n << " " << std::string(directory.names[n], strnlen(directory.names[n], PROFILE_NAME_LENGTH))
+                      << (isBuiltinProfile(n) ? " (built in)" : "") << (n == directory.automatic ? " (selected by the rules)" : "") << "\n";
+        }
+        std::cout << "settings file written " << directory.settingsWrites << " times, " << directory.settingsWriteFailures << " failed; "
+                  << directory.rejectedConfigs << " invalid settings rejected" << std::endl;
+        return 0;
+    }
+
+    FanCommand command = { 0, COMMAND_SWITCH_PROFILE, 0, { 0, 0, 0, 0, 0 } };
+    if (action == "save") command.type = COMMAND_SAVE_PROFILE;
+    if (action == "delete") command.type = COMMAND_DELETE_PROFILE;
+    command.args[0] = std::atoi(args[1].c_str());
+    if (action == "save") packProfileName(args[2], command.args + 1);
+    int32_t status = sendCommand(*view.writableData(), command);
+    if (status != COMMAND_ACCEPTED) {
+        std::cerr << "FanControl backend did not " << action << " profile " << args[1] << ": " << commandStatusName(status) << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static int runWatch(const std::vector<std::string>& args)
+{
+    WatchOptions options;
+    for (size_t i = 0; i < args.size(); ++i) {
+        bool hasValue = i + 1 < args.size();
+        if (args[i] == "--format" && hasValue) {
+            std::string format = args[++i];
+            if (format != "csv" && format != "json") throw std::invalid_argument("format must be csv or json: " + format);
+            options.json = format == "json";
+        }
+        else if (args[i] == "-n" && hasValue) options.count = std::strtoull(args[++i].c_str(), nullptr, 10);
+        else if (args[i] == "--poll" && hasValue) options.pollMs = std::max(10, std::atoi(args[++i].c_str()));
+        else if (args[i] == "--history") options.history = true;
+        else throw std::invalid_argument("unknown watch option: " + args[i]);
+    }
+
+    SharedView view;
+    std::string error;
+    if (!view.open(error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    uint64_t lost = 0;
+    watch(*view.data(), std::cout, options, lost);
+    if (lost) std::cerr << lost << " records were overwritten before they could be read" << std::endl;
+    return 0;
+}
+
+static int runServe(const std::vector<std::string>& args)
+{
+    int port = 9489;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--port" && i + 1 < args.size()) port = std::atoi(args[++i].c_str());
+        else throw std::invalid_argument("unknown serve option: " + args[i]);
+    }
+
+    MetricsServer server(port);
+    std::cerr << "Serving metrics on http://127.0.0.1:" << server.port() << "/metrics" << std::endl;
+
+    // The backend may start, stop or restart while the exporter runs
+    SharedView view;
+    for (;;) {
+        server.serveOne([&view]() {
+            std::string error;
+            if (!view.data() || !SharedView::check(*view.data(), error)) view.open(error);
+            std::ostringstream body;
+            writeMetrics(view.data(), body);
+            return body.str();
+        });
+    }
+}
+
+static bool expect(bool condition, const std::string& what, int& failures)
+{
+    std::cout << (condition ? "ok    " : "FAIL  ") << what << std::endl;
+    if (!condition) ++failures;
+    return condition;
+}
+
+static size_t countLines(const std::string& text)
+{
+    return static_cast<size_t>(std::count(text.begin(), text.end(), '\n'));
+}
+
+// Runs the control loop against the simulated EC and thermal plant on a
+// thread that publishes telemetry and history the way the backend does,
+// and checks every client path against what it published.
+static int runSelfTest(const std::vector<std::string>& args)
+{
+    int ticks = 300;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-n" && i + 1 < args.size()) ticks = std::max(1, std::atoi(args[++i].c_str()));
+    }
+
+    std::unique_ptr<SharedData> shared(new SharedData());
+    FanConfig config = defaultFanConfig();
+    shared->config.store(config);
+    shared->telemetry.store(Telemetry());
+    shared->history.init();
+    shared->commands.init();
+    shared->stats.init();
+    shared->header.layoutVersion = SHARED_LAYOUT_VERSION;
+    shared->header.size = sizeof(SharedData);
+    shared->header.magic = SHARED_MAGIC;
+
+    int failures = 0;
+    std::string error;
+    expect(SharedView::check(*shared, error), "the simulated backend's header is accepted", failures);
+
+    SimulatedEc::Timing timing;
+    timing.inputLatency = std::chrono::microseconds(0);
+    timing.outputLatency = std::chrono::microseconds(0);
+    SimulatedEc ec(timing);
+    ThermalPlant plant(ec, ThermalPlantParams());
+    plant.settle();
+    plant.setLoad(65, 120);
+    ec.setStats(&shared->stats);
+
+    // For ten ticks a third into the run the EC stops answering; the loop
+    // must hand it the fans and take them back once it answers again
+    EcCompletionPolicy policy;
+    policy.timeout = std::chrono::milliseconds(1);
+    ec.setCompletionPolicy(policy);
+    EcWatchdogParams watchdogParams;
+    watchdogParams.backoff = std::chrono::microseconds(100);
+    EcWatchdog watchdog(watchdogParams);
+    RetryingEcTransport retrying(ec, watchdog, true);
+    const int outageStart = ticks >= 60 ? ticks / 3 : ticks;
+    const int outageEnd = outageStart + 10;
+    bool inFallback = false;
+    uint32_t fallbacks = 0;
+
+    ControlLoop loop(retrying, config);
+    loop.setStats(&shared->stats);
+    loop.setWatchdog(&watchdog);
+
+    // After its ticks the backend keeps answering commands until stopped
+    std::vector<TelemetryRecord> published;
+    Telemetry last = {};
+    std::atomic<bool> ticked(false), stopBackend(false);
+    std::thread backend([&]() {
+        for (int i = 0; i < ticks; ++i) {
+            LatencyClock::time_point tickBegin = LatencyClock::now();
+            ec.setUnresponsive(i >= outageStart && i < outageEnd);
+            ControlTickResult tick = loop.tick(i, 70.0);
+            plant.step(1.0);
+            if (tick.fallback && !inFallback) ++fallbacks;
+            inFallback = tick.fallback;
+
+            Telemetry telemetry = {};
+            TelemetryRecord record = {};
+            telemetry.channelCount = tick.channelCount;
+            record.timestampUs = 1700000000000000ull + i * 1000000ull;
+            for (int c = 0; c < tick.channelCount; ++c) {
+                telemetry.temp[c] = tick.temp[c];
+                telemetry.fanSpeed[c] = tick.fan[c];
+                telemetry.rawTemp[c] = static_cast<float>(tick.raw[c]);
+                telemetry.sensorRejects[c] = static_cast<uint32_t>(loop.sensor(c).rejects());
+                record.rawTemp[c] = static_cast<float>(tick.raw[c]);
+                record.filteredTemp[c] = static_cast<float>(tick.temp[c]);
+                record.fanCommand[c] = tick.fan[c];
+            }
+            telemetry.fanForced = tick.forced;
+            telemetry.cpuLoad = 70.0;
+            telemetry.controlPeriodMs = record.periodMs = 1000;
+            telemetry.scheduleReasons = record.scheduleReasons = SCHEDULE_RATE | SCHEDULE_AT_MIN;
+            telemetry.ecWritesIssued = ec.writes();
+            telemetry.loopWakeups = i + 1;
+            telemetry.actuationLatencyUs = record.actuationUs = static_cast<float>(tick.ecWriteUs);
+            telemetry.deadlineMisses = static_cast<uint32_t>(watchdog.deadlineMisses());
+            telemetry.ecFailures = static_cast<uint32_t>(watchdog.failures());
+            telemetry.ecFallback = tick.fallback ? 1 : 0;
+            telemetry.ecFallbacks = fallbacks;
+            shared->telemetry.store(telemetry);
+            shared->history.push(record);
+            published.push_back(record);
+            last = telemetry;
+            shared->stats.phases[PHASE_TICK].record(LatencyClock::now() - tickBegin);
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+        ticked = true;
+
+        FanConfig backendConfig = config;
+        while (!stopBackend) {
+            shared->commands.drain([&](const FanCommand& command) {
+                if (command.type == COMMAND_RESET_STATS) {
+                    shared->stats.reset();
+                    return COMMAND_ACCEPTED;
+                }
+                int32_t status = applyConfigCommand(backendConfig, command);
+                if (status == COMMAND_ACCEPTED) shared->config.store(backendConfig);
+                return status;
+            }, [&] { return shared->config.version(); });
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    // Follow the ring while the backend writes it, as watch does
+    WatchOptions options;
+    options.history = true;
+    options.count = ticks;
+    options.pollMs = 5;
+    options.timeoutSeconds = 30;
+    std::ostringstream csv;
+    uint64_t lost = 0;
+    unsigned long long streamed = watch(*shared, csv, options, lost);
+    while (!ticked) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    int channels = channelCount(last);
+    std::ostringstream expectedCsv;
+    writeRecordCsvHeader(expectedCsv, channels);
+    for (const TelemetryRecord& record : published) writeRecordCsv(expectedCsv, record, channels);
+    expect(streamed == static_cast<unsigned long long>(ticks) && lost == 0,
+           "watch streamed all " + std::to_string(ticks) + " records while they were written (" + std::to_string(streamed) +
+           " streamed, " + std::to_string(lost) + " lost)", failures);
+    expect(csv.str() == expectedCsv.str(), "CSV rows match the published records, in order", failures);
+
+    std::string header = csv.str().substr(0, csv.str().find('\n'));
+    expect(std::count(header.begin(), header.end(), ',') == 6 + 5 * channels, "CSV header has 5 columns per channel", failures);
+
+    options.json = true;
+    std::ostringstream json, expectedJson;
+    watch(*shared, json, options, lost);
+    for (const TelemetryRecord& record : published) writeRecordJson(expectedJson, record, channels);
+    expect(json.str() == expectedJson.str() && countLines(json.str()) == published.size(), "JSON lines match the published records", failures);
+
+    std::ostringstream status, expectedStatus, statusJson, expectedStatusJson;
+    printStatus(shared->telemetry.load(), status);
+    printStatus(last, expectedStatus);
+    printStatusJson(shared->telemetry.load(), statusJson);
+    printStatusJson(last, expectedStatusJson);
+    expect(status.str() == expectedStatus.str() && statusJson.str() == expectedStatusJson.str(), "status shows the last telemetry", failures);
+
+    MetricsServer server(0);
+    std::thread exporter([&]() {
+        for (int i = 0; i < 3; ++i) {
+            server.serveOne([&]() {
+                std::ostringstream body;
+                writeMetrics(i == 2 ? nullptr : shared.get(), body);
+                return body.str();
+            });
+        }
+    });
+    std::string scrape = httpGet(server.port(), "/metrics");
+    std::string missing = httpGet(server.port(), "/nope");
+    std::string down = httpGet(server.port(), "/metrics");
+    exporter.join();
+
+    std::ostringstream cpuTemp;
+    cpuTemp << std::defaultfloat << std::setprecision(10) << "\nfancontrol_temperature_celsius{channel=\"cpu\"} " << last.temp[CHANNEL_CPU] << '\n';
+    expect(scrape.compare(0, 15, "HTTP/1.0 200 OK") == 0 && scrape.find("\nfancontrol_up 1\n") != std::string::npos,
+           "GET /metrics answers with the backend up", failures);
+    expect(scrape.find(cpuTemp.str()) != std::string::npos, "the scrape carries the published CPU temperature", failures);
+    expect(scrape.find("\nfancontrol_ticks_total " + std::to_string(ticks) + "\n") != std::string::npos, "the scrape counts every tick", failures);
+    if (outageStart < ticks) {
+        expect(last.ecFallbacks == 1 && !last.ecFallback && last.ecFailures > 0 &&
+               scrape.find("\nfancontrol_ec_fallbacks_total 1\n") != std::string::npos,
+               "the loop handed the fans to the EC while it did not answer and took them back after (" +
+               std::to_string(last.ecFailures) + " failed transactions)", failures);
+    }
+    expect(missing.compare(0, 12, "HTTP/1.0 404") == 0, "other paths answer 404", failures);
+    expect(down.find("\nfancontrol_up 0\n") != std::string::npos && down.find("fancontrol_temperature") == std::string::npos,
+           "without a backend only fancontrol_up 0 is exported", failures);
+
+    const HotPathStats& stats = shared->stats;
+    uint64_t tickEvents = summarizeLatency(stats.phases[PHASE_TICK]).count;
+    uint64_t filterEvents = summarizeLatency(stats.phases[PHASE_FILTER]).count;
+    expect(tickEvents == static_cast<uint64_t>(ticks) && filterEvents == static_cast<uint64_t>(ticks) * channels,
+           "every tick and sensor pipeline run was timed (" + std::to_string(tickEvents) + " ticks, " + std::to_string(filterEvents) + " filter runs)", failures);
+    expect(summarizeLatency(stats.phases[PHASE_EC_READ]).count == ec.reads() &&
+           summarizeLatency(stats.phases[PHASE_EC_WRITE]).count == ec.writes() && summarizeLatency(stats.phases[PHASE_CONTROL]).count > 0,
+           "EC transactions and controller runs were timed", failures);
+    std::ostringstream statsTable;
+    printStats(stats, statsTable);
+    expect(statsTable.str().find("\ntick") != std::string::npos && countLines(statsTable.str()) == PHASE_COUNT + 2, "stats prints every phase", failures);
+    expect(scrape.find("\nfancontrol_phase_duration_seconds_count{phase=\"tick\"} " + std::to_string(ticks) + "\n") != std::string::npos &&
+           scrape.find("fancontrol_phase_duration_seconds_bucket{phase=\"ec_read\",le=\"+Inf\"}") != std::string::npos,
+           "the scrape carries the phase histograms", failures);
+
+    FanCommand reset = { 0, COMMAND_RESET_STATS, 0, { 0, 0, 0, 0, 0 } };
+    int32_t resetStatus = sendCommand(*shared, reset);
+    expect(resetStatus == COMMAND_ACCEPTED && summarizeLatency(stats.phases[PHASE_TICK]).count == 0 &&
+           summarizeLatency(stats.phases[PHASE_EC_READ]).count == 0 && stats.resets.load() == 1,
+           "reset-stats clears the histograms through a command lane", failures);
+    stopBackend = true;
+    backend.join();
+
+    // What a client costs: building a scrape or a status, and an idle watch
+    const int repeats = 2000;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < repeats; ++i) {
+        std::ostringstream body;
+        writeMetrics(shared.get(), body);
+    }
+    double scrapeUs = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / repeats;
+    std::clock_t cpuStart = std::clock();
+    options.json = false;
+    options.history = false;
+    options.count = 0;
+    options.pollMs = 250;
+    options.timeoutSeconds = 2;
+    std::ostringstream idle;
+    watch(*shared, idle, options, lost);
+    double watchCpuMs = 1000.0 * (std::clock() - cpuStart) / CLOCKS_PER_SEC / options.timeoutSeconds;
+    std::cout << std::fixed << std::setprecision(1) << "one scrape takes " << scrapeUs << " us; an idle watch uses "
+              << std::setprecision(3) << watchCpuMs << " ms of CPU per second" << std::endl;
+
+    std::cout << (failures ? std::to_string(failures) + " checks failed" : "all checks passed") << std::endl;
+    return failures ? 2 : 0;
+}
+
+static void usage()
+{
+    std::cerr << "usage: FanCtl status [--json]\n"
+              << "       FanCtl stats\n"
+              << "       FanCtl reset-stats\n"
+              << "       FanCtl profile [list | use number | save number name | delete number]\n"
+              << "       FanCtl watch [--format csv|json] [-n records] [--poll ms] [--history]\n"
+              << "       FanCtl serve [--port port]\n"
+              << "       FanCtl selftest [-n ticks]\n"
+              << "serve answers Prometheus scrapes at http://127.0.0.1:port/metrics (default port 9489)." << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    std::string command = argv[1];
+    std::vector<std::string> args(argv + 2, argv + argc);
+
+    try {
+        if (command == "status") return runStatus(args);
+        if (command == "stats") return runStats(args);
+        if (command == "reset-stats") return runResetStats(args);
+        if (command == "profile") return runProfile(args);
+        if (command == "watch") return runWatch(args);
+        if (command == "serve") return runServe(args);
+        if (command == "selftest") return runSelfTest(args);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    usage();
+    return 1;
+}
@@ -0,0 +1,1375 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+
+#include "SimulatedEc.h"
+#include "EcShadow.h"
+#include "EcWatchdog.h"
+#include "ControlLoop.h"
+#include "ThermalPlant.h"
+#include "SampleScheduler.h"
+#include "TraceRecorder.h"
+#include "TraceReplay.h"
+#include "CurveTuner.h"
+#include "SettingsStore.h"
+#include "ProfileSet.h"
+
+// Runs the real control loop against a simulated laptop, much faster than
+// real time. The EC is a zero-latency SimulatedEc whose temperature
+// registers are driven by ThermalPlant, so every curve, filter and coupling
+// decision goes through the same code as on hardware.
+
+typedef std::chrono::steady_clock Clock;
+
+struct SimOptions
+{
+    FanConfig config;
+    SensorPipeline::Params sensor;
+    double physicsStep = 0.1;       // s per plant integration step
+    double settleBand = 2.0;        // C around the final value that counts as settled
+    double cpuFullLoadWatts = 90.0; // CPU power that reads as 100% utilization
+    ThermalPlantParams plant;
+    bool onBattery = false;         // the simulated laptop runs on mains unless --battery
+    std::vector<std::pair<double, double> > ecOutages;  // sim s start and duration of each time the EC stops answering
+    double ecStallRate = 0;         // probability that the EC drops a command byte and stalls
+    std::ofstream* csv = nullptr;
+    std::string tracePrefix;        // records the run to trace files when set
+    size_t traceBytes = 16u << 20;
+
+    bool ecFaults() const { return !ecOutages.empty() || ecStallRate > 0; }
+};
+
+struct ZoneResult
+{
+    double peak = 0;
+    double maxOvershoot = 0;
+    double maxSettling = 0;
+    double settlingSum = 0;
+    int settledSteps = 0;
+    int unsettledSteps = 0;
+    unsigned long long fanChanges = 0;
+    unsigned long long held = 0;    // ticks whose fan change the slew or step limit held back
+    double fanEffort = 0;           // integral of the actual fan speed, %*s
+    double responseSum = 0;         // s from a load increase to half the fan command rise
+    int responses = 0;
+};
+
+struct SimResult
+{
+    ZoneResult cpu;
+    ZoneResult gpu;
+    double simSeconds = 0;
+    unsigned long long ticks = 0;
+    unsigned long long ecWritesIssued = 0;
+    unsigned long long ecWritesElided = 0;
+    unsigned long long ecTransactions = 0;
+    unsigned long long idleEntries = 0;
+    double idleSeconds = 0;         // fans handed back to the EC
+    unsigned long long ecFailures = 0;      // transactions that failed after their retries
+    unsigned long long ecRetries = 0;
+    unsigned long long fallbacks = 0;
+    double fallbackSeconds = 0;     // fans with the EC because the watchdog tripped
+    unsigned long long deadlineMisses = 0;
+    double wallSeconds = 0;
+    std::vector<std::string> traceFiles;
+    unsigned long long traceDropped = 0;
+};
+
+static std::vector<int> parseList(const std::string& text)
+{
+    std::vector<int> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        values.push_back(std::atoi(item.c_str()));
+    }
+    return values;
+}
+
+// "t1,...,tn/f1,...,fn" for a full curve of 2 to MAX_CURVE_POINTS points,
+// or "t2,...,tn-1/f1,...,fn" with the end points at 0 and 100 C, the way
+// the UI edits them
+static void parseCurve(const std::string& text, FanConfig& config, int channel)
+{
+    size_t slash = text.find('/');
+    std::vector<int> t = parseList(text.substr(0, slash));
+    std::vector<int> f = slash == std::string::npos ? std::vector<int>() : parseList(text.substr(slash + 1));
+    if (t.size() + 2 == f.size()) {
+        t.insert(t.begin(), 0);
+        t.push_back(100);
+    }
+    if (t.size() != f.size() || f.size() < 2 || f.size() > static_cast<size_t>(MAX_CURVE_POINTS)) {
+        throw std::invalid_argument("curve must be t1,...,tn/f1,...,fn or t2,...,tn-1/f1,...,fn: " + text);
+    }
+    config.point_count[channel] = static_cast<int32_t>(f.size());
+    std::copy(t.begin(), t.end(), config.curve_temp[channel]);
+    std::copy(f.begin(), f.end(), config.curve_fan[channel]);
+}
+
+static int32_t parseMode(const std::string& text)
+{
+    if (text == "curve") return FAN_MODE_CURVE;
+    if (text == "pid") return FAN_MODE_PID;
+    throw std::invalid_argument("mode must be curve or pid: " + text);
+}
+
+static int32_t parseInterpolation(const std::string& text)
+{
+    if (text == "linear") return CURVE_LINEAR;
+    if (text == "step") return CURVE_STEP;
+    if (text == "cubic") return CURVE_CUBIC;
+    throw std::invalid_argument("interpolation must be linear, step or cubic: " + text);
+}
+
+static int32_t parseIdleMode(const std::string& text)
+{
+    if (text == "off") return IDLE_OFF;
+    if (text == "always") return IDLE_ALWAYS;
+    if (text == "battery") return IDLE_ON_BATTERY;
+    throw std::invalid_argument("idle mode must be off, always or battery: " + text);
+}
+
+static std::vector<double> parseDoubles(const std::string& text)
+{
+    std::vector<double> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        values.push_back(std::atof(item.c_str()));
+    }
+    return values;
+}
+
+// "kp,ki,kd" or "kp,ki,kd,feedforward"
+static void parsePid(const std::string& text, FanConfig& config, int channel)
+{
+    std::vector<double> gains = parseDoubles(text);
+    if (gains.size() != 3 && gains.size() != 4) {
+        throw std::invalid_argument("PID gains must be kp,ki,kd[,feedforward]: " + text);
+    }
+    config.kp[channel] = static_cast<float>(gains[0]);
+    config.ki[channel] = static_cast<float>(gains[1]);
+    config.kd[channel] = static_cast<float>(gains[2]);
+    if (gains.size() == 4) config.feedforward[channel] = static_cast<float>(gains[3]);
+}
+
+// "w" for the same weight both ways between the CPU and GPU zones, or
+// "cpu_from_gpu,gpu_from_cpu"
+static void parseCoupling(const std::string& text, FanConfig& config)
+{
+    std::vector<double> weights = parseDoubles(text);
+    if (weights.empty() || weights.size() > 2 || *std::min_element(weights.begin(), weights.end()) < 0) {
+        throw std::invalid_argument("--coupling must be w or cpu_from_gpu,gpu_from_cpu: " + text);
+    }
+    config.coupling[CHANNEL_CPU][CHANNEL_GPU] = static_cast<float>(weights.front());
+    config.coupling[CHANNEL_GPU][CHANNEL_CPU] = static_cast<float>(weights.back());
+}
+
+static int32_t parseCouplingMode(const std::string& text)
+{
+    if (text == "max") return COUPLING_MAX;
+    if (text == "sum") return COUPLING_SUM;
+    throw std::invalid_argument("coupling mode must be max or sum: " + text);
+}
+
+// "up,down" in % per second, 0 for no limit
+static void parseSlew(const std::string& text, FanConfig& config, int channel)
+{
+    std::vector<double> rates = parseDoubles(text);
+    if (rates.size() != 2 || rates[0] < 0 || rates[1] < 0) {
+        throw std::invalid_argument("slew must be up,down in %/s: " + text);
+    }
+    config.slew_up[channel] = static_cast<float>(rates[0]);
+    config.slew_down[channel] = static_cast<float>(rates[1]);
+}
+
+// Each zone drives only its own fan, which follows its controller at once
+static void disableArbitration(FanConfig& config)
+{
+    for (int f = 0; f < MAX_CHANNELS; ++f) {
+        for (int z = 0; z < MAX_CHANNELS; ++z) config.coupling[f][z] = f == z ? 1.0f : 0.0f;
+        config.slew_up[f] = 0;
+        config.slew_down[f] = 0;
+        config.min_step[f] = 0;
+    }
+    config.coupling_mode = COUPLING_MAX;
+}
+
+// "ms" for a fixed control period, "min,max" for adaptive bounds
+static void parseOutage(const std::string& text, SimOptions& options)
+{
+    std::stringstream stream(text);
+    double start = -1, duration = 0;
+    char comma = 0;
+    if (!(stream >> start >> comma >> duration) || comma != ',' || start < 0 || duration <= 0) {
+        throw std::invalid_argument("--ec-outage must be start_s,duration_s: " + text);
+    }
+    options.ecOutages.push_back(std::make_pair(start, duration));
+}
+
+static void parsePeriod(const std::string& text, FanConfig& config)
+{
+    std::vector<int> bounds = parseList(text);
+    if (bounds.empty() || bounds.size() > 2 || bounds.front() <= 0 || bounds.back() < bounds.front()) {
+        throw std::invalid_argument("--period must be ms or min,max: " + text);
+    }
+    config.min_period_ms = bounds.front();
+    config.max_period_ms = bounds.back();
+}
+
+// Sensor pipeline and sensor noise options shared by run and filter.
+// Returns false when args[i] is not one of them.
+static bool parseSensorOption(const std::vector<std::string>& args, size_t& i, SensorPipeline::Params& sensor, SensorNoiseParams& noise)
+{
+    if (i + 1 >= args.size()) return false;
+    const std::string& option = args[i];
+    const std::string& value = args[i + 1];
+
+    if (option == "--alpha") sensor.alpha = std::atof(value.c_str());
+    else if (option == "--median") sensor.medianWindow = std::atoi(value.c_str());
+    else if (option == "--kalman") {
+        std::vector<double> qr = parseDoubles(value);
+        if (qr.size() != 2 || qr[0] < 0 || qr[1] <= 0) {
+            throw std::invalid_argument("--kalman must be q,r with q >= 0 and r > 0: " + value);
+        }
+        sensor.kalmanQ = qr[0];
+        sensor.kalmanR = qr[1];
+    }
+    else if (option == "--noise") noise.sensorNoise = std::atof(value.c_str());
+    else if (option == "--glitches") noise.glitchRate = std::atof(value.c_str());
+    else if (option == "--spikes") noise.spikeRate = std::atof(value.c_str());
+    else return false;
+
+    ++i;
+    return true;
+}
+
+static void checkSensorOptions(const SensorPipeline::Params& sensor)
+{
+    if (sensor.alpha <= 0 || sensor.alpha > 1) {
+        throw std::invalid_argument("--alpha must be in (0, 1]");
+    }
+    if (sensor.medianWindow < 1) {
+        throw std::invalid_argument("--median must be at least 1");
+    }
+}
+
+// Settling time and overshoot of one zone over one load segment, from
+// one temperature sample per simulated second, measured against the
+// temperature at the end of the segment
+static void analyzeSegment(ZoneResult& result, const std::vector<double>& temps, double band, bool loadRose)
+{
+    if (temps.size() < 2) return;
+    double final = temps.back();
+
+    size_t lastOutside = 0;
+    bool outside = false;
+    double highest = temps.front();
+    for (size_t i = 0; i < temps.size(); ++i) {
+        if (std::fabs(temps[i] - final) > band) {
+            lastOutside = i;
+            outside = true;
+        }
+        highest = std::max(highest, temps[i]);
+    }
+
+    // Still moving in the last quarter of the segment: the step never settled
+    if (outside && lastOutside >= temps.size() * 3 / 4) {
+        ++result.unsettledSteps;
+    }
+    else {
+        double settling = outside ? lastOutside + 1.0 : 0.0;
+        result.maxSettling = std::max(result.maxSettling, settling);
+        result.settlingSum += settling;
+        ++result.settledSteps;
+    }
+    if (loadRose) {
+        result.maxOvershoot = std::max(result.maxOvershoot, highest - final);
+    }
+}
+
+// Time from a load increase until the fan command has covered half of
+// its rise over the segment
+static void analyzeResponse(ZoneResult& result, const std::vector<std::pair<double, int> >& commands, int startCommand)
+{
+    int highest = startCommand;
+    for (const std::pair<double, int>& c : commands) highest = std::max(highest, c.second);
+    if (highest <= startCommand) return;
+
+    double half = startCommand + 0.5 * (highest - startCommand);
+    for (const std::pair<double, int>& c : commands) {
+        if (c.second >= half) {
+            result.responseSum += c.first;
+            ++result.responses;
+            return;
+        }
+    }
+}
+
+static SimResult simulate(const LoadTrace& trace, const SimOptions& options)
+{
+    SimulatedEc::Timing timing;
+    timing.inputLatency = std::chrono::microseconds(0);
+    timing.outputLatency = std::chrono::microseconds(0);
+    SimulatedEc ec(timing);
+
+    // With faults the loop talks to the EC the way the backend does, through
+    // retries and the watchdog. A stall outlasts every retry of its
+    // transaction; the timeouts are short so the faults cost little wall time.
+    EcWatchdogParams watchdogParams;
+    watchdogParams.backoff = std::chrono::microseconds(100);
+    EcWatchdog watchdog(watchdogParams);
+    RecordingEcTransport bus(ec);
+    RetryingEcTransport retrying(bus, watchdog, true);
+    if (options.ecFaults()) {
+        EcCompletionPolicy policy;
+        policy.timeout = std::chrono::milliseconds(1);
+        ec.setCompletionPolicy(policy);
+        ec.setStalls(options.ecStallRate, std::chrono::milliseconds(5));
+    }
+    ShadowedEcTransport shadow(options.ecFaults() ? static_cast<EcTransport&>(retrying) : bus);
+    TickTrace tickTrace(shadow);
+
+    const std::vector<LoadSegment>& segments = trace.segments();
+    ThermalPlant plant(ec, options.plant);
+    plant.setLoad(segments.front().cpuWatts, segments.front().gpuWatts);
+    plant.settle();
+
+    ControlLoop loop(tickTrace, options.config, options.sensor);
+    loop.setOnBattery(options.onBattery);
+    if (options.ecFaults()) {
+        loop.setWatchdog(&watchdog);
+        tickTrace.setWatchdog(&watchdog);
+    }
+    SampleScheduler scheduler(options.config);
+
+    std::unique_ptr<TraceRecorder> recorder;
+    if (!options.tracePrefix.empty()) {
+        TraceRecorderParams traceParams;
+        traceParams.prefix = options.tracePrefix;
+        traceParams.fileBytes = options.traceBytes;
+        TraceStart traceStart = { options.config, -1, loop.ecRegisters(), options.sensor };
+        recorder.reset(new TraceRecorder(traceParams, traceStart));
+        bus.setRecorder(recorder.get());
+        tickTrace.setRecorder(recorder.get());
+    }
+    bool inFallback = false;
+
+    SimResult result;
+    int lastCpuFan = -1, lastGpuFan = -1;
+    double lastCpuWatts = segments.front().cpuWatts, lastGpuWatts = segments.front().gpuWatts;
+    unsigned long long ecBefore = ec.reads() + ec.writes();
+
+    double now = 0, nextTick = 0;
+    const double epsilon = 1e-9;
+    Clock::time_point start = Clock::now();
+    std::vector<double> cpuTemps, gpuTemps;
+    std::vector<std::pair<double, int> > cpuCommands, gpuCommands;
+    for (const LoadSegment& segment : segments) {
+        plant.setLoad(segment.cpuWatts, segment.gpuWatts);
+        double load = std::min(100.0, 100.0 * segment.cpuWatts / options.cpuFullLoadWatts);
+        double segmentEnd = now + segment.duration;
+        double nextSample = now + 1.0;
+        double segmentStart = now;
+        int cpuStartCommand = lastCpuFan, gpuStartCommand = lastGpuFan;
+        cpuTemps.clear();
+        gpuTemps.clear();
+        cpuCommands.clear();
+        gpuCommands.clear();
+
+        while (now < segmentEnd - epsilon) {
+            if (now >= nextTick - epsilon) {
+                bool outage = false;
+                for (const std::pair<double, double>& o : options.ecOutages) {
+                    if (now >= o.first && now < o.first + o.second) outage = true;
+                }
+                ec.setUnresponsive(outage);
+
+                tickTrace.beginTick(now, load, options.onBattery, watchdog.tripped());
+                ControlTickResult tick = loop.tick(now, load);
+                if (tick.ecFailed || tick.fallback != inFallback) shadow.invalidate();
+                if (tick.fallback && !inFallback) ++result.fallbacks;
+                inFallback = tick.fallback;
+                int cpuFan = tick.fan[CHANNEL_CPU];
+                int gpuFan = tick.fan[CHANNEL_GPU];
+                if (result.ticks > 0) {
+                    if (cpuFan != lastCpuFan) ++result.cpu.fanChanges;
+                    if (gpuFan != lastGpuFan) ++result.gpu.fanChanges;
+                }
+                if (tick.held & (1u << CHANNEL_CPU)) ++result.cpu.held;
+                if (tick.held & (1u << CHANNEL_GPU)) ++result.gpu.held;
+                lastCpuFan = cpuFan;
+                lastGpuFan = gpuFan;
+                cpuCommands.push_back(std::make_pair(now - segmentStart, cpuFan));
+                gpuCommands.push_back(std::make_pair(now - segmentStart, gpuFan));
+                ++result.ticks;
+
+                int periodMs = scheduler.next(now, tick.fast, tick.channelCount, load, tick.idle || tick.fallback);
+                nextTick = now + periodMs / 1000.0;
+                tickTrace.endTick(tick, watchdog.tripped(), periodMs);
+                // The simulation outruns the recorder's flush interval
+                if (recorder && recorder->backlogged()) recorder->flush();
+
+                if (options.csv) {
+                    *options.csv << trace.name() << ',' << now << ','
+                                 << segment.cpuWatts << ',' << segment.gpuWatts << ','
+                                 << plant.cpu().dieTemp << ',' << plant.gpu().dieTemp << ','
+                                 << tick.raw[CHANNEL_CPU] << ',' << tick.raw[CHANNEL_GPU] << ','
+                                 << tick.temp[CHANNEL_CPU] << ',' << tick.temp[CHANNEL_GPU] << ','
+                                 << cpuFan << ',' << gpuFan << ','
+
+                                 << plant.cpu().fanActual << ',' << plant.gpu().fanActual << ','
+                                 << periodMs << ',' << scheduler.reasons() << '\n';
+                }
+            }
+
+            double dt = std::min(options.physicsStep, std::min(nextTick, segmentEnd) - now);
+            plant.step(dt);
+            now += dt;
+            result.cpu.fanEffort += plant.cpu().fanActual * dt;
+            result.gpu.fanEffort += plant.gpu().fanActual * dt;
+            if (inFallback) result.fallbackSeconds += dt;
+            result.cpu.peak = std::max(result.cpu.peak, plant.cpu().dieTemp);
+            result.gpu.peak = std::max(result.gpu.peak, plant.gpu().dieTemp);
+
+            if (now >= nextSample - epsilon) {
+                cpuTemps.push_back(plant.cpu().dieTemp);
+                gpuTemps.push_back(plant.gpu().dieTemp);
+                nextSample += 1.0;
+            }
+        }
+
+        // Only load changes are steps; an unchanged zone is not scored
+        if (segment.cpuWatts != lastCpuWatts) {
+            analyzeSegment(result.cpu, cpuTemps, options.settleBand, segment.cpuWatts > lastCpuWatts);
+            if (segment.cpuWatts > lastCpuWatts) analyzeResponse(result.cpu, cpuCommands, cpuStartCommand);
+        }
+        if (segment.gpuWatts != lastGpuWatts) {
+            analyzeSegment(result.gpu, gpuTemps, options.settleBand, segment.gpuWatts > lastGpuWatts);
+            if (segment.gpuWatts > lastGpuWatts) analyzeResponse(result.gpu, gpuCommands, gpuStartCommand);
+        }
+        lastCpuWatts = segment.cpuWatts;
+        lastGpuWatts = segment.gpuWatts;
+    }
+    result.wallSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.simSeconds = now;
+    result.ecWritesIssued = shadow.issued();
+    result.ecWritesElided = shadow.elided();
+    result.ecTransactions = ec.reads() + ec.writes() - ecBefore;
+    result.idleEntries = loop.idleState().entries();
+    result.idleSeconds = loop.idleState().seconds();
+    result.ecFailures = watchdog.failures();
+    result.ecRetries = watchdog.retries();
+    result.deadlineMisses = watchdog.deadlineMisses();
+    if (recorder) {
+        bus.setRecorder(nullptr);
+        recorder->close();
+        result.traceFiles = recorder->files();
+        result.traceDropped = recorder->dropped();
+    }
+    return result;
+}
+
+static void printZone(const std::string& label, const ZoneResult& zone, double simSeconds)
+{
+    double hours = simSeconds / 3600.0;
+    double meanSettling = zone.settledSteps ? zone.settlingSum / zone.settledSteps : 0.0;
+    std::cout << std::left << std::setw(20) << label << std::right << std::fixed << std::setprecision(1)
+              << std::setw(8) << zone.peak
+              << std::setw(11) << zone.maxOvershoot
+              << std::setw(11) << meanSettling
+              << std::setw(11) << zone.maxSettling
+              << std::setw(11) << zone.unsettledSteps
+              << std::setw(11) << (zone.responses ? zone.responseSum / zone.responses : 0.0)
+              << std::setw(11) << zone.fanChanges / hours
+              << std::setw(11) << zone.fanEffort / simSeconds
+              << std::setw(11) << zone.fanEffort / 3600.0 << std::endl;
+}
+
+// Options of run and arbitration; returns the scenarios and trace files
+static std::vector<std::string> parseRunOptions(const std::vector<std::string>& args, SimOptions& options, std::string& csvPath, double& maxPeak)
+{
+    options.config = defaultFanConfig();
+    std::vector<std::string> traces;
+    for (size_t i = 0; i < args.size(); ++i) {
+        bool hasValue = i + 1 < args.size();
+        // --cpu-* and --gpu-* options set the matching channel
+        int channel = args[i].compare(0, 6, "--gpu-") == 0 ? CHANNEL_GPU : CHANNEL_CPU;
+        std::string option = args[i].compare(0, 6, "--cpu-") == 0 || args[i].compare(0, 6, "--gpu-") == 0
+            ? args[i].substr(6) : std::string();
+
+        if (option == "curve" && hasValue) parseCurve(args[++i], options.config, channel);
+        else if (option == "interp" && hasValue) options.config.interpolation[channel] = parseInterpolation(args[++i]);
+        else if (option == "hyst" && hasValue) options.config.hysteresis[channel] = std::atoi(args[++i].c_str());
+        else if (option == "mode" && hasValue) options.config.mode[channel] = parseMode(args[++i]);
+        else if (option == "target" && hasValue) options.config.target_temp[channel] = std::atoi(args[++i].c_str());
+        else if (option == "pid" && hasValue) parsePid(args[++i], options.config, channel);
+        else if (option == "slew" && hasValue) parseSlew(args[++i], options.config, channel);
+        else if (option == "min-step" && hasValue) options.config.min_step[channel] = std::max(0, std::atoi(args[++i].c_str()));
+        else if (parseSensorOption(args, i, options.sensor, options.plant.sensor)) continue;
+        else if (args[i] == "--period" && hasValue) parsePeriod(args[++i], options.config);
+        else if (args[i] == "--idle" && hasValue) options.config.idle_mode = parseIdleMode(args[++i]);
+        else if (args[i] == "--battery") options.onBattery = true;
+        else if (args[i] == "--ambient" && hasValue) options.plant.ambient = std::atof(args[++i].c_str());
+        else if (args[i] == "--csv" && hasValue) csvPath = args[++i];
+        else if (args[i] == "--trace" && hasValue) options.tracePrefix = args[++i];
+        else if (args[i] == "--trace-size" && hasValue) options.traceBytes = static_cast<size_t>(std::atof(args[++i].c_str()) * (1u << 20));
+        else if (args[i] == "--max-peak" && hasValue) maxPeak = std::atof(args[++i].c_str());
+        else if (args[i] == "--ec-outage" && hasValue) parseOutage(args[++i], options);
+        else if (args[i] == "--ec-stalls" && hasValue) options.ecStallRate = std::atof(args[++i].c_str());
+        else if (args[i] == "--coupling" && hasValue) parseCoupling(args[++i], options.config);
+        else if (args[i] == "--coupling-mode" && hasValue) options.config.coupling_mode = parseCouplingMode(args[++i]);
+        else if (args[i] == "--no-arbitration") disableArbitration(options.config);
+        else traces.push_back(args[i]);
+    }
+    checkSensorOptions(options.sensor);
+    if (traces.empty()) traces = LoadTrace::builtinNames();
+    return traces;
+}
+
+static LoadTrace loadTrace(const std::string& name)
+{
+    bool isFile = name.find('.') != std::string::npos || name.find('/') != std::string::npos || name.find('\\') != std::string::npos;
+    return isFile ? LoadTrace::fromCsv(name) : LoadTrace::builtin(name);
+}
+
+static int runSimulation(const std::vector<std::string>& args)
+{
+    SimOptions options;
+    std::string csvPath;
+    double maxPeak = 0;
+    std::vector<std::string> traces = parseRunOptions(args, options, csvPath, maxPeak);
+    if (!options.tracePrefix.empty() && traces.size() != 1) throw std::invalid_argument("--trace records one scenario");
+
+    std::ofstream csv;
+    if (!csvPath.empty()) {
+        csv.open(csvPath);
+        if (!csv) throw std::runtime_error("Could not create " + csvPath);
+        csv << "scenario,time_s,cpu_w,gpu_w,cpu_temp,gpu_temp,cpu_raw,gpu_raw,cpu_filtered,gpu_filtered,"
+               "cpu_cmd,gpu_cmd,cpu_fan,gpu_fan,period_ms,reasons\n";
+        options.csv = &csv;
+    }
+
+    std::cout << std::left << std::setw(20) << "scenario/zone" << std::right
+              << std::setw(8) << "peak C" << std::setw(11) << "overshoot" << std::setw(11) << "settle s"
+              << std::setw(11) << "settle max" << std::setw(11) << "unsettled" << std::setw(11) << "t50 s" << std::setw(11) << "changes/h"
+              << std::setw(11) << "mean fan %" << std::setw(11) << "effort %h" << std::endl;
+
+    bool peakExceeded = false;
+    std::vector<std::string> summaries;
+    for (const std::string& name : traces) {
+        SimResult result = simulate(loadTrace(name), options);
+
+        printZone(name + "/cpu", result.cpu, result.simSeconds);
+        printZone(name + "/gpu", result.gpu, result.simSeconds);
+
+        std::ostringstream summary;
+        summary << std::fixed << std::setprecision(0) << name << ": " << result.ticks << " ticks ("
+                << result.simSeconds << " s simulated) in " << std::setprecision(3) << result.wallSeconds << " s, "
+                << std::setprecision(0) << result.ticks / result.wallSeconds << " ticks/s; EC writes "
+                << result.ecWritesIssued << " issued, " << result.ecWritesElided << " elided; "
+                << result.ecTransactions * 3600.0 / result.simSeconds << " EC transactions/h; "
+                << (result.cpu.held + result.gpu.held) << " fan changes held back by the slew or step limit";
+        if (result.idleEntries > 0) {
+            summary << "; idle " << std::setprecision(1) << 100.0 * result.idleSeconds / result.simSeconds << "% ("
+                    << result.idleEntries << " entries)";
+        }
+        if (options.ecFaults()) {
+            summary << "; EC " << result.ecFailures << " failed transactions (" << result.ecRetries << " retries), "
+                    << result.fallbacks << " fallbacks, " << std::setprecision(1) << result.fallbackSeconds
+                    << " s on EC auto, " << result.deadlineMisses << " deadline misses";
+        }
+        if (!result.traceFiles.empty()) {
+            summary << "; traced to " << result.traceFiles.size() << " files, " << result.traceDropped << " records dropped";
+            for (const std::string& file : result.traceFiles) summary << "\n  " << file;
+        }
+        summaries.push_back(summary.str());
+
+        if (maxPeak > 0 && (result.cpu.peak > maxPeak || result.gpu.peak > maxPeak)) {
+            peakExceeded = true;
+        }
+    }
+
+    std::cout << std::endl;
+    for (const std::string& summary : summaries) std::cout << summary << std::endl;
+
+    if (peakExceeded) {
+        std::cerr << "peak temperature above " << maxPeak << " C" << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+// Runs every scenario twice, with each zone driving only its own fan at
+// once and with the configured coupling, slew and step limits, and
+// compares fan commands, EC writes, temperatures and fan effort
+static int runArbitration(const std::vector<std::string>& args)
+{
+    SimOptions options;
+    std::string csvPath;
+    double maxPeak = 0;
+    std::vector<std::string> traces = parseRunOptions(args, options, csvPath, maxPeak);
+    if (!csvPath.empty()) throw std::invalid_argument("arbitration does not write --csv");
+    if (!options.tracePrefix.empty()) throw std::invalid_argument("arbitration does not write --trace");
+    SimOptions direct = options;
+    disableArbitration(direct.config);
+
+    std::cout << std::left << std::setw(12) << "scenario" << std::right
+              << std::setw(11) << "cmds/h" << std::setw(11) << "arbitrated" << std::setw(11) << "change"
+              << std::setw(11) << "writes/h" << std::setw(11) << "arbitrated"
+              << std::setw(11) << "peak C" << std::setw(11) << "arbitrated"
+              << std::setw(11) << "mean fan %" << std::setw(11) << "arbitrated" << std::endl;
+
+    bool peakExceeded = false;
+    double directTotal = 0, arbitratedTotal = 0;
+    for (const std::string& name : traces) {
+        LoadTrace trace = loadTrace(name);
+        SimResult before = simulate(trace, direct);
+        SimResult after = simulate(trace, options);
+
+        double hours = before.simSeconds / 3600.0;
+        double beforeCommands = (before.cpu.fanChanges + before.gpu.fanChanges) / hours;
+        double afterCommands = (after.cpu.fanChanges + after.gpu.fanChanges) / hours;
+        directTotal += beforeCommands;
+        arbitratedTotal += afterCommands;
+        std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(11) << beforeCommands << std::setw(11) << afterCommands
+                  << std::setw(10) << (beforeCommands > 0 ? 100.0 * (afterCommands - beforeCommands) / beforeCommands : 0.0) << '%'
+                  << std::setw(11) << before.ecWritesIssued / hours << std::setw(11) << after.ecWritesIssued / hours
+                  << std::setw(11) << std::max(before.cpu.peak, before.gpu.peak) << std::setw(11) << std::max(after.cpu.peak, after.gpu.peak)
+                  << std::setw(11) << (before.cpu.fanEffort + before.gpu.fanEffort) / (2 * before.simSeconds)
+                  << std::setw(11) << (after.cpu.fanEffort + after.gpu.fanEffort) / (2 * after.simSeconds) << std::endl;
+
+        if (maxPeak > 0 && (after.cpu.peak > maxPeak || after.gpu.peak > maxPeak)) peakExceeded = true;
+    }
+    std::cout << std::endl << std::fixed << std::setprecision(1) << "fan commands/h over all scenarios: " << directTotal
+              << " direct, " << arbitratedTotal << " arbitrated";
+    if (directTotal > 0) std::cout << " (" << 100.0 * (arbitratedTotal - directTotal) / directTotal << "%)";
+    std::cout << std::endl;
+
+    if (peakExceeded) {
+        std::cerr << "peak temperature above " << maxPeak << " C" << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+// One sensor's readings for the filter evaluation
+struct SensorTrace
+{
+    std::string name;
+    std::vector<double> times;      // s
+    std::vector<double> raw;        // what the EC reported
+    std::vector<double> truth;      // the actual temperature, empty when unknown
+    std::vector<double> clean;      // the readings without noise, glitches or spikes, empty when unknown
+};
+
+// Built-in temperature profiles, one reading per second for 20 minutes
+static double syntheticTemperature(const std::string& name, double t)
+{
+    const double pi = 3.14159265358979;
+    if (name == "idle") return 45.0;
+    if (name == "ramp") return t < 600 ? 45.0 + 50.0 * t / 600 : 95.0 - 50.0 * (t - 600) / 600;
+    if (name == "step") return t >= 300 && t < 800 ? 85.0 : 50.0;
+    if (name == "sine") return 65.0 + 15.0 * std::sin(2 * pi * t / 240);
+    throw std::invalid_argument("unknown sensor trace " + name + " (idle, ramp, step, sine or a CSV file)");
+}
+
+static SensorTrace syntheticSensorTrace(const std::string& name, const SensorNoiseParams& noiseParams)
+{
+    SensorTrace trace;
+    trace.name = name;
+    SensorNoise noise(noiseParams);
+    for (int t = 0; t < 1200; ++t) {
+        double truth = syntheticTemperature(name, t);
+        trace.times.push_back(t);
+        trace.truth.push_back(truth);
+        trace.raw.push_back(noise.reading(truth));
+        trace.clean.push_back(std::round(truth));
+    }
+    return trace;
+}
+
+// CSV rows of time_s,raw[,truth], e.g. columns cut from a FanSim --csv log
+static SensorTrace sensorTraceFromCsv(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("Could not open sensor trace " + path);
+
+    SensorTrace trace;
+    trace.name = path;
+    bool hasTruth = true;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::istringstream fields(line);
+        double t, raw, truth;
+        if (!(fields >> t >> raw)) continue;
+        if (!trace.times.empty() && t <= trace.times.back()) {
+            throw std::runtime_error("Sensor trace " + path + " times must increase");
+        }
+        trace.times.push_back(t);
+        trace.raw.push_back(raw);
+        if (fields >> truth) trace.truth.push_back(truth);
+        else hasTruth = false;
+    }
+    if (trace.raw.empty()) throw std::runtime_error("Sensor trace " + path + " has no rows");
+    if (!hasTruth) trace.truth.clear();
+    return trace;
+}
+
+// Error of one filter stage against the true temperature, and how far
+// noise, glitches and spikes pushed it from the same stage fed clean readings
+struct StageError
+{
+    double sumSquares = 0;
+    double maxError = 0;
+    double maxDeviation = 0;
+    unsigned long long deviations = 0;     // ticks more than 2 C from the clean run
+    unsigned long long samples = 0;
+    unsigned long long extraReads = 0;     // EC reads beyond one per tick
+
+    void add(const SensorTrace& trace, size_t i, double value, double cleanValue)
+    {
+        ++samples;
+        if (!trace.truth.empty()) {
+            double error = value - trace.truth[i];
+            sumSquares += error * error;
+            maxError = std::max(maxError, std::fabs(error));
+        }
+        if (!trace.clean.empty()) {
+            double deviation = std::fabs(value - cleanValue);
+            maxDeviation = std::max(maxDeviation, deviation);
+            if (deviation > 2.0) ++deviations;
+        }
+    }
+};
+
+static void printStage(const std::string& label, const StageError& stage, const SensorTrace& trace)
+{
+    std::cout << std::left << std::setw(20) << label << std::right << std::fixed << std::setprecision(2);
+    if (trace.truth.empty()) std::cout << std::setw(10) << "-" << std::setw(10) << "-";
+    else std::cout << std::setw(10) << std::sqrt(stage.sumSquares / std::max(1ULL, stage.samples)) << std::setw(10) << stage.maxError;
+    if (trace.clean.empty()) std::cout << std::setw(10) << "-" << std::setw(10) << "-";
+    else std::cout << std::setw(10) << stage.maxDeviation << std::setw(10) << stage.deviations;
+    std::cout << std::setw(12) << stage.extraReads << std::endl;
+}
+
+// The sensor handling before SensorPipeline: the EMA's output was range
+// checked, and while it was out of range the register was read again (up
+// to three times, each read going through the EMA) before giving up at 100 C
+static double legacyRetryFilter(LowPassFilter& filter, double raw, double dt, double truth, SensorNoise& rereads, unsigned long long& extraReads)
+{
+    const int retry_count = 3;
+    double temp = filter.filter(raw, dt);
+    for (int i = 0; (temp == 0 || temp > 110) && i < retry_count + 1; i++)
+    {
+        if (i != retry_count) {
+            temp = filter.filter(rereads.reading(truth));
+            ++extraReads;
+        }
+        else temp = 100;
+    }
+    return temp;
+}
+
+static void evaluateFilters(const SensorTrace& trace, const SensorPipeline::Params& params, const SensorNoiseParams& noiseParams)
+{
+    enum { RAW, MEDIAN, EMA, FAST, KALMAN, STAGES };
+    const char* names[STAGES] = { "raw", "median", "ema", "fast", "kalman" };
+    StageError stages[STAGES];
+    StageError legacy;
+
+    SensorPipeline pipeline(params), cleanPipeline(params);
+    LowPassFilter legacyFilter(params.alpha), cleanLegacy(params.alpha);
+    SensorNoiseParams rereadParams = noiseParams;
+    rereadParams.seed = noiseParams.seed + 1;
+    SensorNoise rereads(rereadParams);
+    bool synthetic = !trace.clean.empty();
+    unsigned long long faultedTicks = 0;
+
+    for (size_t i = 0; i < trace.raw.size(); ++i) {
+        double dt = i ? trace.times[i] - trace.times[i - 1] : 1.0;
+        const SensorSample& s = pipeline.update(trace.raw[i], dt);
+        SensorSample c = synthetic ? cleanPipeline.update(trace.clean[i], dt) : s;
+        if (s.faulted) ++faultedTicks;
+        if (!s.primed) continue;
+
+        double values[STAGES] = { trace.raw[i], s.median, s.ema, s.fast, s.kalman };
+        double cleanValues[STAGES] = { synthetic ? trace.clean[i] : 0, c.median, c.ema, c.fast, c.kalman };
+        for (int k = 0; k < STAGES; ++k) stages[k].add(trace, i, values[k], cleanValues[k]);
+
+        if (synthetic) {
+            double value = legacyRetryFilter(legacyFilter, trace.raw[i], dt, trace.truth[i], rereads, legacy.extraReads);
+            legacy.add(trace, i, value, cleanLegacy.filter(trace.clean[i], dt));
+        }
+    }
+
+    for (int k = 0; k < STAGES; ++k) {
+        if (k == KALMAN && params.kalmanQ <= 0) continue;
+        printStage(trace.name + "/" + names[k], stages[k], trace);
+    }
+    if (synthetic) printStage(trace.name + "/legacy", legacy, trace);
+    std::cout << trace.name << ": " << trace.raw.size() << " readings, " << pipeline.rejects() << " rejected, "
+              << faultedTicks << " faulted ticks" << std::endl;
+}
+
+static int runFilter(const std::vector<std::string>& args)
+{
+    SensorPipeline::Params params;
+    SensorNoiseParams noise;
+    noise.sensorNoise = 0.5;
+    noise.glitchRate = 0.02;
+    noise.spikeRate = 0.02;
+    std::vector<std::string> traces;
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (parseSensorOption(args, i, params, noise)) continue;
+        traces.push_back(args[i]);
+    }
+    checkSensorOptions(params);
+    if (traces.empty()) traces = { "idle", "ramp", "step", "sine" };
+
+    std::cout << std::left << std::setw(20) << "trace/stage" << std::right
+              << std::setw(10) << "rmse C" << std::setw(10) << "max err" << std::setw(10) << "max dev"
+              << std::setw(10) << "dev>2C" << std::setw(12) << "extra reads" << std::endl;
+
+    for (const std::string& name : traces) {
+        bool isFile = name.find('.') != std::string::npos || name.find('/') != std::string::npos || name.find('\\') != std::string::npos;
+        SensorTrace trace = isFile ? sensorTraceFromCsv(name) : syntheticSensorTrace(name, noise);
+        evaluateFilters(trace, params, noise);
+    }
+    return 0;
+}
+
+// One run of the control loop through a register map against a simulated
+// EC whose every other register holds a sentinel
+struct ModelRun
+{
+    int channels;                   // channels the loop ran, those of the default config the map has
+    std::vector<int> commands;      // every tick's fan commands, channel by channel
+    unsigned char registers[256];   // the EC at the end
+    bool compiled;                  // the loop ran the pass compiled for the map
+    unsigned long long writes;
+    double tickNs;                  // mean time of a tick, EC access included
+};
+
+static unsigned char sentinel(int reg) { return static_cast<unsigned char>(0xa5 ^ reg); }
+
+// registers runs the loop's compiled pass when it is one of ec_models,
+// the runtime one for any other map, such as a copy of a built-in map
+static ModelRun runModel(const EcRegisterMap& registers, const LoadTrace& trace)
+{
+    SimulatedEc::Timing timing;
+    timing.inputLatency = std::chrono::microseconds(0);
+    timing.outputLatency = std::chrono::microseconds(0);
+    SimulatedEc ec(timing);
+    for (int r = 0; r < 256; ++r) ec.poke(static_cast<short>(r), sentinel(r));
+
+    const std::vector<LoadSegment>& segments = trace.segments();
+    ThermalPlant plant(ec, ThermalPlantParams(), registers);
+    plant.setLoad(segments.front().cpuWatts, segments.front().gpuWatts);
+    plant.settle();
+
+    ControlLoop loop(ec, defaultFanConfig());
+    loop.setRegisters(registers);
+
+    ModelRun run = {};
+    run.compiled = loop.compiledRegisters();
+    unsigned long long writesBefore = ec.writes();
+    Clock::duration ticking = Clock::duration::zero();
+    double now = 0;
+    for (const LoadSegment& segment : segments) {
+        plant.setLoad(segment.cpuWatts, segment.gpuWatts);
+        for (double end = now + segment.duration; now < end - 1e-9; now += 1.0) {
+            Clock::time_point start = Clock::now();
+            ControlTickResult tick = loop.tick(now);
+            ticking += Clock::now() - start;
+            run.channels = tick.channelCount;
+            for (int c = 0; c < tick.channelCount; ++c) run.commands.push_back(tick.fan[c]);
+            for (int i = 0; i < 10; ++i) plant.step(0.1);
+        }
+    }
+    for (int r = 0; r < 256; ++r) run.registers[r] = ec.peek(static_cast<short>(r));
+    run.writes = ec.writes() - writesBefore;
+    run.tickNs = std::chrono::duration<double, std::nano>(ticking).count() / std::max<size_t>(1, static_cast<size_t>(now));
+    return run;
+}
+
+// The register file text describing registers for a model
+static std::string registerFileText(const std::string& manufacturer, const std::string& product, const EcRegisterMap& registers)
+{
+    static const char* keys[MAX_CHANNELS] = { "cpu", "gpu", "fan3", "fan4" };
+    std::ostringstream text;
+    text << "# generated by FanSim models\nmanufacturer " << manufacturer << "\nproduct  " << product << "\r\n";
+    for (int c = 0; c < registers.channelCount; ++c) {
+        const FanChannelRegisters& channel = registers.channels[c];
+        text << keys[c] << ' ' << channel.tempReg << ' ' << channel.fanModeReg << " 0x" << std::hex << channel.fanModeAuto
+             << " 0x" << channel.fanModeManual << std::dec << ' ' << channel.fanSpeedReg << '\n';
+    }
+    return text.str();
+}
+
+static bool sameRegisters(const EcRegisterMap& a, const EcRegisterMap& b)
+{
+    if (a.channelCount != b.channelCount) return false;
+    for (int c = 0; c < a.channelCount; ++c) {
+        const FanChannelRegisters& x = a.channels[c];
+        const FanChannelRegisters& y = b.channels[c];
+        if (x.tempReg != y.tempReg || x.fanModeReg != y.fanModeReg || x.fanModeAuto != y.fanModeAuto ||
+            x.fanModeManual != y.fanModeManual || x.fanSpeedReg != y.fanSpeedReg) return false;
+    }
+    return true;
+}
+
+// What the run left wrong on the EC: a register outside the map changed,
+// a fan mode register holding neither of its values, or a fan in manual
+// mode at another speed than the last command. Empty when nothing is.
+static std::string checkModelRun(const EcRegisterMap& registers, const ModelRun& run)
+{
+    bool mapped[256] = {};
+    for (int c = 0; c < registers.channelCount; ++c) {
+        const FanChannelRegisters& channel = registers.channels[c];
+        mapped[channel.tempReg & 0xff] = mapped[channel.fanModeReg & 0xff] = mapped[channel.fanSpeedReg & 0xff] = true;
+    }
+    for (int r = 0; r < 256; ++r) {
+        if (!mapped[r] && run.registers[r] != sentinel(r)) return "wrote register " + std::to_string(r) + " outside the map";
+    }
+
+    int count = run.channels;
+    for (int c = 0; c < count; ++c) {
+        const FanChannelRegisters& channel = registers.channels[c];
+        unsigned char mode = run.registers[channel.fanModeReg & 0xff];
+        int last = run.commands.empty() ? -1 : run.commands[run.commands.size() - count + c];
+        bool commanded = false;
+        for (size_t i = c; i < run.commands.size(); i += count) commanded = commanded || run.commands[i] >= 0;
+        if (!commanded) return std::string(channel.name) + " fan never commanded";
+        if (mode != channel.fanModeAuto && mode != channel.fanModeManual) return std::string(channel.name) + " fan mode register holds neither mode";
+        if (mode == channel.fanModeManual && run.registers[channel.fanSpeedReg & 0xff] != last) {
+            return std::string(channel.name) + " fan speed register is not the last command";
+        }
+    }
+    return std::string();
+}
+
+// Runs every built-in register map, and the map of a register file when
+// given, through the control loop against the simulated EC, then checks
+// the register file parser on each built-in map and on broken files.
+// Returns 2 when a check fails.
+static int runModels(const std::vector<std::string>& args)
+{
+    std::string registersPath;
+    std::string traceName = "gaming";
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--registers" && i + 1 < args.size()) registersPath = args[++i];
+        else traceName = args[i];
+    }
+    LoadTrace trace = loadTrace(traceName);
+
+    struct Model { std::string name; EcRegisterMap registers; const EcRegisterMap* builtin; };
+    std::vector<Model> models;
+    for (const EcModel& model : ec_models) {
+        models.push_back({ std::string(model.manufacturer) + " " + model.product, *model.registers, model.registers });
+    }
+    if (!registersPath.empty()) {
+        std::ifstream in(registersPath, std::ios::binary);
+        if (!in) throw std::runtime_error("Could not open register file " + registersPath);
+        EcRegisterFile file = parseEcRegisterFile(std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()));
+        if (file.registers.channelCount < 2) throw std::invalid_argument("the simulated laptop needs the cpu and gpu channels");
+        models.push_back({ file.manufacturer + " " + file.product + " (file)", file.registers, nullptr });
+    }
+
+    std::cout << std::left << std::setw(36) << "model/pass" << std::right << std::setw(10) << "channels"
+              << std::setw(10) << "ticks" << std::setw(10) << "writes" << std::setw(10) << "tick ns" << "  result" << std::endl;
+
+    int failures = 0;
+    auto report = [&](const std::string& label, const EcRegisterMap& registers, const ModelRun& run, std::string problem) {
+        if (problem.empty()) problem = checkModelRun(registers, run);
+        std::cout << std::left << std::setw(36) << label << std::right << std::setw(10) << run.channels
+                  << std::setw(10) << run.commands.size() / std::max(1, run.channels) << std::setw(10) << run.writes
+                  << std::setw(10) << std::fixed << std::setprecision(0) << run.tickNs
+                  << "  " << (problem.empty() ? "ok" : "FAIL: " + problem) << std::endl;
+        if (!problem.empty()) ++failures;
+    };
+
+    for (const Model& model : models) {
+        // The copy is not a built-in map, so it takes the runtime pass
+        ModelRun runtime = runModel(model.registers, trace);
+        if (model.builtin) {
+            ModelRun compiled = runModel(*model.builtin, trace);
+            std::string problem;
+            if (!compiled.compiled) problem = "the compiled pass was not selected";
+            else if (compiled.commands != runtime.commands) problem = "the compiled and runtime passes disagree";
+            report(model.name + "/compiled", *model.builtin, compiled, problem);
+        }
+        report(model.name + "/runtime", model.registers, runtime, runtime.compiled ? "a copy ran the compiled pass" : "");
+    }
+
+    // Every built-in map survives a trip through a register file
+    for (const EcModel& model : ec_models) {
+        EcRegisterFile file = parseEcRegisterFile(registerFileText(model.manufacturer, model.product, *model.registers));
+        if (!file.matches(model.manufacturer, model.product) || !sameRegisters(file.registers, *model.registers)) {
+            std::cout << "FAIL: the register file of " << model.product << " does not read back" << std::endl;
+            ++failures;
+        }
+    }
+
+    const char* broken[] = {
+        "cpu 176 34 0x04 0x0c 55\n",                                              // no model
+        "manufacturer Acer\nproduct X\n",                                         // no channels
+        "manufacturer Acer\nproduct X\ncpu 176 34 0x04 0x0c\n",                    // a value short
+        "manufacturer Acer\nproduct X\ncpu 176 34 0x04 0x0c 55 7\n",               // a value over
+        "manufacturer Acer\nproduct X\ncpu 176 34 0x04 0x0c 256\n",                // not a byte
+        "manufacturer Acer\nproduct X\ncpu 176 34 0x04 0x0c -1\n",
+        "manufacturer Acer\nproduct X\ncpu 176 34 0x04 0x0g 55\n",
+        "manufacturer Acer\nproduct X\ngpu 180 33 0x10 0x30 58\n",                 // gpu without cpu
+        "manufacturer Acer\nproduct X\ncpu 176 34 4 12 55\ncpu 176 34 4 12 55\n", // twice
+        "manufacturer Acer\nproduct X\nfan5 1 2 3 4 5\n",
+    };
+    int rejected = 0;
+    for (const char* text : broken) {
+        try {
+            parseEcRegisterFile(text);
+            std::cout << "FAIL: accepted the register file \"" << text << "\"" << std::endl;
+            ++failures;
+        }
+        catch (const std::invalid_argument&) {
+            ++rejected;
+        }
+    }
+    std::cout << std::endl << ec_model_count << " built-in maps read back from register files, "
+              << rejected << " of " << sizeof(broken) / sizeof(broken[0]) << " broken files rejected" << std::endl;
+
+    if (failures) {
+        std::cerr << failures << " register map checks failed" << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+// Runs the control loop of a recorded trace again through a simulated EC
+// and compares its decisions with the recorded ones. Returns 2 when a
+// trace from the start of its run does not replay the same.
+static int runReplay(const std::vector<std::string>& args)
+{
+    if (args.empty()) throw std::invalid_argument("replay needs the trace files of a run");
+    std::vector<TraceFile> files;
+    for (const std::string& path : args) files.push_back(readTraceFile(path));
+    orderTraceFiles(files);
+
+    TraceReplayResult result = replayTrace(files);
+    std::cout << std::fixed << std::setprecision(1) << files.size() << " files, " << result.ticks << " ticks ("
+              << result.traceSeconds << " s recorded) replayed in " << std::setprecision(3) << result.wallSeconds << " s, "
+              << std::setprecision(0) << result.traceSeconds / std::max(result.wallSeconds, 1e-9) << "x real time; "
+              << result.busTransactions << " EC transactions recorded (" << result.busFailures << " failed), "
+              << result.dropped << " records dropped" << std::endl;
+    if (!result.fromStart) {
+        std::cout << "the trace starts after its run did; the loop starts from the settings of its first file" << std::endl;
+    }
+    if (result.mismatches == 0) {
+        std::cout << "every decision replayed the same" << std::endl;
+        return 0;
+    }
+    std::cout << result.mismatches << " ticks decided differently; first " << result.firstMismatch << std::endl;
+    return result.fromStart ? 2 : 0;
+}
+
+// A step-load run on the simulated laptop for fitting its zone models: the
+// load steps through light, medium and heavy, and at each the fans are
+// held at a sequence of speeds long enough for the temperatures to move.
+// Records what the EC reported, as a recording of the real machine would.
+static std::vector<ThermalSeries> identificationRun(const SimOptions& options)
+{
+    SimulatedEc::Timing timing;
+    timing.inputLatency = std::chrono::microseconds(0);
+    timing.outputLatency = std::chrono::microseconds(0);
+    SimulatedEc ec(timing);
+    ThermalPlant plant(ec, options.plant);
+    ControlLoop loop(ec, options.config, options.sensor);
+
+    const double loads[][2] = { { 10, 8 }, { 50, 70 }, { 90, 140 } };
+    const int fans[] = { 20, 60, 100, 40 };
+    const double hold = 600, tick = 1.0;
+    std::vector<ThermalSeries> zones(2);
+    double now = 0;
+    double heat[2] = { loads[0][0], loads[0][1] };
+    plant.setLoad(heat[0], heat[1]);
+    plant.settle();
+    for (const auto& load : loads) {
+        for (int i = 0; i < 4; ++i) {
+            loop.forceFan(CHANNEL_CPU, fans[i]);
+            loop.forceFan(CHANNEL_GPU, fans[i]);
+            for (double t = 0; t < hold; t += tick) {
+                ControlTickResult result = loop.tick(now, 100.0 * heat[0] / options.cpuFullLoadWatts);
+                for (int c = 0; c < 2; ++c) {
+                    zones[c].time.push_back(now);
+                    zones[c].temp.push_back(result.raw[c]);
+                    zones[c].heat.push_back(heat[c]);
+                    zones[c].fan.push_back(result.fan[c]);
+                }
+                heat[0] = load[0];
+                heat[1] = load[1];
+                plant.setLoad(heat[0], heat[1]);
+                for (double s = 0; s < tick - 1e-9; s += options.physicsStep) plant.step(options.physicsStep);
+                now += tick;
+            }
+        }
+    }
+    return zones;
+}
+
+// The load of a scenario as the models take it: CPU and GPU watts
+static TuneWorkload workloadFromTrace(const LoadTrace& trace, const SimOptions& options)
+{
+    TuneWorkload workload;
+    double now = 0;
+    for (const LoadSegment& segment : trace.segments()) {
+        workload.time.push_back(now);
+        workload.heat[CHANNEL_CPU].push_back(segment.cpuWatts);
+        workload.heat[CHANNEL_GPU].push_back(segment.gpuWatts);
+        now += segment.duration;
+    }
+    workload.duration = now;
+
+    // Where simulate() starts the scenario
+    SimulatedEc::Timing timing;
+    timing.inputLatency = std::chrono::microseconds(0);
+    timing.outputLatency = std::chrono::microseconds(0);
+    SimulatedEc ec(timing);
+    ThermalPlant plant(ec, options.plant);
+    plant.setLoad(trace.segments().front().cpuWatts, trace.segments().front().gpuWatts);
+    plant.settle();
+    workload.startTemp[CHANNEL_CPU] = plant.cpu().dieTemp;
+    workload.startTemp[CHANNEL_GPU] = plant.gpu().dieTemp;
+    return workload;
+}
+
+static std::string curveOption(const FanConfig& config, int channel)
+{
+    std::ostringstream text;
+    for (int i = 0; i < config.point_count[channel]; ++i) text << (i ? "," : "") << config.curve_temp[channel][i];
+    text << '/';
+    for (int i = 0; i < config.point_count[channel]; ++i) text << (i ? "," : "") << config.curve_fan[channel][i];
+    return text.str();
+}
+
+// Stores config as a profile named name in the backend's settings file,
+// over a profile of that name or in the first free slot, and makes it
+// the active settings
+static int saveTunedProfile(const std::string& path, const std::string& name, const FanConfig& config)
+{
+    SettingsStore store(path);
+    if (store.load() == SettingsLoad::Corrupt) throw std::runtime_error(path + " is damaged; it was kept as " + path + ".corrupt");
+    ProfileDirectory directory = store.directory();
+    int slot = 0;
+    for (int p = 1; p <= PROFILE_SLOTS && !slot; ++p) {
+        if ((directory.used & (1u << p)) && name == directory.names[p]) slot = p;
+    }
+    for (int p = 1; p <= PROFILE_SLOTS && !slot; ++p) {
+        if (!(directory.used & (1u << p))) slot = p;
+    }
+    if (!slot) throw std::runtime_error(path + " has no free profile slot");
+
+    FanConfig saved = config;
+    FanCommand save = { 1, COMMAND_SAVE_PROFILE, 0, { slot, 0, 0, 0, 0 } };
+    packProfileName(name, save.args + 1);
+    FanCommand use = { 2, COMMAND_SWITCH_PROFILE, 0, { slot, 0, 0, 0, 0 } };
+    Clock::time_point now = Clock::now();
+    if (store.applyProfileCommand(saved, save, now) != COMMAND_ACCEPTED ||
+        store.applyProfileCommand(saved, use, now) != COMMAND_ACCEPTED || !store.flush()) {
+        throw std::runtime_error("Could not save the profile to " + path);
+    }
+    return slot;
+}
+
+// Fits a model of each zone, from trace files or a step-load run on the
+// simulated laptop, and searches curves for the lowest fan effort that
+// keeps the zones under --max-temp with the fans reversing at most
+// --max-reversals times an hour. Returns 2 when no curve does.
+static int runTune(const std::vector<std::string>& args)
+{
+    TuneLimits limits;
+    int threads = 0, rounds = 2;
+    std::string profilePath, profileName = "Tuned";
+    std::vector<std::string> rest;
+    for (size_t i = 0; i < args.size(); ++i) {
+        bool hasValue = i + 1 < args.size();
+        if (args[i] == "--max-temp" && hasValue) limits.maxTemp = std::atof(args[++i].c_str());
+        else if (args[i] == "--max-reversals" && hasValue) limits.maxReversals = std::atof(args[++i].c_str());
+        else if (args[i] == "--threads" && hasValue) threads = std::atoi(args[++i].c_str());
+        else if (args[i] == "--rounds" && hasValue) rounds = std::max(1, std::atoi(args[++i].c_str()));
+        else if (args[i] == "--profile-out" && hasValue) profilePath = args[++i];
+        else if (args[i] == "--name" && hasValue) profileName = args[++i];
+        else rest.push_back(args[i]);
+    }
+    if (profileName.empty() || profileName.size() >= PROFILE_NAME_LENGTH) {
+        throw std::invalid_argument("--name takes 1 to " + std::to_string(PROFILE_NAME_LENGTH - 1) + " characters");
+    }
+
+    std::vector<std::string> traceFiles, scenarios;
+    for (const std::string& arg : rest) {
+        bool bin = arg.size() > 4 && arg.compare(arg.size() - 4, 4, ".bin") == 0;
+        (bin ? traceFiles : scenarios).push_back(arg);
+    }
+    SimOptions options;
+    std::string csvPath;
+    double maxPeak = 0;
+    scenarios = parseRunOptions(scenarios, options, csvPath, maxPeak);
+    if (!csvPath.empty() || !options.tracePrefix.empty() || options.ecFaults()) {
+        throw std::invalid_argument("tune takes curve, sensor and load options of run, not --csv, --trace or EC faults");
+    }
+
+    // Without one, parseRunOptions gives every built-in scenario
+    bool scenarioGiven = scenarios != LoadTrace::builtinNames();
+    std::vector<ThermalSeries> series;
+    TuneWorkload workload;
+    LoadTrace scenario;
+    if (!traceFiles.empty()) {
+        // The recording is both what the models are fitted to and the workload they are tuned for
+        if (scenarioGiven) throw std::invalid_argument("tune takes trace files or a scenario, not both");
+        std::vector<TraceFile> files;
+        for (const std::string& path : traceFiles) files.push_back(readTraceFile(path));
+        orderTraceFiles(files);
+        options.config = files.front().header.config;
+        series = thermalSeriesFromTrace(files);
+        if (series.empty()) throw std::invalid_argument("the trace has no channels");
+        workload = workloadFromSeries(series);
+    }
+    else {
+        if (!scenarioGiven) scenarios = { "gaming" };
+        if (scenarios.size() != 1) throw std::invalid_argument("tune takes one scenario");
+        scenario = loadTrace(scenarios.front());
+        series = identificationRun(options);
+        workload = workloadFromTrace(scenario, options);
+    }
+
+    std::vector<ZoneModel> models;
+    std::cout << std::left << std::setw(8) << "zone" << std::right << std::setw(10) << "tau s" << std::setw(10) << "gain"
+              << std::setw(12) << "fan effect" << std::setw(11) << "ambient C" << std::setw(10) << "rise" << std::setw(10) << "rms C"
+              << std::setw(10) << "samples" << std::endl;
+    std::string unmodelled;
+    for (size_t c = 0; c < series.size(); ++c) {
+        try {
+            models.push_back(fitZoneModel(series[c]));
+        }
+        catch (const std::invalid_argument& e) {
+            // The CPU load a trace records is no measure of a later zone's heat
+            if (c == 0) throw;
+            unmodelled = std::string(ec_channel_names[c]) + ": " + e.what() + "; it and the channels after it keep their curves";
+            break;
+        }
+        const ZoneModel& m = models.back();
+        std::cout << std::left << std::setw(8) << ec_channel_names[c] << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << m.tau << std::setprecision(3) << std::setw(10) << m.gain << std::setprecision(2)
+                  << std::setw(12) << m.fanEffect << std::setprecision(1) << std::setw(11) << m.ambient << std::setprecision(3)
+                  << std::setw(10) << m.rise << std::setprecision(2)
+                  << std::setw(10) << m.rms << std::setw(10) << m.samples << std::endl;
+    }
+    if (!unmodelled.empty()) std::cout << unmodelled << std::endl;
+
+    Clock::time_point start = Clock::now();
+    TuneResult result = tuneCurves(options.config, models, workload, limits, threads, rounds);
+    double wall = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::cout << std::endl << std::left << std::setw(8) << "zone" << std::right << std::setw(10) << "peak C" << std::setw(10) << "tuned"
+              << std::setw(12) << "mean fan %" << std::setw(10) << "tuned" << std::setw(12) << "reversals/h" << std::setw(10) << "tuned"
+              << std::endl;
+    for (size_t c = 0; c < models.size(); ++c) {
+        std::cout << std::left << std::setw(8) << ec_channel_names[c] << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << result.base.peak[c] << std::setw(10) << result.tuned.peak[c]
+                  << std::setw(12) << result.base.meanFan[c] << std::setw(10) << result.tuned.meanFan[c]
+                  << std::setw(12) << result.base.reversals[c] << std::setw(10) << result.tuned.reversals[c] << std::endl;
+    }
+    std::cout << std::endl << result.evaluations << " curves evaluated on " << result.threads << " threads in "
+              << std::setprecision(2) << wall << " s" << std::endl;
+
+    // As run options; the simulated laptop has a CPU and a GPU zone
+    std::cout << "tuned:";
+    const char* prefixes[] = { " --cpu-", " --gpu-" };
+    for (int c = 0; c < std::min(2, result.config.channel_count); ++c) {
+        std::cout << prefixes[c] << "curve " << curveOption(result.config, c) << prefixes[c] << "hyst " << result.config.hysteresis[c];
+    }
+    std::cout << std::endl;
+
+    if (traceFiles.empty()) {
+        // The models only approximate the plant; check the tuned curves on it
+        SimOptions tuned = options;
+        tuned.config = result.config;
+        SimResult before = simulate(scenario, options);
+        SimResult after = simulate(scenario, tuned);
+        std::cout << scenario.name() << " on the simulated laptop: peak " << std::setprecision(1)
+                  << std::max(before.cpu.peak, before.gpu.peak) << " C -> " << std::max(after.cpu.peak, after.gpu.peak)
+                  << " C, mean fan " << (before.cpu.fanEffort + before.gpu.fanEffort) / (2 * before.simSeconds) << "% -> "
+                  << (after.cpu.fanEffort + after.gpu.fanEffort) / (2 * after.simSeconds) << "%" << std::endl;
+    }
+
+    if (!result.tuned.feasible) {
+        std::cerr << "no curve keeps every zone under " << limits.maxTemp << " C within " << limits.maxReversals
+                  << " fan reversals/h; profile not written" << std::endl;
+        return 2;
+    }
+    if (!profilePath.empty()) {
+        validateFanConfig(result.config);
+        int slot = saveTunedProfile(profilePath, profileName, result.config);
+        std::cout << "saved as profile " << slot << " \"" << profileName << "\" in " << profilePath << std::endl;
+    }
+    return 0;
+}
+
+static void usage()
+{
+    std::cerr << "usage: FanSim run [idle|step|gaming|bursty|trace.csv]... [--cpu-curve [t1,]t2,...[,tn]/f1,...,fn]\n"
+              << "                  [--gpu-curve ...] [--cpu-interp linear|step|cubic] [--gpu-interp ...]\n"
+              << "                  [--cpu-hyst C] [--gpu-hyst C] [--period ms|min,max]\n"
+              << "                  [--cpu-mode curve|pid] [--gpu-mode curve|pid] [--cpu-target C] [--gpu-target C]\n"
+              << "                  [--cpu-pid kp,ki,kd[,ff]] [--gpu-pid kp,ki,kd[,ff]]\n"
+              << "                  [--coupling w|cpu_from_gpu,gpu_from_cpu] [--coupling-mode max|sum]\n"
+              << "                  [--cpu-slew up,down] [--gpu-slew up,down] [--cpu-min-step %] [--gpu-min-step %] [--no-arbitration]\n"
+              << "                  [--idle off|always|battery] [--battery]\n"
+              << "                  [--ambient C] [--csv out.csv] [--max-peak C] [sensor options]\n"
+              << "                  [--ec-outage start_s,duration_s]... [--ec-stalls p] [--trace prefix [--trace-size MB]]\n"
+              << "       FanSim arbitration [scenarios and run options]\n"
+              << "       FanSim filter [idle|ramp|step|sine|trace.csv]... [sensor options]\n"
+              << "       FanSim models [idle|step|gaming|bursty|trace.csv] [--registers fanctrl_registers.txt]\n"
+              << "       FanSim replay trace_file...\n"
+              << "       FanSim tune [scenario|trace.csv|trace_file...] [run options] [--max-temp C] [--max-reversals N]\n"
+              << "                  [--threads N] [--rounds N] [--profile-out fanctrl_settings.dat [--name name]]\n"
+              << "sensor options: [--alpha a] [--median N] [--kalman q,r] [--noise C] [--glitches p] [--spikes p]\n"
+              << "Load traces are CSV rows of time_s,cpu_w,gpu_w; sensor traces are rows of time_s,raw[,truth]." << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    std::string command = argv[1];
+    std::vector<std::string> args(argv + 2, argv + argc);
+
+    try {
+        if (command == "run") return runSimulation(args);
+        if (command == "filter") return runFilter(args);
+        if (command == "arbitration") return runArbitration(args);
+        if (command == "models") return runModels(args);
+        if (command == "replay") return runReplay(args);
+        if (command == "tune") return runTune(args);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    usage();
+    return 1;
+}
@@ -1,59 +1,494 @@
 import ctypes
 import mmap
+import os
+import struct
 import time
 import tkinter as tk
-from tkinter import ttk
+from tkinter import ttk, simpledialog
 import matplotlib.pyplot as plt
 from matplotlib.backends.backend_tkagg import FigureCanvasTkAgg
 import matplotlib.animation as animation
 
+SHARED_MAGIC = 0x4C435446  # "FTCL"
+SHARED_LAYOUT_VERSION = 17
+TELEMETRY_HISTORY_CAPACITY = 4096
+COMMAND_LANES = 8
+COMMAND_CAPACITY = 64
+LATENCY_BUCKETS = 128
+PHASE_COUNT = 8
+PROFILE_SLOTS = 8
+PROFILE_COUNT = PROFILE_SLOTS + 4  # the saved slots, the balanced defaults and three more built-in profiles
+PROFILE_NAME_LENGTH = 16
+INFINITE = 0xFFFFFFFF
+EVENT_MODIFY_STATE = 0x0002
+PROCESS_QUERY_LIMITED_INFORMATION = 0x1000
+STILL_ACTIVE = 259
+FAN_MODE_CURVE = 0
+FAN_MODE_PID = 1
+CURVE_LINEAR = 0
+CURVE_STEP = 1
+CURVE_CUBIC = 2
+INTERPOLATION_NAMES = {CURVE_LINEAR: "Linear", CURVE_STEP: "Step", CURVE_CUBIC: "Cubic"}
+IDLE_OFF = 0
+IDLE_ALWAYS = 1
+IDLE_ON_BATTERY = 2
+IDLE_NAMES = {IDLE_OFF: "Off", IDLE_ALWAYS: "Always", IDLE_ON_BATTERY: "On battery"}
+COUPLING_MAX = 0
+COUPLING_SUM = 1
+COMMAND_SET_CURVE_POINT = 1
+COMMAND_SET_POINT_COUNT = 2
+COMMAND_SET_HYSTERESIS = 3
+COMMAND_SET_MODE = 4
+COMMAND_SET_INTERPOLATION = 5
+COMMAND_SET_IDLE_MODE = 6
+COMMAND_SWITCH_PROFILE = 7
+COMMAND_FORCE_SPEED = 8
+COMMAND_RESET_STATS = 9
+COMMAND_SAVE_PROFILE = 10
+COMMAND_DELETE_PROFILE = 11
+COMMAND_SET_COUPLING = 12
+COMMAND_SET_SLEW = 13
+COMMAND_SET_COUPLING_MODE = 14
+COMMAND_STATUS_NAMES = {0: "accepted", 1: "unknown command", 2: "bad channel", 3: "bad value", 4: "unknown profile"}
+MAX_CHANNELS = 4
+MAX_CURVE_POINTS = 8
+CHANNEL_NAMES = ["CPU", "GPU", "Fan 3", "Fan 4"]
+
+# Mirrors CPP/FanControl/FanControl/SharedData.h
+class SharedHeader(ctypes.Structure):
+    _fields_ = [
+        ("magic", ctypes.c_uint32),
+        ("layoutVersion", ctypes.c_uint32),
+        ("size", ctypes.c_uint32),
+        ("reserved", ctypes.c_uint32),
+    ]
+
+class FanConfig(ctypes.Structure):
+    _fields_ = [
+        ("channel_count", ctypes.c_int32),
+        ("reserved", ctypes.c_int32),
+
+        ("point_count", ctypes.c_int32 * MAX_CHANNELS),
+        ("hysteresis", ctypes.c_int32 * MAX_CHANNELS),
+
+        ("mode", ctypes.c_int32 * MAX_CHANNELS),
+        ("target_temp", ctypes.c_int32 * MAX_CHANNELS),
+
+        ("kp", ctypes.c_float * MAX_CHANNELS),
+        ("ki", ctypes.c_float * MAX_CHANNELS),
+        ("kd", ctypes.c_float * MAX_CHANNELS),
+        ("feedforward", ctypes.c_float * MAX_CHANNELS),
+
+        ("curve_temp", (ctypes.c_int32 * MAX_CURVE_POINTS) * MAX_CHANNELS),
+        ("curve_fan", (ctypes.c_int32 * MAX_CURVE_POINTS) * MAX_CHANNELS),
+
+        ("min_period_ms", ctypes.c_int32),
+        ("max_period_ms", ctypes.c_int32),
+
+        ("interpolation", ctypes.c_int32 * MAX_CHANNELS),
+
+        ("idle_mode", ctypes.c_int32),
+        ("idle_margin", ctypes.c_int32),
+        ("idle_max_fan", ctypes.c_int32),
+        ("idle_dwell_s", ctypes.c_int32),
+        ("idle_period_ms", ctypes.c_int32),
+        ("reserved2", ctypes.c_int32),
+
+        ("coupling", (ctypes.c_float * MAX_CHANNELS) * MAX_CHANNELS),
+        ("slew_up", ctypes.c_float * MAX_CHANNELS),
+        ("slew_down", ctypes.c_float * MAX_CHANNELS),
+        ("min_step", ctypes.c_int32 * MAX_CHANNELS),
+        ("coupling_mode", ctypes.c_int32),
+        ("reserved3", ctypes.c_int32),
+    ]
+
+class Telemetry(ctypes.Structure):
+    _fields_ = [
+        ("channelCount", ctypes.c_int32),
+        ("reserved", ctypes.c_uint32),
+        ("temp", ctypes.c_double * MAX_CHANNELS),
+        ("fanSpeed", ctypes.c_int32 * MAX_CHANNELS),
+
+        ("ecWritesIssued", ctypes.c_uint64),
+        ("ecWritesElided", ctypes.c_uint64),
+        ("ecShadowMismatches", ctypes.c_uint64),
+
+        ("loopWakeups", ctypes.c_uint64),
+
+        ("cpuLoad", ctypes.c_double),
+
+        ("controlPeriodMs", ctypes.c_int32),
+        ("scheduleReasons", ctypes.c_uint32),
+
+        ("rawTemp", ctypes.c_float * MAX_CHANNELS),
+        ("medianTemp", ctypes.c_float * MAX_CHANNELS),
+        ("emaTemp", ctypes.c_float * MAX_CHANNELS),
+        ("kalmanTemp", ctypes.c_float * MAX_CHANNELS),
+        ("sensorRejects", ctypes.c_uint32 * MAX_CHANNELS),
+        ("sensorFaulted", ctypes.c_uint32),
+        ("fanForced", ctypes.c_uint32),
+
+        ("sampleAgeUs", ctypes.c_float),
+        ("actuationLatencyUs", ctypes.c_float),
+
+        ("idleActive", ctypes.c_uint32),
+        ("idleEntries", ctypes.c_uint32),
+        ("idleSeconds", ctypes.c_double),
+
+        ("loopJitterUs", ctypes.c_float),
+        ("maxLoopJitterUs", ctypes.c_float),
+        ("deadlineMisses", ctypes.c_uint32),
+
+        ("ecFailures", ctypes.c_uint32),
+        ("ecFallback", ctypes.c_uint32),
+        ("ecFallbacks", ctypes.c_uint32),
+    ]
+
+class ConfigBlock(ctypes.Structure):
+    _fields_ = [("seq", ctypes.c_uint32), ("reserved", ctypes.c_uint32), ("data", FanConfig)]
+
+class TelemetryBlock(ctypes.Structure):
+    _fields_ = [("seq", ctypes.c_uint32), ("reserved", ctypes.c_uint32), ("data", Telemetry)]
+
+class TelemetryRecord(ctypes.Structure):
+    _fields_ = [
+        ("timestampUs", ctypes.c_uint64),
+        ("rawTemp", ctypes.c_float * MAX_CHANNELS),
+        ("filteredTemp", ctypes.c_float * MAX_CHANNELS),
+        ("fanCommand", ctypes.c_int32 * MAX_CHANNELS),
+        ("ecReadUs", ctypes.c_float),
+        ("ecWriteUs", ctypes.c_float),
+        ("periodMs", ctypes.c_int32),
+        ("scheduleReasons", ctypes.c_uint32),
+        ("sensorRejected", ctypes.c_uint32),
+        ("sensorFaulted", ctypes.c_uint32),
+        ("sampleAgeUs", ctypes.c_float),
+        ("actuationUs", ctypes.c_float),
+    ]
+
+class TelemetrySlot(ctypes.Structure):
+    _fields_ = [("seq", ctypes.c_uint64), ("data", TelemetryRecord)]
+
+class TelemetryRing(ctypes.Structure):
+    _fields_ = [
+        ("head", ctypes.c_uint64),
+        ("capacity", ctypes.c_uint32),
+        ("recordSize", ctypes.c_uint32),
+        ("slots", TelemetrySlot * TELEMETRY_HISTORY_CAPACITY),
+    ]
+
+class FanCommand(ctypes.Structure):
+    _fields_ = [
+        ("seq", ctypes.c_uint32),
+        ("type", ctypes.c_uint32),
+        ("channel", ctypes.c_int32),
+        ("args", ctypes.c_int32 * 5),
+    ]
+
+class CommandCompletion(ctypes.Structure):
+    _fields_ = [
+        ("seq", ctypes.c_uint32),
+        ("status", ctypes.c_int32),
+        ("configVersion", ctypes.c_uint32),
+        ("reserved", ctypes.c_uint32),
+    ]
+
+class CommandLane(ctypes.Structure):
+    _fields_ = [
+        ("ownerPid", ctypes.c_uint32),
+        ("head", ctypes.c_uint32),
+        ("tail", ctypes.c_uint32),
+        ("reserved", ctypes.c_uint32),
+        ("commands", FanCommand * COMMAND_CAPACITY),
+        ("completions", CommandCompletion * COMMAND_CAPACITY),
+    ]
+
+class CommandQueue(ctypes.Structure):
+    _fields_ = [
+        ("laneCount", ctypes.c_uint32),
+        ("capacity", ctypes.c_uint32),
+        ("reserved", ctypes.c_uint32 * 2),
+        ("lanes", CommandLane * COMMAND_LANES),
+    ]
+
+class LatencyHistogram(ctypes.Structure):
+    _fields_ = [
+        ("buckets", ctypes.c_uint64 * LATENCY_BUCKETS),
+        ("sumNs", ctypes.c_uint64),
+        ("maxNs", ctypes.c_uint64),
+    ]
+
+class HotPathStats(ctypes.Structure):
+    _fields_ = [
+        ("ecRetries", ctypes.c_uint64),
+        ("ecTimeouts", ctypes.c_uint64),
+        ("ecWritesElided", ctypes.c_uint64),
+        ("resets", ctypes.c_uint32),
+        ("reserved", ctypes.c_uint32),
+        ("phases", LatencyHistogram * PHASE_COUNT),
+    ]
+
+class ProfileDirectory(ctypes.Structure):
+    _fields_ = [
+        ("active", ctypes.c_int32),
+        ("used", ctypes.c_uint32),
+        ("names", (ctypes.c_char * PROFILE_NAME_LENGTH) * PROFILE_COUNT),
+        ("settingsWrites", ctypes.c_uint32),
+        ("settingsWriteFailures", ctypes.c_uint32),
+        ("automatic", ctypes.c_int32),
+        ("rejectedConfigs", ctypes.c_uint32),
+    ]
+
+class ProfileBlock(ctypes.Structure):
+    _fields_ = [("seq", ctypes.c_uint32), ("reserved", ctypes.c_uint32), ("data", ProfileDirectory)]
+
 class SharedData(ctypes.Structure):
     _fields_ = [
-        ("cpuTemp", ctypes.c_double),
-        ("gpuTemp", ctypes.c_double),
-        ("cpuFanSpeed", ctypes.c_int),
-        ("gpuFanSpeed", ctypes.c_int),
-
-        ("cpu_hysteresis", ctypes.c_int),
-        ("gpu_hysteresis", ctypes.c_int),
-
-        ("cpu_temp_point_2", ctypes.c_int),
-        ("cpu_temp_point_3", ctypes.c_int),
-        ("cpu_temp_point_4", ctypes.c_int),
-
-        ("gpu_temp_point_2", ctypes.c_int),
-        ("gpu_temp_point_3", ctypes.c_int),
-        ("gpu_temp_point_4", ctypes.c_int),
-
-        ("cpu_fan_point_1", ctypes.c_int),
-        ("cpu_fan_point_2", ctypes.c_int),
-        ("cpu_fan_point_3", ctypes.c_int),
-        ("cpu_fan_point_4", ctypes.c_int),
-        ("cpu_fan_point_5", ctypes.c_int),
-
-        ("gpu_fan_point_1", ctypes.c_int),
-        ("gpu_fan_point_2", ctypes.c_int),
-        ("gpu_fan_point_3", ctypes.c_int),
-        ("gpu_fan_point_4", ctypes.c_int),
-        ("gpu_fan_point_5", ctypes.c_int),
-
-        ("write_sync", ctypes.c_bool),
+        ("header", SharedHeader),
+        ("config", ConfigBlock),
+        ("telemetry", TelemetryBlock),
+        ("history", TelemetryRing),
+        ("commands", CommandQueue),
+        ("stats", HotPathStats),
+        ("profiles", ProfileBlock),
     ]
 
+CONFIG_OFFSET = SharedData.config.offset
+TELEMETRY_OFFSET = SharedData.telemetry.offset
+PROFILES_OFFSET = SharedData.profiles.offset
+BLOCK_DATA_OFFSET = ConfigBlock.data.offset
+LANES_OFFSET = SharedData.commands.offset + CommandQueue.lanes.offset
+
 try:
     shm = mmap.mmap(-1, ctypes.sizeof(SharedData), tagname="MySharedMemory", access=mmap.ACCESS_WRITE)
 except Exception as e:
     print("Failed to open shared memory:", e)
     exit(1)
 
-def read_shared_data():
-    shm.seek(0)
-    buf = shm.read(ctypes.sizeof(SharedData))
-    return SharedData.from_buffer_copy(buf)
+header = SharedHeader.from_buffer_copy(shm, 0)
+if header.magic != SHARED_MAGIC or header.layoutVersion != SHARED_LAYOUT_VERSION:
+    print("FanControl backend is not running or uses an incompatible shared memory layout")
+    exit(1)
+
+# Config writers are serialized with the backend through a named mutex
+kernel32 = ctypes.WinDLL("kernel32", use_last_error=True)
+kernel32.CreateMutexW.restype = ctypes.c_void_p
+kernel32.CreateMutexW.argtypes = [ctypes.c_void_p, ctypes.c_bool, ctypes.c_wchar_p]
+kernel32.WaitForSingleObject.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+kernel32.ReleaseMutex.argtypes = [ctypes.c_void_p]
+kernel32.OpenEventW.restype = ctypes.c_void_p
+kernel32.OpenEventW.argtypes = [ctypes.c_uint32, ctypes.c_bool, ctypes.c_wchar_p]
+kernel32.SetEvent.argtypes = [ctypes.c_void_p]
+kernel32.OpenProcess.restype = ctypes.c_void_p
+kernel32.OpenProcess.argtypes = [ctypes.c_uint32, ctypes.c_bool, ctypes.c_uint32]
+kernel32.GetExitCodeProcess.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32)]
+kernel32.CloseHandle.argtypes = [ctypes.c_void_p]
+config_lock = kernel32.CreateMutexW(None, False, "FanControlConfigLock")
+
+# Wakes the backend so new settings apply immediately instead of next tick
+config_changed = kernel32.OpenEventW(EVENT_MODIFY_STATE, False, "FanControlConfigChanged")
+
+def read_block(offset, cls):
+    # Seqlock read: retry while the sequence is odd or changed during the copy
+    while True:
+        before = struct.unpack_from("<I", shm, offset)[0]
+        if before & 1:
+            time.sleep(0)
+            continue
+        data = cls.from_buffer_copy(shm, offset + BLOCK_DATA_OFFSET)
+        if struct.unpack_from("<I", shm, offset)[0] == before:
+            return data
+
+def read_config():
+    return read_block(CONFIG_OFFSET, FanConfig)
+
+def read_telemetry():
+    return read_block(TELEMETRY_OFFSET, Telemetry)
+
+def read_profiles():
+    """(number, name) of every built-in and saved profile, and the active one."""
+    directory = read_block(PROFILES_OFFSET, ProfileDirectory)
+    profiles = [(n, directory.names[n].value.decode(errors="replace"))
+                for n in range(PROFILE_COUNT) if directory.used & (1 << n)]
+    return profiles, directory.active
+
+def write_config(config):
+    start = CONFIG_OFFSET + BLOCK_DATA_OFFSET
+    kernel32.WaitForSingleObject(config_lock, INFINITE)
+    try:
+        seq = struct.unpack_from("<I", shm, CONFIG_OFFSET)[0]
+        struct.pack_into("<I", shm, CONFIG_OFFSET, (seq + 1) & 0xFFFFFFFF)
+        shm[start:start + ctypes.sizeof(FanConfig)] = bytes(config)
+        struct.pack_into("<I", shm, CONFIG_OFFSET, (seq + 2) & 0xFFFFFFFF)
+    finally:
+        kernel32.ReleaseMutex(config_lock)
+    if config_changed:
+        kernel32.SetEvent(config_changed)
+
+def process_alive(pid):
+    handle = kernel32.OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, False, pid)
+    if not handle:
+        return False
+    code = ctypes.c_uint32()
+    alive = kernel32.GetExitCodeProcess(handle, ctypes.byref(code)) and code.value == STILL_ACTIVE
+    kernel32.CloseHandle(handle)
+    return bool(alive)
+
+class CommandClient:
+    """One lane of the backend's command queue (CommandQueue.h)."""
+
+    def __init__(self):
+        # Lanes are claimed under the config lock: a free lane first, then
+        # one left behind by a client that exited without releasing it
+        self.lane = None
+        pid = os.getpid()
+        kernel32.WaitForSingleObject(config_lock, INFINITE)
+        try:
+            for stale in (False, True):
+                for lane in range(COMMAND_LANES):
+                    owner = struct.unpack_from("<I", shm, self.lane_offset(lane))[0]
+                    if owner == 0 or (stale and not process_alive(owner)):
+                        struct.pack_into("<I", shm, self.lane_offset(lane), pid)
+                        self.lane = lane
+                        return
+        finally:
+            kernel32.ReleaseMutex(config_lock)
+
+    @staticmethod
+    def lane_offset(lane):
+        return LANES_OFFSET + lane * ctypes.sizeof(CommandLane)
 
-def write_shared_data(data):
-    shm.seek(0)
-    shm.write(bytes(data))
+    def send(self, commands, timeout=2.0):
+        """Runs (type, channel, args) commands in order; returns each one's
+        status, or None for those that did not complete within timeout."""
+        base = self.lane_offset(self.lane)
+        statuses = []
+        for start in range(0, len(commands), COMMAND_CAPACITY):
+            batch = commands[start:start + COMMAND_CAPACITY]
+            head, tail = struct.unpack_from("<II", shm, base + CommandLane.head.offset)
+            while head - tail > COMMAND_CAPACITY - len(batch):
+                time.sleep(0.001)
+                tail = struct.unpack_from("<I", shm, base + CommandLane.tail.offset)[0]
+
+            # The command bytes are in place before head moves past them
+            first = head
+            for kind, channel, args in batch:
+                slot = base + CommandLane.commands.offset + (head % COMMAND_CAPACITY) * ctypes.sizeof(FanCommand)
+                command = FanCommand(head + 1, kind, channel, (ctypes.c_int32 * 5)(*args))
+                shm[slot:slot + ctypes.sizeof(FanCommand)] = bytes(command)
+                head = (head + 1) & 0xFFFFFFFF
+                struct.pack_into("<I", shm, base + CommandLane.head.offset, head)
+            if config_changed:
+                kernel32.SetEvent(config_changed)
+
+            deadline = time.time() + timeout
+            done = 0
+            while done < len(batch) and time.time() < deadline:
+                tail = struct.unpack_from("<I", shm, base + CommandLane.tail.offset)[0]
+                done = min(len(batch), (tail - first) & 0xFFFFFFFF)
+                if done < len(batch):
+                    time.sleep(0.005)
+            for i in range(len(batch)):
+                slot = base + CommandLane.completions.offset + ((first + i) % COMMAND_CAPACITY) * ctypes.sizeof(CommandCompletion)
+                completion = CommandCompletion.from_buffer_copy(shm, slot)
+                statuses.append(completion.status if i < done and completion.seq == first + i + 1 else None)
+        return statuses
+
+    def close(self):
+        if self.lane is not None:
+            kernel32.WaitForSingleObject(config_lock, INFINITE)
+            struct.pack_into("<I", shm, self.lane_offset(self.lane), 0)
+            kernel32.ReleaseMutex(config_lock)
+            self.lane = None
+
+def point_commands(current, wanted, channel):
+    # Points moving up go from the top down and points moving down from the
+    # bottom up, so every command leaves the curve ascending
+    old_count = max(2, min(MAX_CURVE_POINTS, current.point_count[channel]))
+    new_count = max(2, min(MAX_CURVE_POINTS, wanted.point_count[channel]))
+    changed = [i for i in range(new_count)
+               if (current.curve_temp[channel][i], current.curve_fan[channel][i]) !=
+                  (wanted.curve_temp[channel][i], wanted.curve_fan[channel][i])]
+    up = [i for i in changed if wanted.curve_temp[channel][i] > current.curve_temp[channel][i]]
+    down = [i for i in changed if i not in up]
+    points = [(COMMAND_SET_CURVE_POINT, channel, (i, wanted.curve_temp[channel][i], wanted.curve_fan[channel][i]))
+              for i in sorted(up, reverse=True) + sorted(down)]
+    if new_count == old_count:
+        return points
+    count = [(COMMAND_SET_POINT_COUNT, channel, (new_count,))]
+    return count + points if new_count < old_count else points + count
+
+def apply_config(client, config):
+    """Sends the settings that differ from the backend's as commands, so
+    changes other clients made to the rest of the config are kept."""
+    if client is None or client.lane is None:
+        write_config(config)
+        return
+    current = read_config()
+    commands = []
+    for c in range(min(current.channel_count, MAX_CHANNELS)):
+        commands += point_commands(current, config, c)
+        if config.hysteresis[c] != current.hysteresis[c]:
+            commands.append((COMMAND_SET_HYSTERESIS, c, (config.hysteresis[c],)))
+        if (config.mode[c], config.target_temp[c]) != (current.mode[c], current.target_temp[c]):
+            commands.append((COMMAND_SET_MODE, c, (config.mode[c], config.target_temp[c])))
+        if config.interpolation[c] != current.interpolation[c]:
+            commands.append((COMMAND_SET_INTERPOLATION, c, (config.interpolation[c],)))
+    if config.idle_mode != current.idle_mode:
+        commands.append((COMMAND_SET_IDLE_MODE, 0, (config.idle_mode,)))
+
+    for command, status in zip(commands, client.send(commands)):
+        if status != 0:
+            reason = "no answer from the backend" if status is None else COMMAND_STATUS_NAMES.get(status, status)
+            print(f"Setting not applied ({reason}): {command}")
+
+def curve_points(config, channel):
+    count = max(2, min(MAX_CURVE_POINTS, config.point_count[channel]))
+    return list(config.curve_temp[channel][:count]), list(config.curve_fan[channel][:count])
+
+def monotone_tangents(temps, fans):
+    # Fritsch-Carlson, as in CurveTable.h
+    count = len(temps)
+    secant = [(fans[i + 1] - fans[i]) / (temps[i + 1] - temps[i]) if temps[i + 1] > temps[i] else 0.0
+              for i in range(count - 1)]
+    tangent = [secant[0]] + [0.0] * (count - 2) + [secant[-1]]
+    for i in range(1, count - 1):
+        tangent[i] = 0.0 if secant[i - 1] * secant[i] <= 0 else (secant[i - 1] + secant[i]) / 2
+    for i in range(count - 1):
+        if secant[i] == 0:
+            tangent[i] = tangent[i + 1] = 0.0
+            continue
+        a, b = tangent[i] / secant[i], tangent[i + 1] / secant[i]
+        if a * a + b * b > 9:
+            tau = 3 / (a * a + b * b) ** 0.5
+            tangent[i], tangent[i + 1] = tau * a * secant[i], tau * b * secant[i]
+    return tangent
+
+def curve_line(config, channel):
+    # The curve as the backend evaluates it, sampled for drawing
+    temps, fans = curve_points(config, channel)
+    mode = config.interpolation[channel]
+    if mode == CURVE_LINEAR:
+        return temps, fans
+    xs, ys = [], []
+    tangent = monotone_tangents(temps, fans) if mode == CURVE_CUBIC else None
+    for i in range(len(temps) - 1):
+        t0, t1 = temps[i], temps[i + 1]
+        if t1 <= t0:
+            continue
+        if mode == CURVE_STEP:
+            xs += [t0, t1]
+            ys += [fans[i], fans[i]]
+            continue
+        width = t1 - t0
+        for k in range(21):
+            s = k / 20
+            xs.append(t0 + s * width)
+            ys.append((2 * s**3 - 3 * s**2 + 1) * fans[i] + (s**3 - 2 * s**2 + s) * width * tangent[i]
+                      + (-2 * s**3 + 3 * s**2) * fans[i + 1] + (s**3 - s**2) * width * tangent[i + 1])
+    xs.append(temps[-1])
+    ys.append(fans[-1])
+    return xs, ys
 
 class FanControlGUI:
     def __init__(self, root):
@@ -68,6 +503,10 @@ class FanControlGUI:
         self.dragging = None
         self.last_data_update = 0
         self.running = True  # Add this flag
+
+        # Settings go to the backend as commands; without a free lane the
+        # whole config is written as before
+        self.commands = CommandClient()
         
         # Create the main frame
         main_frame = ttk.Frame(root)
@@ -84,60 +523,90 @@ class FanControlGUI:
         # Reset button
         self.reset_button = ttk.Button(control_frame, text="Reset", command=self.reset_curve)
         self.reset_button.pack(side=tk.LEFT, padx=(10, 0))
+
+        # Named profiles from the backend's settings file
+        ttk.Label(control_frame, text="Profile:").pack(side=tk.LEFT, padx=(20, 5))
+        self.profile_var = tk.StringVar()
+        self.profile_box = ttk.Combobox(control_frame, width=16, state="readonly", textvariable=self.profile_var)
+        self.profile_box.pack(side=tk.LEFT)
+        self.profile_box.bind("<<ComboboxSelected>>", lambda event: self.switch_profile())
+        ttk.Button(control_frame, text="Save As...", command=self.save_profile).pack(side=tk.LEFT, padx=(5, 0))
+        self.profiles = []
         
-        # CPU Hysteresis
-        ttk.Label(control_frame, text="CPU Hysteresis:").pack(side=tk.LEFT, padx=(20, 5))
-        self.cpu_hysteresis_var = tk.IntVar()
-        self.cpu_hysteresis_spinbox = ttk.Spinbox(control_frame, from_=0, to=10, width=5, 
-                                                  textvariable=self.cpu_hysteresis_var,
-                                                  command=self.on_hysteresis_change)
-        self.cpu_hysteresis_spinbox.pack(side=tk.LEFT, padx=(0, 5))
-        ttk.Label(control_frame, text="°C").pack(side=tk.LEFT, padx=(0, 15))
-        
-        # GPU Hysteresis
-        ttk.Label(control_frame, text="GPU Hysteresis:").pack(side=tk.LEFT, padx=(0, 5))
-        self.gpu_hysteresis_var = tk.IntVar()
-        self.gpu_hysteresis_spinbox = ttk.Spinbox(control_frame, from_=0, to=10, width=5,
-                                                  textvariable=self.gpu_hysteresis_var,
-                                                  command=self.on_hysteresis_change)
-        self.gpu_hysteresis_spinbox.pack(side=tk.LEFT, padx=(0, 5))
-        ttk.Label(control_frame, text="°C").pack(side=tk.LEFT)
-
-        # Create matplotlib figure with subplots
-        self.fig, (self.ax1, self.ax2) = plt.subplots(1, 2, figsize=(12, 5))
+        # One set of controls and one plot per channel the backend runs
+        self.channel_count = max(1, min(MAX_CHANNELS, read_config().channel_count))
+        self.names = CHANNEL_NAMES[:self.channel_count]
+
+        # Hysteresis per channel
+        self.hysteresis_vars = []
+        for name in self.names:
+            ttk.Label(control_frame, text=f"{name} Hysteresis:").pack(side=tk.LEFT, padx=(20, 5))
+            var = tk.IntVar()
+            ttk.Spinbox(control_frame, from_=0, to=10, width=5, textvariable=var,
+                        command=self.on_hysteresis_change).pack(side=tk.LEFT, padx=(0, 5))
+            ttk.Label(control_frame, text="°C").pack(side=tk.LEFT)
+            self.hysteresis_vars.append(var)
+
+        # Controller mode per channel: the curve, or PID tracking a target temperature
+        mode_frame = ttk.Frame(main_frame)
+        mode_frame.pack(fill=tk.X, pady=(0, 10))
+
+        self.mode_vars = []
+        self.target_vars = []
+        self.interpolation_vars = []
+        for name in self.names:
+            ttk.Label(mode_frame, text=f"{name} Mode:").pack(side=tk.LEFT, padx=(0, 5))
+            mode_var = tk.StringVar(value="Curve")
+            ttk.Combobox(mode_frame, values=["Curve", "PID"], width=6, state="readonly",
+                         textvariable=mode_var).pack(side=tk.LEFT, padx=(0, 5))
+            ttk.Label(mode_frame, text="Target:").pack(side=tk.LEFT, padx=(0, 5))
+            target_var = tk.IntVar()
+            ttk.Spinbox(mode_frame, from_=40, to=95, width=5,
+                        textvariable=target_var).pack(side=tk.LEFT, padx=(0, 5))
+            ttk.Label(mode_frame, text="°C").pack(side=tk.LEFT, padx=(0, 5))
+            interpolation_var = tk.StringVar(value="Linear")
+            ttk.Combobox(mode_frame, values=list(INTERPOLATION_NAMES.values()), width=7, state="readonly",
+                         textvariable=interpolation_var).pack(side=tk.LEFT, padx=(0, 15))
+            interpolation_var.trace_add("write", lambda *args: self.on_interpolation_change())
+            self.mode_vars.append(mode_var)
+            self.target_vars.append(target_var)
+            self.interpolation_vars.append(interpolation_var)
+
+        # Handing the fans back to the EC when everything is cool
+        ttk.Label(mode_frame, text="EC idle:").pack(side=tk.LEFT, padx=(0, 5))
+        self.idle_var = tk.StringVar(value=IDLE_NAMES[IDLE_ON_BATTERY])
+        ttk.Combobox(mode_frame, values=list(IDLE_NAMES.values()), width=10, state="readonly",
+                     textvariable=self.idle_var).pack(side=tk.LEFT)
+
+        # Create matplotlib figure with one subplot per channel
+        self.fig, axes = plt.subplots(1, self.channel_count, figsize=(6 * self.channel_count, 5), squeeze=False)
+        self.axes = list(axes[0])
         self.fig.suptitle("Fan Control Curves (Drag points to edit)")
         
-        # Setup CPU plot
-        self.ax1.set_title("CPU Fan Curve")
-        self.ax1.set_xlabel("Temperature (°C)")
-        self.ax1.set_ylabel("Fan Speed (%)")
-        self.ax1.grid(True)
-        self.ax1.set_xlim(0, 100)
-        self.ax1.set_ylim(0, 100)
-        
-        # Setup GPU plot
-        self.ax2.set_title("GPU Fan Curve")
-        self.ax2.set_xlabel("Temperature (°C)")
-        self.ax2.set_ylabel("Fan Speed (%)")
-        self.ax2.grid(True)
-        self.ax2.set_xlim(0, 100)
-        self.ax2.set_ylim(0, 100)
+        for name, ax in zip(self.names, self.axes):
+            ax.set_title(f"{name} Fan Curve")
+            ax.set_xlabel("Temperature (°C)")
+            ax.set_ylabel("Fan Speed (%)")
+            ax.grid(True)
+            ax.set_xlim(0, 100)
+            ax.set_ylim(0, 100)
         
         # Create canvas
         self.canvas = FigureCanvasTkAgg(self.fig, main_frame)
         self.canvas.get_tk_widget().pack(fill=tk.BOTH, expand=True)
         
         # Initialize lines
-        self.cpu_line, = self.ax1.plot([], [], 'b-', linewidth=2, label='Fan Curve')
-        self.cpu_point, = self.ax1.plot([], [], 'ro', markersize=8, label='Current Point')
-        self.cpu_edit_points, = self.ax1.plot([], [], 'go', markersize=10, picker=True, label='Edit Points')
-        
-        self.gpu_line, = self.ax2.plot([], [], 'g-', linewidth=2, label='Fan Curve')
-        self.gpu_point, = self.ax2.plot([], [], 'ro', markersize=8, label='Current Point')
-        self.gpu_edit_points, = self.ax2.plot([], [], 'go', markersize=10, picker=True, label='Edit Points')
-        
-        self.ax1.legend()
-        self.ax2.legend()
+        self.curve_lines = []
+        self.current_points = []
+        self.edit_points = []
+        for c, ax in enumerate(self.axes):
+            line, = ax.plot([], [], 'b-' if c == 0 else 'g-', linewidth=2, label='Fan Curve')
+            point, = ax.plot([], [], 'ro', markersize=8, label='Current Point')
+            edit, = ax.plot([], [], 'go', markersize=10, picker=True, label='Edit Points')
+            ax.legend()
+            self.curve_lines.append(line)
+            self.current_points.append(point)
+            self.edit_points.append(edit)
         
         # Connect mouse events
         self.canvas.mpl_connect('button_press_event', self.on_press)
@@ -157,39 +626,44 @@ class FanControlGUI:
         try:
             # Update data from shared memory every 500ms or when dragging
             if current_time - self.last_data_update > 0.5 or self.edit_data is None:
-                data = read_shared_data()
+                data = read_telemetry()
                 
                 # Update local edit data if not currently editing
                 if self.edit_data is None:
-                    self.edit_data = data
-                    # Update hysteresis spinboxes with current values
-                    self.cpu_hysteresis_var.set(self.edit_data.cpu_hysteresis)
-                    self.gpu_hysteresis_var.set(self.edit_data.gpu_hysteresis)
+                    self.edit_data = read_config()
+                    # Update channel controls with current values
+                    for c in range(self.channel_count):
+                        self.hysteresis_vars[c].set(self.edit_data.hysteresis[c])
+                        self.mode_vars[c].set("PID" if self.edit_data.mode[c] == FAN_MODE_PID else "Curve")
+                        self.target_vars[c].set(self.edit_data.target_temp[c])
+                        self.interpolation_vars[c].set(INTERPOLATION_NAMES.get(self.edit_data.interpolation[c], "Linear"))
+                    self.idle_var.set(IDLE_NAMES.get(self.edit_data.idle_mode, IDLE_NAMES[IDLE_OFF]))
                 
-                # Update titles with current values
-                self.ax1.set_title(f"CPU: {data.cpuTemp:.1f}°C, {data.cpuFanSpeed}% (Hyst: {self.edit_data.cpu_hysteresis}°C)")
-                self.ax2.set_title(f"GPU: {data.gpuTemp:.1f}°C, {data.gpuFanSpeed}% (Hyst: {self.edit_data.gpu_hysteresis}°C)")
+                # Update titles and current point positions with current values
+                for c, name in enumerate(self.names):
+                    load = f", load {data.cpuLoad:.0f}%" if c == 0 else ""
+                    fault = ", SENSOR FAULT" if data.sensorFaulted & (1 << c) else ""
+                    # A negative speed means the EC runs the fan on its own
+                    fan = "EC auto" if data.fanSpeed[c] < 0 else f"{data.fanSpeed[c]}%"
+                    if data.fanForced & (1 << c):
+                        fan += " forced"
+                    self.axes[c].set_title(f"{name}: {data.temp[c]:.1f}°C, {fan}{load} ({self.mode_label(c)}){fault}")
+                    self.current_points[c].set_data([data.temp[c]], [max(0, data.fanSpeed[c])])
                 
-                # Update current point positions
-                self.cpu_point.set_data([data.cpuTemp], [data.cpuFanSpeed])
-                self.gpu_point.set_data([data.gpuTemp], [data.gpuFanSpeed])
+                idle = f", EC idle {data.idleSeconds / 60:.0f} min ({data.idleEntries}x)" if data.idleEntries else ""
+                # The EC took the fans because it stopped answering reliably
+                fallback = ", EC NOT RESPONDING - fans on EC auto" if data.ecFallback else ""
+                self.fig.suptitle(f"Fan Control Curves (Drag points to edit) - sampling every {data.controlPeriodMs} ms, "
+                                  f"read to fan write {data.actuationLatencyUs / 1000:.1f} ms{idle}{fallback}")
                 
+                self.update_profiles()
                 self.last_data_update = current_time
             
             # Always update curves (for smooth dragging)
-            cpu_temps = [0, self.edit_data.cpu_temp_point_2, self.edit_data.cpu_temp_point_3, self.edit_data.cpu_temp_point_4, 100]
-            cpu_fans = [self.edit_data.cpu_fan_point_1, self.edit_data.cpu_fan_point_2, self.edit_data.cpu_fan_point_3, self.edit_data.cpu_fan_point_4, self.edit_data.cpu_fan_point_5]
-            
-            gpu_temps = [0, self.edit_data.gpu_temp_point_2, self.edit_data.gpu_temp_point_3, self.edit_data.gpu_temp_point_4, 100]
-            gpu_fans = [self.edit_data.gpu_fan_point_1, self.edit_data.gpu_fan_point_2, self.edit_data.gpu_fan_point_3, self.edit_data.gpu_fan_point_4, self.edit_data.gpu_fan_point_5]
-            
-            # Update CPU curve
-            self.cpu_line.set_data(cpu_temps, cpu_fans)
-            self.cpu_edit_points.set_data(cpu_temps, cpu_fans)
-            
-            # Update GPU curve
-            self.gpu_line.set_data(gpu_temps, gpu_fans)
-            self.gpu_edit_points.set_data(gpu_temps, gpu_fans)
+            for c in range(self.channel_count):
+                temps, fans = curve_points(self.edit_data, c)
+                self.curve_lines[c].set_data(*curve_line(self.edit_data, c))
+                self.edit_points[c].set_data(temps, fans)
             
             # Only redraw when necessary
             self.canvas.draw_idle()
@@ -205,147 +679,144 @@ class FanControlGUI:
             else:
                 self.root.after(100, self.update_ui)  # 10 FPS when idle
 
+    def update_profiles(self):
+        self.profiles, active = read_profiles()
+        self.profile_box["values"] = [name for _, name in self.profiles]
+        self.profile_var.set(next((name for n, name in self.profiles if n == active), ""))
+
+    def switch_profile(self):
+        number = next((n for n, name in self.profiles if name == self.profile_var.get()), None)
+        if number is None or self.commands.lane is None:
+            return
+        status = self.commands.send([(COMMAND_SWITCH_PROFILE, 0, (number,))])[0]
+        if status != 0:
+            print(f"Profile not switched ({COMMAND_STATUS_NAMES.get(status, 'no answer from the backend')})")
+        # Reload the controls from the profile's settings
+        self.edit_data = None
+
+    def save_profile(self):
+        """Applies the edited settings and saves them under a name, replacing
+        the profile with that name or taking the first free number."""
+        name = simpledialog.askstring("Save profile", "Profile name:", parent=self.root)
+        if not name or self.commands.lane is None:
+            return
+        self.apply_changes()
+        raw = name.encode()[:PROFILE_NAME_LENGTH - 1]
+        name = raw.decode(errors="replace")
+        used = {n: existing for n, existing in self.profiles if 1 <= n <= PROFILE_SLOTS}
+        free = [n for n in range(1, PROFILE_SLOTS + 1) if n not in used]
+        number = next((n for n, existing in used.items() if existing == name), free[0] if free else None)
+        if number is None:
+            print("Profile not saved: every profile slot is in use")
+            return
+        words = struct.unpack("<4i", raw.ljust(PROFILE_NAME_LENGTH, b"\0"))
+        status = self.commands.send([(COMMAND_SAVE_PROFILE, 0, (number,) + words)])[0]
+        if status != 0:
+            print(f"Profile not saved ({COMMAND_STATUS_NAMES.get(status, 'no answer from the backend')})")
+        self.update_profiles()
+
+    def mode_label(self, channel):
+        if self.edit_data.mode[channel] == FAN_MODE_PID:
+            return f"PID, target {self.edit_data.target_temp[channel]}°C"
+        return f"Hyst: {self.edit_data.hysteresis[channel]}°C"
+
     def update_plots(self, frame):
         try:
-            data = read_shared_data()
+            data = read_telemetry()
             
             # Update local edit data if not currently editing
             if self.edit_data is None:
-                self.edit_data = data
-            
-            # CPU curve points (temp, fan%)
-            cpu_temps = [0, self.edit_data.cpu_temp_point_2, self.edit_data.cpu_temp_point_3, self.edit_data.cpu_temp_point_4, 100]
-            cpu_fans = [self.edit_data.cpu_fan_point_1, self.edit_data.cpu_fan_point_2, self.edit_data.cpu_fan_point_3, self.edit_data.cpu_fan_point_4, self.edit_data.cpu_fan_point_5]
-            
-            # GPU curve points (temp, fan%)
-            gpu_temps = [0, self.edit_data.gpu_temp_point_2, self.edit_data.gpu_temp_point_3, self.edit_data.gpu_temp_point_4, 100]
-            gpu_fans = [self.edit_data.gpu_fan_point_1, self.edit_data.gpu_fan_point_2, self.edit_data.gpu_fan_point_3, self.edit_data.gpu_fan_point_4, self.edit_data.gpu_fan_point_5]
+                self.edit_data = read_config()
             
-            # Update CPU curve
-            self.cpu_line.set_data(cpu_temps, cpu_fans)
-            self.cpu_point.set_data([data.cpuTemp], [data.cpuFanSpeed])
-            self.cpu_edit_points.set_data(cpu_temps, cpu_fans)
-            
-            # Update GPU curve
-            self.gpu_line.set_data(gpu_temps, gpu_fans)
-            self.gpu_point.set_data([data.gpuTemp], [data.gpuFanSpeed])
-            self.gpu_edit_points.set_data(gpu_temps, gpu_fans)
-            
-            # Update titles with current values
-            self.ax1.set_title(f"CPU: {data.cpuTemp:.1f}°C, {data.cpuFanSpeed}%")
-            self.ax2.set_title(f"GPU: {data.gpuTemp:.1f}°C, {data.gpuFanSpeed}%")
+            # Curve points (temp, fan%) and the current reading per channel
+            for c, name in enumerate(self.names):
+                temps, fans = curve_points(self.edit_data, c)
+                self.curve_lines[c].set_data(*curve_line(self.edit_data, c))
+                self.current_points[c].set_data([data.temp[c]], [max(0, data.fanSpeed[c])])
+                self.edit_points[c].set_data(temps, fans)
+                fan = "EC auto" if data.fanSpeed[c] < 0 else f"{data.fanSpeed[c]}%"
+                self.axes[c].set_title(f"{name}: {data.temp[c]:.1f}°C, {fan}")
             
         except Exception as e:
             print(f"Error updating plots: {e}")
         
-        return self.cpu_line, self.cpu_point, self.gpu_line, self.gpu_point, self.cpu_edit_points, self.gpu_edit_points
+        return self.curve_lines + self.current_points + self.edit_points
 
     def on_press(self, event):
-        if event.inaxes not in [self.ax1, self.ax2]:
+        if event.inaxes not in self.axes:
             return
         
         # Find closest point
-        if event.inaxes == self.ax1:
-            temps = [0, self.edit_data.cpu_temp_point_2, self.edit_data.cpu_temp_point_3, self.edit_data.cpu_temp_point_4, 100]
-            fans = [self.edit_data.cpu_fan_point_1, self.edit_data.cpu_fan_point_2, self.edit_data.cpu_fan_point_3, self.edit_data.cpu_fan_point_4, self.edit_data.cpu_fan_point_5]
-            curve_type = 'cpu'
-        else:
-            temps = [0, self.edit_data.gpu_temp_point_2, self.edit_data.gpu_temp_point_3, self.edit_data.gpu_temp_point_4, 100]
-            fans = [self.edit_data.gpu_fan_point_1, self.edit_data.gpu_fan_point_2, self.edit_data.gpu_fan_point_3, self.edit_data.gpu_fan_point_4, self.edit_data.gpu_fan_point_5]
-            curve_type = 'gpu'
+        channel = self.axes.index(event.inaxes)
+        temps, fans = curve_points(self.edit_data, channel)
         
-        # Find closest point (exclude fixed points 0 and 4)
+        # Find closest point (exclude the fixed end points)
         min_dist = float('inf')
         closest_idx = None
-        for i in range(1, 4):  # Only points 1, 2, 3 are editable
+        for i in range(1, len(temps) - 1):  # Only inner points are editable
             dist = ((temps[i] - event.xdata)**2 + (fans[i] - event.ydata)**2)**0.5
             if dist < min_dist and dist < 5:  # 5 unit tolerance
                 min_dist = dist
                 closest_idx = i
         
         if closest_idx is not None:
-            self.dragging = (curve_type, closest_idx)
+            self.dragging = (channel, closest_idx)
 
     def on_motion(self, event):
-        if self.dragging is None or event.inaxes not in [self.ax1, self.ax2]:
+        if self.dragging is None or event.inaxes not in self.axes:
             return
         
-        curve_type, point_idx = self.dragging
+        channel, point_idx = self.dragging
         new_x = max(0, min(100, event.xdata))
         new_y = max(0, min(100, event.ydata))
         
-        if curve_type == 'cpu':
-            if point_idx == 1:
-                self.edit_data.cpu_temp_point_2 = int(new_x)
-                self.edit_data.cpu_fan_point_2 = int(new_y)
-            elif point_idx == 2:
-                self.edit_data.cpu_temp_point_3 = int(new_x)
-                self.edit_data.cpu_fan_point_3 = int(new_y)
-            elif point_idx == 3:
-                self.edit_data.cpu_temp_point_4 = int(new_x)
-                self.edit_data.cpu_fan_point_4 = int(new_y)
-        else:  # gpu
-            if point_idx == 1:
-                self.edit_data.gpu_temp_point_2 = int(new_x)
-                self.edit_data.gpu_fan_point_2 = int(new_y)
-            elif point_idx == 2:
-                self.edit_data.gpu_temp_point_3 = int(new_x)
-                self.edit_data.gpu_fan_point_3 = int(new_y)
-            elif point_idx == 3:
-                self.edit_data.gpu_temp_point_4 = int(new_x)
-                self.edit_data.gpu_fan_point_4 = int(new_y)
+        self.edit_data.curve_temp[channel][point_idx] = int(new_x)
+        self.edit_data.curve_fan[channel][point_idx] = int(new_y)
 
     def on_release(self, event):
         self.dragging = None
 
     def reset_curve(self):
         if self.edit_data is not None:
-            # Set linear curve from 0 to 100
-            # Temperature points: 0, 25, 50, 75, 100
-            self.edit_data.cpu_temp_point_2 = 60
-            self.edit_data.cpu_temp_point_3 = 80
-            self.edit_data.cpu_temp_point_4 = 95
-            
-            self.edit_data.gpu_temp_point_2 = 50
-            self.edit_data.gpu_temp_point_3 = 70
-            self.edit_data.gpu_temp_point_4 = 85
-            
-            # Fan points: 0, 25, 50, 75, 100 (linear)
-            self.edit_data.cpu_fan_point_1 = 0
-            self.edit_data.cpu_fan_point_2 = 5
-            self.edit_data.cpu_fan_point_3 = 10
-            self.edit_data.cpu_fan_point_4 = 30
-            self.edit_data.cpu_fan_point_5 = 100
-            
-            self.edit_data.gpu_fan_point_1 = 0
-            self.edit_data.gpu_fan_point_2 = 5
-            self.edit_data.gpu_fan_point_3 = 10
-            self.edit_data.gpu_fan_point_4 = 30
-            self.edit_data.gpu_fan_point_5 = 100
-            
-            # Reset hysteresis to 3
-            self.edit_data.cpu_hysteresis = 3
-            self.edit_data.gpu_hysteresis = 3
-            
-            # Update spinboxes
-            self.cpu_hysteresis_var.set(3)
-            self.gpu_hysteresis_var.set(3)
+            # Five-point curves; the GPU and extra fans start earlier than the CPU
+            for c in range(self.channel_count):
+                temps = [0, 60, 80, 95, 100] if c == 0 else [0, 50, 70, 85, 100]
+                fans = [0, 5, 10, 30, 100]
+                self.edit_data.point_count[c] = len(temps)
+                for i in range(len(temps)):
+                    self.edit_data.curve_temp[c][i] = temps[i]
+                    self.edit_data.curve_fan[c][i] = fans[i]
+                
+                # Reset hysteresis to 3
+                self.edit_data.hysteresis[c] = 3
+                self.hysteresis_vars[c].set(3)
 
     def on_hysteresis_change(self):
         if self.edit_data is not None:
             # Update hysteresis values in edit_data
-            self.edit_data.cpu_hysteresis = self.cpu_hysteresis_var.get()
-            self.edit_data.gpu_hysteresis = self.gpu_hysteresis_var.get()
+            for c in range(self.channel_count):
+                self.edit_data.hysteresis[c] = self.hysteresis_vars[c].get()
+
+    def on_interpolation_change(self):
+        if self.edit_data is not None:
+            # Redraw with the new interpolation before it is applied
+            for c in range(self.channel_count):
+                name = self.interpolation_vars[c].get()
+                self.edit_data.interpolation[c] = next(k for k, v in INTERPOLATION_NAMES.items() if v == name)
 
     def apply_changes(self):
         if self.edit_data is not None:
-            # Update hysteresis values from spinboxes
-            self.edit_data.cpu_hysteresis = self.cpu_hysteresis_var.get()
-            self.edit_data.gpu_hysteresis = self.gpu_hysteresis_var.get()
+            # Update channel settings from the controls
+            for c in range(self.channel_count):
+                self.edit_data.hysteresis[c] = self.hysteresis_vars[c].get()
+                self.edit_data.mode[c] = FAN_MODE_PID if self.mode_vars[c].get() == "PID" else FAN_MODE_CURVE
+                self.edit_data.target_temp[c] = self.target_vars[c].get()
+            self.on_interpolation_change()
+            self.edit_data.idle_mode = next(k for k, v in IDLE_NAMES.items() if v == self.idle_var.get())
             
-            self.edit_data.write_sync = True
-            write_shared_data(self.edit_data)
-            print(f"Changes applied! CPU Hyst: {self.edit_data.cpu_hysteresis}°C, GPU Hyst: {self.edit_data.gpu_hysteresis}°C")
+            apply_config(self.commands, self.edit_data)
+            hysteresis = ", ".join(f"{name} Hyst: {self.edit_data.hysteresis[c]}°C" for c, name in enumerate(self.names))
+            print(f"Changes applied! {hysteresis}")
 
     def on_closing(self):
         """Handle window close event"""
@@ -353,11 +824,11 @@ class FanControlGUI:
         try:
             # Save current settings before closing
             if self.edit_data is not None:
-                self.edit_data.write_sync = True
-                write_shared_data(self.edit_data)
+                apply_config(self.commands, self.edit_data)
         except Exception as e:
             print(f"Error saving on close: {e}")
         finally:
+            self.commands.close()
             # Clean exit
             self.root.quit()
             # Remove destroy() and sys.exit() to prevent conflicts